@@ -28,6 +28,31 @@ LICENSE
 
 #define PERF_API static
 
+/* Thread local storage and atomic increment where the compiler provides them */
+#if defined(_MSC_VER)
+#define PERF_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define PERF_THREAD_LOCAL __thread
+#endif
+
+/* 64-bit unsigned integer for cycle counter values */
+#if defined(_MSC_VER)
+typedef unsigned __int64 perf_u64;
+#elif defined(__GNUC__) || defined(__clang__)
+__extension__ typedef unsigned long long perf_u64;
+#else
+typedef unsigned long perf_u64;
+#endif
+
+/* Unsigned integer with the size of a pointer (LLP64 Windows has a 32-bit long) */
+#if defined(_WIN64) && defined(_MSC_VER)
+typedef unsigned __int64 perf_uptr;
+#elif defined(_WIN64)
+__extension__ typedef unsigned long long perf_uptr;
+#else
+typedef unsigned long perf_uptr;
+#endif
+
 PERF_API PERF_INLINE unsigned long perf_strlen(char *str)
 {
     char *s = str;
@@ -80,6 +105,8 @@ PERF_WIN32_API(int)
 QueryPerformanceCounter(LARGE_INTEGER *lpPerformanceCount);
 PERF_WIN32_API(void *)
 GetStdHandle(unsigned long nStdHandle);
+PERF_WIN32_API(unsigned long)
+GetCurrentThreadId(void);
 PERF_WIN32_API(int)
 WriteConsoleA(void *hConsoleOutput, void *lpBuffer, unsigned long nNumberOfCharsToWrite, unsigned long *lpNumberOfCharsWritten, void *lpReserved);
 
@@ -126,6 +153,11 @@ PERF_API PERF_INLINE void perf_platform_print(char *str)
     WriteConsoleA(hConsole, str, perf_strlen(str), &written, ((void *)0));
 }
 
+PERF_API PERF_INLINE unsigned long perf_platform_thread_id(void)
+{
+    return GetCurrentThreadId();
+}
+
 #endif /* _WIN32 */
 
 /* #############################################################################
@@ -140,8 +172,9 @@ PERF_API PERF_INLINE void perf_platform_print(char *str)
 #define _GNU_SOURCE
 #endif
 
-#ifndef __timespec_defined
+#if !defined(__timespec_defined) && !defined(_STRUCT_TIMESPEC) /* Older and newer glibc guards */
 #define __timespec_defined
+#define _STRUCT_TIMESPEC 1
 struct timespec
 {
     long tv_sec;  /* seconds */
@@ -154,10 +187,34 @@ typedef int clockid_t;
 #define __clockid_t_defined
 #endif
 
+/* Guarded as system headers (e.g. pulled in by pio.h) may already define these */
+#ifndef CLOCK_MONOTONIC
 #define CLOCK_MONOTONIC 1
-#define SYS_clock_gettime 228 /* On x86_64, check for other architectures */
-#define SYS_write 1           /* On x86_64, check for other architectures */
+#endif
+#ifndef SYS_clock_gettime
+#if defined(__aarch64__)
+#define SYS_clock_gettime 113
+#define SYS_write 64
+#elif defined(__i386__)
+#define SYS_clock_gettime 265
+#define SYS_write 4
+#else
+#define SYS_clock_gettime 228 /* x86_64 */
+#define SYS_write 1
+#endif
+#endif
+#ifndef STDOUT_FILENO
 #define STDOUT_FILENO 1
+#endif
+#ifndef SYS_gettid
+#if defined(__aarch64__)
+#define SYS_gettid 178
+#elif defined(__i386__)
+#define SYS_gettid 224
+#else
+#define SYS_gettid 186 /* x86_64 */
+#endif
+#endif
 
 extern long syscall(long number, ...);
 
@@ -176,6 +233,11 @@ PERF_API PERF_INLINE void perf_platform_print(char *str)
     syscall(SYS_write, STDOUT_FILENO, str, len);
 }
 
+PERF_API PERF_INLINE unsigned long perf_platform_thread_id(void)
+{
+    return (unsigned long)syscall(SYS_gettid);
+}
+
 #endif /* __linux__ */
 
 /* #############################################################################
@@ -185,6 +247,7 @@ PERF_API PERF_INLINE void perf_platform_print(char *str)
 #ifdef __APPLE__
 
 #include <mach/mach_time.h>
+#include <pthread.h>
 #include <unistd.h>
 
 PERF_API PERF_INLINE double perf_platform_current_time_nanoseconds(void)
@@ -205,23 +268,443 @@ PERF_API PERF_INLINE void perf_platform_print(char *str)
     write(STDOUT_FILENO, str, len);
 }
 
+PERF_API PERF_INLINE unsigned long perf_platform_thread_id(void)
+{
+    uint64_t id = 0;
+    pthread_threadid_np(0, &id);
+    return (unsigned long)id;
+}
+
 #endif /* __APPLE__ */
 
-#if defined(__x86_64__) || defined(__i386__)
-PERF_API PERF_INLINE unsigned long perf_platform_current_cycle_count(void)
+/* #############################################################################
+ * # CYCLE COUNTER
+ * #############################################################################
+ *
+ * perf_platform_current_cycle_count starts a measurement, perf_platform_current_cycle_count_end
+ * ends it. Both reads are fenced so the CPU cannot move the measured code across them.
+ *
+ *   x86     : lfence; rdtsc ... rdtscp; lfence (TSC calibrated once against the monotonic clock)
+ *   aarch64 : isb; mrs cntvct_el0 (generic timer, frequency read from cntfrq_el0)
+ *   other   : monotonic clock in nanoseconds
+ *
+ * perf_cycles_to_ns converts a tick difference to nanoseconds.
+ */
+#ifndef PERF_CALIBRATION_NS
+#define PERF_CALIBRATION_NS 10000000.0 /* Busy wait of the one-time TSC calibration (10 ms) */
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PERF_CYCLE_COUNTER_TSC
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count(void)
 {
-    unsigned long low_part = 0;
-    unsigned long high_part = 0;
-    __asm __volatile("rdtsc" : "=a"(low_part), "=d"(high_part));
-    return ((unsigned long)((double)high_part * 4294967296.0 + (double)low_part));
+    unsigned int low_part;
+    unsigned int high_part;
+    __asm __volatile("lfence\n\trdtsc" : "=a"(low_part), "=d"(high_part) : : "memory");
+    return ((perf_u64)high_part << 32) | (perf_u64)low_part;
 }
-#elif defined(__aarch64__) && defined(__APPLE__)
-#include <mach/mach_time.h>
-PERF_API PERF_INLINE unsigned long perf_platform_current_cycle_count(void)
+
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count_end(void)
+{
+    unsigned int low_part;
+    unsigned int high_part;
+    unsigned int aux;
+    __asm __volatile("rdtscp\n\tlfence" : "=a"(low_part), "=d"(high_part), "=c"(aux) : : "memory");
+    (void)aux;
+    return ((perf_u64)high_part << 32) | (perf_u64)low_part;
+}
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER)
+#include <intrin.h>
+#define PERF_CYCLE_COUNTER_TSC
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count(void)
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count_end(void)
+{
+    unsigned int aux;
+    perf_u64 ticks = __rdtscp(&aux);
+    _mm_lfence();
+    return ticks;
+}
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define PERF_CYCLE_COUNTER_CNTVCT
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count(void)
+{
+    perf_u64 ticks;
+    __asm __volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) : : "memory");
+    return ticks;
+}
+
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count_end(void)
+{
+    perf_u64 ticks;
+    __asm __volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(ticks) : : "memory");
+    return ticks;
+}
+#else
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count(void)
+{
+    return (perf_u64)perf_platform_current_time_nanoseconds();
+}
+
+PERF_API PERF_INLINE perf_u64 perf_platform_current_cycle_count_end(void)
+{
+    return (perf_u64)perf_platform_current_time_nanoseconds();
+}
+#endif
+
+/* Cycle counter ticks per nanosecond, determined on first use */
+PERF_API PERF_INLINE double perf_platform_cycles_per_ns(void)
+{
+    static double cycles_per_ns = 0.0;
+
+    if (cycles_per_ns <= 0.0)
+    {
+#if defined(PERF_CYCLE_COUNTER_TSC)
+        double start_ns = perf_platform_current_time_nanoseconds();
+        perf_u64 start_cycles = perf_platform_current_cycle_count();
+        double end_ns;
+        perf_u64 end_cycles;
+
+        do
+        {
+            end_ns = perf_platform_current_time_nanoseconds();
+        } while (end_ns - start_ns < PERF_CALIBRATION_NS);
+
+        end_cycles = perf_platform_current_cycle_count_end();
+        cycles_per_ns = (double)(end_cycles - start_cycles) / (end_ns - start_ns);
+#elif defined(PERF_CYCLE_COUNTER_CNTVCT)
+        perf_u64 frequency;
+        __asm __volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+        cycles_per_ns = (double)frequency / 1000000000.0;
+#else
+        cycles_per_ns = 1.0;
+#endif
+    }
+
+    return cycles_per_ns;
+}
+
+PERF_API PERF_INLINE double perf_cycles_to_ns(unsigned long cycles)
+{
+    return (double)cycles / perf_platform_cycles_per_ns();
+}
+
+/* #############################################################################
+ * # HARDWARE PERFORMANCE COUNTERS
+ * #############################################################################
+ *
+ * Opt-in on Linux with PERF_HW_COUNTERS. A perf_event_open group (cycles, instructions,
+ * cache misses, branch misses and with PERF_HW_COUNTERS_LLC also LLC loads) is opened once
+ * per thread on its first read and read with a single read() around each PERF_PROFILE scope.
+ * The stats then report IPC, misses per call and misses per 1000 instructions (MPKI).
+ *
+ * A group only counts the thread that opened it, so the group is kept in thread local
+ * storage. Call perf_hw_close before a recording thread exits to release its descriptors.
+ * Without thread local storage the group belongs to the first reading thread and
+ * PERF_HW_COUNTERS cannot be combined with PERF_STATS_THREADS.
+ *
+ * If the counters cannot be opened (containers, perf_event_paranoid, VMs without PMU)
+ * perf_hw_read returns 0 and scopes are recorded without hardware counters.
+ */
+#define PERF_HW_CYCLES 0
+#define PERF_HW_INSTRUCTIONS 1
+#define PERF_HW_CACHE_MISSES 2
+#define PERF_HW_BRANCH_MISSES 3
+#define PERF_HW_LLC_LOADS 4
+#define PERF_HW_COUNTER_COUNT 5
+
+typedef struct perf_hw_sample
+{
+    perf_u64 value[PERF_HW_COUNTER_COUNT]; /* Indexed by PERF_HW_* */
+
+} perf_hw_sample;
+
+#if defined(PERF_HW_COUNTERS) && defined(__linux__)
+
+#if defined(__aarch64__)
+#define PERF_SYS_PERF_EVENT_OPEN 241
+#define PERF_SYS_READ 63
+#define PERF_SYS_CLOSE 57
+#elif defined(__i386__)
+#define PERF_SYS_PERF_EVENT_OPEN 336
+#define PERF_SYS_READ 3
+#define PERF_SYS_CLOSE 6
+#else
+#define PERF_SYS_PERF_EVENT_OPEN 298 /* x86_64 */
+#define PERF_SYS_READ 0
+#define PERF_SYS_CLOSE 3
+#endif
+
+#define PERF_HW_TYPE_HARDWARE 0
+#define PERF_HW_TYPE_HW_CACHE 3
+#define PERF_HW_ATTR_EXCLUDE_KERNEL (1UL << 5)
+#define PERF_HW_ATTR_EXCLUDE_HV (1UL << 6)
+#define PERF_HW_FORMAT_GROUP (1UL << 3)
+
+/* struct perf_event_attr up to PERF_ATTR_SIZE_VER0 (64 bytes), newer kernels accept it */
+typedef struct perf_hw_event_attr
+{
+    unsigned int type;
+    unsigned int size;
+    perf_u64 config;
+    perf_u64 sample_period;
+    perf_u64 sample_type;
+    perf_u64 read_format;
+    perf_u64 flags; /* disabled, inherit, pinned, exclusive, exclude_user, exclude_kernel, exclude_hv, ... */
+    unsigned int wakeup_events;
+    unsigned int bp_type;
+    perf_u64 config1;
+
+} perf_hw_event_attr;
+
+typedef struct perf_hw_group
+{
+    int state;                         /* 0 = not opened yet, 1 = available, -1 = unavailable */
+    int members;                       /* Counters in the group */
+    long fd[PERF_HW_COUNTER_COUNT];    /* Descriptors in group order, fd[0] is the leader */
+    int slot[PERF_HW_COUNTER_COUNT];   /* Position of a counter in the group read, -1 if not open */
+
+} perf_hw_group;
+
+#if defined(PERF_THREAD_LOCAL)
+static PERF_THREAD_LOCAL perf_hw_group perf_hw;
+#elif defined(PERF_STATS_THREADS)
+#error "PERF_HW_COUNTERS with PERF_STATS_THREADS requires thread local storage (PERF_THREAD_LOCAL)"
+#else
+static perf_hw_group perf_hw;
+#endif
+
+PERF_API PERF_INLINE long perf_hw_open_counter(unsigned int type, perf_u64 config, long group_fd)
+{
+    perf_hw_event_attr attr;
+    unsigned char *bytes = (unsigned char *)&attr;
+    unsigned long i;
+
+    for (i = 0; i < sizeof(attr); ++i)
+    {
+        bytes[i] = 0;
+    }
+
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.read_format = PERF_HW_FORMAT_GROUP;
+    attr.flags = PERF_HW_ATTR_EXCLUDE_KERNEL | PERF_HW_ATTR_EXCLUDE_HV; /* Allowed with perf_event_paranoid <= 2 */
+
+    /* Calling thread (pid 0) on any cpu (-1) */
+    return syscall(PERF_SYS_PERF_EVENT_OPEN, &attr, 0L, -1L, group_fd, 0UL);
+}
+
+PERF_API PERF_INLINE int perf_hw_init(void)
+{
+    static unsigned int types[PERF_HW_COUNTER_COUNT] = {PERF_HW_TYPE_HARDWARE, PERF_HW_TYPE_HARDWARE, PERF_HW_TYPE_HARDWARE, PERF_HW_TYPE_HARDWARE, PERF_HW_TYPE_HW_CACHE};
+    static perf_u64 configs[PERF_HW_COUNTER_COUNT] = {0 /* cpu cycles */, 1 /* instructions */, 3 /* cache misses */, 5 /* branch misses */, 2 /* LL | op read << 8 | result access << 16 */};
+    int count = PERF_HW_COUNTER_COUNT;
+    int c;
+
+    if (perf_hw.state != 0)
+    {
+        return perf_hw.state > 0;
+    }
+
+    perf_hw.state = -1;
+    perf_hw.members = 0;
+
+    for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+    {
+        perf_hw.slot[c] = -1;
+    }
+
+#ifndef PERF_HW_COUNTERS_LLC
+    count = PERF_HW_LLC_LOADS;
+#endif
+
+    for (c = 0; c < count; ++c)
+    {
+        long fd = perf_hw_open_counter(types[c], configs[c], perf_hw.members ? perf_hw.fd[0] : -1L);
+
+        if (fd < 0)
+        {
+            if (c == 0)
+            {
+                return 0; /* No group without the cycles leader */
+            }
+            continue; /* Counter not supported by this PMU */
+        }
+
+        perf_hw.fd[perf_hw.members] = fd;
+        perf_hw.slot[c] = perf_hw.members++;
+    }
+
+    perf_hw.state = 1;
+    return 1;
+}
+
+/* Closes the group of the calling thread, the next read opens a new one */
+PERF_API PERF_INLINE void perf_hw_close(void)
+{
+    int m;
+
+    for (m = perf_hw.members - 1; m >= 0; --m)
+    {
+        syscall(PERF_SYS_CLOSE, perf_hw.fd[m]);
+    }
+
+    perf_hw.state = 0;
+    perf_hw.members = 0;
+}
+
+PERF_API PERF_INLINE int perf_hw_available(int counter)
+{
+    return perf_hw_init() && perf_hw.slot[counter] >= 0;
+}
+
+PERF_API PERF_INLINE int perf_hw_read(perf_hw_sample *sample)
+{
+    perf_u64 data[1 + PERF_HW_COUNTER_COUNT]; /* nr, values[nr] */
+    long expected;
+    int c;
+
+    if (!perf_hw_init())
+    {
+        return 0;
+    }
+
+    expected = (long)((unsigned long)(1 + perf_hw.members) * sizeof(perf_u64));
+
+    if (syscall(PERF_SYS_READ, perf_hw.fd[0], data, sizeof(data)) < expected)
+    {
+        return 0;
+    }
+
+    for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+    {
+        sample->value[c] = perf_hw.slot[c] >= 0 ? data[1 + perf_hw.slot[c]] : 0;
+    }
+
+    return 1;
+}
+#else
+PERF_API PERF_INLINE void perf_hw_close(void)
+{
+}
+
+PERF_API PERF_INLINE int perf_hw_available(int counter)
+{
+    (void)counter;
+    return 0;
+}
+
+PERF_API PERF_INLINE int perf_hw_read(perf_hw_sample *sample)
+{
+    (void)sample;
+    return 0;
+}
+#endif
+
+/* end = end - start */
+PERF_API PERF_INLINE void perf_hw_sample_delta(perf_hw_sample *start, perf_hw_sample *end)
+{
+    int c;
+
+    for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+    {
+        end->value[c] -= start->value[c];
+    }
+}
+
+#ifdef PERF_HW_COUNTERS
+#define PERF_HW_SCOPE_DECLARE         \
+    perf_hw_sample perf_hw_start;     \
+    perf_hw_sample perf_hw_end;       \
+    int perf_hw_ok;
+#define PERF_HW_SCOPE_BEGIN perf_hw_ok = perf_hw_read(&perf_hw_start);
+#define PERF_HW_SCOPE_END                                     \
+    perf_hw_ok = perf_hw_ok && perf_hw_read(&perf_hw_end);   \
+    if (perf_hw_ok)                                           \
+    {                                                         \
+        perf_hw_sample_delta(&perf_hw_start, &perf_hw_end);   \
+    }
+#define PERF_HW_SCOPE_SAMPLE (perf_hw_ok ? &perf_hw_end : 0)
+#else
+#define PERF_HW_SCOPE_DECLARE
+#define PERF_HW_SCOPE_BEGIN
+#define PERF_HW_SCOPE_END
+#define PERF_HW_SCOPE_SAMPLE 0
+#endif
+
+/* #############################################################################
+ * # THREADS
+ * #############################################################################
+ *
+ * Atomic add and a minimal spin lock for the rarely taken paths (site registration,
+ * thread slot claims). Without compiler support they degrade to plain operations
+ * which are only correct single threaded.
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* Returns the previous value */
+PERF_API PERF_INLINE long perf_atomic_add(volatile long *value, long add)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchangeAdd(value, add);
+#elif defined(__GNUC__) || defined(__clang__)
+    return __sync_fetch_and_add(value, add);
+#else
+    long previous = *value;
+    *value += add;
+    return previous;
+#endif
+}
+
+PERF_API PERF_INLINE void perf_spin_lock(volatile long *lock)
+{
+#if defined(_MSC_VER)
+    while (_InterlockedExchange(lock, 1) != 0)
+    {
+    }
+#elif defined(__GNUC__) || defined(__clang__)
+    while (__sync_lock_test_and_set(lock, 1L) != 0)
+    {
+    }
+#else
+    *lock = 1;
+#endif
+}
+
+PERF_API PERF_INLINE void perf_spin_unlock(volatile long *lock)
 {
-    return (unsigned long)mach_absolute_time();
+#if defined(_MSC_VER)
+    _InterlockedExchange(lock, 0);
+#elif defined(__GNUC__) || defined(__clang__)
+    __sync_lock_release(lock);
+#else
+    *lock = 0;
+#endif
 }
+
+/* Thread id of the caller, cached in thread local storage where available */
+PERF_API PERF_INLINE unsigned long perf_thread_id(void)
+{
+#ifdef PERF_THREAD_LOCAL
+    static PERF_THREAD_LOCAL unsigned long thread_id = 0;
+
+    if (thread_id == 0)
+    {
+        thread_id = perf_platform_thread_id();
+    }
+
+    return thread_id;
+#else
+    return perf_platform_thread_id();
 #endif
+}
 
 /* #############################################################################
  * # String Utility Functions
@@ -434,130 +917,541 @@ PERF_API PERF_INLINE void perf_double_to_string(double value, char *buffer, unsi
     buffer[pad_count + temp_index] = '\0';
 }
 
-/* #############################################################################
- * # PERF MAIN IMPLEMENTATION
- * #############################################################################
- */
-#ifndef PERF_MAX_PRINT_BUFFER
-#define PERF_MAX_PRINT_BUFFER 1024
-#endif
-
-#ifdef PERF_STATS_ENABLE
-
-#ifndef PERF_STATS_ENTRIES_MAX
-#define PERF_STATS_ENTRIES_MAX 1024 /* Max unique (file+line+name) combinations */
-#endif
-
-#ifndef PERF_STATS_NAME_MAX
-#define PERF_STATS_NAME_MAX 512
-#endif
+/* Number formatting without the column padding used by the text report */
+PERF_API PERF_INLINE char *perf_format_ulong(unsigned long value, char *buffer, unsigned long max_len)
+{
+    perf_ulong_to_string(value, buffer, max_len);
+    while (*buffer == ' ')
+    {
+        buffer++;
+    }
+    return buffer;
+}
 
-typedef struct perf_stats_entry
+/* 64 bit counters (unsigned long is 32 bit on Windows) */
+PERF_API PERF_INLINE char *perf_format_u64(perf_u64 value, char *buffer, unsigned long max_len)
 {
-    char file[128];                 /* File name */
-    int line;                       /* Line number */
-    char name[PERF_STATS_NAME_MAX]; /* Function or code block name */
+    char temp[21];
+    unsigned long i = 0;
+    unsigned long j = 0;
 
-    unsigned long count;
+    if (max_len == 0)
+    {
+        return buffer;
+    }
 
-    unsigned long cycles_min;
-    unsigned long cycles_max;
-    unsigned long cycles_sum;
+    do
+    {
+        temp[i++] = (char)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value > 0 && i < sizeof(temp));
 
-    double time_ms_min;
-    double time_ms_max;
-    double time_ms_sum;
+    while (i > 0 && j + 1 < max_len)
+    {
+        buffer[j++] = temp[--i];
+    }
 
-} perf_stats_entry;
+    buffer[j] = '\0';
 
-static perf_stats_entry perf_stats_entries[PERF_STATS_ENTRIES_MAX];
-static unsigned long perf_stats_entry_count = 0;
+    return buffer;
+}
 
-PERF_API PERF_INLINE perf_stats_entry *perf_stats_get_entry(char *file, int line, char *name)
+PERF_API PERF_INLINE char *perf_format_double(double value, char *buffer, unsigned long max_len, int precision)
 {
-    unsigned long i;
-    for (i = 0; i < perf_stats_entry_count; i++)
+    perf_double_to_string(value, buffer, max_len, precision);
+    while (*buffer == ' ')
     {
-        if (perf_stats_entries[i].line == line)
-        {
-            char *f1 = perf_stats_entries[i].file;
-            char *f2 = file;
-            while (*f1 && *f2 && *f1 == *f2)
-            {
-                f1++;
-                f2++;
-            }
-            if (*f1 == '\0' && *f2 == '\0')
-            {
-                /* Now check name */
-                char *n1 = perf_stats_entries[i].name;
-                char *n2 = name;
-                while (*n1 && *n2 && *n1 == *n2)
-                {
-                    n1++;
-                    n2++;
-                }
-                if (*n1 == '\0' && *n2 == '\0')
-                {
-                    return &perf_stats_entries[i];
-                }
-            }
-        }
+        buffer++;
     }
+    return buffer;
+}
 
-    /* If not found, create a new entry */
-    if (perf_stats_entry_count < PERF_STATS_ENTRIES_MAX)
-    {
-        perf_stats_entry *e = &perf_stats_entries[perf_stats_entry_count++];
-        unsigned long j = 0;
+/* Appends a string escaped for a quoted JSON or CSV field */
+PERF_API PERF_INLINE unsigned long perf_append_escaped(char *dest, unsigned long current_len, unsigned long max_len, char *src, int csv)
+{
+    unsigned long added = 0;
+    char pair[3];
 
-        /* Copy file */
-        while (file[j] && j < sizeof(e->file) - 1)
+    pair[2] = '\0';
+
+    while (*src)
+    {
+        if (*src == '"')
         {
-            e->file[j] = file[j];
-            j++;
+            pair[0] = csv ? '"' : '\\';
+            pair[1] = '"';
+            added += perf_append_string(dest, current_len + added, max_len, pair);
         }
-        e->file[j] = '\0';
-
-        /* Copy name */
-        j = 0;
-        while (name[j] && j < PERF_STATS_NAME_MAX - 1)
+        else if (*src == '\\' && !csv)
+        {
+            added += perf_append_string(dest, current_len + added, max_len, "\\\\");
+        }
+        else
         {
-            e->name[j] = name[j];
-            j++;
+            pair[0] = *src;
+            pair[1] = '\0';
+            added += perf_append_string(dest, current_len + added, max_len, pair);
         }
+        src++;
+    }
 
-        e->name[j] = '\0';
+    return added;
+}
+
+PERF_API PERF_INLINE double perf_sqrt(double value)
+{
+    double x = value;
+    int i;
+
+    if (value <= 0.0)
+    {
+        return 0.0;
+    }
+
+    /* Newton iterations, start from a power of two close to the root */
+    while (x > 4.0 * value / x)
+    {
+        x *= 0.5;
+    }
+
+    for (i = 0; i < 32; ++i)
+    {
+        x = 0.5 * (x + value / x);
+    }
+
+    return x;
+}
+
+/* #############################################################################
+ * # PERF MAIN IMPLEMENTATION
+ * #############################################################################
+ */
+#ifndef PERF_MAX_PRINT_BUFFER
+#define PERF_MAX_PRINT_BUFFER 1024
+#endif
+
+/* #############################################################################
+ * # OUTPUT SINKS
+ * #############################################################################
+ *
+ * Exporters hand null terminated chunks to a sink function.
+ * perf_sink_print writes to stdout, with pio.h included first perf_sink_pio
+ * writes to a pio_stream (pass the stream as user pointer).
+ */
+typedef void (*perf_sink)(void *user, char *str);
+
+PERF_API PERF_INLINE void perf_sink_print(void *user, char *str)
+{
+    (void)user;
+    perf_platform_print(str);
+}
+
+#ifdef PIO_H
+PERF_API PERF_INLINE void perf_sink_pio(void *user, char *str)
+{
+    pio_stream_write((pio_stream *)user, (unsigned char *)str, perf_strlen(str));
+}
+#endif
+
+#ifdef PERF_STATS_ENABLE
+
+/* Multithreaded profiling: define PERF_STATS_THREADS as the max number of recording threads.
+ * Every thread then records into its own copy of the table (no locks or atomics on the hot path),
+ * the copies are merged when stats are printed or exported. Sites are registered once globally.
+ */
+#ifndef PERF_STATS_ENTRIES_MAX
+#ifdef PERF_STATS_THREADS
+#define PERF_STATS_ENTRIES_MAX 256 /* Every thread holds a copy, keep the memory bounded */
+#else
+#define PERF_STATS_ENTRIES_MAX 1024 /* Max unique (file+line+name) combinations */
+#endif
+#endif
+
+#ifndef PERF_STATS_HASH_SIZE
+#define PERF_STATS_HASH_SIZE (PERF_STATS_ENTRIES_MAX * 2) /* Must be a power of two and larger than PERF_STATS_ENTRIES_MAX */
+#endif
+
+/* Log-linear (HDR style) latency histogram in nanoseconds, define PERF_STATS_HISTOGRAM to record it.
+ * Values below 2^PERF_HISTOGRAM_SUB_BITS get an exact bucket, above that every power of two is split
+ * into 2^PERF_HISTOGRAM_SUB_BITS linear sub buckets (3 bits = max 12.5% bucket width).
+ * Values above 2^PERF_HISTOGRAM_MAX_BITS ns are clamped into the last bucket. Samples are bucketed
+ * from double (perf_histogram_bucket_ns), so this holds where unsigned long is 32 bit (LLP64) too.
+ * Every entry holds PERF_HISTOGRAM_BUCKETS counters (304 = 1.2 KB with the defaults), without
+ * the histogram the percentiles are 0 and perf_stats_compare falls back to the mean.
+ */
+#ifndef PERF_HISTOGRAM_SUB_BITS
+#define PERF_HISTOGRAM_SUB_BITS 3
+#endif
+
+#ifndef PERF_HISTOGRAM_MAX_BITS
+#define PERF_HISTOGRAM_MAX_BITS 40 /* 2^40 ns ~ 18 minutes */
+#endif
+
+#ifndef PERF_HISTOGRAM_PRINT_WIDTH
+#define PERF_HISTOGRAM_PRINT_WIDTH 32 /* Characters of the compact histogram in perf_print_stats */
+#endif
+
+#define PERF_HISTOGRAM_SUB_COUNT (1UL << PERF_HISTOGRAM_SUB_BITS)
+#define PERF_HISTOGRAM_BUCKETS ((PERF_HISTOGRAM_MAX_BITS - PERF_HISTOGRAM_SUB_BITS + 1) * PERF_HISTOGRAM_SUB_COUNT)
+
+/* File and name are stored by pointer (__FILE__ and the stringified call are literals) and must outlive the stats */
+typedef struct perf_stats_entry
+{
+    char *file; /* File name */
+    int line;   /* Line number */
+    char *name; /* Function or code block name */
+
+    unsigned long count;
+
+    unsigned long cycles_min;
+    unsigned long cycles_max;
+    unsigned long cycles_sum;
+
+    double time_ms_min;
+    double time_ms_max;
+    double time_ms_sum;
+    double time_ms_sum_sq; /* For the standard deviation */
+
+#ifdef PERF_STATS_HISTOGRAM
+    unsigned int histogram[PERF_HISTOGRAM_BUCKETS]; /* Sample counts per log-linear nanosecond bucket */
+#endif
+
+    unsigned long hw_count;                 /* Samples with hardware counters */
+    perf_u64 hw_sum[PERF_HW_COUNTER_COUNT]; /* Summed counter deltas, indexed by PERF_HW_* */
+
+    unsigned long tp_count; /* Samples with throughput (see PERF_PROFILE_WITH_THROUGHPUT) */
+    perf_u64 tp_bytes_in;
+    perf_u64 tp_bytes_out;
+    perf_u64 tp_items; /* Pixels for imagine */
+    perf_u64 tp_cycles;
+    double tp_time_ms;
+
+} perf_stats_entry;
+
+/* Site registry and (merged) report table */
+static perf_stats_entry perf_stats_entries[PERF_STATS_ENTRIES_MAX];
+static unsigned long perf_stats_entry_count = 0;
+
+#ifdef PERF_STATS_THREADS
+typedef struct perf_stats_thread
+{
+    unsigned long thread_id;
+    perf_stats_entry entries[PERF_STATS_ENTRIES_MAX]; /* Indexed like perf_stats_entries, file == 0 until first use */
+
+} perf_stats_thread;
+
+static perf_stats_thread perf_stats_threads[PERF_STATS_THREADS];
+static volatile long perf_stats_thread_count = 0;
+static volatile long perf_stats_threads_dropped = 0; /* Threads that found no free slot, their samples are not recorded */
+static volatile long perf_stats_lock = 0;
+#endif
+
+PERF_API PERF_INLINE unsigned long perf_histogram_bucket(unsigned long value)
+{
+    unsigned long msb = 0;
+    unsigned long shift;
+    unsigned long bucket;
+
+    if (value < PERF_HISTOGRAM_SUB_COUNT)
+    {
+        return value;
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    msb = (unsigned long)(sizeof(unsigned long) * 8 - 1) - (unsigned long)__builtin_clzl(value);
+#else
+    {
+        unsigned long v = value;
+        while (v >>= 1)
+        {
+            msb++;
+        }
+    }
+#endif
+
+    shift = msb - PERF_HISTOGRAM_SUB_BITS;
+    bucket = (shift + 1) * PERF_HISTOGRAM_SUB_COUNT + ((value >> shift) & (PERF_HISTOGRAM_SUB_COUNT - 1));
+
+    return bucket < PERF_HISTOGRAM_BUCKETS ? bucket : PERF_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Bucket of a sample in ns. Values of 2^31 ns and above are halved into unsigned long range first,
+ * every halving is one power of two, so one PERF_HISTOGRAM_SUB_COUNT further.
+ */
+PERF_API PERF_INLINE unsigned long perf_histogram_bucket_ns(double ns)
+{
+    unsigned long octaves = 0;
+    unsigned long bucket;
+
+    if (!(ns >= 0.0))
+    {
+        return 0;
+    }
+
+    while (ns >= 2147483648.0)
+    {
+        if (++octaves >= PERF_HISTOGRAM_BUCKETS / PERF_HISTOGRAM_SUB_COUNT)
+        {
+            return PERF_HISTOGRAM_BUCKETS - 1;
+        }
+
+        ns *= 0.5;
+    }
+
+    bucket = perf_histogram_bucket((unsigned long)ns) + octaves * PERF_HISTOGRAM_SUB_COUNT;
+
+    return bucket < PERF_HISTOGRAM_BUCKETS ? bucket : PERF_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Smallest value (ns) that falls into the bucket */
+PERF_API PERF_INLINE double perf_histogram_bucket_lower(unsigned long bucket)
+{
+    unsigned long shift;
+    unsigned long sub;
+    double scale = 1.0;
+
+    if (bucket < PERF_HISTOGRAM_SUB_COUNT)
+    {
+        return (double)bucket;
+    }
+
+    shift = bucket / PERF_HISTOGRAM_SUB_COUNT - 1;
+    sub = bucket % PERF_HISTOGRAM_SUB_COUNT;
+
+    while (shift--)
+    {
+        scale *= 2.0;
+    }
+
+    return (double)(PERF_HISTOGRAM_SUB_COUNT + sub) * scale;
+}
+
+PERF_API PERF_INLINE double perf_histogram_bucket_width(unsigned long bucket)
+{
+    if (bucket < 2 * PERF_HISTOGRAM_SUB_COUNT)
+    {
+        return 1.0;
+    }
+
+    return perf_histogram_bucket_lower(bucket) / (double)(PERF_HISTOGRAM_SUB_COUNT + bucket % PERF_HISTOGRAM_SUB_COUNT);
+}
+
+/* Open addressing table of entry index + 1 (0 = empty slot), keyed on the (file, line, name) pointers */
+static unsigned int perf_stats_hash_table[PERF_STATS_HASH_SIZE];
 
+PERF_API PERF_INLINE unsigned long perf_stats_hash(char *file, int line, char *name)
+{
+    perf_uptr h = (perf_uptr)file;
+
+    h ^= (perf_uptr)name * 31u;
+    h ^= (perf_uptr)(unsigned int)line * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+
+    return (unsigned long)h & (PERF_STATS_HASH_SIZE - 1);
+}
+
+PERF_API PERF_INLINE void perf_stats_entry_reset(perf_stats_entry *e)
+{
+    int c;
+
+    e->count = 0;
+
+    e->cycles_min = ~0UL; /* Max unsigned long */
+    e->cycles_max = 0;
+    e->cycles_sum = 0;
+
+    e->time_ms_min = 1e30; /* Huge number */
+    e->time_ms_max = 0.0;
+    e->time_ms_sum = 0.0;
+    e->time_ms_sum_sq = 0.0;
+
+#ifdef PERF_STATS_HISTOGRAM
+    {
+        unsigned long b;
+
+        for (b = 0; b < PERF_HISTOGRAM_BUCKETS; ++b)
+        {
+            e->histogram[b] = 0;
+        }
+    }
+#endif
+
+    e->hw_count = 0;
+    for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+    {
+        e->hw_sum[c] = 0;
+    }
+
+    e->tp_count = 0;
+    e->tp_bytes_in = 0;
+    e->tp_bytes_out = 0;
+    e->tp_items = 0;
+    e->tp_cycles = 0;
+    e->tp_time_ms = 0.0;
+}
+
+/* Returns the index of the site in perf_stats_entries, registering it on first use (-1 if full) */
+PERF_API PERF_INLINE long perf_stats_get_site(char *file, int line, char *name)
+{
+    unsigned long slot = perf_stats_hash(file, line, name);
+    perf_stats_entry *e;
+    long index = -1;
+
+#ifdef PERF_STATS_THREADS
+    perf_spin_lock(&perf_stats_lock);
+#endif
+
+    /* Linear probing, terminates since the table is always larger than the number of entries */
+    while (perf_stats_hash_table[slot] != 0)
+    {
+        e = &perf_stats_entries[perf_stats_hash_table[slot] - 1];
+
+        if (e->file == file && e->line == line && e->name == name)
+        {
+            index = (long)perf_stats_hash_table[slot] - 1;
+            break;
+        }
+
+        slot = (slot + 1) & (PERF_STATS_HASH_SIZE - 1);
+    }
+
+    /* If not found, create a new entry */
+    if (index < 0 && perf_stats_entry_count < PERF_STATS_ENTRIES_MAX)
+    {
+        e = &perf_stats_entries[perf_stats_entry_count];
+
+        e->file = file;
         e->line = line;
-        e->count = 0;
+        e->name = name;
+        perf_stats_entry_reset(e);
+
+        index = (long)perf_stats_entry_count++;
+        perf_stats_hash_table[slot] = (unsigned int)perf_stats_entry_count;
+    }
+
+#ifdef PERF_STATS_THREADS
+    perf_spin_unlock(&perf_stats_lock);
+#endif
+
+    return index;
+}
+
+#ifdef PERF_STATS_THREADS
+/* Claims the table copy of the calling thread on first use, 0 if all PERF_STATS_THREADS slots are taken */
+PERF_API PERF_INLINE perf_stats_thread *perf_stats_thread_get(void)
+{
+#ifdef PERF_THREAD_LOCAL
+    static PERF_THREAD_LOCAL perf_stats_thread *thread = 0;
+    static PERF_THREAD_LOCAL int dropped = 0; /* Remembered so a thread without slot claims only once */
+
+    if (!thread)
+    {
+        long index;
+
+        if (dropped)
+        {
+            return 0;
+        }
+
+        index = perf_atomic_add(&perf_stats_thread_count, 1);
+
+        if (index >= PERF_STATS_THREADS)
+        {
+            dropped = 1;
+            perf_atomic_add(&perf_stats_threads_dropped, 1);
+            return 0;
+        }
+
+        thread = &perf_stats_threads[index];
+        thread->thread_id = perf_thread_id();
+    }
+
+    return thread;
+#else
+    /* No thread local storage: search the slot by thread id */
+    unsigned long thread_id = perf_thread_id();
+    long count = perf_stats_thread_count;
+    long i;
 
-        e->cycles_min = ~0UL; /* Max unsigned long */
-        e->cycles_max = 0;
-        e->cycles_sum = 0;
+    for (i = 0; i < count && i < PERF_STATS_THREADS; ++i)
+    {
+        if (perf_stats_threads[i].thread_id == thread_id)
+        {
+            return &perf_stats_threads[i];
+        }
+    }
 
-        e->time_ms_min = 1e30; /* Huge number */
-        e->time_ms_max = 0.0;
-        e->time_ms_sum = 0.0;
+    if (count >= PERF_STATS_THREADS)
+    {
+        return 0; /* Full, without thread local storage drops are not counted */
+    }
 
-        return e;
+    perf_spin_lock(&perf_stats_lock);
+    i = perf_stats_thread_count;
+    if (i < PERF_STATS_THREADS)
+    {
+        perf_stats_threads[i].thread_id = thread_id;
+        perf_stats_thread_count = i + 1;
     }
+    perf_spin_unlock(&perf_stats_lock);
 
-    return 0; /* No space */
+    return i < PERF_STATS_THREADS ? &perf_stats_threads[i] : 0;
+#endif
 }
+#endif
 
-PERF_API PERF_INLINE void perf_stats_store_result(char *file, int line, unsigned long cycles, double time_ms, char *name)
+/* site is an optional per call site cache of the site index (initially -1) so the lookup only happens once per site.
+ * bytes_in, bytes_out and items are the work done by the sample, all 0 if unknown.
+ */
+PERF_API PERF_INLINE void perf_stats_record(long *site, char *file, int line, unsigned long cycles, double time_ms, perf_hw_sample *hw, perf_u64 bytes_in, perf_u64 bytes_out, perf_u64 items, char *name)
 {
-    perf_stats_entry *e = perf_stats_get_entry(file, line, name);
+    perf_stats_entry *e;
+    long index = site ? *site : -1;
+
+    if (index < 0)
+    {
+        index = perf_stats_get_site(file, line, name);
+
+        if (index < 0)
+        {
+            return; /* Out of slots */
+        }
+
+        if (site)
+        {
+            *site = index;
+        }
+    }
 
-    if (!e)
+#ifdef PERF_STATS_THREADS
     {
-        return; /* Out of slots */
+        perf_stats_thread *thread = perf_stats_thread_get();
+
+        if (!thread)
+        {
+            return; /* More threads than PERF_STATS_THREADS */
+        }
+
+        e = &thread->entries[index];
+
+        if (!e->file)
+        {
+            e->file = file;
+            e->line = line;
+            e->name = name;
+            perf_stats_entry_reset(e);
+        }
     }
+#else
+    e = &perf_stats_entries[index];
+#endif
 
     e->count++;
     e->cycles_sum += cycles;
     e->time_ms_sum += time_ms;
+    e->time_ms_sum_sq += time_ms * time_ms;
 
     if (cycles < e->cycles_min)
     {
@@ -573,127 +1467,1412 @@ PERF_API PERF_INLINE void perf_stats_store_result(char *file, int line, unsigned
     }
     if (time_ms > e->time_ms_max)
     {
-        e->time_ms_max = time_ms;
+        e->time_ms_max = time_ms;
+    }
+
+#ifdef PERF_STATS_HISTOGRAM
+    e->histogram[perf_histogram_bucket_ns(time_ms * 1000000.0 + 0.5)]++;
+#endif
+
+    if (hw)
+    {
+        int c;
+        e->hw_count++;
+        for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+        {
+            e->hw_sum[c] += hw->value[c];
+        }
+    }
+
+    if (bytes_in || bytes_out || items)
+    {
+        e->tp_count++;
+        e->tp_bytes_in += bytes_in;
+        e->tp_bytes_out += bytes_out;
+        e->tp_items += items;
+        e->tp_cycles += cycles;
+        e->tp_time_ms += time_ms;
+    }
+}
+
+/* Average hardware counter delta per sample */
+PERF_API PERF_INLINE double perf_stats_hw_avg(perf_stats_entry *e, int counter)
+{
+    return e->hw_count ? (double)e->hw_sum[counter] / (double)e->hw_count : 0.0;
+}
+
+PERF_API PERF_INLINE double perf_stats_ipc(perf_stats_entry *e)
+{
+    return e->hw_sum[PERF_HW_CYCLES] ? (double)e->hw_sum[PERF_HW_INSTRUCTIONS] / (double)e->hw_sum[PERF_HW_CYCLES] : 0.0;
+}
+
+/* Counter events per 1000 instructions */
+PERF_API PERF_INLINE double perf_stats_mpki(perf_stats_entry *e, int counter)
+{
+    return e->hw_sum[PERF_HW_INSTRUCTIONS] ? 1000.0 * (double)e->hw_sum[counter] / (double)e->hw_sum[PERF_HW_INSTRUCTIONS] : 0.0;
+}
+
+/* #############################################################################
+ * # Throughput
+ * #############################################################################
+ *
+ * Scopes profiled with PERF_PROFILE_WITH_THROUGHPUT carry the bytes read, bytes written
+ * and items (pixels) processed. Bytes are counted as traffic (in + out) so they compare
+ * directly against the reference memcpy bandwidth, which also moves every byte twice
+ * (read + write). The reference is measured once, on first use, by copying between the two
+ * halves of a static buffer of 2 * PERF_BANDWIDTH_SIZE bytes, each half well beyond the last
+ * level cache. To avoid the static buffer call perf_stats_reference_bandwidth_measure with an
+ * own buffer first, with PERF_BANDWIDTH_SIZE defined as 0 the static buffer is not compiled in.
+ */
+#ifndef PERF_BANDWIDTH_SIZE
+#define PERF_BANDWIDTH_SIZE (8UL * 1024UL * 1024UL)
+#endif
+
+#ifndef PERF_BANDWIDTH_PASSES
+#define PERF_BANDWIDTH_PASSES 4 /* Best of, after one untimed pass that faults the pages in */
+#endif
+
+static double perf_stats_bandwidth = 0.0;
+
+/* Measures the reference copy bandwidth in GB/s (bytes per nanosecond, read + write traffic)
+ * by copying the first half of buffer (size bytes, 8 byte aligned) to the second half.
+ */
+PERF_API PERF_INLINE double perf_stats_reference_bandwidth_measure(void *buffer, unsigned long size)
+{
+    perf_u64 *src = (perf_u64 *)buffer;
+    unsigned long words = (unsigned long)(size / 2 / sizeof(perf_u64)) & ~3UL;
+    perf_u64 *dst = src + words;
+    double best_ns = 0.0;
+    unsigned long pass;
+    unsigned long i;
+
+    if (words == 0)
+    {
+        return 0.0;
+    }
+
+    /* Written pages, a never written source maps the shared zero page and reads too fast */
+    for (i = 0; i < words; ++i)
+    {
+        src[i] = (perf_u64)i * 2654435761UL;
+    }
+
+    for (pass = 0; pass <= PERF_BANDWIDTH_PASSES; ++pass)
+    {
+        perf_u64 key = (perf_u64)pass; /* Not a plain copy, so the loop is not turned into a memcpy call (nostdlib) */
+        double start = perf_platform_current_time_nanoseconds();
+        double ns;
+
+        for (i = 0; i < words; i += 4)
+        {
+            dst[i] = src[i] ^ key;
+            dst[i + 1] = src[i + 1] ^ key;
+            dst[i + 2] = src[i + 2] ^ key;
+            dst[i + 3] = src[i + 3] ^ key;
+        }
+
+#if defined(__GNUC__) || defined(__clang__)
+        /* The stores complete before the end time is taken */
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+#endif
+
+        ns = perf_platform_current_time_nanoseconds() - start;
+
+        if (pass > 0 && ns > 0.0 && (best_ns == 0.0 || ns < best_ns))
+        {
+            best_ns = ns;
+        }
+    }
+
+    /* Keeps the copies observable */
+    src[0] = dst[words - 1];
+
+    perf_stats_bandwidth = best_ns > 0.0 ? 2.0 * (double)(words * sizeof(perf_u64)) / best_ns : 0.0;
+
+    return perf_stats_bandwidth;
+}
+
+/* Reference copy bandwidth in GB/s, measured on first use unless measured before */
+PERF_API PERF_INLINE double perf_stats_reference_bandwidth(void)
+{
+#if PERF_BANDWIDTH_SIZE > 0
+    static perf_u64 buffer[2 * PERF_BANDWIDTH_SIZE / sizeof(perf_u64)];
+
+    if (perf_stats_bandwidth <= 0.0)
+    {
+        perf_stats_reference_bandwidth_measure(buffer, (unsigned long)sizeof(buffer));
+    }
+#endif
+
+    return perf_stats_bandwidth;
+}
+
+PERF_API PERF_INLINE double perf_stats_bytes(perf_stats_entry *e)
+{
+    return (double)(e->tp_bytes_in + e->tp_bytes_out);
+}
+
+/* GB/s over the samples with throughput */
+PERF_API PERF_INLINE double perf_stats_gbs(perf_stats_entry *e)
+{
+    return e->tp_time_ms > 0.0 ? perf_stats_bytes(e) / (e->tp_time_ms * 1000000.0) : 0.0;
+}
+
+PERF_API PERF_INLINE double perf_stats_cycles_per_byte(perf_stats_entry *e)
+{
+    return perf_stats_bytes(e) > 0.0 ? (double)e->tp_cycles / perf_stats_bytes(e) : 0.0;
+}
+
+PERF_API PERF_INLINE double perf_stats_cycles_per_item(perf_stats_entry *e)
+{
+    return e->tp_items ? (double)e->tp_cycles / (double)e->tp_items : 0.0;
+}
+
+/* Percent of the reference memcpy bandwidth (roofline position of a memory bound scope) */
+PERF_API PERF_INLINE double perf_stats_bandwidth_percent(perf_stats_entry *e)
+{
+    double reference = perf_stats_reference_bandwidth();
+    return reference > 0.0 ? 100.0 * perf_stats_gbs(e) / reference : 0.0;
+}
+
+/* Average counter delta per item, assumes hardware samples and throughput samples cover the same runs */
+PERF_API PERF_INLINE double perf_stats_hw_per_item(perf_stats_entry *e, int counter)
+{
+    return e->tp_items && e->tp_count ? perf_stats_hw_avg(e, counter) * (double)e->tp_count / (double)e->tp_items : 0.0;
+}
+
+/* Adds the samples of src to dst */
+PERF_API PERF_INLINE void perf_stats_entry_merge(perf_stats_entry *dst, perf_stats_entry *src)
+{
+    int c;
+
+    if (src->count == 0)
+    {
+        return;
+    }
+
+    dst->count += src->count;
+    dst->cycles_sum += src->cycles_sum;
+    dst->time_ms_sum += src->time_ms_sum;
+    dst->time_ms_sum_sq += src->time_ms_sum_sq;
+
+    if (src->cycles_min < dst->cycles_min)
+    {
+        dst->cycles_min = src->cycles_min;
+    }
+    if (src->cycles_max > dst->cycles_max)
+    {
+        dst->cycles_max = src->cycles_max;
+    }
+    if (src->time_ms_min < dst->time_ms_min)
+    {
+        dst->time_ms_min = src->time_ms_min;
+    }
+    if (src->time_ms_max > dst->time_ms_max)
+    {
+        dst->time_ms_max = src->time_ms_max;
+    }
+
+#ifdef PERF_STATS_HISTOGRAM
+    {
+        unsigned long b;
+
+        for (b = 0; b < PERF_HISTOGRAM_BUCKETS; ++b)
+        {
+            dst->histogram[b] += src->histogram[b];
+        }
+    }
+#endif
+
+    dst->hw_count += src->hw_count;
+    for (c = 0; c < PERF_HW_COUNTER_COUNT; ++c)
+    {
+        dst->hw_sum[c] += src->hw_sum[c];
+    }
+
+    dst->tp_count += src->tp_count;
+    dst->tp_bytes_in += src->tp_bytes_in;
+    dst->tp_bytes_out += src->tp_bytes_out;
+    dst->tp_items += src->tp_items;
+    dst->tp_cycles += src->tp_cycles;
+    dst->tp_time_ms += src->tp_time_ms;
+}
+
+/* Rebuilds perf_stats_entries from the per thread tables. Called by the reports,
+ * values of threads still recording while merging may be slightly inconsistent.
+ */
+PERF_API PERF_INLINE void perf_stats_merge(void)
+{
+#ifdef PERF_STATS_THREADS
+    long threads = perf_stats_thread_count < PERF_STATS_THREADS ? perf_stats_thread_count : PERF_STATS_THREADS;
+    unsigned long i;
+    long t;
+
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        perf_stats_entry_reset(&perf_stats_entries[i]);
+
+        for (t = 0; t < threads; ++t)
+        {
+            perf_stats_entry_merge(&perf_stats_entries[i], &perf_stats_threads[t].entries[i]);
+        }
+    }
+#endif
+}
+
+/* Returns the latency (ms) below which the given fraction (0.5 = p50, 0.999 = p999) of samples fall.
+ * The value is the middle of the bucket holding that sample, 0 without PERF_STATS_HISTOGRAM.
+ */
+PERF_API PERF_INLINE double perf_stats_percentile(perf_stats_entry *e, double fraction)
+{
+#ifdef PERF_STATS_HISTOGRAM
+    unsigned long target;
+    unsigned long seen = 0;
+    unsigned long b;
+
+    if (e->count == 0)
+    {
+        return 0.0;
+    }
+
+    target = (unsigned long)(fraction * (double)e->count);
+
+    if ((double)target < fraction * (double)e->count)
+    {
+        target++; /* ceil */
+    }
+
+    if (target == 0)
+    {
+        target = 1;
+    }
+
+    for (b = 0; b < PERF_HISTOGRAM_BUCKETS; ++b)
+    {
+        seen += e->histogram[b];
+
+        if (seen >= target)
+        {
+            /* Middle of the bucket, clamped to the exact observed range */
+            double value_ms = (perf_histogram_bucket_lower(b) + perf_histogram_bucket_width(b) * 0.5) / 1000000.0;
+
+            if (value_ms < e->time_ms_min)
+            {
+                value_ms = e->time_ms_min;
+            }
+
+            if (value_ms > e->time_ms_max)
+            {
+                value_ms = e->time_ms_max;
+            }
+
+            return value_ms;
+        }
+    }
+
+    return e->time_ms_max;
+#else
+    (void)e;
+    (void)fraction;
+    return 0.0;
+#endif
+}
+
+#ifdef PERF_STATS_HISTOGRAM
+
+/* Renders the populated bucket range as a fixed width character density bar */
+PERF_API PERF_INLINE void perf_stats_histogram_string(perf_stats_entry *e, char *buffer, unsigned long max_len)
+{
+    static char levels[] = " .:-=+*#%@";
+    unsigned long columns[PERF_HISTOGRAM_PRINT_WIDTH];
+    unsigned long first = PERF_HISTOGRAM_BUCKETS;
+    unsigned long last = 0;
+    unsigned long width;
+    unsigned long peak = 0;
+    unsigned long b;
+    unsigned long c;
+
+    if (max_len == 0)
+    {
+        return;
+    }
+
+    for (b = 0; b < PERF_HISTOGRAM_BUCKETS; ++b)
+    {
+        if (e->histogram[b])
+        {
+            if (first == PERF_HISTOGRAM_BUCKETS)
+            {
+                first = b;
+            }
+            last = b;
+        }
+    }
+
+    width = max_len - 1 < PERF_HISTOGRAM_PRINT_WIDTH ? max_len - 1 : PERF_HISTOGRAM_PRINT_WIDTH;
+
+    if (first == PERF_HISTOGRAM_BUCKETS || width == 0)
+    {
+        buffer[0] = '\0';
+        return;
+    }
+
+    for (c = 0; c < width; ++c)
+    {
+        columns[c] = 0;
+    }
+
+    /* Spread the populated buckets evenly over the columns */
+    for (b = first; b <= last; ++b)
+    {
+        c = ((b - first) * width) / (last - first + 1);
+        columns[c] += e->histogram[b];
+    }
+
+    for (c = 0; c < width; ++c)
+    {
+        if (columns[c] > peak)
+        {
+            peak = columns[c];
+        }
+    }
+
+    for (c = 0; c < width; ++c)
+    {
+        unsigned long level = columns[c] ? 1 + (columns[c] * (sizeof(levels) - 3)) / peak : 0;
+        buffer[c] = levels[level];
+    }
+
+    buffer[width] = '\0';
+}
+#endif
+
+PERF_API PERF_INLINE void perf_stats_store_result(char *file, int line, unsigned long cycles, double time_ms, char *name)
+{
+    perf_stats_record(0, file, line, cycles, time_ms, 0, 0, 0, 0, name);
+}
+
+/* Per call site cache slot used by PERF_PROFILE_WITH_NAME (define PERF_STATS_NO_SITE_CACHE to always hash) */
+#ifdef PERF_STATS_NO_SITE_CACHE
+#define PERF_STATS_SITE_DECLARE
+#define PERF_STATS_SITE_RECORD(cycles, time_ms, hw, bytes_in, bytes_out, items, name) perf_stats_record(0, __FILE__, __LINE__, cycles, time_ms, hw, bytes_in, bytes_out, items, name)
+#else
+#define PERF_STATS_SITE_DECLARE static long perf_stats_site = -1;
+#define PERF_STATS_SITE_RECORD(cycles, time_ms, hw, bytes_in, bytes_out, items, name) perf_stats_record(&perf_stats_site, __FILE__, __LINE__, cycles, time_ms, hw, bytes_in, bytes_out, items, name)
+#endif
+
+PERF_API PERF_INLINE void perf_print_stats(void)
+{
+    unsigned long i;
+    unsigned long first = perf_stats_entry_count; /* First and last entry with samples, the table borders */
+    unsigned long last = 0;
+
+    char buffer[PERF_MAX_PRINT_BUFFER];
+
+    perf_stats_merge();
+
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        if (perf_stats_entries[i].count == 0)
+        {
+            continue; /* Registered site without samples (yet) */
+        }
+
+        if (first == perf_stats_entry_count)
+        {
+            first = i;
+        }
+        last = i;
+    }
+
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        unsigned long current_pos = 0;
+
+        perf_stats_entry *e = &perf_stats_entries[i];
+        unsigned long avg_cycles = e->count ? e->cycles_sum / e->count : 0;
+        double avg_time_ms = e->count ? (e->time_ms_sum / (double)e->count) : 0.0;
+
+        char line_str[5];
+        char count_str[7];
+
+        char cycles_min[12];
+        char cycles_max[12];
+        char cycles_avg[12];
+        char cycles_sum[12];
+
+        char time_min[12];
+        char time_max[12];
+        char time_avg[12];
+        char time_sum[12];
+
+        if (e->count == 0)
+        {
+            continue;
+        }
+
+        perf_int_to_string(e->line, line_str, sizeof(line_str));
+        perf_ulong_to_string(e->count, count_str, sizeof(count_str));
+
+        perf_ulong_to_string(e->cycles_min, cycles_min, sizeof(cycles_min));
+        perf_ulong_to_string(e->cycles_max, cycles_max, sizeof(cycles_max));
+        perf_ulong_to_string(avg_cycles, cycles_avg, sizeof(cycles_avg));
+        perf_ulong_to_string(e->cycles_sum, cycles_sum, sizeof(cycles_sum));
+
+        perf_double_to_string(e->time_ms_min, time_min, sizeof(time_min), 4);
+        perf_double_to_string(e->time_ms_max, time_max, sizeof(time_max), 4);
+        perf_double_to_string(avg_time_ms, time_avg, sizeof(time_avg), 4);
+        perf_double_to_string(e->time_ms_sum, time_sum, sizeof(time_sum), 4);
+
+        if (i == first)
+        {
+            buffer[0] = '\0';
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf]\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------------------------------------------------+-------------------------------------------------------+\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | cylces                                                | time_ms                                               |\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |         min |         max |         avg |         sum |         min |         max |         avg |         sum |\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
+            current_pos = 0;
+            perf_platform_print(buffer);
+        }
+
+        buffer[0] = '\0';
+
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_min);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_max);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_avg);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_sum);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_min);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_max);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_avg);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_sum);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, count_str);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " x ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
+        current_pos = 0;
+
+        perf_platform_print(buffer);
+
+        if (i == last)
+        {
+            buffer[0] = '\0';
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
+            current_pos = 0;
+            perf_platform_print(buffer);
+        }
+    }
+
+#ifdef PERF_STATS_HISTOGRAM
+    /* Latency percentiles and distribution per entry */
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        unsigned long current_pos = 0;
+        perf_stats_entry *e = &perf_stats_entries[i];
+
+        char line_str[12];
+        char p50[12];
+        char p90[12];
+        char p99[12];
+        char p999[12];
+        char histogram[PERF_HISTOGRAM_PRINT_WIDTH + 1];
+
+        if (e->count == 0)
+        {
+            continue;
+        }
+
+        perf_int_to_string(e->line, line_str, sizeof(line_str));
+        perf_double_to_string(perf_stats_percentile(e, 0.5), p50, sizeof(p50), 4);
+        perf_double_to_string(perf_stats_percentile(e, 0.9), p90, sizeof(p90), 4);
+        perf_double_to_string(perf_stats_percentile(e, 0.99), p99, sizeof(p99), 4);
+        perf_double_to_string(perf_stats_percentile(e, 0.999), p999, sizeof(p999), 4);
+        perf_stats_histogram_string(e, histogram, sizeof(histogram));
+
+        buffer[0] = '\0';
+
+        if (i == first)
+        {
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+----------------------------------+\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |  p50 (ms)   |  p90 (ms)   |  p99 (ms)   |  p999 (ms)  | histogram (min .. max)           |\n");
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+----------------------------------+\n");
+        }
+
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, p50);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, p90);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, p99);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, p999);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, histogram);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+        if (i == last)
+        {
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+----------------------------------+\n");
+        }
+
+        perf_platform_print(buffer);
+    }
+#endif
+
+    /* Hardware counters, only for entries that have samples */
+    {
+        perf_stats_entry *last = 0;
+        char last_line_str[12];
+        int header_printed = 0;
+
+        for (i = 0; i < perf_stats_entry_count; ++i)
+        {
+            unsigned long current_pos = 0;
+            perf_stats_entry *e = &perf_stats_entries[i];
+
+            char line_str[12];
+            char ipc[12];
+            char cache_misses[12];
+            char branch_misses[12];
+            char cache_mpki[12];
+            char branch_mpki[12];
+            char llc_loads[12];
+
+            if (e->hw_count == 0)
+            {
+                continue;
+            }
+
+            perf_int_to_string(e->line, line_str, sizeof(line_str));
+            perf_double_to_string(perf_stats_ipc(e), ipc, sizeof(ipc), 2);
+            perf_double_to_string(perf_stats_hw_avg(e, PERF_HW_CACHE_MISSES), cache_misses, sizeof(cache_misses), 1);
+            perf_double_to_string(perf_stats_hw_avg(e, PERF_HW_BRANCH_MISSES), branch_misses, sizeof(branch_misses), 1);
+            perf_double_to_string(perf_stats_mpki(e, PERF_HW_CACHE_MISSES), cache_mpki, sizeof(cache_mpki), 2);
+            perf_double_to_string(perf_stats_mpki(e, PERF_HW_BRANCH_MISSES), branch_mpki, sizeof(branch_mpki), 2);
+            perf_double_to_string(perf_stats_hw_avg(e, PERF_HW_LLC_LOADS), llc_loads, sizeof(llc_loads), 1);
+
+            buffer[0] = '\0';
+
+            if (!header_printed)
+            {
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+\n");
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |     IPC     | cache miss  | branch miss | cache MPKI  | branch MPKI |  LLC loads  |\n");
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+\n");
+                header_printed = 1;
+            }
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ipc);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cache_misses);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, branch_misses);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cache_mpki);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, branch_mpki);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, perf_hw_available(PERF_HW_LLC_LOADS) ? llc_loads : "          -");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+            perf_platform_print(buffer);
+
+            last = e;
+        }
+
+        if (last)
+        {
+            unsigned long current_pos = 0;
+
+            perf_int_to_string(last->line, last_line_str, sizeof(last_line_str));
+
+            buffer[0] = '\0';
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last_line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+\n");
+            perf_platform_print(buffer);
+        }
+    }
+
+    /* Throughput, only for entries that have bytes or items attached */
+    {
+        perf_stats_entry *last = 0;
+        char last_line_str[12];
+        int header_printed = 0;
+
+        for (i = 0; i < perf_stats_entry_count; ++i)
+        {
+            unsigned long current_pos = 0;
+            perf_stats_entry *e = &perf_stats_entries[i];
+
+            char line_str[12];
+            char gbs[12];
+            char cycles_byte[12];
+            char cycles_item[12];
+            char bandwidth[12];
+            char misses_item[12];
+
+            if (e->tp_count == 0)
+            {
+                continue;
+            }
+
+            perf_int_to_string(e->line, line_str, sizeof(line_str));
+            perf_double_to_string(perf_stats_gbs(e), gbs, sizeof(gbs), 3);
+            perf_double_to_string(perf_stats_cycles_per_byte(e), cycles_byte, sizeof(cycles_byte), 3);
+            perf_double_to_string(perf_stats_cycles_per_item(e), cycles_item, sizeof(cycles_item), 3);
+            perf_double_to_string(perf_stats_bandwidth_percent(e), bandwidth, sizeof(bandwidth), 1);
+            perf_double_to_string(perf_stats_hw_per_item(e, PERF_HW_CACHE_MISSES), misses_item, sizeof(misses_item), 4);
+
+            buffer[0] = '\0';
+
+            if (!header_printed)
+            {
+                char reference[24];
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+\n");
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |    GB/s     | cycles/byte | cycles/item |  % mem bw   | misses/item | memcpy ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_reference_bandwidth(), reference, sizeof(reference), 3));
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " GB/s\n");
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+\n");
+                header_printed = 1;
+            }
+
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, gbs);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, perf_stats_bytes(e) > 0.0 ? cycles_byte : "          -");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->tp_items ? cycles_item : "          -");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, bandwidth);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->hw_count && e->tp_items ? misses_item : "          -");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+            perf_platform_print(buffer);
+
+            last = e;
+        }
+
+        if (last)
+        {
+            unsigned long current_pos = 0;
+
+            perf_int_to_string(last->line, last_line_str, sizeof(last_line_str));
+
+            buffer[0] = '\0';
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last_line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+\n");
+            perf_platform_print(buffer);
+        }
+    }
+
+#ifdef PERF_STATS_THREADS
+    if (perf_stats_threads_dropped > 0)
+    {
+        unsigned long current_pos = 0;
+        char dropped_str[24];
+
+        buffer[0] = '\0';
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "[perf] ");
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)perf_stats_threads_dropped, dropped_str, sizeof(dropped_str)));
+        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " thread(s) not recorded, raise PERF_STATS_THREADS\n");
+        perf_platform_print(buffer);
+    }
+
+    /* Per thread breakdown */
+    {
+        long threads = perf_stats_thread_count < PERF_STATS_THREADS ? perf_stats_thread_count : PERF_STATS_THREADS;
+        perf_stats_entry *last = 0;
+        char last_line_str[12];
+        int header_printed = 0;
+        long t;
+
+        for (t = 0; t < threads; ++t)
+        {
+            for (i = 0; i < perf_stats_entry_count; ++i)
+            {
+                unsigned long current_pos = 0;
+                perf_stats_entry *e = &perf_stats_threads[t].entries[i];
+
+                char line_str[12];
+                char thread_str[12];
+                char count_str[12];
+                char time_avg[12];
+                char time_sum[12];
+
+                if (e->count == 0)
+                {
+                    continue;
+                }
+
+                perf_int_to_string(e->line, line_str, sizeof(line_str));
+                perf_ulong_to_string(perf_stats_threads[t].thread_id, thread_str, sizeof(thread_str));
+                perf_ulong_to_string(e->count, count_str, sizeof(count_str));
+                perf_double_to_string(e->time_ms_sum / (double)e->count, time_avg, sizeof(time_avg), 4);
+                perf_double_to_string(e->time_ms_sum, time_sum, sizeof(time_sum), 4);
+
+                buffer[0] = '\0';
+
+                if (!header_printed)
+                {
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+\n");
+
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |   thread    |    count    |  avg (ms)   |  sum (ms)   |\n");
+
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+\n");
+                    header_printed = 1;
+                }
+
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, thread_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, count_str);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_avg);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_sum);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
+                current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+                perf_platform_print(buffer);
+
+                last = e;
+            }
+        }
+
+        if (last)
+        {
+            unsigned long current_pos = 0;
+
+            perf_int_to_string(last->line, last_line_str, sizeof(last_line_str));
+
+            buffer[0] = '\0';
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last->file);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, last_line_str);
+            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+\n");
+            perf_platform_print(buffer);
+        }
+    }
+#endif
+}
+
+/* #############################################################################
+ * # Machine readable export (JSON, CSV) and baseline comparison
+ * #############################################################################
+ *
+ * All output goes through a perf_sink (see OUTPUT SINKS).
+ *
+ * USAGE (performance gate)
+ *   perf_stats_export_csv(perf_sink_pio, &stream);            (store as new baseline)
+ *   regressions = perf_stats_compare(baseline, baseline_size, 0.10, perf_sink_print, 0);
+ */
+#ifndef PERF_COMPARE_T_MIN
+#define PERF_COMPARE_T_MIN 3.0 /* Min Welch t statistic for a slowdown to count as significant */
+#endif
+
+PERF_API PERF_INLINE double perf_stats_stddev(perf_stats_entry *e)
+{
+    double mean;
+    double variance;
+
+    if (e->count < 2)
+    {
+        return 0.0;
+    }
+
+    mean = e->time_ms_sum / (double)e->count;
+    variance = (e->time_ms_sum_sq - mean * e->time_ms_sum) / (double)(e->count - 1);
+
+    return perf_sqrt(variance);
+}
+
+PERF_API PERF_INLINE void perf_stats_export_csv(perf_sink sink, void *user)
+{
+    char buffer[PERF_MAX_PRINT_BUFFER];
+    char number[24];
+    unsigned long i;
+
+    perf_stats_merge();
+
+    sink(user, "file,line,name,count,cycles_min,cycles_max,cycles_avg,time_ms_min,time_ms_max,time_ms_mean,time_ms_stddev,time_ms_p50,time_ms_p90,time_ms_p99,time_ms_p999,cycles_avg_ns,hw_samples,ipc,cache_misses_avg,branch_misses_avg,llc_loads_avg,tp_samples,bytes_in,bytes_out,items,gb_per_s,cycles_per_byte,cycles_per_item,bandwidth_percent\n");
+
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        perf_stats_entry *e = &perf_stats_entries[i];
+        unsigned long pos = 0;
+
+        if (e->count == 0)
+        {
+            continue; /* Registered site without samples (yet) */
+        }
+
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\"");
+        pos += perf_append_escaped(buffer, pos, PERF_MAX_PRINT_BUFFER, e->file, 1);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)e->line, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"");
+        pos += perf_append_escaped(buffer, pos, PERF_MAX_PRINT_BUFFER, e->name, 1);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->cycles_min, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->cycles_max, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->count ? e->cycles_sum / e->count : 0, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->time_ms_min, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->time_ms_max, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->count ? e->time_ms_sum / (double)e->count : 0.0, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_stddev(e), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.5), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.9), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.99), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.999), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_cycles_to_ns(e->count ? e->cycles_sum / e->count : 0), number, sizeof(number), 1));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->hw_count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_ipc(e), number, sizeof(number), 3));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_CACHE_MISSES), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_BRANCH_MISSES), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_LLC_LOADS), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->tp_count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_bytes_in, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_bytes_out, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_items, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_gbs(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_cycles_per_byte(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_cycles_per_item(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->tp_count ? perf_stats_bandwidth_percent(e) : 0.0, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+        sink(user, buffer);
+    }
+}
+
+PERF_API PERF_INLINE void perf_stats_export_json(perf_sink sink, void *user)
+{
+    char buffer[PERF_MAX_PRINT_BUFFER];
+    char number[24];
+    unsigned long i;
+    int first = 1;
+
+    perf_stats_merge();
+
+    sink(user, "{\"entries\":[\n");
+
+    for (i = 0; i < perf_stats_entry_count; ++i)
+    {
+        perf_stats_entry *e = &perf_stats_entries[i];
+        unsigned long pos = 0;
+#ifdef PERF_STATS_HISTOGRAM
+        unsigned long b;
+        int first_bucket = 1;
+#endif
+
+        if (e->count == 0)
+        {
+            continue; /* Registered site without samples (yet) */
+        }
+
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, first ? "{\"file\":\"" : ",{\"file\":\"");
+        first = 0;
+        pos += perf_append_escaped(buffer, pos, PERF_MAX_PRINT_BUFFER, e->file, 0);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\",\"line\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)e->line, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"name\":\"");
+        pos += perf_append_escaped(buffer, pos, PERF_MAX_PRINT_BUFFER, e->name, 0);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\",\"count\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cycles\":{\"min\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->cycles_min, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"max\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->cycles_max, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"sum\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->cycles_sum, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"avg_ns\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_cycles_to_ns(e->count ? e->cycles_sum / e->count : 0), number, sizeof(number), 1));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "},\"time_ms\":{\"min\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->time_ms_min, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"max\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->time_ms_max, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"mean\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->count ? e->time_ms_sum / (double)e->count : 0.0, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"stddev\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_stddev(e), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"p50\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.5), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"p90\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.9), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"p99\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.99), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"p999\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_percentile(e, 0.999), number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "},");
+        sink(user, buffer);
+
+        pos = 0;
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\"hw\":{\"samples\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->hw_count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"ipc\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_ipc(e), number, sizeof(number), 3));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cache_misses_avg\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_CACHE_MISSES), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"branch_misses_avg\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_BRANCH_MISSES), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cache_mpki\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_mpki(e, PERF_HW_CACHE_MISSES), number, sizeof(number), 3));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"branch_mpki\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_mpki(e, PERF_HW_BRANCH_MISSES), number, sizeof(number), 3));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"llc_loads_avg\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_avg(e, PERF_HW_LLC_LOADS), number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "},");
+        sink(user, buffer);
+
+        pos = 0;
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\"throughput\":{\"samples\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->tp_count, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"bytes_in\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_bytes_in, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"bytes_out\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_bytes_out, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"items\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_u64(e->tp_items, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"gb_per_s\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_gbs(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cycles_per_byte\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_cycles_per_byte(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cycles_per_item\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_cycles_per_item(e), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"bandwidth_percent\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(e->tp_count ? perf_stats_bandwidth_percent(e) : 0.0, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"cache_misses_per_item\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_stats_hw_per_item(e, PERF_HW_CACHE_MISSES), number, sizeof(number), 4));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "},\"histogram_ns\":[");
+        sink(user, buffer);
+
+#ifdef PERF_STATS_HISTOGRAM
+        /* Populated buckets as [lower bound ns, count] pairs */
+        for (b = 0; b < PERF_HISTOGRAM_BUCKETS; ++b)
+        {
+            if (e->histogram[b] == 0)
+            {
+                continue;
+            }
+
+            pos = 0;
+            buffer[0] = '\0';
+            pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, first_bucket ? "[" : ",[");
+            pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)perf_histogram_bucket_lower(b), number, sizeof(number)));
+            pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",");
+            pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(e->histogram[b], number, sizeof(number)));
+            pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "]");
+            sink(user, buffer);
+            first_bucket = 0;
+        }
+#endif
+
+#ifdef PERF_STATS_THREADS
+        /* Per thread breakdown as {"id","count","time_ms_sum"} objects */
+        {
+            long threads = perf_stats_thread_count < PERF_STATS_THREADS ? perf_stats_thread_count : PERF_STATS_THREADS;
+            int first_thread = 1;
+            long t;
+
+            sink(user, "],\"threads\":[");
+
+            for (t = 0; t < threads; ++t)
+            {
+                perf_stats_entry *te = &perf_stats_threads[t].entries[i];
+
+                if (te->count == 0)
+                {
+                    continue;
+                }
+
+                pos = 0;
+                buffer[0] = '\0';
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, first_thread ? "{\"id\":" : ",{\"id\":");
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(perf_stats_threads[t].thread_id, number, sizeof(number)));
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"count\":");
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(te->count, number, sizeof(number)));
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"time_ms_sum\":");
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(te->time_ms_sum, number, sizeof(number), 6));
+                pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "}");
+                sink(user, buffer);
+                first_thread = 0;
+            }
+        }
+#endif
+
+        sink(user, "]}\n");
+    }
+
+    sink(user, "]}\n");
+}
+
+/* Baseline CSV parsing helpers, fields are read in place */
+PERF_API PERF_INLINE char *perf_csv_field(char *p, char *end, char *field, unsigned long max_len)
+{
+    unsigned long len = 0;
+    int quoted = 0;
+
+    if (p < end && *p == '"')
+    {
+        quoted = 1;
+        p++;
+    }
+
+    while (p < end)
+    {
+        if (quoted && *p == '"')
+        {
+            if (p + 1 < end && p[1] == '"')
+            {
+                p++; /* escaped quote */
+            }
+            else
+            {
+                quoted = 0;
+                p++;
+                continue;
+            }
+        }
+        else if (!quoted && (*p == ',' || *p == '\n' || *p == '\r'))
+        {
+            break;
+        }
+
+        if (len + 1 < max_len)
+        {
+            field[len++] = *p;
+        }
+        p++;
+    }
+
+    field[len] = '\0';
+
+    if (p < end && *p == ',')
+    {
+        p++;
+    }
+
+    return p;
+}
+
+PERF_API PERF_INLINE double perf_parse_double(char *str)
+{
+    double value = 0.0;
+    double scale = 1.0;
+    int negative = 0;
+
+    if (*str == '-')
+    {
+        negative = 1;
+        str++;
+    }
+
+    while (*str >= '0' && *str <= '9')
+    {
+        value = value * 10.0 + (double)(*str++ - '0');
+    }
+
+    if (*str == '.')
+    {
+        str++;
+        while (*str >= '0' && *str <= '9')
+        {
+            scale *= 0.1;
+            value += (double)(*str++ - '0') * scale;
+        }
     }
+
+    return negative ? -value : value;
 }
 
-PERF_API PERF_INLINE void perf_print_stats(void)
+PERF_API PERF_INLINE int perf_string_equals(char *a, char *b)
 {
-    unsigned long i;
+    while (*a && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
 
+/* Compares the current stats against a baseline CSV written by perf_stats_export_csv.
+ * Sites are matched by file, line and name. When the line moved between releases a site is
+ * matched by file and name, but only if no other site in that file has the same name.
+ * A site regresses when its median (mean without PERF_STATS_HISTOGRAM) grew by more than threshold
+ * (0.10 = 10%) and the slowdown is significant (Welch t statistic of the means >= PERF_COMPARE_T_MIN).
+ * Every matched site is reported through the sink. Returns the number of regressions.
+ */
+PERF_API PERF_INLINE int perf_stats_compare(char *baseline, unsigned long baseline_size, double threshold, perf_sink sink, void *user)
+{
+    char *p = baseline;
+    char *end = baseline + baseline_size;
     char buffer[PERF_MAX_PRINT_BUFFER];
+    char fields[15][PERF_MAX_PRINT_BUFFER / 4];
+    char number[24];
+    int regressions = 0;
 
-    for (i = 0; i < perf_stats_entry_count; ++i)
-    {
-        unsigned long current_pos = 0;
+    perf_stats_merge();
 
-        perf_stats_entry *e = &perf_stats_entries[i];
-        unsigned long avg_cycles = e->count ? e->cycles_sum / e->count : 0;
-        double avg_time_ms = e->count ? (e->time_ms_sum / (double)e->count) : 0.0;
+    /* Skip header line */
+    while (p < end && *p != '\n')
+    {
+        p++;
+    }
 
-        char line_str[5];
-        char count_str[7];
+    while (p < end)
+    {
+        unsigned long f;
+        unsigned long i;
+        unsigned long base_count, base_line, candidates;
+        double base_mean, base_stddev, base_p50;
+        double mean, stddev, p50, change, t, se;
+        int regressed;
+        int use_mean;
+        unsigned long pos = 0;
+        perf_stats_entry *e, *fallback;
+
+        while (p < end && (*p == '\n' || *p == '\r'))
+        {
+            p++;
+        }
 
-        char cycles_min[12];
-        char cycles_max[12];
-        char cycles_avg[12];
-        char cycles_sum[12];
+        if (p >= end)
+        {
+            break;
+        }
 
-        char time_min[12];
-        char time_max[12];
-        char time_avg[12];
-        char time_sum[12];
+        for (f = 0; f < 15; ++f)
+        {
+            p = perf_csv_field(p, end, fields[f], sizeof(fields[f]));
+        }
 
-        perf_int_to_string(e->line, line_str, sizeof(line_str));
-        perf_ulong_to_string(e->count, count_str, sizeof(count_str));
+        /* Ignore columns added by newer versions */
+        while (p < end && *p != '\n')
+        {
+            p++;
+        }
 
-        perf_ulong_to_string(e->cycles_min, cycles_min, sizeof(cycles_min));
-        perf_ulong_to_string(e->cycles_max, cycles_max, sizeof(cycles_max));
-        perf_ulong_to_string(avg_cycles, cycles_avg, sizeof(cycles_avg));
-        perf_ulong_to_string(e->cycles_sum, cycles_sum, sizeof(cycles_sum));
+        base_line = (unsigned long)perf_parse_double(fields[1]);
+        base_count = (unsigned long)perf_parse_double(fields[3]);
+        base_mean = perf_parse_double(fields[9]);
+        base_stddev = perf_parse_double(fields[10]);
+        base_p50 = perf_parse_double(fields[11]);
 
-        perf_double_to_string(e->time_ms_min, time_min, sizeof(time_min), 4);
-        perf_double_to_string(e->time_ms_max, time_max, sizeof(time_max), 4);
-        perf_double_to_string(avg_time_ms, time_avg, sizeof(time_avg), 4);
-        perf_double_to_string(e->time_ms_sum, time_sum, sizeof(time_sum), 4);
+        /* Exact site first, a file + name match only if it is unique (the line moved) */
+        e = 0;
+        fallback = 0;
+        candidates = 0;
 
-        if (i == 0)
+        for (i = 0; i < perf_stats_entry_count; ++i)
         {
-            buffer[0] = '\0';
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf]\n");
-
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------------------------------------------------+-------------------------------------------------------+\n");
+            perf_stats_entry *candidate = &perf_stats_entries[i];
 
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | cylces                                                | time_ms                                               |\n");
+            if (!perf_string_equals(candidate->file, fields[0]) || !perf_string_equals(candidate->name, fields[2]) || candidate->count == 0)
+            {
+                continue;
+            }
 
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
+            if ((unsigned long)candidate->line == base_line)
+            {
+                e = candidate;
+                break;
+            }
 
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] |         min |         max |         avg |         sum |         min |         max |         avg |         sum |\n");
+            fallback = candidate;
+            candidates++;
+        }
 
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
-            current_pos = 0;
-            perf_platform_print(buffer);
+        if (!e && candidates == 1)
+        {
+            e = fallback;
         }
 
-        buffer[0] = '\0';
+        if (!e)
+        {
+            continue;
+        }
 
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_min);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_max);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_avg);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_sum);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_min);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_max);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_avg);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_sum);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " | ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, count_str);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " x ");
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->name);
-        current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\n");
-        current_pos = 0;
+        mean = e->time_ms_sum / (double)e->count;
+        stddev = perf_stats_stddev(e);
+        p50 = perf_stats_percentile(e, 0.5);
 
-        perf_platform_print(buffer);
+        /* Baselines or builds without the histogram compare the means */
+        use_mean = base_p50 <= 0.0 || p50 <= 0.0;
 
-        if (i == perf_stats_entry_count - 1)
+        if (use_mean)
         {
-            buffer[0] = '\0';
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, e->file);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, ":");
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
-            current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] +-------------+-------------+-------------+-------------+-------------+-------------+-------------+-------------+\n");
-            current_pos = 0;
-            perf_platform_print(buffer);
+            base_p50 = base_mean;
+            p50 = mean;
         }
+
+        change = base_p50 > 0.0 ? (p50 - base_p50) / base_p50 : 0.0;
+
+        /* Welch t statistic of the mean difference */
+        se = perf_sqrt((stddev * stddev) / (double)e->count + (base_count ? (base_stddev * base_stddev) / (double)base_count : 0.0));
+        t = se > 0.0 ? (mean - base_mean) / se : (mean > base_mean ? PERF_COMPARE_T_MIN : 0.0);
+
+        regressed = change > threshold && t >= PERF_COMPARE_T_MIN;
+        regressions += regressed;
+
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, e->file);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)e->line, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, regressed ? " [perf] REGRESSION " : " [perf] ok ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, use_mean ? "mean " : "p50 ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(base_p50, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " ms -> ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(p50, number, sizeof(number), 6));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " ms (");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, change < 0.0 ? "-" : "+");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double((change < 0.0 ? -change : change) * 100.0, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "%, t=");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(t, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ") ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, e->name);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\n");
+        sink(user, buffer);
     }
+
+    return regressions;
 }
 #else
 PERF_API PERF_INLINE void perf_stats_store_result(char *file, int line, unsigned long cycles, double time_ms, char *name)
@@ -704,8 +2883,62 @@ PERF_API PERF_INLINE void perf_stats_store_result(char *file, int line, unsigned
     (void)time_ms;
     (void)name;
 }
+
+#define PERF_STATS_SITE_DECLARE
+#define PERF_STATS_SITE_RECORD(cycles, time_ms, hw, bytes_in, bytes_out, items, name)
 #endif /* PERF_STATS_ENABLE */
 
+
+/* #############################################################################
+ * # BUFFERED LOG
+ * #############################################################################
+ *
+ * Collects report lines in memory instead of issuing one write per line.
+ * The log is flushed when full and by perf_log_flush, call it once before exiting.
+ * With PERF_LOG_BUFFERED the intermediate PERF_PROFILE prints go through the log as well.
+ */
+#ifndef PERF_LOG_SIZE
+#define PERF_LOG_SIZE 16384
+#endif
+
+static char perf_log_buffer[PERF_LOG_SIZE];
+static unsigned long perf_log_size = 0;
+
+PERF_API PERF_INLINE void perf_log_flush(void)
+{
+    if (perf_log_size > 0)
+    {
+        perf_log_buffer[perf_log_size] = '\0';
+        perf_platform_print(perf_log_buffer);
+        perf_log_size = 0;
+    }
+}
+
+PERF_API PERF_INLINE void perf_log_write(char *str)
+{
+    unsigned long length = perf_strlen(str);
+
+    if (perf_log_size + length + 1 > PERF_LOG_SIZE)
+    {
+        perf_log_flush();
+
+        if (length + 1 > PERF_LOG_SIZE)
+        {
+            perf_platform_print(str); /* Larger than the whole log */
+            return;
+        }
+    }
+
+    perf_log_size += perf_append_string(perf_log_buffer, perf_log_size, PERF_LOG_SIZE, str);
+}
+
+/* Sink writing into the buffered log */
+PERF_API PERF_INLINE void perf_sink_log(void *user, char *str)
+{
+    (void)user;
+    perf_log_write(str);
+}
+
 #ifdef PERF_DISBALE_INTERMEDIATE_PRINT
 PERF_API PERF_INLINE void perf_print_result(char *file, int line, unsigned long cycles, double time_ms, char *name)
 {
@@ -720,6 +2953,7 @@ PERF_API PERF_INLINE void perf_print_result(char *file, int line, unsigned long
 {
     char buffer[PERF_MAX_PRINT_BUFFER];
     char cycles_str[14];
+    char cycles_ns_str[20];
     char time_ms_str[14];
     char line_str[12];
     unsigned long current_pos = 0;
@@ -735,43 +2969,384 @@ PERF_API PERF_INLINE void perf_print_result(char *file, int line, unsigned long
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, line_str);
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " [perf] ");
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, cycles_str);
-    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " cycles, ");
+    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " cycles (");
+    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, perf_format_double(perf_cycles_to_ns(cycles), cycles_ns_str, sizeof(cycles_ns_str), 1));
+    current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " ns), ");
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, time_ms_str);
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, " ms, \"");
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, name);
     current_pos += perf_append_string(buffer, current_pos, PERF_MAX_PRINT_BUFFER, "\"\n");
 
+#ifdef PERF_LOG_BUFFERED
+    perf_log_write(buffer);
+#else
     perf_platform_print(buffer);
+#endif
 }
 #endif
 
 #define PERF_PROFILE(func_call) PERF_PROFILE_WITH_NAME(func_call, #func_call)
+#define PERF_PROFILE_WITH_NAME(func_call, name) PERF_PROFILE_WITH_THROUGHPUT(func_call, name, 0, 0, 0)
 
+/* bytes_in, bytes_out and items are evaluated after func_call (for example the decoded image size) */
 #ifdef PERF_DISABLE
-#define PERF_PROFILE_WITH_NAME(func_call, name) func_call;
+#define PERF_PROFILE_WITH_THROUGHPUT(func_call, name, bytes_in, bytes_out, items) func_call;
 #else
-#define PERF_PROFILE_WITH_NAME(func_call, name)                                                                 \
-    do                                                                                                          \
-    {                                                                                                           \
-        unsigned long perf_start_cycles, perf_end_cycles;                                                       \
-        double perf_start_time_nano, perf_end_time_nano;                                                        \
-        double perf_time_ms;                                                                                    \
-        perf_start_time_nano = perf_platform_current_time_nanoseconds();                                        \
-        perf_start_cycles = perf_platform_current_cycle_count();                                                \
-        func_call;                                                                                              \
-        perf_end_cycles = perf_platform_current_cycle_count();                                                  \
-        perf_end_time_nano = perf_platform_current_time_nanoseconds();                                          \
-        perf_time_ms = ((perf_end_time_nano - perf_start_time_nano) / 1000000.0);                               \
-        perf_print_result(                                                                                      \
-            __FILE__,                                                                                           \
-            __LINE__,                                                                                           \
-            perf_end_cycles - perf_start_cycles,                                                                \
-            perf_time_ms,                                                                                       \
-            (name));                                                                                            \
-        perf_stats_store_result(__FILE__, __LINE__, perf_end_cycles - perf_start_cycles, perf_time_ms, (name)); \
+#define PERF_PROFILE_WITH_THROUGHPUT(func_call, name, bytes_in, bytes_out, items)            \
+    do                                                                                       \
+    {                                                                                        \
+        PERF_STATS_SITE_DECLARE                                                              \
+        PERF_HW_SCOPE_DECLARE                                                                \
+        perf_u64 perf_start_cycles, perf_end_cycles;                                         \
+        unsigned long perf_cycles;                                                           \
+        double perf_start_time_nano, perf_end_time_nano;                                     \
+        double perf_time_ms;                                                                 \
+        perf_start_time_nano = perf_platform_current_time_nanoseconds();                     \
+        PERF_HW_SCOPE_BEGIN                                                                  \
+        perf_start_cycles = perf_platform_current_cycle_count();                             \
+        func_call;                                                                           \
+        perf_end_cycles = perf_platform_current_cycle_count_end();                           \
+        PERF_HW_SCOPE_END                                                                    \
+        perf_end_time_nano = perf_platform_current_time_nanoseconds();                       \
+        perf_cycles = (unsigned long)(perf_end_cycles - perf_start_cycles);                  \
+        perf_time_ms = ((perf_end_time_nano - perf_start_time_nano) / 1000000.0);            \
+        perf_print_result(                                                                   \
+            __FILE__,                                                                        \
+            __LINE__,                                                                        \
+            perf_cycles,                                                                     \
+            perf_time_ms,                                                                    \
+            (name));                                                                         \
+        PERF_STATS_SITE_RECORD(perf_cycles, perf_time_ms, PERF_HW_SCOPE_SAMPLE,              \
+                               (perf_u64)(bytes_in), (perf_u64)(bytes_out),                  \
+                               (perf_u64)(items), (name));                                   \
     } while (0)
 #endif
 
+/* #############################################################################
+ * # BENCHMARK
+ * #############################################################################
+ *
+ * Runs a block warmup + iterations times and reports robust statistics of the
+ * measured iterations through the buffered log.
+ *
+ * USAGE
+ *   perf_bench bench = {0};
+ *   bench.bytes = size;                     (optional, enables MB/s)
+ *   bench.pixels = width * height;          (optional, enables Mpix/s)
+ *   bench.flush_buffer = scratch;           (optional, evicts caches before every run)
+ *   bench.flush_size = sizeof(scratch);
+ *
+ *   PERF_BENCH_BEGIN(bench, "imagine_load", 1000, 10)
+ *   {
+ *     imagine_load(&img, buffer, size);
+ *   }
+ *   PERF_BENCH_END(bench)
+ *
+ *   perf_log_flush();
+ *
+ * Samples are kept for the first PERF_BENCH_SAMPLES_MAX iterations (median), min/mean/stddev
+ * cover all iterations. The results stay in the struct (*_ns fields) after PERF_BENCH_END.
+ */
+#ifndef PERF_BENCH_SAMPLES_MAX
+#define PERF_BENCH_SAMPLES_MAX 1024
+#endif
+
+typedef struct perf_bench
+{
+    /* Set by the caller (optional) */
+    unsigned long bytes;          /* Bytes processed per iteration */
+    unsigned long pixels;         /* Pixels processed per iteration */
+    unsigned char *flush_buffer;  /* Touched before every run to evict caches */
+    unsigned long flush_size;
+
+    /* Run state */
+    char *name;
+    char *file;
+    int line;
+    unsigned long iterations;
+    unsigned long warmup;
+    unsigned long run;
+    unsigned long count;          /* Measured iterations */
+    double sum_ns;
+    double sum_sq_ns;
+    unsigned long samples_count;
+    unsigned long samples[PERF_BENCH_SAMPLES_MAX]; /* Cycle counter ticks */
+
+    /* Results */
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+    double stddev_ns;
+
+} perf_bench;
+
+PERF_API PERF_INLINE void perf_bench_begin(perf_bench *bench, char *file, int line, char *name, unsigned long iterations, unsigned long warmup)
+{
+    bench->name = name;
+    bench->file = file;
+    bench->line = line;
+    bench->iterations = iterations;
+    bench->warmup = warmup;
+    bench->run = 0;
+    bench->count = 0;
+    bench->sum_ns = 0.0;
+    bench->sum_sq_ns = 0.0;
+    bench->samples_count = 0;
+    bench->min_ns = 0.0;
+    bench->median_ns = 0.0;
+    bench->mean_ns = 0.0;
+    bench->stddev_ns = 0.0;
+}
+
+/* Returns 1 while runs are left, prepares the next run */
+PERF_API PERF_INLINE int perf_bench_next(perf_bench *bench)
+{
+    if (bench->run >= bench->warmup + bench->iterations)
+    {
+        return 0;
+    }
+
+    if (bench->flush_buffer)
+    {
+        volatile unsigned char *p = bench->flush_buffer;
+        unsigned long i;
+
+        for (i = 0; i < bench->flush_size; i += 64)
+        {
+            p[i] = (unsigned char)(p[i] + 1);
+        }
+    }
+
+    return 1;
+}
+
+PERF_API PERF_INLINE void perf_bench_sample(perf_bench *bench, unsigned long ticks)
+{
+    if (bench->run++ < bench->warmup)
+    {
+        return;
+    }
+
+    {
+        double ns = perf_cycles_to_ns(ticks);
+
+        if (bench->count == 0 || ns < bench->min_ns)
+        {
+            bench->min_ns = ns;
+        }
+
+        bench->count++;
+        bench->sum_ns += ns;
+        bench->sum_sq_ns += ns * ns;
+
+        if (bench->samples_count < PERF_BENCH_SAMPLES_MAX)
+        {
+            bench->samples[bench->samples_count++] = ticks;
+        }
+    }
+}
+
+PERF_API PERF_INLINE void perf_bench_end(perf_bench *bench)
+{
+    char buffer[PERF_MAX_PRINT_BUFFER];
+    char number[32];
+    unsigned long pos = 0;
+    unsigned long gap, i, j;
+
+    if (bench->count == 0)
+    {
+        return;
+    }
+
+    /* Shell sort of the kept samples for the median */
+    for (gap = bench->samples_count / 2; gap > 0; gap /= 2)
+    {
+        for (i = gap; i < bench->samples_count; ++i)
+        {
+            unsigned long value = bench->samples[i];
+
+            for (j = i; j >= gap && bench->samples[j - gap] > value; j -= gap)
+            {
+                bench->samples[j] = bench->samples[j - gap];
+            }
+
+            bench->samples[j] = value;
+        }
+    }
+
+    bench->median_ns = perf_cycles_to_ns(bench->samples[bench->samples_count / 2]);
+    bench->mean_ns = bench->sum_ns / (double)bench->count;
+    bench->stddev_ns = bench->count > 1 ? perf_sqrt((bench->sum_sq_ns - bench->mean_ns * bench->sum_ns) / (double)(bench->count - 1)) : 0.0;
+
+    buffer[0] = '\0';
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, bench->file);
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ":");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong((unsigned long)bench->line, number, sizeof(number)));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " [bench] ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, bench->name);
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ": ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(bench->count, number, sizeof(number)));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " runs, min ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(bench->min_ns / 1000.0, number, sizeof(number), 3));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " us, median ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(bench->median_ns / 1000.0, number, sizeof(number), 3));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " us, mean ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(bench->mean_ns / 1000.0, number, sizeof(number), 3));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " us, stddev ");
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double(bench->stddev_ns / 1000.0, number, sizeof(number), 3));
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " us");
+
+    /* Throughput based on the median */
+    if (bench->bytes && bench->median_ns > 0.0)
+    {
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ", ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double((double)bench->bytes * 1000.0 / bench->median_ns, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " MB/s");
+    }
+
+    if (bench->pixels && bench->median_ns > 0.0)
+    {
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ", ");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double((double)bench->pixels * 1000.0 / bench->median_ns, number, sizeof(number), 2));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, " Mpix/s");
+    }
+
+    pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "\n");
+
+    perf_log_write(buffer);
+}
+
+#define PERF_BENCH_BEGIN(bench, name, iterations, warmup)                               \
+    {                                                                                   \
+        perf_u64 perf_bench_start_ticks;                                                \
+        perf_bench_begin(&(bench), __FILE__, __LINE__, (name), (iterations), (warmup)); \
+        while (perf_bench_next(&(bench)))                                               \
+        {                                                                               \
+            perf_bench_start_ticks = perf_platform_current_cycle_count();
+
+#define PERF_BENCH_END(bench)                                                                                               \
+            perf_bench_sample(&(bench), (unsigned long)(perf_platform_current_cycle_count_end() - perf_bench_start_ticks)); \
+        }                                                                                                                   \
+        perf_bench_end(&(bench));                                                                                           \
+    }
+
+/* #############################################################################
+ * # ZONES (Chrome/Perfetto trace events)
+ * #############################################################################
+ *
+ * Opt-in with PERF_ZONES_ENABLE. PERF_ZONE_BEGIN/PERF_ZONE_END mark nested regions,
+ * each records one event (name, cycle counter, thread id) into a preallocated ring
+ * buffer of PERF_ZONE_CAPACITY events. The slot is claimed with an atomic increment
+ * so zones can be recorded from several threads. When the ring wraps the oldest
+ * events are overwritten.
+ *
+ * perf_zones_export_trace writes the Chrome trace event JSON format which can be
+ * opened in chrome://tracing or ui.perfetto.dev.
+ *
+ * USAGE
+ *   PERF_ZONE_BEGIN("decode");
+ *   PERF_ZONE_BEGIN("header");
+ *   ...
+ *   PERF_ZONE_END("header");
+ *   PERF_ZONE_END("decode");
+ *   perf_zones_export_trace(perf_sink_pio, &stream);
+ *
+ * Only the name pointer is stored, names must stay valid until the export (string literals).
+ */
+#if defined(PERF_ZONES_ENABLE) && !defined(PERF_DISABLE)
+
+#ifndef PERF_ZONE_CAPACITY
+#define PERF_ZONE_CAPACITY 65536 /* Must be a power of two */
+#endif
+
+typedef struct perf_zone_event
+{
+    char *name;
+    perf_u64 ticks;
+    unsigned long thread_id;
+    char phase; /* 'B' begin, 'E' end */
+
+} perf_zone_event;
+
+static perf_zone_event perf_zone_events[PERF_ZONE_CAPACITY];
+static volatile long perf_zone_write_index = 0; /* Total events ever recorded */
+
+PERF_API PERF_INLINE void perf_zone_record(char *name, char phase)
+{
+    /* Keep the bookkeeping outside of the measured region: read the end timestamp first, the begin timestamp last */
+    perf_u64 end_ticks = phase == 'E' ? perf_platform_current_cycle_count_end() : 0;
+    perf_zone_event *event = &perf_zone_events[(unsigned long)perf_atomic_add(&perf_zone_write_index, 1) & (PERF_ZONE_CAPACITY - 1)];
+
+    event->name = name;
+    event->thread_id = perf_thread_id();
+    event->phase = phase;
+    event->ticks = phase == 'B' ? perf_platform_current_cycle_count() : end_ticks;
+}
+
+/* Events currently held by the ring buffer */
+PERF_API PERF_INLINE unsigned long perf_zones_count(void)
+{
+    unsigned long total = (unsigned long)perf_zone_write_index;
+    return total < PERF_ZONE_CAPACITY ? total : PERF_ZONE_CAPACITY;
+}
+
+PERF_API PERF_INLINE void perf_zones_reset(void)
+{
+    perf_zone_write_index = 0;
+}
+
+/* Writes all buffered events as Chrome trace event JSON. Call when no zones are being recorded. */
+PERF_API PERF_INLINE void perf_zones_export_trace(perf_sink sink, void *user)
+{
+    char buffer[PERF_MAX_PRINT_BUFFER];
+    char number[32];
+    unsigned long total = (unsigned long)perf_zone_write_index;
+    unsigned long count = perf_zones_count();
+    unsigned long first = total - count;
+    double ticks_per_us = perf_platform_cycles_per_ns() * 1000.0;
+    perf_u64 epoch = 0;
+    unsigned long i;
+
+    /* Timestamps relative to the oldest event */
+    for (i = 0; i < count; ++i)
+    {
+        perf_zone_event *event = &perf_zone_events[(first + i) & (PERF_ZONE_CAPACITY - 1)];
+
+        if (i == 0 || event->ticks < epoch)
+        {
+            epoch = event->ticks;
+        }
+    }
+
+    sink(user, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (i = 0; i < count; ++i)
+    {
+        perf_zone_event *event = &perf_zone_events[(first + i) & (PERF_ZONE_CAPACITY - 1)];
+        unsigned long pos = 0;
+
+        buffer[0] = '\0';
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, i == 0 ? "{\"name\":\"" : ",{\"name\":\"");
+        pos += perf_append_escaped(buffer, pos, PERF_MAX_PRINT_BUFFER, event->name, 0);
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, event->phase == 'B' ? "\",\"ph\":\"B\",\"pid\":1,\"tid\":" : "\",\"ph\":\"E\",\"pid\":1,\"tid\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_ulong(event->thread_id, number, sizeof(number)));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, ",\"ts\":");
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, perf_format_double((double)(event->ticks - epoch) / ticks_per_us, number, sizeof(number), 3));
+        pos += perf_append_string(buffer, pos, PERF_MAX_PRINT_BUFFER, "}\n");
+
+        sink(user, buffer);
+    }
+
+    sink(user, "]}\n");
+}
+
+#define PERF_ZONE_BEGIN(name) perf_zone_record((name), 'B')
+#define PERF_ZONE_END(name) perf_zone_record((name), 'E')
+#else
+#define PERF_ZONE_BEGIN(name)
+#define PERF_ZONE_END(name)
+#endif /* PERF_ZONES_ENABLE */
+
 #endif /* PERF_H */
 
 /*
@@ -44,6 +44,103 @@ PIO_API PIO_INLINE unsigned long pio_strlen(char *str)
   return (unsigned long)(s - str);
 }
 
+/* #############################################################################
+ * # Buffered stream writer
+ * #############################################################################
+ *
+ * A pio_stream coalesces many small writes (e.g. image rows) into a user
+ * provided buffer and only hands data to the OS when the buffer is full.
+ * Payloads that do not fit are written together with the pending buffer in a
+ * single gather write so nothing is copied twice.
+ *
+ * USAGE
+ *   unsigned char buffer[4096];
+ *   pio_stream stream;
+ *
+ *   if (pio_stream_open(&stream, "out.ppm", buffer, sizeof(buffer)))
+ *   {
+ *     pio_stream_write(&stream, header, header_size);
+ *     for (y = 0; y < height; ++y)
+ *       pio_stream_write(&stream, row + y * row_size, row_size);
+ *     pio_stream_close(&stream, 0);  (1 = fsync before close)
+ *   }
+ */
+#ifndef PIO_STREAM_SEGMENTS_MAX
+#define PIO_STREAM_SEGMENTS_MAX 16 /* Max segments passed to one gather write */
+#endif
+
+typedef struct pio_segment
+{
+  unsigned char *data;
+  unsigned long size;
+
+} pio_segment;
+
+typedef struct pio_stream
+{
+  void *handle;           /* Win32 file handle */
+  int fd;                 /* POSIX file descriptor */
+  unsigned char *buffer;  /* user-provided coalescing buffer */
+  unsigned long capacity; /* size of buffer in bytes */
+  unsigned long size;     /* bytes currently pending in buffer */
+  unsigned long written;  /* bytes handed to the OS so far */
+  int error;              /* sticky error flag, set on the first failed write */
+
+} pio_stream;
+
+/* #############################################################################
+ * # Directory enumeration
+ * #############################################################################
+ *
+ * Entries are returned in batches into caller-provided arrays, names are
+ * stored null terminated in a caller-provided character buffer. "." and ".."
+ * are never returned. A name that does not fit into an empty names buffer is
+ * skipped and counted in dir.skipped instead of ending the enumeration.
+ * Sizes and unknown entry types are looked up (one stat on POSIX) only for
+ * entries that pass the filters and are copied into the batch.
+ *
+ * USAGE
+ *   pio_dir dir;
+ *   pio_dir_entry entries[64];
+ *   char names[4096];
+ *   unsigned long count, i;
+ *
+ *   if (pio_dir_open(&dir, "images", ".ppm", PIO_DIR_SIZES))
+ *   {
+ *     while (pio_dir_next(&dir, entries, 64, names, sizeof(names), &count))
+ *       for (i = 0; i < count; ++i)
+ *         ... entries[i].name, entries[i].size ...
+ *     pio_dir_close(&dir);
+ *   }
+ */
+#ifndef PIO_DIR_BUFFER_SIZE
+#define PIO_DIR_BUFFER_SIZE 8192 /* getdents64 batch buffer (linux) */
+#endif
+
+#ifndef PIO_DIR_PATH_MAX
+#define PIO_DIR_PATH_MAX 1024
+#endif
+
+#define PIO_DIR_SIZES 1 /* Fill in pio_dir_entry.size */
+
+#define PIO_DIR_TYPE_UNKNOWN (-1) /* is_directory from peek when the listing has no type */
+
+typedef struct pio_dir_entry
+{
+  char *name;         /* null terminated, points into the caller names buffer */
+  unsigned long size; /* file size in bytes (only with PIO_DIR_SIZES) */
+  int is_directory;
+
+} pio_dir_entry;
+
+PIO_API PIO_INLINE void pio_copy(unsigned char *dst, unsigned char *src, unsigned long size)
+{
+  while (size--)
+  {
+    *dst++ = *src++;
+  }
+}
+
 /* #############################################################################
  * # WIN32 Implementation
  * #############################################################################
@@ -63,6 +160,23 @@ PIO_API PIO_INLINE unsigned long pio_strlen(char *str)
 #define GENERIC_READ (0x80000000L)
 #define FILE_SHARE_READ 0x00000001
 #define OPEN_EXISTING 3
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x0004
+
+typedef struct PIO_WIN32_FIND_DATAA
+{
+  unsigned long dwFileAttributes;
+  unsigned long ftCreationTime[2];
+  unsigned long ftLastAccessTime[2];
+  unsigned long ftLastWriteTime[2];
+  unsigned long nFileSizeHigh;
+  unsigned long nFileSizeLow;
+  unsigned long dwReserved0;
+  unsigned long dwReserved1;
+  char cFileName[260];
+  char cAlternateFileName[14];
+
+} PIO_WIN32_FIND_DATAA;
 
 PIO_WIN32_API(int)
 CloseHandle(void *hObject);
@@ -81,6 +195,32 @@ CreateFileA(char *lpFileName, unsigned long dwDesiredAccess, unsigned long dwSha
 PIO_WIN32_API(int)
 WriteFile(void *hFile, void *lpBuffer, unsigned long nNumberOfBytesToWrite, unsigned long *lpNumberOfBytesWritten, void *lpOverlapped);
 
+PIO_WIN32_API(int)
+FlushFileBuffers(void *hFile);
+
+/* Memory mapped files */
+PIO_WIN32_API(void *)
+CreateFileMappingA(void *hFile, void *lpFileMappingAttributes, unsigned long flProtect, unsigned long dwMaximumSizeHigh, unsigned long dwMaximumSizeLow, char *lpName);
+
+PIO_WIN32_API(void *)
+MapViewOfFile(void *hFileMappingObject, unsigned long dwDesiredAccess, unsigned long dwFileOffsetHigh, unsigned long dwFileOffsetLow, unsigned long dwNumberOfBytesToMap);
+
+PIO_WIN32_API(int)
+UnmapViewOfFile(void *lpBaseAddress);
+
+PIO_WIN32_API(void)
+ExitProcess(unsigned int uExitCode);
+
+/* Directory enumeration */
+PIO_WIN32_API(void *)
+FindFirstFileA(char *lpFileName, void *lpFindFileData);
+
+PIO_WIN32_API(int)
+FindNextFileA(void *hFindFile, void *lpFindFileData);
+
+PIO_WIN32_API(int)
+FindClose(void *hFindFile);
+
 /* Print to console */
 PIO_WIN32_API(void *)
 GetStdHandle(unsigned long nStdHandle);
@@ -88,6 +228,8 @@ GetStdHandle(unsigned long nStdHandle);
 PIO_WIN32_API(int)
 WriteConsoleA(void *hConsoleOutput, void *lpBuffer, unsigned long nNumberOfCharsToWrite, unsigned long *lpNumberOfCharsWritten, void *lpReserved);
 
+#else
+typedef WIN32_FIND_DATAA PIO_WIN32_FIND_DATAA;
 #endif /* _WINDOWS_ */
 
 PIO_API PIO_INLINE unsigned long pio_file_size(char *filename)
@@ -175,6 +317,189 @@ PIO_API PIO_INLINE int pio_write(char *filename, unsigned char *buffer, unsigned
   return (success && (bytes_written == size));
 }
 
+/* Maps a file read-only into memory (zero copy input for imagine_load). Release with pio_unmap */
+PIO_API PIO_INLINE int pio_map(char *filename, unsigned char **data, unsigned long *size)
+{
+  void *hFile;
+  void *hMapping;
+  void *address;
+  unsigned long fileSize;
+
+  hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+  if (hFile == INVALID_HANDLE)
+  {
+    return 0;
+  }
+
+  fileSize = GetFileSize(hFile, 0);
+
+  if (fileSize == INVALID_FILE_SIZE || fileSize == 0)
+  {
+    CloseHandle(hFile);
+    return 0;
+  }
+
+  hMapping = CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+
+  if (!hMapping)
+  {
+    CloseHandle(hFile);
+    return 0;
+  }
+
+  address = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+
+  /* The view keeps the mapping and file alive */
+  CloseHandle(hMapping);
+  CloseHandle(hFile);
+
+  if (!address)
+  {
+    return 0;
+  }
+
+  *data = (unsigned char *)address;
+  *size = fileSize;
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_unmap(unsigned char *data, unsigned long size)
+{
+  (void)size;
+  return UnmapViewOfFile(data) != 0;
+}
+
+PIO_API PIO_INLINE void pio_exit(int code)
+{
+  ExitProcess((unsigned int)code);
+}
+
+PIO_API PIO_INLINE int pio_platform_stream_open(pio_stream *stream, char *filename)
+{
+  stream->handle = CreateFileA(filename, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+  stream->fd = -1;
+
+  return stream->handle != INVALID_HANDLE;
+}
+
+/* Win32 has no gather write for regular (buffered) handles, so write segment by segment */
+PIO_API PIO_INLINE int pio_platform_stream_writev(pio_stream *stream, pio_segment *segments, unsigned long count)
+{
+  unsigned long i;
+
+  for (i = 0; i < count; ++i)
+  {
+    unsigned char *data = segments[i].data;
+    unsigned long remaining = segments[i].size;
+
+    while (remaining > 0)
+    {
+      unsigned long bytes_written = 0;
+
+      if (!WriteFile(stream->handle, data, remaining, &bytes_written, 0) || bytes_written == 0)
+      {
+        return 0;
+      }
+
+      data += bytes_written;
+      remaining -= bytes_written;
+      stream->written += bytes_written;
+    }
+  }
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_platform_stream_close(pio_stream *stream, int sync)
+{
+  int success = 1;
+
+  if (sync && !FlushFileBuffers(stream->handle))
+  {
+    success = 0;
+  }
+
+  if (!CloseHandle(stream->handle))
+  {
+    success = 0;
+  }
+
+  stream->handle = INVALID_HANDLE;
+
+  return success;
+}
+
+typedef struct pio_dir
+{
+  void *handle;
+  int has_entry; /* find_data holds an entry that was not returned yet */
+  PIO_WIN32_FIND_DATAA find_data;
+
+  /* platform independant state */
+  char *extension;
+  int flags;
+  unsigned long skipped; /* names longer than names_capacity, see pio_dir_next */
+
+} pio_dir;
+
+PIO_API PIO_INLINE int pio_platform_dir_open(pio_dir *dir, char *path)
+{
+  char pattern[PIO_DIR_PATH_MAX];
+  unsigned long len = pio_strlen(path);
+
+  if (len + 3 > PIO_DIR_PATH_MAX)
+  {
+    return 0;
+  }
+
+  pio_copy((unsigned char *)pattern, (unsigned char *)path, len);
+  pattern[len++] = '\\';
+  pattern[len++] = '*';
+  pattern[len] = '\0';
+
+  dir->handle = FindFirstFileA(pattern, &dir->find_data);
+  dir->has_entry = dir->handle != INVALID_HANDLE;
+
+  return dir->handle != INVALID_HANDLE;
+}
+
+/* Returns the current entry without advancing */
+PIO_API PIO_INLINE int pio_platform_dir_peek(pio_dir *dir, char **name, int *is_directory)
+{
+  if (!dir->has_entry)
+  {
+    return 0;
+  }
+
+  *name = dir->find_data.cFileName;
+  *is_directory = (dir->find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+  return 1;
+}
+
+/* Type and size of the current entry, they come for free with the find data */
+PIO_API PIO_INLINE void pio_platform_dir_stat(pio_dir *dir, int *is_directory, unsigned long *size)
+{
+  *is_directory = (dir->find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  *size = dir->find_data.nFileSizeLow;
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_advance(pio_dir *dir)
+{
+  dir->has_entry = FindNextFileA(dir->handle, &dir->find_data) != 0;
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_close(pio_dir *dir)
+{
+  if (dir->handle != INVALID_HANDLE)
+  {
+    FindClose(dir->handle);
+    dir->handle = INVALID_HANDLE;
+  }
+}
+
 PIO_API PIO_INLINE int pio_print(char *str)
 {
   unsigned long written;
@@ -188,102 +513,971 @@ PIO_API PIO_INLINE int pio_print(char *str)
  */
 #elif defined(__linux__) || defined(__APPLE__)
 
+/* On Linux x86_64/aarch64 pio can talk to the kernel directly instead of going through libc.
+ * This is enabled automatically for freestanding builds (-ffreestanding) or with PIO_LINUX_NOSTDLIB.
+ */
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+    (defined(PIO_LINUX_NOSTDLIB) || (defined(__STDC_HOSTED__) && __STDC_HOSTED__ == 0))
+#define PIO_LINUX_SYSCALLS
+#endif
+
+#ifdef PIO_LINUX_SYSCALLS
+
+/* #############################################################################
+ * # LINUX raw syscall layer (no libc)
+ * #############################################################################
+ */
+#ifdef __x86_64__
+#define PIO_SYS_read 0
+#define PIO_SYS_write 1
+#define PIO_SYS_close 3
+#define PIO_SYS_fstat 5
+#define PIO_SYS_mmap 9
+#define PIO_SYS_munmap 11
+#define PIO_SYS_writev 20
+#define PIO_SYS_fsync 74
+#define PIO_SYS_getdents64 217
+#define PIO_SYS_exit_group 231
+#define PIO_SYS_openat 257
+#define PIO_SYS_newfstatat 262
+#define PIO_O_DIRECTORY 0200000
+
+/* Kernel struct stat layout (x86_64) */
+typedef struct pio_stat
+{
+  unsigned long st_dev;
+  unsigned long st_ino;
+  unsigned long st_nlink;
+  unsigned int st_mode;
+  unsigned int st_uid;
+  unsigned int st_gid;
+  unsigned int pad0;
+  unsigned long st_rdev;
+  long st_size;
+  long st_blksize;
+  long st_blocks;
+  unsigned long st_times[6];
+  long unused[3];
+
+} pio_stat;
+
+PIO_API PIO_INLINE long pio_syscall6(long n, long a, long b, long c, long d, long e, long f)
+{
+  long ret;
+  register long r10 __asm__("r10") = d;
+  register long r8 __asm__("r8") = e;
+  register long r9 __asm__("r9") = f;
+
+  __asm__ __volatile__("syscall"
+                       : "=a"(ret)
+                       : "a"(n), "D"(a), "S"(b), "d"(c), "r"(r10), "r"(r8), "r"(r9)
+                       : "rcx", "r11", "memory");
+  return ret;
+}
+
+#else /* __aarch64__ */
+#define PIO_SYS_getdents64 61
+#define PIO_SYS_openat 56
+#define PIO_O_DIRECTORY 040000
+#define PIO_SYS_close 57
+#define PIO_SYS_read 63
+#define PIO_SYS_write 64
+#define PIO_SYS_writev 66
+#define PIO_SYS_newfstatat 79
+#define PIO_SYS_fstat 80
+#define PIO_SYS_fsync 82
+#define PIO_SYS_exit_group 94
+#define PIO_SYS_munmap 215
+#define PIO_SYS_mmap 222
+
+/* Kernel struct stat layout (asm-generic, aarch64) */
+typedef struct pio_stat
+{
+  unsigned long st_dev;
+  unsigned long st_ino;
+  unsigned int st_mode;
+  unsigned int st_nlink;
+  unsigned int st_uid;
+  unsigned int st_gid;
+  unsigned long st_rdev;
+  unsigned long pad1;
+  long st_size;
+  int st_blksize;
+  int pad2;
+  long st_blocks;
+  unsigned long st_times[6];
+  unsigned int unused[2];
+
+} pio_stat;
+
+PIO_API PIO_INLINE long pio_syscall6(long n, long a, long b, long c, long d, long e, long f)
+{
+  register long x8 __asm__("x8") = n;
+  register long x0 __asm__("x0") = a;
+  register long x1 __asm__("x1") = b;
+  register long x2 __asm__("x2") = c;
+  register long x3 __asm__("x3") = d;
+  register long x4 __asm__("x4") = e;
+  register long x5 __asm__("x5") = f;
+
+  __asm__ __volatile__("svc 0"
+                       : "+r"(x0)
+                       : "r"(x8), "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x5)
+                       : "memory", "cc");
+  return x0;
+}
+#endif
+
+#define PIO_AT_FDCWD -100
+#define PIO_O_RDONLY 0
+#define PIO_O_WRONLY 01
+#define PIO_O_CREAT 0100
+#define PIO_O_TRUNC 01000
+#define PIO_PROT_READ 1
+#define PIO_MAP_PRIVATE 2
+#define PIO_S_ISDIR(mode) (((mode) & 0170000) == 0040000)
+
+typedef struct pio_iovec
+{
+  void *iov_base;
+  unsigned long iov_len;
+
+} pio_iovec;
+
+/* The kernel returns -errno on failure, so all wrappers report errors as negative values like libc does */
+PIO_API PIO_INLINE int pio_sys_open(char *filename, int flags, int mode)
+{
+  return (int)pio_syscall6(PIO_SYS_openat, PIO_AT_FDCWD, (long)filename, flags, mode, 0, 0);
+}
+
+PIO_API PIO_INLINE long pio_sys_read(int fd, void *buffer, unsigned long size)
+{
+  return pio_syscall6(PIO_SYS_read, fd, (long)buffer, (long)size, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE long pio_sys_write(int fd, void *buffer, unsigned long size)
+{
+  return pio_syscall6(PIO_SYS_write, fd, (long)buffer, (long)size, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE long pio_sys_writev(int fd, pio_iovec *iov, int count)
+{
+  return pio_syscall6(PIO_SYS_writev, fd, (long)iov, count, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE int pio_sys_fstat(int fd, pio_stat *st)
+{
+  return (int)pio_syscall6(PIO_SYS_fstat, fd, (long)st, 0, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE int pio_sys_fstatat(int dirfd, char *name, pio_stat *st)
+{
+  return (int)pio_syscall6(PIO_SYS_newfstatat, dirfd, (long)name, (long)st, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE int pio_sys_fsync(int fd)
+{
+  return (int)pio_syscall6(PIO_SYS_fsync, fd, 0, 0, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE int pio_sys_close(int fd)
+{
+  return (int)pio_syscall6(PIO_SYS_close, fd, 0, 0, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE long pio_sys_getdents64(int fd, void *buffer, unsigned long size)
+{
+  return pio_syscall6(PIO_SYS_getdents64, fd, (long)buffer, (long)size, 0, 0, 0);
+}
+
+/* Returns 0 on failure */
+PIO_API PIO_INLINE void *pio_sys_mmap_read(int fd, unsigned long size)
+{
+  long result = pio_syscall6(PIO_SYS_mmap, 0, (long)size, PIO_PROT_READ, PIO_MAP_PRIVATE, fd, 0);
+
+  /* Errors are returned as -4095..-1 */
+  if (result < 0 && result > -4096)
+  {
+    return 0;
+  }
+
+  return (void *)result;
+}
+
+PIO_API PIO_INLINE int pio_sys_munmap(void *address, unsigned long size)
+{
+  return (int)pio_syscall6(PIO_SYS_munmap, (long)address, (long)size, 0, 0, 0, 0);
+}
+
+PIO_API PIO_INLINE void pio_exit(int code)
+{
+  for (;;)
+  {
+    pio_syscall6(PIO_SYS_exit_group, code, 0, 0, 0, 0, 0);
+  }
+}
+
+#else
+
+/* #############################################################################
+ * # LINUX/MACOS libc syscall layer
+ * #############################################################################
+ */
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+extern long syscall(long number, ...);
+#else
+#include <dirent.h>
+#endif
+
+#define PIO_O_RDONLY O_RDONLY
+#define PIO_O_WRONLY O_WRONLY
+#define PIO_O_CREAT O_CREAT
+#define PIO_O_TRUNC O_TRUNC
+#define PIO_S_ISDIR(mode) S_ISDIR(mode)
+
+/* Strict ANSI builds hide O_DIRECTORY, the kernel value is fixed per architecture */
+#if defined(O_DIRECTORY)
+#define PIO_O_DIRECTORY O_DIRECTORY
+#elif defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define PIO_O_DIRECTORY 0200000
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#define PIO_O_DIRECTORY 040000
+#else
+#define PIO_O_DIRECTORY 0
+#endif
+
+typedef struct stat pio_stat;
+typedef struct iovec pio_iovec;
+
+PIO_API PIO_INLINE int pio_sys_open(char *filename, int flags, int mode)
+{
+  return open(filename, flags, mode);
+}
+
+PIO_API PIO_INLINE long pio_sys_read(int fd, void *buffer, unsigned long size)
+{
+  return (long)read(fd, buffer, size);
+}
+
+PIO_API PIO_INLINE long pio_sys_write(int fd, void *buffer, unsigned long size)
+{
+  return (long)write(fd, buffer, size);
+}
+
+PIO_API PIO_INLINE long pio_sys_writev(int fd, pio_iovec *iov, int count)
+{
+  return (long)writev(fd, iov, count);
+}
+
+PIO_API PIO_INLINE int pio_sys_fstat(int fd, pio_stat *st)
+{
+  return fstat(fd, st);
+}
+
+#ifdef __linux__
+PIO_API PIO_INLINE int pio_sys_fstatat(int dirfd, char *name, pio_stat *st)
+{
+#ifdef SYS_newfstatat
+  return (int)syscall(SYS_newfstatat, dirfd, name, st, 0);
+#else
+  (void)dirfd;
+  (void)name;
+  (void)st;
+  return -1;
+#endif
+}
+
+PIO_API PIO_INLINE long pio_sys_getdents64(int fd, void *buffer, unsigned long size)
+{
+  return syscall(SYS_getdents64, fd, buffer, size);
+}
+#endif
+
+PIO_API PIO_INLINE int pio_sys_fsync(int fd)
+{
+  return fsync(fd);
+}
+
+PIO_API PIO_INLINE int pio_sys_close(int fd)
+{
+  return close(fd);
+}
+
+/* Returns 0 on failure */
+PIO_API PIO_INLINE void *pio_sys_mmap_read(int fd, unsigned long size)
+{
+  void *address = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return address == MAP_FAILED ? 0 : address;
+}
+
+PIO_API PIO_INLINE int pio_sys_munmap(void *address, unsigned long size)
+{
+  return munmap(address, size);
+}
+
+PIO_API PIO_INLINE void pio_exit(int code)
+{
+  _exit(code);
+}
+
+#endif /* PIO_LINUX_SYSCALLS */
 
 PIO_API PIO_INLINE unsigned long pio_file_size(char *filename)
 {
   int fd;
-  struct stat st;
+  pio_stat st;
   unsigned long size = 0;
 
-  fd = open(filename, O_RDONLY);
+  fd = pio_sys_open(filename, PIO_O_RDONLY, 0);
 
   if (fd < 0)
   {
     return 0;
   }
 
-  if (fstat(fd, &st) == 0)
+  if (pio_sys_fstat(fd, &st) == 0)
   {
     size = (unsigned long)st.st_size;
   }
 
-  close(fd);
+  pio_sys_close(fd);
   return size;
 }
 
 PIO_API PIO_INLINE int pio_read(char *filename, unsigned char *file_buffer, unsigned long file_buffer_capacity, unsigned long *file_buffer_size)
 {
   int fd;
-  struct stat st;
-  ssize_t bytes_read;
+  pio_stat st;
+  long bytes_read;
 
-  fd = open(filename, O_RDONLY);
+  fd = pio_sys_open(filename, PIO_O_RDONLY, 0);
 
   if (fd < 0)
   {
     return 0;
   }
 
-  if (fstat(fd, &st) != 0)
+  if (pio_sys_fstat(fd, &st) != 0)
   {
-    close(fd);
+    pio_sys_close(fd);
     return 0;
   }
 
   if ((unsigned long)st.st_size + 1 > file_buffer_capacity)
   {
-    close(fd);
+    pio_sys_close(fd);
     return 0;
   }
 
-  bytes_read = read(fd, file_buffer, (size_t)st.st_size);
+  bytes_read = pio_sys_read(fd, file_buffer, (unsigned long)st.st_size);
 
-  if (bytes_read != st.st_size)
+  if (bytes_read != (long)st.st_size)
   {
-    close(fd);
+    pio_sys_close(fd);
     return 0;
   }
 
   file_buffer[st.st_size] = '\0'; /* Optional: null-terminate */
   *file_buffer_size = (unsigned long)st.st_size;
 
-  close(fd);
+  pio_sys_close(fd);
   return 1;
 }
 
 PIO_API PIO_INLINE int pio_write(char *filename, unsigned char *buffer, unsigned long size)
 {
   int fd;
-  ssize_t written;
+  long written;
 
-  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fd = pio_sys_open(filename, PIO_O_WRONLY | PIO_O_CREAT | PIO_O_TRUNC, 0644);
 
   if (fd < 0)
   {
     return 0;
   }
 
-  written = write(fd, buffer, size);
-  close(fd);
+  written = pio_sys_write(fd, buffer, size);
+  pio_sys_close(fd);
+
+  return (written == (long)size);
+}
+
+/* Maps a file read-only into memory (zero copy input for imagine_load). Release with pio_unmap */
+PIO_API PIO_INLINE int pio_map(char *filename, unsigned char **data, unsigned long *size)
+{
+  int fd;
+  pio_stat st;
+  void *address;
+
+  fd = pio_sys_open(filename, PIO_O_RDONLY, 0);
+
+  if (fd < 0)
+  {
+    return 0;
+  }
+
+  if (pio_sys_fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    pio_sys_close(fd);
+    return 0;
+  }
+
+  address = pio_sys_mmap_read(fd, (unsigned long)st.st_size);
+
+  /* The mapping stays valid after the descriptor is closed */
+  pio_sys_close(fd);
+
+  if (!address)
+  {
+    return 0;
+  }
+
+  *data = (unsigned char *)address;
+  *size = (unsigned long)st.st_size;
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_unmap(unsigned char *data, unsigned long size)
+{
+  return pio_sys_munmap(data, size) == 0;
+}
+
+PIO_API PIO_INLINE int pio_platform_stream_open(pio_stream *stream, char *filename)
+{
+  stream->handle = 0;
+  stream->fd = pio_sys_open(filename, PIO_O_WRONLY | PIO_O_CREAT | PIO_O_TRUNC, 0644);
+
+  return stream->fd >= 0;
+}
+
+PIO_API PIO_INLINE int pio_platform_stream_writev(pio_stream *stream, pio_segment *segments, unsigned long count)
+{
+  pio_iovec iov[PIO_STREAM_SEGMENTS_MAX + 1];
+  unsigned long first = 0;
+  unsigned long i;
+
+  if (count > PIO_STREAM_SEGMENTS_MAX + 1)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    iov[i].iov_base = segments[i].data;
+    iov[i].iov_len = segments[i].size;
+  }
+
+  while (first < count)
+  {
+    long result = pio_sys_writev(stream->fd, iov + first, (int)(count - first));
+    unsigned long done;
+
+    if (result <= 0)
+    {
+      return 0;
+    }
+
+    done = (unsigned long)result;
+    stream->written += done;
+
+    /* Skip fully written segments and advance into a partially written one */
+    while (first < count && done >= iov[first].iov_len)
+    {
+      done -= iov[first].iov_len;
+      first++;
+    }
+
+    if (first < count)
+    {
+      iov[first].iov_base = (unsigned char *)iov[first].iov_base + done;
+      iov[first].iov_len -= done;
+    }
+  }
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_platform_stream_close(pio_stream *stream, int sync)
+{
+  int success = 1;
+
+  if (sync && pio_sys_fsync(stream->fd) != 0)
+  {
+    success = 0;
+  }
+
+  if (pio_sys_close(stream->fd) != 0)
+  {
+    success = 0;
+  }
+
+  stream->fd = -1;
+
+  return success;
+}
+
+#ifdef __linux__
+
+/* Layout of the records returned by the getdents64 syscall */
+typedef struct pio_linux_dirent64
+{
+  unsigned long d_ino;
+  long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+
+} pio_linux_dirent64;
+
+#define PIO_DT_UNKNOWN 0
+#define PIO_DT_DIR 4
+#define PIO_DT_REG 8
+
+typedef struct pio_dir
+{
+  int fd;
+  unsigned long buffer_pos;
+  unsigned long buffer_size;
+  union
+  {
+    unsigned char bytes[PIO_DIR_BUFFER_SIZE];
+    unsigned long align;
+  } buffer;
+
+  /* platform independant state */
+  char *extension;
+  int flags;
+  unsigned long skipped; /* names longer than names_capacity, see pio_dir_next */
+
+} pio_dir;
+
+PIO_API PIO_INLINE int pio_platform_dir_open(pio_dir *dir, char *path)
+{
+  dir->fd = pio_sys_open(path, PIO_O_RDONLY | PIO_O_DIRECTORY, 0);
+  dir->buffer_pos = 0;
+  dir->buffer_size = 0;
+
+  return dir->fd >= 0;
+}
+
+PIO_API PIO_INLINE int pio_platform_dir_peek(pio_dir *dir, char **name, int *is_directory)
+{
+  pio_linux_dirent64 *entry;
+
+  if (dir->buffer_pos >= dir->buffer_size)
+  {
+    long result = pio_sys_getdents64(dir->fd, dir->buffer.bytes, (unsigned long)PIO_DIR_BUFFER_SIZE);
+
+    if (result <= 0)
+    {
+      return 0;
+    }
+
+    dir->buffer_pos = 0;
+    dir->buffer_size = (unsigned long)result;
+  }
+
+  entry = (pio_linux_dirent64 *)(dir->buffer.bytes + dir->buffer_pos);
+
+  *name = entry->d_name;
+  *is_directory = entry->d_type == PIO_DT_UNKNOWN ? PIO_DIR_TYPE_UNKNOWN : entry->d_type == PIO_DT_DIR;
+
+  return 1;
+}
+
+/* getdents64 has no sizes, stat relative to the open directory fd so no path walk is needed */
+PIO_API PIO_INLINE void pio_platform_dir_stat(pio_dir *dir, int *is_directory, unsigned long *size)
+{
+  pio_linux_dirent64 *entry = (pio_linux_dirent64 *)(dir->buffer.bytes + dir->buffer_pos);
+  pio_stat st;
+
+  if (pio_sys_fstatat(dir->fd, entry->d_name, &st) == 0)
+  {
+    *is_directory = PIO_S_ISDIR(st.st_mode);
+    *size = (unsigned long)st.st_size;
+  }
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_advance(pio_dir *dir)
+{
+  pio_linux_dirent64 *entry = (pio_linux_dirent64 *)(dir->buffer.bytes + dir->buffer_pos);
+  dir->buffer_pos += entry->d_reclen;
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_close(pio_dir *dir)
+{
+  if (dir->fd >= 0)
+  {
+    pio_sys_close(dir->fd);
+    dir->fd = -1;
+  }
+}
+
+#else /* __APPLE__ */
+
+typedef struct pio_dir
+{
+  DIR *handle;
+  struct dirent *entry;
+  char path[PIO_DIR_PATH_MAX];
+  unsigned long path_length;
+
+  /* platform independant state */
+  char *extension;
+  int flags;
+  unsigned long skipped; /* names longer than names_capacity, see pio_dir_next */
+
+} pio_dir;
+
+PIO_API PIO_INLINE int pio_platform_dir_open(pio_dir *dir, char *path)
+{
+  dir->path_length = pio_strlen(path);
+
+  if (dir->path_length + 2 > PIO_DIR_PATH_MAX)
+  {
+    return 0;
+  }
+
+  pio_copy((unsigned char *)dir->path, (unsigned char *)path, dir->path_length);
+  dir->path[dir->path_length++] = '/';
+  dir->path[dir->path_length] = '\0';
+
+  dir->handle = opendir(path);
+  dir->entry = 0;
+
+  return dir->handle != 0;
+}
+
+PIO_API PIO_INLINE int pio_platform_dir_peek(pio_dir *dir, char **name, int *is_directory)
+{
+  if (!dir->entry)
+  {
+    dir->entry = readdir(dir->handle);
+
+    if (!dir->entry)
+    {
+      return 0;
+    }
+  }
+
+  *name = dir->entry->d_name;
+  *is_directory = dir->entry->d_type == DT_UNKNOWN ? PIO_DIR_TYPE_UNKNOWN : dir->entry->d_type == DT_DIR;
 
-  return (written == (ssize_t)size);
+  return 1;
 }
 
+PIO_API PIO_INLINE void pio_platform_dir_stat(pio_dir *dir, int *is_directory, unsigned long *size)
+{
+  struct stat st;
+  unsigned long len = pio_strlen(dir->entry->d_name);
+
+  if (dir->path_length + len + 1 <= PIO_DIR_PATH_MAX)
+  {
+    pio_copy((unsigned char *)dir->path + dir->path_length, (unsigned char *)dir->entry->d_name, len + 1);
+
+    if (stat(dir->path, &st) == 0)
+    {
+      *is_directory = S_ISDIR(st.st_mode);
+      *size = (unsigned long)st.st_size;
+    }
+  }
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_advance(pio_dir *dir)
+{
+  dir->entry = 0;
+}
+
+PIO_API PIO_INLINE void pio_platform_dir_close(pio_dir *dir)
+{
+  if (dir->handle)
+  {
+    closedir(dir->handle);
+    dir->handle = 0;
+  }
+}
+
+#endif /* __linux__ */
+
 PIO_API PIO_INLINE int pio_print(char *str)
 {
   unsigned long len = pio_strlen(str);
-  ssize_t written = write(1, str, len);
-  return written == (ssize_t)len;
+  long written = pio_sys_write(1, str, len);
+  return written == (long)len;
 }
 
 #else
 #error "pio: unsupported operating system. please provide your own read/write file implementation"
 #endif
 
+/* #############################################################################
+ * # Buffered stream writer (platform independant part)
+ * #############################################################################
+ */
+PIO_API PIO_INLINE int pio_stream_open(pio_stream *stream, char *filename, unsigned char *buffer, unsigned long capacity)
+{
+  stream->buffer = buffer;
+  stream->capacity = buffer ? capacity : 0;
+  stream->size = 0;
+  stream->written = 0;
+  stream->error = 0;
+
+  if (!pio_platform_stream_open(stream, filename))
+  {
+    stream->error = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_stream_flush(pio_stream *stream)
+{
+  pio_segment pending;
+
+  if (stream->error)
+  {
+    return 0;
+  }
+
+  if (stream->size == 0)
+  {
+    return 1;
+  }
+
+  pending.data = stream->buffer;
+  pending.size = stream->size;
+  stream->size = 0;
+
+  if (!pio_platform_stream_writev(stream, &pending, 1))
+  {
+    stream->error = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_stream_writev(pio_stream *stream, pio_segment *segments, unsigned long count)
+{
+  pio_segment batch[PIO_STREAM_SEGMENTS_MAX + 1];
+  unsigned long total = 0;
+  unsigned long i;
+
+  if (stream->error)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    total += segments[i].size;
+  }
+
+  /* Fits into the remaining buffer space: just coalesce */
+  if (total <= stream->capacity - stream->size)
+  {
+    for (i = 0; i < count; ++i)
+    {
+      pio_copy(stream->buffer + stream->size, segments[i].data, segments[i].size);
+      stream->size += segments[i].size;
+    }
+
+    return 1;
+  }
+
+  /* Otherwise write the pending buffer and the segments with one gather write per batch */
+  i = 0;
+
+  while (i < count)
+  {
+    unsigned long n = 0;
+
+    if (stream->size > 0)
+    {
+      batch[n].data = stream->buffer;
+      batch[n].size = stream->size;
+      stream->size = 0;
+      n++;
+    }
+
+    while (i < count && n < PIO_STREAM_SEGMENTS_MAX)
+    {
+      batch[n++] = segments[i++];
+    }
+
+    if (!pio_platform_stream_writev(stream, batch, n))
+    {
+      stream->error = 1;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+PIO_API PIO_INLINE int pio_stream_write(pio_stream *stream, unsigned char *data, unsigned long size)
+{
+  pio_segment segment;
+
+  segment.data = data;
+  segment.size = size;
+
+  return pio_stream_writev(stream, &segment, 1);
+}
+
+/* Flushes pending data and closes the file. If sync is set the data is also committed to disk (fsync/FlushFileBuffers) */
+PIO_API PIO_INLINE int pio_stream_close(pio_stream *stream, int sync)
+{
+  int success = pio_stream_flush(stream);
+
+  if (!pio_platform_stream_close(stream, sync))
+  {
+    success = 0;
+  }
+
+  return success && !stream->error;
+}
+
+/* #############################################################################
+ * # Directory enumeration (platform independant part)
+ * #############################################################################
+ */
+PIO_API PIO_INLINE int pio_dir_extension_matches(char *name, char *extension)
+{
+  unsigned long name_length = pio_strlen(name);
+  unsigned long extension_length = pio_strlen(extension);
+  unsigned long i;
+
+  if (extension_length > name_length)
+  {
+    return 0;
+  }
+
+  name += name_length - extension_length;
+
+  /* ASCII case insensitive compare */
+  for (i = 0; i < extension_length; ++i)
+  {
+    char a = name[i];
+    char b = extension[i];
+
+    if (a >= 'A' && a <= 'Z')
+    {
+      a = (char)(a - 'A' + 'a');
+    }
+
+    if (b >= 'A' && b <= 'Z')
+    {
+      b = (char)(b - 'A' + 'a');
+    }
+
+    if (a != b)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Opens a directory. extension (e.g. ".ppm") restricts the results to matching files, 0 returns all entries */
+PIO_API PIO_INLINE int pio_dir_open(pio_dir *dir, char *path, char *extension, int flags)
+{
+  dir->extension = extension;
+  dir->flags = flags;
+  dir->skipped = 0;
+
+  return pio_platform_dir_open(dir, path);
+}
+
+/* Fills up to capacity entries. Returns 0 once the directory is exhausted. Names longer
+ * than names_capacity can never be returned, they are skipped and counted in dir->skipped.
+ */
+PIO_API PIO_INLINE int pio_dir_next(pio_dir *dir, pio_dir_entry *entries, unsigned long capacity, char *names, unsigned long names_capacity, unsigned long *count)
+{
+  unsigned long names_used = 0;
+  char *name;
+  int is_directory;
+  unsigned long size;
+
+  *count = 0;
+
+  while (*count < capacity && pio_platform_dir_peek(dir, &name, &is_directory))
+  {
+    unsigned long length;
+
+    if ((name[0] == '.' && name[1] == '\0') ||
+        (name[0] == '.' && name[1] == '.' && name[2] == '\0') ||
+        (dir->extension && (is_directory == 1 || !pio_dir_extension_matches(name, dir->extension))))
+    {
+      pio_platform_dir_advance(dir);
+      continue;
+    }
+
+    length = pio_strlen(name) + 1;
+
+    if (length > names_capacity)
+    {
+      dir->skipped++;
+      pio_platform_dir_advance(dir);
+      continue;
+    }
+
+    /* Names buffer full, keep the entry for the next call */
+    if (names_used + length > names_capacity)
+    {
+      break;
+    }
+
+    /* Only entries that are returned are stat'd, once */
+    size = 0;
+
+    if ((dir->flags & PIO_DIR_SIZES) || is_directory == PIO_DIR_TYPE_UNKNOWN)
+    {
+      if (is_directory == PIO_DIR_TYPE_UNKNOWN)
+      {
+        is_directory = 0;
+      }
+
+      pio_platform_dir_stat(dir, &is_directory, &size);
+
+      if (dir->extension && is_directory)
+      {
+        pio_platform_dir_advance(dir);
+        continue;
+      }
+    }
+
+    pio_copy((unsigned char *)names + names_used, (unsigned char *)name, length);
+
+    entries[*count].name = names + names_used;
+    entries[*count].size = size;
+    entries[*count].is_directory = is_directory;
+
+    names_used += length;
+    (*count)++;
+
+    pio_platform_dir_advance(dir);
+  }
+
+  return *count > 0;
+}
+
+PIO_API PIO_INLINE void pio_dir_close(pio_dir *dir)
+{
+  pio_platform_dir_close(dir);
+}
+
 #endif /* PIO_H */
 
 /*
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Compiles the program without the C standard library (static, no libc, no dynamic loader)
+# -ffreestanding selects the raw syscall layer of pio.h
+# -fno-pie -no-pie -static produce a plain static executable that needs no runtime relocation
+# -fno-stack-protector avoids references to the libc stack guard
+# -ftime-report    /* To see compile/link time statistic */
+
+DEF_COMPILER_FLAGS="-march=native -mtune=native -std=c89 -pedantic -nodefaultlibs -nostdlib -static -fno-pie -no-pie \
+-fno-builtin -ffreestanding -fno-asynchronous-unwind-tables -fno-stack-protector \
+-Wall -Wextra -Werror -Wvla -Wconversion -Wdouble-promotion -Wsign-conversion -Wmissing-field-initializers -Wuninitialized -Winit-self -Wunused -Wunused-macros -Wunused-local-typedefs"
+
+DEF_FLAGS_LINKER=""
+
+SOURCE_NAME=imagine_linux_nostdlib
+
+cc -s -O2 $DEF_COMPILER_FLAGS $SOURCE_NAME.c -o $SOURCE_NAME $DEF_FLAGS_LINKER && ./$SOURCE_NAME
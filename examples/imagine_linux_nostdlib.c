@@ -0,0 +1,114 @@
+/* imagine.h - v0.2 - public domain data structures - nickscha 2025
+
+A C89 standard compliant, single header, nostdlib (no C Standard Library) Image Library (IMAGINE).
+
+This example demonstrates a linux program using imagine.h without using and linking to the C standard library.
+
+The resulting static executable talks to the kernel directly through the raw syscall layer of pio.h
+(x86_64 and aarch64) and provides its own "_start" entry point, so there is no libc, no dynamic loader
+and no startup code involved.
+
+It maps the test image into memory, decodes it with imagine and exits with 0 on success.
+
+This example tested with clang and gcc.
+
+Please read build.sh file to see the compiler flags and their description.
+
+LICENSE
+
+  Placed in the public domain and also MIT licensed.
+  See end of file for detailed license information.
+
+*/
+#include "../imagine.h"  /* Image Library                                      */
+#include "../deps/pio.h" /* Read/Write Files (raw syscalls when freestanding) */
+
+#ifndef PIO_LINUX_SYSCALLS
+#error "this example must be compiled freestanding (-ffreestanding) or with PIO_LINUX_NOSTDLIB"
+#endif
+
+#define assert(expression)                            \
+  if (!(expression))                                  \
+  {                                                   \
+    pio_print("assertion failed: " #expression "\n"); \
+    pio_exit(1);                                      \
+  }
+
+#define PIXELS_CAPACITY 128 * 128 * 4
+
+static unsigned char pixels[PIXELS_CAPACITY];
+
+static void imagine_example(void)
+{
+  unsigned char *data;
+  unsigned long size;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = PIXELS_CAPACITY;
+
+  if (!pio_map("../tests/images/test-p6.ppm", &data, &size))
+  {
+    assert(pio_map("tests/images/test-p6.ppm", &data, &size));
+  }
+
+  assert(imagine_load(&img, data, (unsigned int)size));
+  assert(img.width == 2 && img.height == 2 && img.stride == 3);
+  assert(img.pixels[0] == 255 && img.pixels[1] == 0 && img.pixels[2] == 0);
+  assert(pio_unmap(data, size));
+
+  pio_print("imagine: decoded test-p6.ppm without libc\n");
+}
+
+#ifdef __x86_64__
+/* The kernel enters _start with a 16 byte aligned stack but the compiler expects the alignment of a call */
+__attribute((force_align_arg_pointer))
+#endif
+void
+_start(void)
+{
+  imagine_example();
+  pio_exit(0);
+}
+
+/*
+   ------------------------------------------------------------------------------
+   This software is available under 2 licenses -- choose whichever you prefer.
+   ------------------------------------------------------------------------------
+   ALTERNATIVE A - MIT License
+   Copyright (c) 2025 nickscha
+   Permission is hereby granted, free of charge, to any person obtaining a copy of
+   this software and associated documentation files (the "Software"), to deal in
+   the Software without restriction, including without limitation the rights to
+   use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is furnished to do
+   so, subject to the following conditions:
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   ------------------------------------------------------------------------------
+   ALTERNATIVE B - Public Domain (www.unlicense.org)
+   This is free and unencumbered software released into the public domain.
+   Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+   software, either in source code form or as a compiled binary, for any purpose,
+   commercial or non-commercial, and by any means.
+   In jurisdictions that recognize copyright laws, the author or authors of this
+   software dedicate any and all copyright interest in the software to the public
+   domain. We make this dedication for the benefit of the public at large and to
+   the detriment of our heirs and successors. We intend this dedication to be an
+   overt act of relinquishment in perpetuity of all present and future rights to
+   this software under copyright law.
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+   ------------------------------------------------------------------------------
+*/
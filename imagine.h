@@ -26,867 +26,5357 @@ LICENSE
 
 #define IMAGINE_API static
 
-typedef struct imagine
-{
-  unsigned int width;
-  unsigned int height;
-  unsigned int stride;      /* bytes per pixel: 1=gray, 3=RGB */
-  unsigned char monochrome; /* 1 if grayscale, 0 if color */
-  unsigned char *pixels;    /* user-provided buffer */
-  unsigned int pixels_capacity;
-  unsigned int pixels_size;
+/* Optional profiling zones around the decode stages. Compiled out by default,
+ * to feed them into perf.h define before including imagine.h:
+ *
+ *   #define IMAGINE_ZONE_BEGIN(name) PERF_ZONE_BEGIN(name)
+ *   #define IMAGINE_ZONE_END(name) PERF_ZONE_END(name)
+ */
+#ifndef IMAGINE_ZONE_BEGIN
+#define IMAGINE_ZONE_BEGIN(name)
+#endif
 
-} imagine;
+#ifndef IMAGINE_ZONE_END
+#define IMAGINE_ZONE_END(name)
+#endif
+
+/* SSE2 passes (resize) on x86, define IMAGINE_NO_SIMD to force the scalar code */
+#if !defined(IMAGINE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define IMAGINE_SSE2
+#include <emmintrin.h>
+#endif
 
 /* ########################################################################## */
-/* HELPERS */
+/* DECODE STATISTICS (opt-in with IMAGINE_STATS) */
 /* ########################################################################## */
-IMAGINE_API IMAGINE_INLINE unsigned short imagine_read16(const unsigned char *p)
-{
-  return (unsigned short)(p[0] | (p[1] << 8));
-}
+/* With IMAGINE_STATS every loader fills img->stats: the loader name, bytes of the
+ * input consumed, rows decoded, the paths taken (IMAGINE_PATH_* flags) and the
+ * cycles spent per stage. On failure the values describe the work done up to the
+ * failing point. Without IMAGINE_STATS the struct member and all hooks compile to nothing.
+ *
+ * Cycles come from the time stamp counter on x86 (GCC/Clang/MSVC), elsewhere define
+ * IMAGINE_STATS_CYCLES() before including imagine.h, for example:
+ *
+ *   #define IMAGINE_STATS_CYCLES() perf_platform_current_cycle_count()
+ */
+#define IMAGINE_STAGE_HEADER 0  /* header parsing and validation */
+#define IMAGINE_STAGE_PIXELS 1  /* pixel decoding (RLE expansion, unpacking, swizzle) */
+#define IMAGINE_STAGE_PALETTE 2 /* separate palette conversion pass */
+#define IMAGINE_STAGE_COUNT 3
+
+#define IMAGINE_PATH_ASCII 0x001      /* text parsing per sample (netpbm P1-P3, slow) */
+#define IMAGINE_PATH_PACKED 0x002     /* sub byte pixels unpacked bit by bit (1/4 bit) */
+#define IMAGINE_PATH_PALETTE 0x004    /* palette lookup per pixel */
+#define IMAGINE_PATH_RESCALE 0x008    /* per sample division to 0..255 (maxval, 5 bit channels) */
+#define IMAGINE_PATH_SWIZZLE 0x010    /* BGR(A) to RGB channel swap */
+#define IMAGINE_PATH_DROP_ALPHA 0x020 /* alpha channel read and discarded */
+#define IMAGINE_PATH_COPY 0x040       /* samples copied unchanged (fast) */
+#define IMAGINE_PATH_RLE 0x080        /* run length decoding */
+#define IMAGINE_PATH_BOTTOM_UP 0x100  /* rows stored bottom up */
+#define IMAGINE_PATH_CONTAINER 0x200  /* image embedded in a container (ICO) */
+
+#ifdef IMAGINE_STATS
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 imagine_u64;
+#elif defined(__GNUC__) || defined(__clang__)
+__extension__ typedef unsigned long long imagine_u64;
+#else
+typedef unsigned long imagine_u64;
+#endif
 
-IMAGINE_API IMAGINE_INLINE unsigned int imagine_read32(const unsigned char *p)
+#ifndef IMAGINE_STATS_CYCLES
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define IMAGINE_STATS_CYCLES() ((imagine_u64)__rdtsc())
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+IMAGINE_API IMAGINE_INLINE imagine_u64 imagine_stats_cycles(void)
 {
-  return (unsigned int)(p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24));
+  unsigned int lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((imagine_u64)hi << 32) | lo;
 }
+#define IMAGINE_STATS_CYCLES() imagine_stats_cycles()
+#else
+#define IMAGINE_STATS_CYCLES() ((imagine_u64)0)
+#endif
+#endif
 
-/* ########################################################################## */
-/* NETPBM (P1–P7) */
-/* ########################################################################## */
-IMAGINE_API IMAGINE_INLINE unsigned char *imagine_ppm_skip(unsigned char *p, unsigned char *end)
+typedef struct imagine_stats
 {
-  while (p < end)
-  {
-    if (*p == '#')
-    {
-      while (p < end && *p != '\n' && *p != '\r')
-        p++;
-    }
-    else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
-    {
-      p++;
-    }
-    else
-    {
-      break;
-    }
-  }
-  return p;
-}
+  char *loader;                             /* "netpbm", "bmp", "tga", "pcx", "dds", "ico" or 0 if unknown */
+  unsigned int bytes_consumed;              /* input bytes read (headers, palettes and pixel data) */
+  unsigned int rows_decoded;                /* complete rows written to pixels */
+  unsigned int paths;                       /* IMAGINE_PATH_* flags */
+  imagine_u64 cycles[IMAGINE_STAGE_COUNT]; /* indexed by IMAGINE_STAGE_* */
 
-IMAGINE_API IMAGINE_INLINE unsigned char *imagine_ppm_parse_uint(unsigned char *p, unsigned char *end, unsigned int *out)
+  /* Internal */
+  imagine_u64 mark;
+  unsigned int stage; /* IMAGINE_STAGE_COUNT once closed */
+
+} imagine_stats;
+
+IMAGINE_API IMAGINE_INLINE void imagine_stats_begin(imagine_stats *stats, char *loader)
 {
-  unsigned int v = 0;
-  p = imagine_ppm_skip(p, end);
+  unsigned int i;
 
-  while (p < end && *p >= '0' && *p <= '9')
+  stats->loader = loader;
+  stats->bytes_consumed = 0;
+  stats->rows_decoded = 0;
+  stats->paths = 0;
+
+  for (i = 0; i < IMAGINE_STAGE_COUNT; ++i)
   {
-    v = v * 10 + (unsigned int)(*p - '0');
-    p++;
+    stats->cycles[i] = 0;
   }
 
-  *out = v;
-  return p;
+  stats->stage = IMAGINE_STAGE_HEADER;
+  stats->mark = IMAGINE_STATS_CYCLES();
 }
 
-IMAGINE_API int imagine_load_netpbm(imagine *img, unsigned char *buffer, unsigned int size)
+/* Charges the cycles since the last mark to the current stage and switches to next */
+IMAGINE_API IMAGINE_INLINE void imagine_stats_stage(imagine_stats *stats, unsigned int next)
 {
-  unsigned char *p, *end, fmt;
-  unsigned int w, h, maxval;
-  unsigned int i, n;
+  imagine_u64 now;
 
-  if (size < 2 || buffer[0] != 'P')
+  if (stats->stage >= IMAGINE_STAGE_COUNT)
   {
-    return 0;
+    return; /* closed */
   }
 
-  fmt = buffer[1];
-  p = buffer + 2;
-  end = buffer + size;
+  now = IMAGINE_STATS_CYCLES();
+  stats->cycles[stats->stage] += now - stats->mark;
+  stats->mark = now;
+  stats->stage = next;
+}
 
-  p = imagine_ppm_parse_uint(p, end, &w);
-  p = imagine_ppm_parse_uint(p, end, &h);
+#define IMAGINE_STATS_BEGIN(img, name) imagine_stats_begin(&(img)->stats, (name))
+#define IMAGINE_STATS_STAGE(img, stage) imagine_stats_stage(&(img)->stats, (stage))
+#define IMAGINE_STATS_END(img) imagine_stats_stage(&(img)->stats, IMAGINE_STAGE_COUNT)
+#define IMAGINE_STATS_PATH(img, flags) ((img)->stats.paths |= (unsigned int)(flags))
+#define IMAGINE_STATS_PROGRESS(img, bytes, rows) ((img)->stats.bytes_consumed = (unsigned int)(bytes), (img)->stats.rows_decoded = (unsigned int)(rows))
+#define IMAGINE_STATS_CONTAINER(img, name, offset) ((img)->stats.loader = (name), (img)->stats.paths |= IMAGINE_PATH_CONTAINER, (img)->stats.bytes_consumed += (unsigned int)(offset))
+#else
+#define IMAGINE_STATS_BEGIN(img, name)
+#define IMAGINE_STATS_STAGE(img, stage)
+#define IMAGINE_STATS_END(img)
+#define IMAGINE_STATS_PATH(img, flags)
+#define IMAGINE_STATS_PROGRESS(img, bytes, rows)
+#define IMAGINE_STATS_CONTAINER(img, name, offset)
+#endif /* IMAGINE_STATS */
 
-  if (w == 0 || h == 0)
-  {
-    return 0;
-  }
+/* ########################################################################## */
+/* HISTOGRAM */
+/* ########################################################################## */
+/* Per channel 256 bin histograms with min, max, sum and mean of 8 bit pixels.
+ *
+ * Counting goes to IMAGINE_HISTOGRAM_COPIES interleaved sub histograms per channel so
+ * runs of equal values do not serialize on one counter (store forwarding), the
+ * copies are merged by imagine_histogram_finish.
+ *
+ * For decoded buffers use imagine_histogram_compute. With IMAGINE_HISTOGRAM defined
+ * the imagine struct gets a histogram pointer, when it is set every loader counts
+ * each output row right after writing it (still in cache) and finishes the histogram
+ * on success, so no second pass over the image is needed.
+ */
+#define IMAGINE_HISTOGRAM_COPIES 4
+
+typedef struct imagine_histogram
+{
+  unsigned int channels; /* stride of the counted pixels, 0 before the first add */
+  unsigned int count;    /* pixels counted */
+  unsigned int bins[4][256];
+  unsigned char min[4];
+  unsigned char max[4];
+  double sum[4];
+  double mean[4];
+  unsigned int partial[4][IMAGINE_HISTOGRAM_COPIES][256];
+
+} imagine_histogram;
+
+IMAGINE_API IMAGINE_INLINE void imagine_histogram_reset(imagine_histogram *h)
+{
+  unsigned int *p = &h->partial[0][0][0];
+  unsigned int i;
 
-  maxval = 1;
-  if (fmt != '1' && fmt != '4')
+  for (i = 0; i < 4 * IMAGINE_HISTOGRAM_COPIES * 256; ++i)
   {
-    p = imagine_ppm_parse_uint(p, end, &maxval);
-
-    if (maxval == 0)
-    {
-      return 0;
-    }
+    p[i] = 0;
   }
 
-  img->width = w;
-  img->height = h;
-  img->monochrome = (fmt == '1' || fmt == '4' || fmt == '2' || fmt == '5');
-  img->stride = img->monochrome ? 1 : 3;
-  img->pixels_size = w * h * img->stride;
+  h->channels = 0;
+  h->count = 0;
+}
+
+/* Counts count pixels of stride 1 to 4. All adds between reset and finish must use the same stride. */
+IMAGINE_API IMAGINE_INLINE int imagine_histogram_add(imagine_histogram *h, unsigned char *pixels, unsigned int count, unsigned int stride)
+{
+  unsigned int n = count * stride;
+  unsigned int i = 0;
+  unsigned int c;
 
-  if (img->pixels_capacity < img->pixels_size)
+  if (stride < 1 || stride > 4 || (h->channels && h->channels != stride))
   {
     return 0;
   }
 
-  n = w * h;
+  h->channels = stride;
+  h->count += count;
 
-  /* ASCII P1 (bitmap 0/1) */
-  if (fmt == '1')
+  if (stride == 2 || stride == 3)
   {
-    for (i = 0; i < n; ++i)
+    for (; i + 4 * stride <= n; i += 4 * stride)
     {
-      unsigned int bit;
-      p = imagine_ppm_parse_uint(p, end, &bit);
-      img->pixels[i] = (unsigned char)(bit ? 0 : 255);
+      for (c = 0; c < stride; ++c)
+      {
+        h->partial[c][0][pixels[i + c]]++;
+        h->partial[c][1][pixels[i + stride + c]]++;
+        h->partial[c][2][pixels[i + 2 * stride + c]]++;
+        h->partial[c][3][pixels[i + 3 * stride + c]]++;
+      }
     }
   }
-  /* Binary P4 (bitmap packed bits) */
-  else if (fmt == '4')
+  else
   {
-    unsigned int x, y;
-    unsigned int rowbytes = (w + 7) / 8;
-
-    p = imagine_ppm_skip(p, end); /* move to pixel data */
-
-    if ((unsigned int)(end - p) < rowbytes * h)
+    /* Stride 1: byte j of a 4 byte group goes to copy j. Stride 4: the group is a pixel,
+     * byte j is channel j and the copy rotates with the pixel. Four groups per iteration
+     * keep the copy indices constant, which is what makes this loop fast (a vector load
+     * followed by scalar increments measured no faster).
+     */
+    if (stride == 1)
     {
-      return 0; /* not enough data */
+      for (; i + 4 <= n; i += 4)
+      {
+        h->partial[0][0][pixels[i]]++;
+        h->partial[0][1][pixels[i + 1]]++;
+        h->partial[0][2][pixels[i + 2]]++;
+        h->partial[0][3][pixels[i + 3]]++;
+      }
     }
-
-    for (y = 0; y < h; ++y)
+    else
     {
-      unsigned char *row = p + y * rowbytes;
-      for (x = 0; x < w; ++x)
+      for (; i + 16 <= n; i += 16)
       {
-        unsigned int byte = row[x >> 3];
-        unsigned int bit = (byte >> (7 - (x & 7))) & 1;
+        unsigned char *p = pixels + i;
+
+        for (c = 0; c < 4; ++c)
+        {
+          h->partial[c][0][p[c]]++;
+          h->partial[c][1][p[4 + c]]++;
+          h->partial[c][2][p[8 + c]]++;
+          h->partial[c][3][p[12 + c]]++;
+        }
+      }
 
-        img->pixels[y * w + x] = (unsigned char)(bit ? 0 : 255);
+      for (; i + 4 <= n; i += 4)
+      {
+        for (c = 0; c < 4; ++c)
+        {
+          h->partial[c][0][pixels[i + c]]++;
+        }
       }
     }
   }
-  /* ASCII grayscale P2 */
-  else if (fmt == '2')
+
+  /* Remaining pixels (stride 1 to 3) */
+  for (; i < n; ++i)
   {
-    for (i = 0; i < n; ++i)
-    {
-      unsigned int v;
-      p = imagine_ppm_parse_uint(p, end, &v);
-      img->pixels[i] = (unsigned char)((255U * v) / maxval);
-    }
+    h->partial[i % stride][0][pixels[i]]++;
   }
-  /* Binary grayscale P5 */
-  else if (fmt == '5')
+
+  return 1;
+}
+
+/* Counts count bytes of channel c of a planar image with channels channels. Channel 0
+ * adds to the pixel count.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_histogram_add_plane(imagine_histogram *h, unsigned char *plane, unsigned int count, unsigned int c, unsigned int channels)
+{
+  unsigned int i = 0;
+
+  if (channels < 1 || channels > 4 || c >= channels || (h->channels && h->channels != channels))
   {
-    unsigned int v;
-    p = imagine_ppm_skip(p, end);
-    for (i = 0; i < n; ++i)
-    {
-      if (p >= end)
-      {
-        return 0;
-      }
+    return 0;
+  }
 
-      v = *p++;
+  h->channels = channels;
+  h->count += c == 0 ? count : 0U;
 
-      img->pixels[i] = (unsigned char)((255U * v) / maxval);
-    }
+  for (; i + 4 <= count; i += 4)
+  {
+    h->partial[c][0][plane[i]]++;
+    h->partial[c][1][plane[i + 1]]++;
+    h->partial[c][2][plane[i + 2]]++;
+    h->partial[c][3][plane[i + 3]]++;
   }
-  /* ASCII RGB P3 */
-  else if (fmt == '3')
+
+  for (; i < count; ++i)
   {
-    for (i = 0; i < n; ++i)
-    {
-      unsigned int r, g, b;
+    h->partial[c][0][plane[i]]++;
+  }
+
+  return 1;
+}
 
-      p = imagine_ppm_parse_uint(p, end, &r);
-      p = imagine_ppm_parse_uint(p, end, &g);
-      p = imagine_ppm_parse_uint(p, end, &b);
+/* Merges the sub histograms into bins and derives min, max, sum and mean */
+IMAGINE_API IMAGINE_INLINE void imagine_histogram_finish(imagine_histogram *h)
+{
+  unsigned int c;
+  unsigned int v;
+  unsigned int k;
 
-      img->pixels[i * 3 + 0] = (unsigned char)((255U * r) / maxval);
-      img->pixels[i * 3 + 1] = (unsigned char)((255U * g) / maxval);
-      img->pixels[i * 3 + 2] = (unsigned char)((255U * b) / maxval);
-    }
-  }
-  /* Binary RGB P6 */
-  else if (fmt == '6')
+  for (c = 0; c < 4; ++c)
   {
-    p = imagine_ppm_skip(p, end);
+    int seen = 0;
 
-    for (i = 0; i < n; ++i)
+    h->min[c] = 0;
+    h->max[c] = 0;
+    h->sum[c] = 0.0;
+    h->mean[c] = 0.0;
+
+    for (v = 0; v < 256; ++v)
     {
-      if (p + 3 > end)
+      unsigned int total = 0;
+
+      for (k = 0; k < IMAGINE_HISTOGRAM_COPIES; ++k)
       {
-        return 0;
+        total += h->partial[c][k][v];
+      }
+
+      h->bins[c][v] = total;
+
+      if (!total)
+      {
+        continue;
+      }
+
+      if (!seen)
+      {
+        h->min[c] = (unsigned char)v;
+        seen = 1;
       }
 
-      img->pixels[i * 3 + 0] = (unsigned char)((255U * p[0]) / maxval);
-      img->pixels[i * 3 + 1] = (unsigned char)((255U * p[1]) / maxval);
-      img->pixels[i * 3 + 2] = (unsigned char)((255U * p[2]) / maxval);
+      h->max[c] = (unsigned char)v;
+      h->sum[c] += (double)total * (double)v;
+    }
 
-      p += 3;
+    if (h->count)
+    {
+      h->mean[c] = h->sum[c] / (double)h->count;
     }
   }
-  /* PAM P7 (partial: only RGB/GRAYSCALE with DEPTH 1/3/4) */
-  else if (fmt == '7')
+}
+
+#ifdef IMAGINE_HISTOGRAM
+#define IMAGINE_HISTOGRAM_BEGIN(img) ((img)->histogram ? imagine_histogram_reset((img)->histogram) : (void)0)
+#define IMAGINE_HISTOGRAM_ROWS(img, y, rows) ((img)->histogram ? (void)imagine_histogram_add((img)->histogram, imagine_row((img), (y)), (rows) * (img)->width, (img)->stride) : (void)0)
+#define IMAGINE_HISTOGRAM_PLANE(img, c, plane_row) ((img)->histogram ? (void)imagine_histogram_add_plane((img)->histogram, (plane_row), (img)->width, (c), (img)->stride) : (void)0)
+#define IMAGINE_HISTOGRAM_END(img) ((img)->histogram ? imagine_histogram_finish((img)->histogram) : (void)0)
+#else
+#define IMAGINE_HISTOGRAM_BEGIN(img)
+#define IMAGINE_HISTOGRAM_ROWS(img, y, rows)
+#define IMAGINE_HISTOGRAM_PLANE(img, c, plane_row)
+#define IMAGINE_HISTOGRAM_END(img)
+#endif /* IMAGINE_HISTOGRAM */
+
+typedef struct imagine
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;      /* bytes per pixel: 1=gray, 3=RGB */
+  unsigned char monochrome; /* 1 if grayscale, 0 if color */
+  unsigned char *pixels;    /* user-provided buffer */
+  unsigned int pixels_capacity;
+  unsigned int pixels_size;
+  int layout;          /* IMAGINE_LAYOUT_*, 0 (linear) unless requested */
+  unsigned int tile;   /* tile edge of the tiled and Morton layouts */
+  unsigned int pitch;  /* bytes from one linear row to the next, 0 = width * stride */
+  unsigned int offset; /* bytes from pixels to the first pixel of a linear image */
+
+#ifdef IMAGINE_STATS
+  imagine_stats stats; /* filled by every load */
+#endif
+
+#ifdef IMAGINE_HISTOGRAM
+  imagine_histogram *histogram; /* optional, counted and finished by every successful load */
+#endif
+
+} imagine;
+
+/* ########################################################################## */
+/* PIXEL LAYOUTS */
+/* ########################################################################## */
+/* img->layout selects how pixels are ordered in img->pixels:
+ *
+ *   IMAGINE_LAYOUT_LINEAR  rows top to bottom (default, the only layout processing functions
+ *                          accept, they return 0 for the others and write linear output)
+ *   IMAGINE_LAYOUT_TILED   img->tile x img->tile tiles, tile rows top to bottom and tiles
+ *                          left to right, pixels row by row inside a tile
+ *   IMAGINE_LAYOUT_MORTON  the same tiles with pixels in Z-order inside full tiles
+ *   IMAGINE_LAYOUT_PLANAR  one plane of width * height bytes per channel (R, G, B, A),
+ *                          plane c at imagine_plane(img, c)
+ *
+ * Tiles are not padded: edge tiles are narrower / shorter (and row by row in both
+ * layouts), so every band of tile rows covers the same bytes as in the linear layout
+ * and pixels_size does not change. The tile edge is a power of two from 8 to 256.
+ *
+ * Planes are rounded up to 16 bytes, so with 16 byte aligned pixels every plane is
+ * aligned too and pixels_size is stride * imagine_plane_size(img).
+ *
+ * When layout is set before a load, loaders reorder every band in place as soon as its
+ * last row is written. That needs tile * width * stride bytes of pixels_capacity
+ * beyond pixels_size. For planar output the loaders decode each row into a staging row
+ * behind the planes (width * stride bytes) and split it with SSE2 while it is in L1,
+ * PCX writes its planes directly.
+ *
+ * Linear images may have a row pitch and an origin offset: row y starts at
+ * pixels + offset + y * pitch. Loaders honor both, so an image can be decoded straight
+ * into aligned rows (imagine_aligned_pitch) or into a rectangle of a larger canvas
+ * (imagine_view) without a copy afterwards. A row may not run past the pitch and
+ * pixels_size ends with the last decoded row. The other layouts and all processing
+ * functions expect packed rows (pitch and offset 0), processing functions return 0
+ * otherwise and write packed rows; imagine_relayout repacks.
+ */
+#define IMAGINE_LAYOUT_LINEAR 0
+#define IMAGINE_LAYOUT_TILED 1
+#define IMAGINE_LAYOUT_MORTON 2
+#define IMAGINE_LAYOUT_PLANAR 3
+
+/* log2 of a valid tile edge, 0 otherwise */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_layout_shift(unsigned int tile)
+{
+  unsigned int shift;
+
+  for (shift = 3; shift <= 8; ++shift)
   {
-    /* Not fully implemented: header parsing required */
-    return 0;
+    if (tile == 1U << shift)
+    {
+      return shift;
+    }
   }
-  else
+
+  return 0;
+}
+
+/* Bits of v (< 256) spread to the even bit positions */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_morton_spread(unsigned int v)
+{
+  v = (v | (v << 4)) & 0x0F0FU;
+  v = (v | (v << 2)) & 0x3333U;
+  return (v | (v << 1)) & 0x5555U;
+}
+
+/* Bytes of one plane of the planar layout */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_plane_size(imagine *img)
+{
+  return (img->width * img->height + 15U) & ~15U;
+}
+
+/* Plane of channel c, 0 unless img is planar */
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_plane(imagine *img, unsigned int c)
+{
+  if (img->layout != IMAGINE_LAYOUT_PLANAR || c >= img->stride)
   {
     return 0;
   }
 
-  return 1;
+  return img->pixels + c * imagine_plane_size(img);
 }
 
-/* ########################################################################## */
-/* BMP LOADER (1,4,8,16,24,32-bit, BI_RGB only)                               */
-/* ########################################################################## */
-IMAGINE_API int imagine_load_bmp(imagine *img, unsigned char *buffer, unsigned int size)
+/* Bytes from the start of one linear row to the next */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_pitch(imagine *img)
 {
-  unsigned int bfOffBits, width, height, planes, bitCount, compression;
-  unsigned int clrUsed;
-  unsigned char *p, *end, *dst;
-  unsigned int x, y, rowSize;
-  unsigned int paletteEntries, b, g, r, a;
-  unsigned char *palette;
+  return img->pitch ? img->pitch : img->width * img->stride;
+}
 
-  if (size < 54 || buffer[0] != 'B' || buffer[1] != 'M')
+/* Row bytes of width pixels rounded up to align (a power of two), for img->pitch */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_aligned_pitch(unsigned int width, unsigned int stride, unsigned int align)
+{
+  return (width * stride + align - 1U) & ~(align - 1U);
+}
+
+/* Points img at the first align (a power of two) aligned byte of buffer */
+IMAGINE_API IMAGINE_INLINE int imagine_align_pixels(imagine *img, unsigned char *buffer, unsigned int capacity, unsigned int align)
+{
+  unsigned int skip;
+
+  if (!img || !buffer || !align || (align & (align - 1U)))
   {
     return 0;
   }
 
-  bfOffBits = imagine_read32(buffer + 10);
-  width = imagine_read32(buffer + 18);
-  height = imagine_read32(buffer + 22);
-  planes = imagine_read16(buffer + 26);
-  bitCount = imagine_read16(buffer + 28);
-  compression = imagine_read32(buffer + 30);
-  clrUsed = imagine_read32(buffer + 46);
+  skip = (align - (unsigned int)((unsigned long)buffer & (align - 1U))) & (align - 1U);
 
-  if (planes != 1 || compression != 0 || width == 0 || height == 0)
+  if (skip > capacity)
   {
     return 0;
   }
 
-  p = buffer + bfOffBits;
-  end = buffer + size;
+  img->pixels = buffer + skip;
+  img->pixels_capacity = capacity - skip;
+  img->offset = 0;
 
-  /* Determine palette size */
-  paletteEntries = 0;
+  return 1;
+}
 
-  if (bitCount <= 8)
-  {
-    paletteEntries = clrUsed;
+/* Makes view decode into canvas with its top left pixel at (x, y). The canvas must be
+ * linear and the decoded image needs the canvas stride to line up with its pixels.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_view(imagine *view, imagine *canvas, unsigned int x, unsigned int y)
+{
+  unsigned int pitch;
 
-    if (paletteEntries == 0)
+  if (!view || !canvas || !canvas->pixels || canvas->layout != IMAGINE_LAYOUT_LINEAR || x >= canvas->width || y >= canvas->height)
+  {
+    return 0;
+  }
+
+  pitch = imagine_pitch(canvas);
+
+  view->pixels = canvas->pixels;
+  view->pixels_capacity = canvas->pixels_capacity;
+  view->pitch = pitch;
+  view->offset = canvas->offset + y * pitch + x * canvas->stride;
+  view->layout = IMAGINE_LAYOUT_LINEAR;
+  view->tile = 0;
+
+  return 1;
+}
+
+/* Called by the loaders once width, height and stride are known: sets pixels_size for
+ * the layout and checks that pixels_capacity also holds what the layout needs while
+ * loading. Returns 0 when it does not fit or the layout is invalid. Sizes come from
+ * the file, so every product is checked against the capacity before it is formed.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_layout_prepare(imagine *img)
+{
+  unsigned int capacity = img->pixels_capacity;
+  unsigned int spare = 0;
+  unsigned int row;
+
+  if (img->stride && img->width > capacity / img->stride)
+  {
+    return 0;
+  }
+
+  row = img->width * img->stride;
+
+  if ((img->pitch || img->offset) && img->layout != IMAGINE_LAYOUT_LINEAR)
+  {
+    return 0;
+  }
+
+  if (img->layout == IMAGINE_LAYOUT_LINEAR && (img->pitch || img->offset))
+  {
+    unsigned int pitch = imagine_pitch(img);
+
+    if (img->pitch && row > img->pitch - img->offset % img->pitch)
     {
-      paletteEntries = 1U << bitCount;
+      return 0;
     }
 
-    if (size < 54 + paletteEntries * 4)
+    if (!img->height || img->offset > capacity || row > capacity - img->offset ||
+        img->height - 1 > (capacity - img->offset - row) / (pitch ? pitch : 1U))
     {
       return 0;
     }
 
-    palette = buffer + 54;
+    img->pixels_size = img->offset + (img->height - 1) * pitch + row;
+  }
+  else if (img->layout == IMAGINE_LAYOUT_PLANAR)
+  {
+    unsigned int plane;
+
+    if (!img->stride || (img->width && img->height > capacity / img->width))
+    {
+      return 0;
+    }
+
+    plane = imagine_plane_size(img);
+
+    if (plane < img->width * img->height || plane > capacity / img->stride)
+    {
+      return 0;
+    }
+
+    img->pixels_size = img->stride * plane;
+    spare = img->stride > 1 ? row : 0U;
   }
   else
   {
-    palette = 0;
+    if (img->layout != IMAGINE_LAYOUT_LINEAR &&
+        ((img->layout != IMAGINE_LAYOUT_TILED && img->layout != IMAGINE_LAYOUT_MORTON) || !imagine_layout_shift(img->tile)))
+    {
+      return 0;
+    }
+
+    if (row && img->height > capacity / row)
+    {
+      return 0;
+    }
+
+    img->pixels_size = img->height * row;
+
+    if (img->layout != IMAGINE_LAYOUT_LINEAR)
+    {
+      if (row > (capacity - img->pixels_size) / img->tile)
+      {
+        return 0;
+      }
+
+      spare = img->tile * row;
+    }
   }
 
-  /* Choose stride and format */
-  if (bitCount == 1 || bitCount == 4 || bitCount == 8)
+  return capacity >= img->pixels_size && capacity - img->pixels_size >= spare;
+}
+
+/* Where loaders write interleaved row y: its linear position, or the staging row for planar output */
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_row(imagine *img, unsigned int y)
+{
+  if (img->layout == IMAGINE_LAYOUT_PLANAR && img->stride > 1)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    return img->pixels + img->pixels_size;
   }
-  else if (bitCount == 16)
+
+  return img->pixels + img->offset + y * imagine_pitch(img);
+}
+
+/* Whether the processing functions can read img: linear with packed rows */
+IMAGINE_API IMAGINE_INLINE int imagine_linear(imagine *img)
+{
+  return img->layout == IMAGINE_LAYOUT_LINEAR && !img->offset && imagine_pitch(img) == img->width * img->stride;
+}
+
+/* Marks dst as linear with packed rows once a processing function has written it,
+ * whatever it was loaded as
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_linear_output(imagine *dst)
+{
+  dst->layout = IMAGINE_LAYOUT_LINEAR;
+  dst->tile = 0;
+  dst->pitch = 0;
+  dst->offset = 0;
+}
+
+#ifdef IMAGINE_SSE2
+/* Four pixels of stride 3 or 4 as RGBX bytes. Stride 3 reads 16 bytes (5.3 pixels). */
+IMAGINE_API IMAGINE_INLINE __m128i imagine_color_load4(unsigned char *p, unsigned int stride)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+  if (stride == 3)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    v = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0, 0, 0x00FFFFFF)),
+                     _mm_and_si128(_mm_slli_si128(v, 1), _mm_set_epi32(0, 0, 0x00FFFFFF, 0))),
+        _mm_or_si128(_mm_and_si128(_mm_slli_si128(v, 2), _mm_set_epi32(0, 0x00FFFFFF, 0, 0)),
+                     _mm_and_si128(_mm_slli_si128(v, 3), _mm_set_epi32(0x00FFFFFF, 0, 0, 0))));
   }
-  else if (bitCount == 24)
+
+  return v;
+}
+#endif
+
+/* Splits count interleaved pixels of stride 1 to 4 into planes (plane c at
+ * planes + c * plane_size). SSE2 widens 16 pixels to RGBX dwords, then shifts, masks
+ * and packs one channel at a time.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_deinterleave(unsigned char *planes, unsigned int plane_size, unsigned char *in, unsigned int count, unsigned int stride)
+{
+  unsigned int x = 0;
+  unsigned int c;
+
+#ifdef IMAGINE_SSE2
+  if (stride >= 3)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    __m128i mask = _mm_set1_epi32(0xFF);
+
+    /* Stride 3 loads read 4 bytes past the 12 they use */
+    for (; x + (stride == 3 ? 18U : 16U) <= count; x += 16)
+    {
+      __m128i v0 = imagine_color_load4(in + x * stride, stride);
+      __m128i v1 = imagine_color_load4(in + (x + 4) * stride, stride);
+      __m128i v2 = imagine_color_load4(in + (x + 8) * stride, stride);
+      __m128i v3 = imagine_color_load4(in + (x + 12) * stride, stride);
+
+      for (c = 0; c < stride; ++c)
+      {
+        __m128i shift = _mm_cvtsi32_si128((int)(c * 8));
+        __m128i lo = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(v0, shift), mask), _mm_and_si128(_mm_srl_epi32(v1, shift), mask));
+        __m128i hi = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(v2, shift), mask), _mm_and_si128(_mm_srl_epi32(v3, shift), mask));
+
+        _mm_storeu_si128((__m128i *)(planes + c * plane_size + x), _mm_packus_epi16(lo, hi));
+      }
+    }
   }
-  else if (bitCount == 32)
+#endif
+
+  for (; x < count; ++x)
   {
-    img->stride = 4;
-    img->monochrome = 0;
+    for (c = 0; c < stride; ++c)
+    {
+      planes[c * plane_size + x] = in[x * stride + c];
+    }
   }
-  else
+}
+
+/* Inverse of imagine_deinterleave */
+IMAGINE_API IMAGINE_INLINE void imagine_interleave(unsigned char *out, unsigned char *planes, unsigned int plane_size, unsigned int count, unsigned int stride)
+{
+  unsigned int x, c;
+
+  for (x = 0; x < count; ++x)
+  {
+    for (c = 0; c < stride; ++c)
+    {
+      out[x * stride + c] = planes[c * plane_size + x];
+    }
+  }
+}
+
+/* Copies one band of th rows between its linear form and its tiled / Morton form */
+IMAGINE_API IMAGINE_INLINE void imagine_layout_band(unsigned char *linear, unsigned char *tiled, unsigned int width, unsigned int th,
+                                                    unsigned int stride, int layout, unsigned int tile, int to_linear)
+{
+  unsigned int tile_x, x, y, c;
+
+  for (tile_x = 0; tile_x < width; tile_x += tile)
+  {
+    unsigned int tw = width - tile_x < tile ? width - tile_x : tile;
+    unsigned char *t = tiled + tile_x * th * stride;
+
+    for (y = 0; y < th; ++y)
+    {
+      unsigned char *l = linear + (y * width + tile_x) * stride;
+
+      if (layout == IMAGINE_LAYOUT_MORTON && tw == tile && th == tile)
+      {
+        unsigned int my = imagine_morton_spread(y) << 1;
+
+        for (x = 0; x < tw; ++x)
+        {
+          unsigned char *p = t + (imagine_morton_spread(x) | my) * stride;
+
+          for (c = 0; c < stride; ++c)
+          {
+            if (to_linear)
+            {
+              l[x * stride + c] = p[c];
+            }
+            else
+            {
+              p[c] = l[x * stride + c];
+            }
+          }
+        }
+      }
+      else
+      {
+        unsigned char *p = t + y * tw * stride;
+        unsigned int n = tw * stride;
+
+        for (x = 0; x < n; ++x)
+        {
+          if (to_linear)
+          {
+            l[x] = p[x];
+          }
+          else
+          {
+            p[x] = l[x];
+          }
+        }
+      }
+    }
+  }
+}
+
+/* Loader hook after row y was written to imagine_row: splits a staged row into the
+ * planes, or reorders a band of tiles once it is complete (staged in the spare capacity
+ * behind the image).
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_layout_row(imagine *img, unsigned int y)
+{
+  unsigned int band_y, n, i;
+  unsigned char *band;
+  unsigned char *spare;
+
+  if (img->layout == IMAGINE_LAYOUT_PLANAR)
+  {
+    if (img->stride > 1)
+    {
+      imagine_deinterleave(img->pixels + y * img->width, imagine_plane_size(img), img->pixels + img->pixels_size, img->width, img->stride);
+    }
+
+    return;
+  }
+
+  if ((y + 1) % img->tile && y + 1 != img->height)
+  {
+    return;
+  }
+
+  band_y = y - y % img->tile;
+  band = img->pixels + band_y * img->width * img->stride;
+  spare = img->pixels + img->pixels_size;
+  n = (y + 1 - band_y) * img->width * img->stride;
+
+  for (i = 0; i < n; ++i)
+  {
+    spare[i] = band[i];
+  }
+
+  imagine_layout_band(spare, band, img->width, y + 1 - band_y, img->stride, img->layout, img->tile, 0);
+}
+
+#define IMAGINE_LAYOUT_ROWS(img, y) ((img)->layout ? imagine_layout_row((img), (y)) : (void)0)
+
+/* Byte offset of pixel (x, y) in any layout. For planar images it is the offset of the
+ * first channel, channel c follows at c * imagine_plane_size(img).
+ */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_pixel_offset(imagine *img, unsigned int x, unsigned int y)
+{
+  unsigned int shift, band_y, tile_x, tw, th, lx, ly;
+
+  if (img->layout == IMAGINE_LAYOUT_LINEAR)
+  {
+    return img->offset + y * imagine_pitch(img) + x * img->stride;
+  }
+
+  if (img->layout == IMAGINE_LAYOUT_PLANAR)
+  {
+    return y * img->width + x;
+  }
+
+  shift = imagine_layout_shift(img->tile);
+  band_y = (y >> shift) << shift;
+  tile_x = (x >> shift) << shift;
+  th = img->height - band_y < img->tile ? img->height - band_y : img->tile;
+  tw = img->width - tile_x < img->tile ? img->width - tile_x : img->tile;
+  lx = x - tile_x;
+  ly = y - band_y;
+
+  if (img->layout == IMAGINE_LAYOUT_MORTON && tw == img->tile && th == img->tile)
+  {
+    return (band_y * img->width + tile_x * th + (imagine_morton_spread(lx) | (imagine_morton_spread(ly) << 1))) * img->stride;
+  }
+
+  return (band_y * img->width + tile_x * th + ly * tw + lx) * img->stride;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_pixel(imagine *img, unsigned int x, unsigned int y)
+{
+  return img->pixels + imagine_pixel_offset(img, x, y);
+}
+
+/* First pixel of tile (tx, ty) and its size. Rows of tw pixels follow each other, except
+ * for full Morton tiles which are in Z-order.
+ */
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_tile(imagine *img, unsigned int tx, unsigned int ty, unsigned int *tw, unsigned int *th)
+{
+  unsigned int tile_x = tx * img->tile;
+  unsigned int band_y = ty * img->tile;
+
+  if ((img->layout != IMAGINE_LAYOUT_TILED && img->layout != IMAGINE_LAYOUT_MORTON) || tile_x >= img->width || band_y >= img->height)
   {
     return 0;
   }
 
-  img->width = width;
-  img->height = height;
-  img->pixels_size = width * height * img->stride;
+  *tw = img->width - tile_x < img->tile ? img->width - tile_x : img->tile;
+  *th = img->height - band_y < img->tile ? img->height - band_y : img->tile;
+
+  return img->pixels + (band_y * img->width + tile_x * *th) * img->stride;
+}
+
+/* Copies src into dst in layout (tile edge tile, ignored unless tiled or Morton).
+ * One of the two layouts must be linear. dst gets packed rows, a linear src with a
+ * pitch or offset can be copied to linear or planar.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_relayout(imagine *dst, imagine *src, int layout, unsigned int tile)
+{
+  unsigned int band_y, n, i, step, plane_size;
+  int tiles = layout == IMAGINE_LAYOUT_TILED || layout == IMAGINE_LAYOUT_MORTON;
 
-  if (img->pixels_capacity < img->pixels_size)
+  if (!dst || !src || dst == src || !src->pixels || !dst->pixels || layout < IMAGINE_LAYOUT_LINEAR ||
+      layout > IMAGINE_LAYOUT_PLANAR || (tiles && !imagine_layout_shift(tile)))
   {
     return 0;
   }
 
-  dst = img->pixels;
+  /* Tile bands are reordered as whole blocks of packed rows */
+  if (tiles && (src->offset || imagine_pitch(src) != src->width * src->stride))
+  {
+    return 0;
+  }
 
-  /* Row size in file (padded to 4 bytes) */
-  rowSize = ((width * bitCount + 31) / 32) * 4;
+  if (!tiles)
+  {
+    tile = 0;
+  }
 
-  /* BMP stores bottom-up */
-  for (y = 0; y < height; ++y)
+  plane_size = imagine_plane_size(src);
+  n = layout == IMAGINE_LAYOUT_PLANAR ? src->stride * plane_size : src->width * src->height * src->stride;
+
+  if (n > dst->pixels_capacity)
   {
-    unsigned char *row = p + (height - 1 - y) * rowSize;
+    return 0;
+  }
 
-    if (row + rowSize > end)
+  if (src->layout == IMAGINE_LAYOUT_LINEAR && layout == IMAGINE_LAYOUT_LINEAR)
+  {
+    step = src->width * src->stride;
+
+    for (band_y = 0; band_y < src->height; ++band_y)
     {
-      return 0;
+      unsigned char *s = imagine_row(src, band_y);
+      unsigned char *d = dst->pixels + band_y * step;
+
+      for (i = 0; i < step; ++i)
+      {
+        d[i] = s[i];
+      }
+    }
+  }
+  else if (src->layout == layout && src->tile == tile)
+  {
+    for (i = 0; i < n; ++i)
+    {
+      dst->pixels[i] = src->pixels[i];
     }
+  }
+  else if (src->layout == IMAGINE_LAYOUT_PLANAR && layout == IMAGINE_LAYOUT_LINEAR)
+  {
+    step = src->width * src->stride;
 
-    if (bitCount == 1)
+    for (band_y = 0; band_y < src->height; ++band_y)
     {
-      for (x = 0; x < width; ++x)
+      imagine_interleave(dst->pixels + band_y * step, src->pixels + band_y * src->width, plane_size, src->width, src->stride);
+    }
+  }
+  else if (src->layout == IMAGINE_LAYOUT_LINEAR && layout == IMAGINE_LAYOUT_PLANAR)
+  {
+    step = src->width * src->stride;
+
+    for (band_y = 0; band_y < src->height; ++band_y)
+    {
+      imagine_deinterleave(dst->pixels + band_y * src->width, plane_size, imagine_row(src, band_y), src->width, src->stride);
+    }
+  }
+  else if (src->layout != IMAGINE_LAYOUT_PLANAR && (src->layout == IMAGINE_LAYOUT_LINEAR || layout == IMAGINE_LAYOUT_LINEAR))
+  {
+    int to_linear = layout == IMAGINE_LAYOUT_LINEAR;
+    unsigned int band = to_linear ? src->tile : tile;
+
+    IMAGINE_ZONE_BEGIN("imagine_relayout");
+
+    step = src->width * src->stride;
+
+    for (band_y = 0; band_y < src->height; band_y += band)
+    {
+      unsigned int th = src->height - band_y < band ? src->height - band_y : band;
+      unsigned char *s = src->pixels + band_y * step;
+      unsigned char *d = dst->pixels + band_y * step;
+
+      imagine_layout_band(to_linear ? d : s, to_linear ? s : d, src->width, th, src->stride,
+                          to_linear ? src->layout : layout, band, to_linear);
+    }
+
+    IMAGINE_ZONE_END("imagine_relayout");
+  }
+  else
+  {
+    return 0;
+  }
+
+  dst->width = src->width;
+  dst->height = src->height;
+  dst->stride = src->stride;
+  dst->monochrome = src->monochrome;
+  dst->pixels_size = n;
+  dst->layout = layout;
+  dst->tile = tile;
+  dst->pitch = 0;
+  dst->offset = 0;
+
+  return 1;
+}
+
+/* Histogram of an already decoded linear or planar image */
+IMAGINE_API IMAGINE_INLINE int imagine_histogram_compute(imagine_histogram *h, imagine *img)
+{
+  unsigned int c;
+
+  if (!h || !img || !img->pixels)
+  {
+    return 0;
+  }
+
+  imagine_histogram_reset(h);
+
+  if (img->layout == IMAGINE_LAYOUT_PLANAR)
+  {
+    for (c = 0; c < img->stride; ++c)
+    {
+      if (!imagine_histogram_add_plane(h, imagine_plane(img, c), img->width * img->height, c, img->stride))
       {
-        unsigned int byteIndex = x >> 3;
-        unsigned int bitIndex = 7 - (x & 7);
-        unsigned char idx = (row[byteIndex] >> bitIndex) & 1;
+        return 0;
+      }
+    }
+  }
+  else
+  {
+    for (c = 0; c < img->height; ++c)
+    {
+      if (!imagine_histogram_add(h, img->layout == IMAGINE_LAYOUT_LINEAR ? imagine_row(img, c) : img->pixels + c * img->width * img->stride,
+                                 img->width, img->stride))
+      {
+        return 0;
+      }
+    }
+  }
+
+  imagine_histogram_finish(h);
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* HELPERS */
+/* ########################################################################## */
+IMAGINE_API IMAGINE_INLINE unsigned short imagine_read16(const unsigned char *p)
+{
+  return (unsigned short)(p[0] | (p[1] << 8));
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_read32(const unsigned char *p)
+{
+  return (unsigned int)(p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24));
+}
+
+/* ########################################################################## */
+/* NETPBM (P1–P7) */
+/* ########################################################################## */
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_ppm_skip(unsigned char *p, unsigned char *end)
+{
+  while (p < end)
+  {
+    if (*p == '#')
+    {
+      while (p < end && *p != '\n' && *p != '\r')
+        p++;
+    }
+    else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    {
+      p++;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return p;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned char *imagine_ppm_parse_uint(unsigned char *p, unsigned char *end, unsigned int *out)
+{
+  unsigned int v = 0;
+  p = imagine_ppm_skip(p, end);
+
+  while (p < end && *p >= '0' && *p <= '9')
+  {
+    v = v * 10 + (unsigned int)(*p - '0');
+    p++;
+  }
+
+  *out = v;
+  return p;
+}
+
+IMAGINE_API int imagine_load_netpbm(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned char *p, *end, fmt;
+  unsigned int w, h, maxval;
+
+  IMAGINE_STATS_BEGIN(img, "netpbm");
+  IMAGINE_HISTOGRAM_BEGIN(img);
+
+  if (size < 2 || buffer[0] != 'P')
+  {
+    return 0;
+  }
+
+  fmt = buffer[1];
+  p = buffer + 2;
+  end = buffer + size;
+
+  p = imagine_ppm_parse_uint(p, end, &w);
+  p = imagine_ppm_parse_uint(p, end, &h);
+
+  if (w == 0 || h == 0)
+  {
+    return 0;
+  }
+
+  maxval = 1;
+  if (fmt != '1' && fmt != '4')
+  {
+    p = imagine_ppm_parse_uint(p, end, &maxval);
+
+    if (maxval == 0)
+    {
+      return 0;
+    }
+  }
+
+  img->width = w;
+  img->height = h;
+  img->monochrome = (fmt == '1' || fmt == '4' || fmt == '2' || fmt == '5');
+  img->stride = img->monochrome ? 1 : 3;
+  img->pixels_size = w * h * img->stride;
+
+  if (!imagine_layout_prepare(img))
+  {
+    return 0;
+  }
+
+  IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PIXELS);
+  IMAGINE_STATS_PATH(img, (fmt >= '1' && fmt <= '3') ? IMAGINE_PATH_ASCII : 0);
+  IMAGINE_STATS_PATH(img, fmt == '4' ? IMAGINE_PATH_PACKED : 0);
+  IMAGINE_STATS_PATH(img, fmt == '2' || fmt == '3' || fmt == '5' || fmt == '6' ? IMAGINE_PATH_RESCALE : 0);
+  IMAGINE_ZONE_BEGIN("netpbm_pixels");
+
+  /* ASCII P1 (bitmap 0/1) */
+  if (fmt == '1')
+  {
+    unsigned int x, y;
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = imagine_row(img, y);
+
+      for (x = 0; x < w; ++x)
+      {
+        unsigned int bit;
+        p = imagine_ppm_parse_uint(p, end, &bit);
+        row[x] = (unsigned char)(bit ? 0 : 255);
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+  /* Binary P4 (bitmap packed bits) */
+  else if (fmt == '4')
+  {
+    unsigned int x, y;
+    unsigned int rowbytes = (w + 7) / 8;
+
+    p = imagine_ppm_skip(p, end); /* move to pixel data */
+
+    if ((unsigned int)(end - p) < rowbytes * h)
+    {
+      IMAGINE_STATS_PROGRESS(img, p - buffer, 0);
+      IMAGINE_STATS_END(img);
+      IMAGINE_ZONE_END("netpbm_pixels");
+      return 0; /* not enough data */
+    }
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = p + y * rowbytes;
+      unsigned char *out = imagine_row(img, y);
+
+      for (x = 0; x < w; ++x)
+      {
+        unsigned int byte = row[x >> 3];
+        unsigned int bit = (byte >> (7 - (x & 7))) & 1;
+
+        out[x] = (unsigned char)(bit ? 0 : 255);
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+
+    p += rowbytes * h;
+  }
+  /* ASCII grayscale P2 */
+  else if (fmt == '2')
+  {
+    unsigned int x, y;
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = imagine_row(img, y);
+
+      for (x = 0; x < w; ++x)
+      {
+        unsigned int v;
+        p = imagine_ppm_parse_uint(p, end, &v);
+        row[x] = (unsigned char)((255U * v) / maxval);
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+  /* Binary grayscale P5 */
+  else if (fmt == '5')
+  {
+    unsigned int x, y;
+
+    p = imagine_ppm_skip(p, end);
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = imagine_row(img, y);
+
+      if ((unsigned int)(end - p) < w)
+      {
+        IMAGINE_STATS_PROGRESS(img, p - buffer, y);
+        IMAGINE_STATS_END(img);
+        IMAGINE_ZONE_END("netpbm_pixels");
+        return 0;
+      }
+
+      for (x = 0; x < w; ++x)
+      {
+        row[x] = (unsigned char)((255U * p[x]) / maxval);
+      }
+
+      p += w;
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+  /* ASCII RGB P3 */
+  else if (fmt == '3')
+  {
+    unsigned int x, y;
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = imagine_row(img, y);
+
+      for (x = 0; x < w; ++x)
+      {
+        unsigned int r, g, b;
+
+        p = imagine_ppm_parse_uint(p, end, &r);
+        p = imagine_ppm_parse_uint(p, end, &g);
+        p = imagine_ppm_parse_uint(p, end, &b);
+
+        row[x * 3 + 0] = (unsigned char)((255U * r) / maxval);
+        row[x * 3 + 1] = (unsigned char)((255U * g) / maxval);
+        row[x * 3 + 2] = (unsigned char)((255U * b) / maxval);
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+  /* Binary RGB P6 */
+  else if (fmt == '6')
+  {
+    unsigned int x, y;
+
+    p = imagine_ppm_skip(p, end);
+
+    for (y = 0; y < h; ++y)
+    {
+      unsigned char *row = imagine_row(img, y);
+
+      if ((unsigned int)(end - p) < w * 3)
+      {
+        IMAGINE_STATS_PROGRESS(img, p - buffer, y);
+        IMAGINE_STATS_END(img);
+        IMAGINE_ZONE_END("netpbm_pixels");
+        return 0;
+      }
+
+      for (x = 0; x < w; ++x)
+      {
+        row[x * 3 + 0] = (unsigned char)((255U * p[0]) / maxval);
+        row[x * 3 + 1] = (unsigned char)((255U * p[1]) / maxval);
+        row[x * 3 + 2] = (unsigned char)((255U * p[2]) / maxval);
+
+        p += 3;
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+  /* PAM P7 (partial: only RGB/GRAYSCALE with DEPTH 1/3/4) */
+  else if (fmt == '7')
+  {
+    /* Not fully implemented: header parsing required */
+    IMAGINE_STATS_END(img);
+    IMAGINE_ZONE_END("netpbm_pixels");
+    return 0;
+  }
+  else
+  {
+    IMAGINE_STATS_END(img);
+    IMAGINE_ZONE_END("netpbm_pixels");
+    return 0;
+  }
+
+  IMAGINE_STATS_PROGRESS(img, p - buffer, h);
+  IMAGINE_STATS_END(img);
+  IMAGINE_HISTOGRAM_END(img);
+  IMAGINE_ZONE_END("netpbm_pixels");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* BMP LOADER (1,4,8,16,24,32-bit, BI_RGB only)                               */
+/* ########################################################################## */
+IMAGINE_API int imagine_load_bmp(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned int bfOffBits, width, height, planes, bitCount, compression;
+  unsigned int clrUsed;
+  unsigned char *p, *end, *dst;
+  unsigned int x, y, rowSize;
+  unsigned int paletteEntries, b, g, r, a;
+  unsigned char *palette;
+
+  IMAGINE_STATS_BEGIN(img, "bmp");
+  IMAGINE_HISTOGRAM_BEGIN(img);
+
+  if (size < 54 || buffer[0] != 'B' || buffer[1] != 'M')
+  {
+    return 0;
+  }
+
+  bfOffBits = imagine_read32(buffer + 10);
+  width = imagine_read32(buffer + 18);
+  height = imagine_read32(buffer + 22);
+  planes = imagine_read16(buffer + 26);
+  bitCount = imagine_read16(buffer + 28);
+  compression = imagine_read32(buffer + 30);
+  clrUsed = imagine_read32(buffer + 46);
+
+  if (planes != 1 || compression != 0 || width == 0 || height == 0)
+  {
+    return 0;
+  }
+
+  p = buffer + bfOffBits;
+  end = buffer + size;
+
+  /* Determine palette size */
+  paletteEntries = 0;
+
+  if (bitCount <= 8)
+  {
+    paletteEntries = clrUsed;
+
+    if (paletteEntries == 0)
+    {
+      paletteEntries = 1U << bitCount;
+    }
+
+    if (size < 54 + paletteEntries * 4)
+    {
+      return 0;
+    }
+
+    palette = buffer + 54;
+  }
+  else
+  {
+    palette = 0;
+  }
+
+  /* Choose stride and format */
+  if (bitCount == 1 || bitCount == 4 || bitCount == 8)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bitCount == 16)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bitCount == 24)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bitCount == 32)
+  {
+    img->stride = 4;
+    img->monochrome = 0;
+  }
+  else
+  {
+    return 0;
+  }
+
+  img->width = width;
+  img->height = height;
+  img->pixels_size = width * height * img->stride;
+
+  if (!imagine_layout_prepare(img))
+  {
+    return 0;
+  }
+
+  /* Row size in file (padded to 4 bytes) */
+  rowSize = ((width * bitCount + 31) / 32) * 4;
+
+  IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PIXELS);
+  IMAGINE_STATS_PATH(img, IMAGINE_PATH_BOTTOM_UP);
+  IMAGINE_STATS_PATH(img, bitCount < 8 ? IMAGINE_PATH_PACKED : 0);
+  IMAGINE_STATS_PATH(img, bitCount <= 8 ? IMAGINE_PATH_PALETTE : 0);
+  IMAGINE_STATS_PATH(img, bitCount == 16 ? IMAGINE_PATH_RESCALE : 0);
+  IMAGINE_STATS_PATH(img, bitCount >= 24 ? IMAGINE_PATH_SWIZZLE : 0);
+  IMAGINE_ZONE_BEGIN("bmp_pixels");
+
+  /* BMP stores bottom-up */
+  for (y = 0; y < height; ++y)
+  {
+    unsigned char *row = p + (height - 1 - y) * rowSize;
+
+    dst = imagine_row(img, y);
+
+    if (row + rowSize > end)
+    {
+      IMAGINE_STATS_PROGRESS(img, bfOffBits + y * rowSize, y);
+      IMAGINE_STATS_END(img);
+      IMAGINE_ZONE_END("bmp_pixels");
+      return 0;
+    }
+
+    if (bitCount == 1)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        unsigned int byteIndex = x >> 3;
+        unsigned int bitIndex = 7 - (x & 7);
+        unsigned char idx = (row[byteIndex] >> bitIndex) & 1;
+
+        b = palette[idx * 4 + 0];
+        g = palette[idx * 4 + 1];
+        r = palette[idx * 4 + 2];
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+      }
+    }
+    else if (bitCount == 4)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        unsigned int byteIndex = x >> 1;
+        unsigned char idx;
+
+        if ((x & 1) == 0)
+        {
+          idx = (row[byteIndex] >> 4) & 0xF;
+        }
+        else
+        {
+          idx = row[byteIndex] & 0xF;
+        }
+
+        b = palette[idx * 4 + 0];
+        g = palette[idx * 4 + 1];
+        r = palette[idx * 4 + 2];
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+      }
+    }
+    else if (bitCount == 8)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        unsigned char idx = row[x];
+
+        if (idx >= paletteEntries)
+        {
+          idx = 0;
+        }
+
+        b = palette[idx * 4 + 0];
+        g = palette[idx * 4 + 1];
+        r = palette[idx * 4 + 2];
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+      }
+    }
+    else if (bitCount == 16)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        unsigned short px = (unsigned short)(row[x * 2] | (row[x * 2 + 1] << 8));
+
+        r = (px >> 10) & 0x1F;
+        g = (px >> 5) & 0x1F;
+        b = (px >> 0) & 0x1F;
+        r = (r * 255) / 31;
+        g = (g * 255) / 31;
+        b = (b * 255) / 31;
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+      }
+    }
+    else if (bitCount == 24)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        b = row[x * 3 + 0];
+        g = row[x * 3 + 1];
+        r = row[x * 3 + 2];
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+      }
+    }
+    else if (bitCount == 32)
+    {
+      for (x = 0; x < width; ++x)
+      {
+        b = row[x * 4 + 0];
+        g = row[x * 4 + 1];
+        r = row[x * 4 + 2];
+        a = row[x * 4 + 3];
+
+        *dst++ = (unsigned char)r;
+        *dst++ = (unsigned char)g;
+        *dst++ = (unsigned char)b;
+        *dst++ = (unsigned char)a; /* keep alpha */
+      }
+    }
+
+    IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+    IMAGINE_LAYOUT_ROWS(img, y);
+  }
+
+  IMAGINE_STATS_PROGRESS(img, bfOffBits + height * rowSize, height);
+  IMAGINE_STATS_END(img);
+  IMAGINE_HISTOGRAM_END(img);
+  IMAGINE_ZONE_END("bmp_pixels");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* TGA LOADER (uncompressed RGB/gray) */
+/* ########################################################################## */
+IMAGINE_API int imagine_load_tga(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned char idlen, type, bpp;
+  unsigned int w, h;
+  unsigned char *src;
+  unsigned char *dst;
+  unsigned int x, y;
+
+  IMAGINE_STATS_BEGIN(img, "tga");
+  IMAGINE_HISTOGRAM_BEGIN(img);
+
+  if (size < 18)
+  {
+    return 0;
+  }
+
+  idlen = buffer[0];
+  type = buffer[2];
+
+  w = imagine_read16(buffer + 12);
+  h = imagine_read16(buffer + 14);
+
+  bpp = buffer[16];
+
+  if (w == 0 || h == 0)
+  {
+    return 0;
+  }
+
+  if (!(type == 2 || type == 3))
+  {
+    return 0;
+  }
+
+  if (bpp == 8)
+  {
+    img->stride = 1;
+    img->monochrome = 1;
+  }
+  else if (bpp == 24)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bpp == 32)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else
+  {
+    return 0;
+  }
+
+  img->width = w;
+  img->height = h;
+  img->pixels_size = w * h * img->stride;
+
+  if (!imagine_layout_prepare(img))
+  {
+    return 0;
+  }
+
+  src = buffer + 18 + idlen;
+
+  IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PIXELS);
+  IMAGINE_STATS_PATH(img, bpp == 8 ? IMAGINE_PATH_COPY : IMAGINE_PATH_SWIZZLE);
+  IMAGINE_STATS_PATH(img, bpp == 32 ? IMAGINE_PATH_DROP_ALPHA : 0);
+  IMAGINE_ZONE_BEGIN("tga_pixels");
+
+  for (y = 0; y < h; ++y)
+  {
+    dst = imagine_row(img, y);
+
+    for (x = 0; x < w; ++x)
+    {
+      if (bpp == 8)
+      {
+        *dst++ = *src++;
+      }
+      else if (bpp == 24)
+      {
+        unsigned char b = *src++;
+        unsigned char g = *src++;
+        unsigned char r = *src++;
+
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+      }
+      else if (bpp == 32)
+      {
+        unsigned char b = *src++;
+        unsigned char g = *src++;
+        unsigned char r = *src++;
+
+        src++; /* skip alpha */
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+      }
+    }
+
+    IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+    IMAGINE_LAYOUT_ROWS(img, y);
+  }
+
+  IMAGINE_STATS_PROGRESS(img, src - buffer, h);
+  IMAGINE_STATS_END(img);
+  IMAGINE_HISTOGRAM_END(img);
+  IMAGINE_ZONE_END("tga_pixels");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* PCX LOADER (RLE, 8-bit or 24-bit) */
+/* ########################################################################## */
+IMAGINE_API int imagine_load_pcx(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned char bpp, planes;
+  unsigned short xmin, ymin, xmax, ymax, w, h, bytes_per_line;
+  unsigned char *src, *end, *dst;
+  unsigned int y, p, step;
+
+  IMAGINE_STATS_BEGIN(img, "pcx");
+  IMAGINE_HISTOGRAM_BEGIN(img);
+
+  if (size < 128 || buffer[0] != 0x0A)
+  {
+    return 0;
+  }
+
+  bpp = buffer[3];
+  xmin = imagine_read16(buffer + 4);
+  ymin = imagine_read16(buffer + 6);
+  xmax = imagine_read16(buffer + 8);
+  ymax = imagine_read16(buffer + 10);
+  w = (unsigned short)(xmax - xmin + 1);
+  h = (unsigned short)(ymax - ymin + 1);
+  planes = buffer[65];
+  bytes_per_line = imagine_read16(buffer + 66);
+
+  if (w == 0 || h == 0)
+  {
+    return 0;
+  }
+
+  if (planes == 1 && bpp == 8)
+  {
+    img->stride = 1;
+    img->monochrome = 1;
+  }
+  else if (planes == 3 && bpp == 8)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else
+  {
+    return 0;
+  }
+
+  img->width = w;
+  img->height = h;
+  img->pixels_size = w * h * img->stride;
+
+  if (!imagine_layout_prepare(img))
+  {
+    return 0;
+  }
+
+  src = buffer + 128;
+  end = buffer + size;
+
+  /* The file stores one plane per scanline, planar output takes it as is */
+  step = img->layout == IMAGINE_LAYOUT_PLANAR ? 1U : img->stride;
+
+  IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PIXELS);
+  IMAGINE_STATS_PATH(img, IMAGINE_PATH_RLE);
+  IMAGINE_ZONE_BEGIN("pcx_rle");
+
+  for (y = 0; y < h; ++y)
+  {
+    for (p = 0; p < planes; ++p)
+    {
+      unsigned int filled = 0;
+
+      dst = img->layout == IMAGINE_LAYOUT_PLANAR ? img->pixels + p * imagine_plane_size(img) + y * w : imagine_row(img, y) + p;
+
+      while (filled < bytes_per_line && src < end)
+      {
+        unsigned char c = *src++;
+
+        if ((c & 0xC0) == 0xC0)
+        {
+          unsigned int run = c & 0x3F;
+          unsigned char val;
+
+          if (src >= end)
+          {
+            IMAGINE_STATS_PROGRESS(img, src - buffer, y);
+            IMAGINE_STATS_END(img);
+            IMAGINE_ZONE_END("pcx_rle");
+            return 0;
+          }
+
+          val = *src++;
+          while (run-- && filled < bytes_per_line)
+          {
+            if (p < img->stride && filled < w)
+            {
+              dst[filled * step] = val;
+            }
+
+            filled++;
+          }
+        }
+        else
+        {
+          if (p < img->stride && filled < w)
+          {
+            dst[filled * step] = c;
+          }
+
+          filled++;
+        }
+      }
+
+      if (planes == 3 && step == 1)
+      {
+        IMAGINE_HISTOGRAM_PLANE(img, p, dst);
+      }
+    }
+
+    /* Gray rows are counted after the palette pass */
+    if (planes == 3 && step != 1)
+    {
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+  }
+
+  IMAGINE_STATS_PROGRESS(img, src - buffer, h);
+  IMAGINE_ZONE_END("pcx_rle");
+
+  if (planes == 1 && bpp == 8)
+  {
+    unsigned char *pal;
+    unsigned char lut[256];
+    unsigned int i;
+
+    IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PALETTE);
+
+    if (size < 769)
+    {
+      IMAGINE_STATS_END(img);
+      return 0;
+    }
+
+    pal = buffer + size - 769;
+
+    if (*pal != 0x0C)
+    {
+      IMAGINE_STATS_END(img);
+      return 0;
+    }
+
+    pal++;
+
+    IMAGINE_STATS_PATH(img, IMAGINE_PATH_PALETTE);
+    IMAGINE_STATS_PROGRESS(img, size, h);
+    IMAGINE_ZONE_BEGIN("pcx_palette");
+
+    for (i = 0; i < 256; ++i)
+    {
+      unsigned char r = pal[i * 3 + 0];
+      unsigned char g = pal[i * 3 + 1];
+      unsigned char b = pal[i * 3 + 2];
+
+      lut[i] = (unsigned char)((r + g + b) / 3);
+    }
+
+    for (y = 0; y < h; ++y)
+    {
+      dst = imagine_row(img, y);
+
+      for (i = 0; i < w; ++i)
+      {
+        dst[i] = lut[dst[i]];
+      }
+
+      IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+      IMAGINE_LAYOUT_ROWS(img, y);
+    }
+
+    IMAGINE_ZONE_END("pcx_palette");
+  }
+
+  IMAGINE_STATS_END(img);
+  IMAGINE_HISTOGRAM_END(img);
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* ICO LOADER (BMP only) */
+/* ########################################################################## */
+IMAGINE_API int imagine_load_ico(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned short reserved, type, count;
+  unsigned int offset;
+  int result;
+
+  IMAGINE_STATS_BEGIN(img, "ico");
+
+  if (size < 6)
+  {
+    return 0;
+  }
+
+  reserved = imagine_read16(buffer);
+  type = imagine_read16(buffer + 2);
+  count = imagine_read16(buffer + 4);
+
+  if (reserved != 0 || type != 1 || count < 1 || size < 22)
+  {
+    return 0;
+  }
+
+  offset = imagine_read32(buffer + 18);
+
+  if (offset >= size)
+  {
+    return 0;
+  }
+
+  if (buffer[offset] == 0x89 && buffer[offset + 1] == 'P')
+  {
+    return 0;
+  }
+
+  result = imagine_load_bmp(img, buffer + offset, size - offset);
+
+  IMAGINE_STATS_CONTAINER(img, "ico", offset);
+
+  return result;
+}
+
+/* ########################################################################## */
+/* DDS LOADER (raw RGB/gray, no compression) */
+/* ########################################################################## */
+IMAGINE_API int imagine_load_dds(imagine *img, unsigned char *buffer, unsigned int size)
+{
+  unsigned int h, w, pf_size, fourcc, bpp;
+  unsigned char *src, *end, *dst;
+  unsigned int x, y;
+
+  IMAGINE_STATS_BEGIN(img, "dds");
+  IMAGINE_HISTOGRAM_BEGIN(img);
+
+  if (size < 128 || !(buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' '))
+  {
+    return 0;
+  }
+
+  h = imagine_read32(buffer + 12);
+  w = imagine_read32(buffer + 16);
+  pf_size = imagine_read32(buffer + 76);
+  fourcc = imagine_read32(buffer + 84);
+  bpp = imagine_read32(buffer + 88);
+
+  if (w == 0 || h == 0 || pf_size != 32 || fourcc != 0)
+  {
+    return 0;
+  }
+
+  if (bpp == 24)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bpp == 32)
+  {
+    img->stride = 3;
+    img->monochrome = 0;
+  }
+  else if (bpp == 8)
+  {
+    img->stride = 1;
+    img->monochrome = 1;
+  }
+  else
+  {
+    return 0;
+  }
+
+  img->width = w;
+  img->height = h;
+  img->pixels_size = w * h * img->stride;
+
+  if (!imagine_layout_prepare(img))
+  {
+    return 0;
+  }
+
+  src = buffer + 128;
+  end = buffer + size;
+
+  if ((unsigned int)(end - src) < w * h * img->stride)
+  {
+    return 0;
+  }
+
+  IMAGINE_STATS_STAGE(img, IMAGINE_STAGE_PIXELS);
+  IMAGINE_STATS_PATH(img, bpp == 8 ? IMAGINE_PATH_COPY : IMAGINE_PATH_SWIZZLE);
+  IMAGINE_STATS_PATH(img, bpp == 32 ? IMAGINE_PATH_DROP_ALPHA : 0);
+  IMAGINE_ZONE_BEGIN("dds_pixels");
+
+  for (y = 0; y < h; ++y)
+  {
+    dst = imagine_row(img, y);
+
+    for (x = 0; x < w; ++x)
+    {
+      if (bpp == 24)
+      {
+        unsigned char b = *src++, g = *src++, r = *src++;
+
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+      }
+      else if (bpp == 32)
+      {
+        unsigned char b = *src++, g = *src++, r = *src++;
+
+        src++;
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+      }
+      else if (bpp == 8)
+      {
+        *dst++ = *src++;
+      }
+    }
+
+    IMAGINE_HISTOGRAM_ROWS(img, y, 1);
+    IMAGINE_LAYOUT_ROWS(img, y);
+  }
+
+  IMAGINE_STATS_PROGRESS(img, src - buffer, h);
+  IMAGINE_STATS_END(img);
+  IMAGINE_HISTOGRAM_END(img);
+  IMAGINE_ZONE_END("dds_pixels");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* DISPATCHER */
+/* ########################################################################## */
+IMAGINE_API IMAGINE_INLINE int imagine_load(imagine *img, unsigned char *buf, unsigned int size)
+{
+  int result = 0;
+
+  IMAGINE_ZONE_BEGIN("imagine_load");
+  IMAGINE_STATS_BEGIN(img, 0);
+
+  if (size >= 2 && buf[0] == 'P' && buf[1] >= '1' && buf[1] <= '7')
+  {
+    result = imagine_load_netpbm(img, buf, size); /* P7 (PAM) partial */
+  }
+  else if (size >= 2 && buf[0] == 'B' && buf[1] == 'M')
+  {
+    result = imagine_load_bmp(img, buf, size);
+  }
+  else if (size >= 18 && (buf[2] == 2 || buf[2] == 3))
+  {
+    result = imagine_load_tga(img, buf, size);
+  }
+  else if (size >= 4 && buf[0] == 0x0A)
+  {
+    result = imagine_load_pcx(img, buf, size);
+  }
+  else if (size >= 4 && buf[0] == 'D' && buf[1] == 'D' && buf[2] == 'S')
+  {
+    result = imagine_load_dds(img, buf, size);
+  }
+  else if (size >= 6 && imagine_read16(buf + 2) == 1)
+  {
+    result = imagine_load_ico(img, buf, size);
+  }
+
+  /* Closes the stage timing of loaders that failed during header parsing */
+  IMAGINE_STATS_END(img);
+  IMAGINE_ZONE_END("imagine_load");
+
+  return result;
+}
+
+/* ########################################################################## */
+/* RESIZE */
+/* ########################################################################## */
+/* Separable resampling of a decoded image into another imagine buffer:
+ *
+ *   unsigned int size = imagine_resize_scratch_size(&src, 320, 240, IMAGINE_FILTER_LANCZOS);
+ *   ... provide size bytes of scratch ...
+ *   imagine_resize(&dst, &src, 320, 240, IMAGINE_FILTER_LANCZOS, scratch, size);
+ *
+ * Weights are precomputed per axis in Q14 fixed point (every window sums to exactly
+ * 1 << 14, so flat areas stay flat). Rows are filtered horizontally on demand into a
+ * ring of taps_y rows of 16 bit samples (Q6) and the vertical pass reads from that ring,
+ * so the intermediate never holds more than one filter window of rows. When downscaling
+ * the filter is widened by the scale factor (box becomes an area average).
+ *
+ * Works for stride 1, 3 and 4, dst->pixels is provided by the caller. The SSE2 passes
+ * produce the same bytes as the scalar ones.
+ */
+#define IMAGINE_FILTER_BOX 0      /* radius 0.5, nearest when upscaling, area average when downscaling */
+#define IMAGINE_FILTER_BILINEAR 1 /* radius 1, triangle */
+#define IMAGINE_FILTER_BICUBIC 2  /* radius 2, Catmull-Rom (a = -0.5) */
+#define IMAGINE_FILTER_LANCZOS 3  /* radius 3, windowed sinc */
+
+#define IMAGINE_RESIZE_WEIGHT_BITS 14
+#define IMAGINE_RESIZE_ROW_BITS 6 /* fraction bits kept between the two passes */
+
+IMAGINE_API IMAGINE_INLINE int imagine_floor(double x)
+{
+  int i = (int)x;
+  return ((double)i > x) ? i - 1 : i;
+}
+
+IMAGINE_API IMAGINE_INLINE int imagine_ceil(double x)
+{
+  int i = (int)x;
+  return ((double)i < x) ? i + 1 : i;
+}
+
+IMAGINE_API IMAGINE_INLINE double imagine_sin(double x)
+{
+  double pi = 3.14159265358979323846;
+  double x2;
+
+  /* Reduce to [-pi/2, pi/2], then Taylor series up to x^11 (error < 1e-8) */
+  x -= 2.0 * pi * (double)imagine_floor(x / (2.0 * pi) + 0.5);
+
+  if (x > 0.5 * pi)
+  {
+    x = pi - x;
+  }
+  else if (x < -0.5 * pi)
+  {
+    x = -pi - x;
+  }
+
+  x2 = x * x;
+
+  return x * (1.0 - x2 / 6.0 * (1.0 - x2 / 20.0 * (1.0 - x2 / 42.0 * (1.0 - x2 / 72.0 * (1.0 - x2 / 110.0)))));
+}
+
+IMAGINE_API IMAGINE_INLINE double imagine_filter_radius(int filter)
+{
+  switch (filter)
+  {
+  case IMAGINE_FILTER_BOX:
+    return 0.5;
+  case IMAGINE_FILTER_BILINEAR:
+    return 1.0;
+  case IMAGINE_FILTER_BICUBIC:
+    return 2.0;
+  case IMAGINE_FILTER_LANCZOS:
+    return 3.0;
+  default:
+    return 0.0;
+  }
+}
+
+IMAGINE_API IMAGINE_INLINE double imagine_filter_eval(int filter, double x)
+{
+  double pi = 3.14159265358979323846;
+
+  if (x < 0.0)
+  {
+    x = -x;
+  }
+
+  switch (filter)
+  {
+  case IMAGINE_FILTER_BOX:
+    return x < 0.5 ? 1.0 : 0.0;
+  case IMAGINE_FILTER_BILINEAR:
+    return x < 1.0 ? 1.0 - x : 0.0;
+  case IMAGINE_FILTER_BICUBIC:
+    if (x < 1.0)
+    {
+      return (1.5 * x - 2.5) * x * x + 1.0;
+    }
+    return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+  case IMAGINE_FILTER_LANCZOS:
+    if (x < 1e-8)
+    {
+      return 1.0;
+    }
+    return x < 3.0 ? 3.0 * imagine_sin(pi * x) * imagine_sin(pi * x / 3.0) / (pi * pi * x * x) : 0.0;
+  default:
+    return 0.0;
+  }
+}
+
+/* Samples read per output sample along one axis */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_resize_taps(unsigned int src_len, unsigned int dst_len, int filter)
+{
+  double scale = (double)dst_len / (double)src_len;
+  double support = imagine_filter_radius(filter) / (scale < 1.0 ? scale : 1.0);
+  unsigned int taps = (unsigned int)(2.0 * support) + 1;
+
+  return taps < src_len ? taps : src_len;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_resize_align(unsigned int size)
+{
+  return (size + 15u) & ~15u;
+}
+
+/* Weight tables and row ring of a separable pass, shared by resize and the filters */
+typedef struct imagine_separable
+{
+  unsigned int taps_x;
+  unsigned int taps_y;
+  int *starts_x; /* first source column per output column */
+  short *weights_x;
+  int *starts_y; /* first source row per output row */
+  short *weights_y;
+  short *ring; /* taps_y horizontally filtered rows */
+  short **rows;
+
+} imagine_separable;
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_separable_scratch_size(unsigned int width, unsigned int height, unsigned int stride, unsigned int taps_x, unsigned int taps_y)
+{
+  return 15u + /* pointer alignment */
+         imagine_resize_align(width * (unsigned int)sizeof(int)) +
+         imagine_resize_align(width * taps_x * (unsigned int)sizeof(short)) +
+         imagine_resize_align(height * (unsigned int)sizeof(int)) +
+         imagine_resize_align(height * taps_y * (unsigned int)sizeof(short)) +
+         imagine_resize_align(taps_y * width * stride * (unsigned int)sizeof(short)) +
+         imagine_resize_align(taps_y * (unsigned int)sizeof(short *));
+}
+
+/* Carves the scratch into 16 byte aligned tables, sep->taps_x/y must be set */
+IMAGINE_API IMAGINE_INLINE void imagine_separable_carve(imagine_separable *sep, unsigned char *scratch, unsigned int width, unsigned int height, unsigned int stride)
+{
+  unsigned char *p = scratch + ((16u - (unsigned int)((unsigned long)scratch & 15u)) & 15u);
+
+  sep->starts_x = (int *)(void *)p;
+  p += imagine_resize_align(width * (unsigned int)sizeof(int));
+  sep->weights_x = (short *)(void *)p;
+  p += imagine_resize_align(width * sep->taps_x * (unsigned int)sizeof(short));
+  sep->starts_y = (int *)(void *)p;
+  p += imagine_resize_align(height * (unsigned int)sizeof(int));
+  sep->weights_y = (short *)(void *)p;
+  p += imagine_resize_align(height * sep->taps_y * (unsigned int)sizeof(short));
+  sep->ring = (short *)(void *)p;
+  p += imagine_resize_align(sep->taps_y * width * stride * (unsigned int)sizeof(short));
+  sep->rows = (short **)(void *)p;
+}
+
+/* Bytes of scratch needed by imagine_resize, 0 for invalid arguments */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_resize_scratch_size(imagine *src, unsigned int width, unsigned int height, int filter)
+{
+  unsigned int taps_x;
+  unsigned int taps_y;
+
+  if (!src || !src->width || !src->height || !width || !height || imagine_filter_radius(filter) <= 0.0 ||
+      (src->stride != 1 && src->stride != 3 && src->stride != 4))
+  {
+    return 0;
+  }
+
+  taps_x = imagine_resize_taps(src->width, width, filter);
+  taps_y = imagine_resize_taps(src->height, height, filter);
+
+  return imagine_separable_scratch_size(width, height, src->stride, taps_x, taps_y);
+}
+
+/* Fills the first source index and taps Q14 weights of every output sample. Samples
+ * outside the source are clamped to the edge, their weight folds onto the edge sample.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_resize_weights(unsigned int src_len, unsigned int dst_len, int filter, unsigned int taps, int *starts, short *weights)
+{
+  double scale = (double)dst_len / (double)src_len;
+  double filter_scale = scale < 1.0 ? scale : 1.0;
+  double support = imagine_filter_radius(filter) / filter_scale;
+  int window = (int)(2.0 * support) + 1;
+  int last = (int)src_len - 1;
+  unsigned int i;
+
+  for (i = 0; i < dst_len; ++i)
+  {
+    double center = ((double)i + 0.5) / scale - 0.5;
+    double total = 0.0;
+    short *w = weights + i * taps;
+    int lo = imagine_ceil(center - support);
+    int hi = imagine_floor(center + support);
+    int start = lo;
+    int sum = 0;
+    int max = 0;
+    int j;
+    unsigned int k;
+
+    if (hi - lo + 1 > window)
+    {
+      hi = lo + window - 1;
+    }
+
+    if (start > (int)src_len - (int)taps)
+    {
+      start = (int)src_len - (int)taps;
+    }
+
+    if (start < 0)
+    {
+      start = 0;
+    }
+
+    starts[i] = start;
+
+    for (k = 0; k < taps; ++k)
+    {
+      w[k] = 0;
+    }
+
+    for (j = lo; j <= hi; ++j)
+    {
+      total += imagine_filter_eval(filter, ((double)j - center) * filter_scale);
+    }
+
+    if (total > -1e-8 && total < 1e-8)
+    {
+      /* Degenerate window, fall back to the nearest sample */
+      j = imagine_floor(center + 0.5);
+      j = j < 0 ? 0 : (j > last ? last : j);
+      w[j - start] = (short)(1 << IMAGINE_RESIZE_WEIGHT_BITS);
+      continue;
+    }
+
+    for (j = lo; j <= hi; ++j)
+    {
+      double q = imagine_filter_eval(filter, ((double)j - center) * filter_scale) / total * (double)(1 << IMAGINE_RESIZE_WEIGHT_BITS);
+      int clamped = j < 0 ? 0 : (j > last ? last : j);
+
+      w[clamped - start] = (short)(w[clamped - start] + (q < 0.0 ? -(int)(0.5 - q) : (int)(q + 0.5)));
+    }
+
+    /* Rounding error goes to the largest weight so every window sums to exactly 1.0 */
+    for (k = 0; k < taps; ++k)
+    {
+      sum += w[k];
+
+      if (w[k] > w[max])
+      {
+        max = (int)k;
+      }
+    }
+
+    w[max] = (short)(w[max] + (1 << IMAGINE_RESIZE_WEIGHT_BITS) - sum);
+  }
+}
+
+/* One source row into width * stride Q6 samples */
+IMAGINE_API IMAGINE_INLINE void imagine_resize_row_h(short *out, unsigned char *row, unsigned int width, unsigned int stride, unsigned int taps, int *starts, short *weights)
+{
+  unsigned int x;
+  unsigned int c;
+  unsigned int k;
+  int shift = IMAGINE_RESIZE_WEIGHT_BITS - IMAGINE_RESIZE_ROW_BITS;
+
+#ifdef IMAGINE_SSE2
+  if (stride == 4)
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+
+    for (x = 0; x < width; ++x)
+    {
+      unsigned char *p = row + (unsigned int)starts[x] * 4;
+      short *w = weights + x * taps;
+      __m128i acc = _mm_setzero_si128();
+
+      /* Two pixels per madd: (a.c, b.c) pairs against (w0, w1) */
+      for (k = 0; k + 1 < taps; k += 2)
+      {
+        __m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + k * 4)), zero);
+        __m128i wk = _mm_set1_epi32((int)(((unsigned int)(unsigned short)w[k + 1] << 16) | (unsigned short)w[k]));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(px, _mm_srli_si128(px, 8)), wk));
+      }
+
+      if (k < taps)
+      {
+        unsigned char *q = p + k * 4;
+        int packed = (int)((unsigned int)q[0] | ((unsigned int)q[1] << 8) | ((unsigned int)q[2] << 16) | ((unsigned int)q[3] << 24));
+        __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(px, zero), _mm_set1_epi32((unsigned short)w[k])));
+      }
+
+      acc = _mm_srai_epi32(_mm_add_epi32(acc, round), shift);
+      _mm_storel_epi64((__m128i *)(out + x * 4), _mm_packs_epi32(acc, acc));
+    }
+
+    return;
+  }
+#endif
+
+  for (x = 0; x < width; ++x)
+  {
+    unsigned char *p = row + (unsigned int)starts[x] * stride;
+    short *w = weights + x * taps;
+
+    for (c = 0; c < stride; ++c)
+    {
+      int sum = 0;
+
+      for (k = 0; k < taps; ++k)
+      {
+        sum += (int)p[k * stride + c] * w[k];
+      }
+
+      sum = (sum + (1 << (shift - 1))) >> shift;
+      out[x * stride + c] = (short)(sum < -32768 ? -32768 : (sum > 32767 ? 32767 : sum));
+    }
+  }
+}
+
+/* Combines taps horizontally filtered rows into count output bytes */
+IMAGINE_API IMAGINE_INLINE void imagine_resize_row_v(unsigned char *out, short **rows, unsigned int count, unsigned int taps, short *w)
+{
+  unsigned int i = 0;
+  unsigned int k;
+  int shift = IMAGINE_RESIZE_WEIGHT_BITS + IMAGINE_RESIZE_ROW_BITS;
+
+#ifdef IMAGINE_SSE2
+  __m128i round = _mm_set1_epi32(1 << (shift - 1));
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i lo = round;
+    __m128i hi = round;
+
+    /* Two rows per madd: (a[i], b[i]) pairs against (w0, w1) */
+    for (k = 0; k < taps; k += 2)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+      __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i *)(rows[k + 1] + i)) : _mm_setzero_si128();
+      __m128i wk = _mm_set1_epi32((int)(((unsigned int)(unsigned short)(k + 1 < taps ? w[k + 1] : 0) << 16) | (unsigned short)w[k]));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+    }
+
+    lo = _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(lo, lo));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    int sum = 1 << (shift - 1);
+
+    for (k = 0; k < taps; ++k)
+    {
+      sum += (int)rows[k][i] * w[k];
+    }
+
+    sum >>= shift;
+    out[i] = (unsigned char)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+  }
+}
+
+/* Runs both passes from src into out (width x height). Rows are filtered horizontally
+ * only once the vertical window reaches them, so with identical sizes (filters) out
+ * may be src->pixels: output row y never overwrites a source row that is still unread.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_separable_run(unsigned char *out, imagine *src, unsigned int width, unsigned int height, imagine_separable *sep)
+{
+  unsigned int stride = src->stride;
+  unsigned int row_count = width * stride;
+  unsigned int next = 0;
+  unsigned int y;
+  unsigned int k;
+
+  for (y = 0; y < height; ++y)
+  {
+    unsigned int first = (unsigned int)sep->starts_y[y];
+
+    /* Window starts never move backwards, so taps_y ring slots hold every row it needs */
+    while (next < first + sep->taps_y)
+    {
+      imagine_resize_row_h(sep->ring + (next % sep->taps_y) * row_count, src->pixels + next * src->width * stride, width, stride, sep->taps_x, sep->starts_x, sep->weights_x);
+      ++next;
+    }
+
+    for (k = 0; k < sep->taps_y; ++k)
+    {
+      sep->rows[k] = sep->ring + ((first + k) % sep->taps_y) * row_count;
+    }
+
+    imagine_resize_row_v(out + y * row_count, sep->rows, row_count, sep->taps_y, sep->weights_y + y * sep->taps_y);
+  }
+}
+
+/* Resizes src into dst (width x height, same stride). dst->pixels and
+ * dst->pixels_capacity are provided by the caller, src and dst must not overlap.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_resize(imagine *dst, imagine *src, unsigned int width, unsigned int height, int filter, unsigned char *scratch, unsigned int scratch_size)
+{
+  imagine_separable sep;
+  unsigned int needed = imagine_resize_scratch_size(src, width, height, filter);
+  unsigned int stride;
+  unsigned int row_count;
+
+  if (!needed || !src->pixels || !imagine_linear(src) || !dst || !dst->pixels || !scratch || scratch_size < needed)
+  {
+    return 0;
+  }
+
+  stride = src->stride;
+  row_count = width * stride;
+
+  if (height > dst->pixels_capacity / row_count)
+  {
+    return 0;
+  }
+
+  IMAGINE_ZONE_BEGIN("imagine_resize");
+
+  sep.taps_x = imagine_resize_taps(src->width, width, filter);
+  sep.taps_y = imagine_resize_taps(src->height, height, filter);
+  imagine_separable_carve(&sep, scratch, width, height, stride);
+
+  imagine_resize_weights(src->width, width, filter, sep.taps_x, sep.starts_x, sep.weights_x);
+  imagine_resize_weights(src->height, height, filter, sep.taps_y, sep.starts_y, sep.weights_y);
+  imagine_separable_run(dst->pixels, src, width, height, &sep);
+
+  dst->width = width;
+  dst->height = height;
+  dst->stride = stride;
+  dst->monochrome = src->monochrome;
+  dst->pixels_size = height * row_count;
+  imagine_linear_output(dst);
+
+  IMAGINE_ZONE_END("imagine_resize");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* COLOR CONVERSION */
+/* ########################################################################## */
+/* Conversions between RGB(A), gray, YCbCr and HSV on imagine buffers. All of them
+ * work in place (dst == src or dst->pixels == src->pixels) when the output stride is
+ * not larger than the input stride, imagine_convert_rgb (gray to RGB) also works in
+ * place as it fills the buffer from the end. Alpha of stride 4 images is kept.
+ *
+ * Gray and YCbCr use a 3x3 matrix in Q13 fixed point with an SSE2 kernel that
+ * handles four RGB(X) pixels per step. HSV uses 0..255 for hue (full circle),
+ * saturation and value and is scalar (per pixel branches on the largest channel).
+ */
+#define IMAGINE_COLOR_BT601 0x0   /* Kr 0.299, Kb 0.114 (JPEG, SD video) */
+#define IMAGINE_COLOR_BT709 0x1   /* Kr 0.2126, Kb 0.0722 (HD video) */
+#define IMAGINE_COLOR_LIMITED 0x2 /* YCbCr in video range: Y 16..235, CbCr 16..240 */
+
+#define IMAGINE_COLOR_BITS 13
+
+typedef struct imagine_color_matrix
+{
+  int m[3][3];
+  int bias[3]; /* offsets and rounding, already in Q13 */
+
+} imagine_color_matrix;
+
+IMAGINE_API IMAGINE_INLINE int imagine_color_fixed(double x)
+{
+  return imagine_floor(x * (double)(1 << IMAGINE_COLOR_BITS) + 0.5);
+}
+
+/* RGB to YCbCr (inverse = 0) or YCbCr to RGB (inverse = 1). Row 0 of the forward
+ * matrix is the luma used for gray conversion.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_color_setup(imagine_color_matrix *cm, int mode, int inverse)
+{
+  double kr = (mode & IMAGINE_COLOR_BT709) ? 0.2126 : 0.299;
+  double kb = (mode & IMAGINE_COLOR_BT709) ? 0.0722 : 0.114;
+  double kg = 1.0 - kr - kb;
+  double ys = (mode & IMAGINE_COLOR_LIMITED) ? 219.0 / 255.0 : 1.0;
+  double cs = (mode & IMAGINE_COLOR_LIMITED) ? 224.0 / 255.0 : 1.0;
+  double yo = (mode & IMAGINE_COLOR_LIMITED) ? 16.0 : 0.0;
+  double f[3][3];
+  double in_offset[3];
+  double out_offset[3];
+  int r;
+  int c;
+
+  if (!inverse)
+  {
+    f[0][0] = kr * ys;
+    f[0][1] = kg * ys;
+    f[0][2] = kb * ys;
+    f[1][0] = -kr / (2.0 * (1.0 - kb)) * cs;
+    f[1][1] = -kg / (2.0 * (1.0 - kb)) * cs;
+    f[1][2] = 0.5 * cs;
+    f[2][0] = 0.5 * cs;
+    f[2][1] = -kg / (2.0 * (1.0 - kr)) * cs;
+    f[2][2] = -kb / (2.0 * (1.0 - kr)) * cs;
+    in_offset[0] = in_offset[1] = in_offset[2] = 0.0;
+    out_offset[0] = yo;
+    out_offset[1] = out_offset[2] = 128.0;
+  }
+  else
+  {
+    f[0][0] = f[1][0] = f[2][0] = 1.0 / ys;
+    f[0][1] = 0.0;
+    f[0][2] = 2.0 * (1.0 - kr) / cs;
+    f[1][1] = -2.0 * kb * (1.0 - kb) / kg / cs;
+    f[1][2] = -2.0 * kr * (1.0 - kr) / kg / cs;
+    f[2][1] = 2.0 * (1.0 - kb) / cs;
+    f[2][2] = 0.0;
+    in_offset[0] = yo;
+    in_offset[1] = in_offset[2] = 128.0;
+    out_offset[0] = out_offset[1] = out_offset[2] = 0.0;
+  }
+
+  for (r = 0; r < 3; ++r)
+  {
+    double offset = out_offset[r];
+
+    for (c = 0; c < 3; ++c)
+    {
+      cm->m[r][c] = imagine_color_fixed(f[r][c]);
+      offset -= f[r][c] * in_offset[c];
+    }
+
+    cm->bias[r] = imagine_color_fixed(offset) + (1 << (IMAGINE_COLOR_BITS - 1));
+  }
+
+  if (!inverse)
+  {
+    /* Gray input must give exact luma and neutral chroma after rounding */
+    cm->m[0][1] = imagine_color_fixed(ys) - cm->m[0][0] - cm->m[0][2];
+    cm->m[1][2] = -cm->m[1][0] - cm->m[1][1];
+    cm->m[2][0] = -cm->m[2][1] - cm->m[2][2];
+  }
+}
+
+#ifdef IMAGINE_SSE2
+/* m[0] * c0 + m[1] * c1 + m[2] * c2 + bias >> 13 for the four pixels in lo (0, 1) and hi (2, 3) */
+IMAGINE_API IMAGINE_INLINE __m128i imagine_color_dot4(__m128i lo, __m128i hi, int *m, int bias)
+{
+  __m128i w = _mm_set_epi16(0, (short)m[2], (short)m[1], (short)m[0], 0, (short)m[2], (short)m[1], (short)m[0]);
+  __m128i a = _mm_shuffle_epi32(_mm_madd_epi16(lo, w), 0xD8); /* x0 x1 y0 y1 */
+  __m128i b = _mm_shuffle_epi32(_mm_madd_epi16(hi, w), 0xD8); /* x2 x3 y2 y3 */
+  __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+
+  return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(bias)), IMAGINE_COLOR_BITS);
+}
+#endif
+
+/* Applies the first channels rows of cm to count pixels. Alpha is copied when both strides are 4. */
+IMAGINE_API IMAGINE_INLINE void imagine_color_row(unsigned char *out, unsigned int out_stride, unsigned char *in, unsigned int in_stride, unsigned int count, imagine_color_matrix *cm, unsigned int channels)
+{
+  unsigned int i = 0;
+  unsigned int k;
+
+#ifdef IMAGINE_SSE2
+  __m128i zero = _mm_setzero_si128();
+  unsigned int tail = (in_stride == 3) ? 2u : 0u; /* stride 3 loads read 16 bytes for 12 */
+
+  if (channels == 1 && out_stride == 1)
+  {
+    /* Sixteen pixels per store */
+    for (; i + 16 + tail <= count; i += 16)
+    {
+      __m128i d[4];
+
+      for (k = 0; k < 4; ++k)
+      {
+        __m128i v = imagine_color_load4(in + (i + k * 4) * in_stride, in_stride);
+        d[k] = imagine_color_dot4(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero), cm->m[0], cm->bias[0]);
+      }
+
+      _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_packs_epi32(d[0], d[1]), _mm_packs_epi32(d[2], d[3])));
+    }
+  }
+  else if (channels == 3 && out_stride == in_stride)
+  {
+    for (; i + 4 + tail <= count; i += 4)
+    {
+      __m128i v = imagine_color_load4(in + i * in_stride, in_stride);
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      __m128i c0 = imagine_color_dot4(lo, hi, cm->m[0], cm->bias[0]);
+      __m128i c1 = imagine_color_dot4(lo, hi, cm->m[1], cm->bias[1]);
+      __m128i c2 = imagine_color_dot4(lo, hi, cm->m[2], cm->bias[2]);
+      __m128i t = _mm_packus_epi16(_mm_packs_epi32(c0, c2), _mm_packs_epi32(c1, in_stride == 4 ? _mm_srli_epi32(v, 24) : zero));
+
+      /* c0 x4, c2 x4, c1 x4, alpha x4 to c0 c1 c2 alpha per pixel */
+      t = _mm_unpacklo_epi8(t, _mm_srli_si128(t, 8));
+      t = _mm_unpacklo_epi16(t, _mm_srli_si128(t, 8));
+
+      if (out_stride == 4)
+      {
+        _mm_storeu_si128((__m128i *)(out + i * 4), t);
+      }
+      else
+      {
+        unsigned char *q = out + i * 3;
+        unsigned int last;
+
+        t = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0, 0, 0x00FFFFFF)),
+                         _mm_and_si128(_mm_srli_si128(t, 1), _mm_set_epi32(0, 0, 0x0000FFFF, (int)0xFF000000))),
+            _mm_or_si128(_mm_and_si128(_mm_srli_si128(t, 2), _mm_set_epi32(0, 0x000000FF, (int)0xFFFF0000, 0)),
+                         _mm_and_si128(_mm_srli_si128(t, 3), _mm_set_epi32(0, (int)0xFFFFFF00, 0, 0))));
+
+        /* Exactly twelve bytes, the next group may still be unread (in place) */
+        _mm_storel_epi64((__m128i *)q, t);
+        last = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(t, 8));
+        q[8] = (unsigned char)last;
+        q[9] = (unsigned char)(last >> 8);
+        q[10] = (unsigned char)(last >> 16);
+        q[11] = (unsigned char)(last >> 24);
+      }
+    }
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    unsigned char *p = in + i * in_stride;
+    unsigned char *q = out + i * out_stride;
+    int c0 = p[0];
+    int c1 = p[1];
+    int c2 = p[2];
+    int v[3];
+
+    for (k = 0; k < channels; ++k)
+    {
+      v[k] = (cm->m[k][0] * c0 + cm->m[k][1] * c1 + cm->m[k][2] * c2 + cm->bias[k]) >> IMAGINE_COLOR_BITS;
+    }
+
+    if (out_stride == 4 && in_stride == 4)
+    {
+      q[3] = p[3];
+    }
+
+    for (k = 0; k < channels; ++k)
+    {
+      q[k] = (unsigned char)(v[k] < 0 ? 0 : (v[k] > 255 ? 255 : v[k]));
+    }
+  }
+}
+
+/* Common checks and output fields. Returns the pixel count or 0. */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_color_prepare(imagine *dst, imagine *src, unsigned int out_stride, unsigned char monochrome)
+{
+  unsigned int count;
+
+  if (!dst || !src || !src->pixels || !dst->pixels || !src->width || !src->height || !imagine_linear(src))
+  {
+    return 0;
+  }
+
+  count = src->width * src->height;
+
+  if (count / src->width != src->height || count > dst->pixels_capacity / out_stride)
+  {
+    return 0;
+  }
+
+  dst->width = src->width;
+  dst->height = src->height;
+  dst->stride = out_stride;
+  dst->monochrome = monochrome;
+  dst->pixels_size = count * out_stride;
+  imagine_linear_output(dst);
+
+  return count;
+}
+
+/* RGB(A) to gray (stride 1) with BT.601 or BT.709 luma weights */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_gray(imagine *dst, imagine *src, int mode)
+{
+  imagine_color_matrix cm;
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int in_stride = src ? src->stride : 0;
+  unsigned int count;
+  unsigned int i;
+
+  if (in_stride != 1 && in_stride != 3 && in_stride != 4)
+  {
+    return 0;
+  }
+
+  if (!(count = imagine_color_prepare(dst, src, 1, 1)))
+  {
+    return 0;
+  }
+
+  if (in_stride == 1)
+  {
+    for (i = 0; dst->pixels != in && i < count; ++i)
+    {
+      dst->pixels[i] = in[i];
+    }
+
+    return 1;
+  }
+
+  imagine_color_setup(&cm, mode & IMAGINE_COLOR_BT709, 0);
+  imagine_color_row(dst->pixels, 1, in, in_stride, count, &cm, 1);
+
+  return 1;
+}
+
+/* Gray (stride 1) to RGB (stride 3) */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_rgb(imagine *dst, imagine *src)
+{
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int count;
+
+  if (!src || src->stride != 1 || !(count = imagine_color_prepare(dst, src, 3, 0)))
+  {
+    return 0;
+  }
+
+  while (count--)
+  {
+    unsigned char v = in[count];
+    dst->pixels[count * 3 + 2] = v;
+    dst->pixels[count * 3 + 1] = v;
+    dst->pixels[count * 3 + 0] = v;
+  }
+
+  return 1;
+}
+
+/* RGB(A) to interleaved 4:4:4 YCbCr(A), same stride */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_ycbcr(imagine *dst, imagine *src, int mode)
+{
+  imagine_color_matrix cm;
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int stride = src ? src->stride : 0;
+  unsigned int count;
+
+  if ((stride != 3 && stride != 4) || !(count = imagine_color_prepare(dst, src, stride, 0)))
+  {
+    return 0;
+  }
+
+  imagine_color_setup(&cm, mode, 0);
+  imagine_color_row(dst->pixels, stride, in, stride, count, &cm, 3);
+
+  return 1;
+}
+
+/* Interleaved 4:4:4 YCbCr(A) back to RGB(A), same stride */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_ycbcr_rgb(imagine *dst, imagine *src, int mode)
+{
+  imagine_color_matrix cm;
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int stride = src ? src->stride : 0;
+  unsigned int count;
+
+  if ((stride != 3 && stride != 4) || !(count = imagine_color_prepare(dst, src, stride, 0)))
+  {
+    return 0;
+  }
+
+  imagine_color_setup(&cm, mode, 1);
+  imagine_color_row(dst->pixels, stride, in, stride, count, &cm, 3);
+
+  return 1;
+}
+
+/* RGB(A) to 4:2:0 planes: y is width * height, cb and cr are ((width + 1) / 2) * ((height + 1) / 2).
+ * Chroma is taken from the average of each 2x2 block (clamped at odd edges).
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_ycbcr420(imagine *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int mode)
+{
+  imagine_color_matrix cm;
+  unsigned int stride;
+  unsigned int row;
+  unsigned int cw;
+  unsigned int cx;
+  unsigned int cy;
+  unsigned int k;
+
+  if (!src || !src->pixels || !imagine_linear(src) || !y || !cb || !cr || (src->stride != 3 && src->stride != 4))
+  {
+    return 0;
+  }
+
+  stride = src->stride;
+  row = src->width * stride;
+  cw = (src->width + 1) / 2;
+
+  imagine_color_setup(&cm, mode, 0);
+  imagine_color_row(y, 1, src->pixels, stride, src->width * src->height, &cm, 1);
+
+  for (cy = 0; cy < (src->height + 1) / 2; ++cy)
+  {
+    unsigned char *r0 = src->pixels + cy * 2 * row;
+    unsigned char *r1 = (cy * 2 + 1 < src->height) ? r0 + row : r0;
+
+    for (cx = 0; cx < cw; ++cx)
+    {
+      unsigned int x0 = cx * 2 * stride;
+      unsigned int x1 = (cx * 2 + 1 < src->width) ? x0 + stride : x0;
+      int c[3];
+      int v;
+
+      for (k = 0; k < 3; ++k)
+      {
+        c[k] = (r0[x0 + k] + r0[x1 + k] + r1[x0 + k] + r1[x1 + k] + 2) >> 2;
+      }
+
+      v = (cm.m[1][0] * c[0] + cm.m[1][1] * c[1] + cm.m[1][2] * c[2] + cm.bias[1]) >> IMAGINE_COLOR_BITS;
+      cb[cy * cw + cx] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+      v = (cm.m[2][0] * c[0] + cm.m[2][1] * c[1] + cm.m[2][2] * c[2] + cm.bias[2]) >> IMAGINE_COLOR_BITS;
+      cr[cy * cw + cx] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+  }
+
+  return 1;
+}
+
+/* RGB(A) to HSV(A), same stride. Hue 0..255 covers the full circle. */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_hsv(imagine *dst, imagine *src)
+{
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int stride = src ? src->stride : 0;
+  unsigned int count;
+  unsigned int i;
+
+  if ((stride != 3 && stride != 4) || !(count = imagine_color_prepare(dst, src, stride, 0)))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    unsigned char *p = in + i * stride;
+    unsigned char *q = dst->pixels + i * stride;
+    int r = p[0];
+    int g = p[1];
+    int b = p[2];
+    int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    int delta = max - min;
+    int h = 0;
+
+    if (delta)
+    {
+      /* Sector offsets of 0, 2 and 4 sixths, +6 sixths keeps the numerator positive */
+      int sector = (max == r) ? (g - b + 6 * delta) : ((max == g) ? (b - r + 2 * delta) : (r - g + 4 * delta));
+      h = ((256 * sector + 3 * delta) / (6 * delta)) & 255;
+    }
+
+    if (stride == 4)
+    {
+      q[3] = p[3];
+    }
+
+    q[0] = (unsigned char)h;
+    q[1] = (unsigned char)(max ? (255 * delta + max / 2) / max : 0);
+    q[2] = (unsigned char)max;
+  }
+
+  return 1;
+}
+
+/* HSV(A) back to RGB(A), same stride */
+IMAGINE_API IMAGINE_INLINE int imagine_convert_hsv_rgb(imagine *dst, imagine *src)
+{
+  unsigned char *in = src ? src->pixels : 0;
+  unsigned int stride = src ? src->stride : 0;
+  unsigned int count;
+  unsigned int i;
+
+  if ((stride != 3 && stride != 4) || !(count = imagine_color_prepare(dst, src, stride, 0)))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    unsigned char *p = in + i * stride;
+    unsigned char *q = dst->pixels + i * stride;
+    int h6 = p[0] * 6;
+    int s = p[1];
+    int v = p[2];
+    int f = h6 & 255; /* position inside the sector */
+    int lo = (v * (255 - s) + 127) / 255;
+    int down = (v * (65025 - s * f) + 32512) / 65025;
+    int up = (v * (65025 - s * (255 - f)) + 32512) / 65025;
+    int r;
+    int g;
+    int b;
+
+    switch (h6 >> 8)
+    {
+    case 0:
+      r = v;
+      g = up;
+      b = lo;
+      break;
+    case 1:
+      r = down;
+      g = v;
+      b = lo;
+      break;
+    case 2:
+      r = lo;
+      g = v;
+      b = up;
+      break;
+    case 3:
+      r = lo;
+      g = down;
+      b = v;
+      break;
+    case 4:
+      r = up;
+      g = lo;
+      b = v;
+      break;
+    default:
+      r = v;
+      g = lo;
+      b = down;
+      break;
+    }
+
+    if (stride == 4)
+    {
+      q[3] = p[3];
+    }
+
+    q[0] = (unsigned char)r;
+    q[1] = (unsigned char)g;
+    q[2] = (unsigned char)b;
+  }
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* ROTATE / FLIP / TRANSPOSE */
+/* ########################################################################## */
+/* Flips and the 180 degree rotation work in place on img. Transpose and the 90/270
+ * degree rotations write into dst (width and height swapped) and need a separate
+ * buffer that does not overlap the source (overlap is rejected). They walk the image
+ * in IMAGINE_ROTATE_TILE x IMAGINE_ROTATE_TILE pixel tiles so both the source rows
+ * and the destination rows of a tile stay in cache. Inside a tile SSE2 transposes 8x8
+ * blocks for stride 1 and 4x4 blocks for stride 4.
+ */
+#ifndef IMAGINE_ROTATE_TILE
+#define IMAGINE_ROTATE_TILE 64
+#endif
+
+#define IMAGINE_ROTATE_TRANSPOSE 0 /* dst(y, x) = src(x, y) */
+#define IMAGINE_ROTATE_90 1        /* clockwise */
+#define IMAGINE_ROTATE_270 2       /* counter clockwise */
+
+/* Copies a w x h block, source row pitch and destination row pitch in bytes (may be
+ * negative), dst(j, i) = src(i, j).
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_transpose_block(unsigned char *dst, long dst_pitch, unsigned char *src, long src_pitch, unsigned int w, unsigned int h, unsigned int stride)
+{
+  unsigned int i;
+  unsigned int j;
+  unsigned int c;
+
+#ifdef IMAGINE_SSE2
+  if (stride == 1 && w == 8 && h == 8)
+  {
+    __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src), _mm_loadl_epi64((const __m128i *)(src + src_pitch)));
+    __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 2 * src_pitch)), _mm_loadl_epi64((const __m128i *)(src + 3 * src_pitch)));
+    __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 4 * src_pitch)), _mm_loadl_epi64((const __m128i *)(src + 5 * src_pitch)));
+    __m128i a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 6 * src_pitch)), _mm_loadl_epi64((const __m128i *)(src + 7 * src_pitch)));
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1); /* columns 0-3 of rows 0-3 */
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1); /* columns 4-7 of rows 0-3 */
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i c0 = _mm_unpacklo_epi32(b0, b2); /* columns 0 and 1 */
+    __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+    __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+    __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+
+    _mm_storel_epi64((__m128i *)dst, c0);
+    _mm_storel_epi64((__m128i *)(dst + dst_pitch), _mm_srli_si128(c0, 8));
+    _mm_storel_epi64((__m128i *)(dst + 2 * dst_pitch), c1);
+    _mm_storel_epi64((__m128i *)(dst + 3 * dst_pitch), _mm_srli_si128(c1, 8));
+    _mm_storel_epi64((__m128i *)(dst + 4 * dst_pitch), c2);
+    _mm_storel_epi64((__m128i *)(dst + 5 * dst_pitch), _mm_srli_si128(c2, 8));
+    _mm_storel_epi64((__m128i *)(dst + 6 * dst_pitch), c3);
+    _mm_storel_epi64((__m128i *)(dst + 7 * dst_pitch), _mm_srli_si128(c3, 8));
+    return;
+  }
+
+  if (stride == 4 && w == 4 && h == 4)
+  {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)src);
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + src_pitch));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * src_pitch));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * src_pitch));
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + dst_pitch), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + 2 * dst_pitch), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(dst + 3 * dst_pitch), _mm_unpackhi_epi64(t2, t3));
+    return;
+  }
+#endif
+
+  for (i = 0; i < h; ++i)
+  {
+    unsigned char *s = src + (long)i * src_pitch;
+    unsigned char *d = dst + i * stride;
+
+    for (j = 0; j < w; ++j)
+    {
+      for (c = 0; c < stride; ++c)
+      {
+        d[c] = s[c];
+      }
+
+      s += stride;
+      d += dst_pitch;
+    }
+  }
+}
+
+/* Transpose (mode IMAGINE_ROTATE_TRANSPOSE) or quarter turn of src into dst */
+IMAGINE_API IMAGINE_INLINE int imagine_rotate_quarter(imagine *dst, imagine *src, int mode)
+{
+  unsigned int w;
+  unsigned int h;
+  unsigned int stride;
+  unsigned int block;
+  unsigned int tx;
+  unsigned int ty;
+  unsigned int count;
+  long src_pitch;
+  long dst_pitch;
+
+  if (!dst || !src || !dst->pixels || !src->pixels || !imagine_linear(src) ||
+      (src->stride != 1 && src->stride != 3 && src->stride != 4))
+  {
+    return 0;
+  }
+
+  count = src->width * src->height;
+
+  if ((src->width && count / src->width != src->height) || count > dst->pixels_capacity / src->stride)
+  {
+    return 0;
+  }
+
+  /* Every source pixel is still read after dst writes started, the buffers must be disjoint */
+  if (dst->pixels < src->pixels + count * src->stride && src->pixels < dst->pixels + count * src->stride)
+  {
+    return 0;
+  }
+
+  w = src->width;
+  h = src->height;
+  stride = src->stride;
+  block = stride == 1 ? 8u : 4u;
+  src_pitch = (long)(w * stride);
+  dst_pitch = (long)(h * stride);
+
+  IMAGINE_ZONE_BEGIN("imagine_rotate");
+
+  for (ty = 0; ty < h; ty += IMAGINE_ROTATE_TILE)
+  {
+    for (tx = 0; tx < w; tx += IMAGINE_ROTATE_TILE)
+    {
+      unsigned int y;
+      unsigned int x;
+
+      for (y = ty; y < h && y < ty + IMAGINE_ROTATE_TILE; y += block)
+      {
+        unsigned int bh = (h - y < block) ? h - y : block;
+
+        for (x = tx; x < w && x < tx + IMAGINE_ROTATE_TILE; x += block)
+        {
+          unsigned int bw = (w - x < block) ? w - x : block;
+          unsigned char *s = src->pixels + (long)y * src_pitch + (long)(x * stride);
+
+          if (mode == IMAGINE_ROTATE_90)
+          {
+            /* Read the block bottom up, dst(h - 1 - y, x) */
+            imagine_transpose_block(dst->pixels + (long)x * dst_pitch + (long)((h - y - bh) * stride), dst_pitch,
+                                    s + (long)(bh - 1) * src_pitch, -src_pitch, bw, bh, stride);
+          }
+          else if (mode == IMAGINE_ROTATE_270)
+          {
+            /* Write the block rows bottom up, dst(y, w - 1 - x) */
+            imagine_transpose_block(dst->pixels + (long)(w - 1 - x) * dst_pitch + (long)(y * stride), -dst_pitch,
+                                    s, src_pitch, bw, bh, stride);
+          }
+          else
+          {
+            imagine_transpose_block(dst->pixels + (long)x * dst_pitch + (long)(y * stride), dst_pitch,
+                                    s, src_pitch, bw, bh, stride);
+          }
+        }
+      }
+    }
+  }
+
+  dst->width = h;
+  dst->height = w;
+  dst->stride = stride;
+  dst->monochrome = src->monochrome;
+  dst->pixels_size = w * h * stride;
+  imagine_linear_output(dst);
+
+  IMAGINE_ZONE_END("imagine_rotate");
+
+  return 1;
+}
+
+IMAGINE_API IMAGINE_INLINE int imagine_transpose(imagine *dst, imagine *src)
+{
+  return imagine_rotate_quarter(dst, src, IMAGINE_ROTATE_TRANSPOSE);
+}
+
+IMAGINE_API IMAGINE_INLINE int imagine_rotate90(imagine *dst, imagine *src)
+{
+  return imagine_rotate_quarter(dst, src, IMAGINE_ROTATE_90);
+}
+
+IMAGINE_API IMAGINE_INLINE int imagine_rotate270(imagine *dst, imagine *src)
+{
+  return imagine_rotate_quarter(dst, src, IMAGINE_ROTATE_270);
+}
+
+#ifdef IMAGINE_SSE2
+/* Reverses the order of the 16 / stride pixels of v */
+IMAGINE_API IMAGINE_INLINE __m128i imagine_reverse16(__m128i v, unsigned int stride)
+{
+  v = _mm_shuffle_epi32(v, 0x1B);
+
+  if (stride == 1)
+  {
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  }
+
+  return v;
+}
+#endif
+
+/* Reverses the pixel order of count pixels in place */
+IMAGINE_API IMAGINE_INLINE void imagine_reverse_pixels(unsigned char *p, unsigned int count, unsigned int stride)
+{
+  unsigned char *lo = p;
+  unsigned char *hi = p + count * stride; /* one past the last pixel */
+  unsigned int c;
+
+#ifdef IMAGINE_SSE2
+  if (stride != 3)
+  {
+    while (hi - lo >= 32)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i *)lo);
+      __m128i b = _mm_loadu_si128((const __m128i *)(hi - 16));
+
+      _mm_storeu_si128((__m128i *)lo, imagine_reverse16(b, stride));
+      _mm_storeu_si128((__m128i *)(hi - 16), imagine_reverse16(a, stride));
+      lo += 16;
+      hi -= 16;
+    }
+  }
+#endif
+
+  while (hi - lo >= (long)(2 * stride))
+  {
+    hi -= stride;
+
+    for (c = 0; c < stride; ++c)
+    {
+      unsigned char t = lo[c];
+      lo[c] = hi[c];
+      hi[c] = t;
+    }
+
+    lo += stride;
+  }
+}
+
+/* Mirrors every row in place (left <-> right) */
+IMAGINE_API IMAGINE_INLINE int imagine_flip_horizontal(imagine *img)
+{
+  unsigned int y;
+
+  if (!img || !img->pixels || !imagine_linear(img) || (img->stride != 1 && img->stride != 3 && img->stride != 4))
+  {
+    return 0;
+  }
+
+  for (y = 0; y < img->height; ++y)
+  {
+    imagine_reverse_pixels(img->pixels + y * img->width * img->stride, img->width, img->stride);
+  }
+
+  return 1;
+}
+
+/* Swaps rows in place (top <-> bottom), for example to fix bottom up sources */
+IMAGINE_API IMAGINE_INLINE int imagine_flip_vertical(imagine *img)
+{
+  unsigned int row;
+  unsigned int y;
+
+  if (!img || !img->pixels || !img->stride || !imagine_linear(img))
+  {
+    return 0;
+  }
+
+  row = img->width * img->stride;
+
+  for (y = 0; y < img->height / 2; ++y)
+  {
+    unsigned char *a = img->pixels + y * row;
+    unsigned char *b = img->pixels + (img->height - 1 - y) * row;
+    unsigned int i = 0;
+
+#ifdef IMAGINE_SSE2
+    for (; i + 16 <= row; i += 16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      _mm_storeu_si128((__m128i *)(a + i), vb);
+      _mm_storeu_si128((__m128i *)(b + i), va);
+    }
+#endif
+
+    for (; i < row; ++i)
+    {
+      unsigned char t = a[i];
+      a[i] = b[i];
+      b[i] = t;
+    }
+  }
+
+  return 1;
+}
+
+/* Rotates by 180 degrees in place, the whole buffer is one reversed run of pixels */
+IMAGINE_API IMAGINE_INLINE int imagine_rotate180(imagine *img)
+{
+  if (!img || !img->pixels || !imagine_linear(img) || (img->stride != 1 && img->stride != 3 && img->stride != 4))
+  {
+    return 0;
+  }
+
+  imagine_reverse_pixels(img->pixels, img->width * img->height, img->stride);
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* FILTERS */
+/* ########################################################################## */
+/* Blur, sharpen and edge filters on imagine buffers with replicated edges:
+ *
+ *   imagine_blur_box       sliding window mean, O(1) per pixel for any radius, in place
+ *   imagine_blur_gaussian  separable Q14 kernel through the resize passes, in place
+ *   imagine_sharpen        unsharp mask, src + amount * (src - gaussian(src))
+ *   imagine_sobel          gradient magnitude of a gray image
+ *
+ * Repeating imagine_blur_box (passes) approaches a Gaussian with sigma^2 =
+ * passes * ((2r + 1)^2 - 1) / 12 at a cost independent of the radius.
+ *
+ * The box blur keeps a ring of 2r + 1 source rows and one row of column sums, the
+ * Gaussian a ring of taps horizontally filtered rows and Sobel reads three rows, so
+ * the working set is a band of rows rather than the image.
+ */
+#define IMAGINE_BOX_RADIUS_MAX 127     /* keeps the Q23 reciprocal of the window exact to 0.2 levels */
+#define IMAGINE_GAUSSIAN_RADIUS_MAX 64 /* kernel radius ceil(3 sigma), beyond that use repeated box blurs */
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_blur_box_scratch_size(imagine *src, unsigned int radius)
+{
+  if (!src || !src->width || !src->height || !radius || radius > IMAGINE_BOX_RADIUS_MAX ||
+      (src->stride != 1 && src->stride != 3 && src->stride != 4))
+  {
+    return 0;
+  }
+
+  return 15u + /* pointer alignment */
+         imagine_resize_align(src->width * src->stride * (unsigned int)sizeof(int)) +
+         (2 * radius + 1) * src->width * src->stride;
+}
+
+/* Adds row enter to the column sums, removes row leave and stores enter in its place */
+IMAGINE_API IMAGINE_INLINE void imagine_blur_box_columns(int *sums, unsigned char *enter, unsigned char *leave, unsigned int count)
+{
+  unsigned int i = 0;
+
+#ifdef IMAGINE_SSE2
+  __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= count; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(enter + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(leave + i));
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    __m128i *s = (__m128i *)(void *)(sums + i);
+
+    /* Sign extend the 16 bit differences */
+    _mm_store_si128(s, _mm_add_epi32(_mm_load_si128(s), _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)));
+    _mm_store_si128(s + 1, _mm_add_epi32(_mm_load_si128(s + 1), _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)));
+    _mm_store_si128(s + 2, _mm_add_epi32(_mm_load_si128(s + 2), _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)));
+    _mm_store_si128(s + 3, _mm_add_epi32(_mm_load_si128(s + 3), _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)));
+    _mm_storeu_si128((__m128i *)(leave + i), a);
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    sums[i] += (int)enter[i] - (int)leave[i];
+    leave[i] = enter[i];
+  }
+}
+
+/* Horizontal sliding sum over the column sums, scaled by mul / 2^23 */
+IMAGINE_API IMAGINE_INLINE void imagine_blur_box_row(unsigned char *out, int *sums, unsigned int width, unsigned int stride, unsigned int radius, unsigned int mul)
+{
+  int last = (int)width - 1;
+  int r = (int)radius;
+  int x;
+  int d;
+  unsigned int c;
+
+#ifdef IMAGINE_SSE2
+  if (stride == 4)
+  {
+    __m128i sum = _mm_setzero_si128();
+    __m128i m = _mm_set1_epi32((int)mul);
+    __m128i round = _mm_set_epi32(0, 1 << 22, 0, 1 << 22);
+    __m128i zero = _mm_setzero_si128();
+
+    for (d = -r; d <= r; ++d)
+    {
+      sum = _mm_add_epi32(sum, _mm_load_si128((const __m128i *)(void *)(sums + (d < 0 ? 0 : (d > last ? last : d)) * 4)));
+    }
+
+    for (x = 0; x <= last; ++x)
+    {
+      int enter = x + r + 1;
+      int leave = x - r;
+      __m128i even = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(sum, m), round), 23);
+      __m128i odd = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(_mm_srli_si128(sum, 4), m), round), 23);
+      __m128i v = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08), _mm_shuffle_epi32(odd, 0x08));
+      int packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, zero), zero));
+
+      out[x * 4 + 0] = (unsigned char)packed;
+      out[x * 4 + 1] = (unsigned char)(packed >> 8);
+      out[x * 4 + 2] = (unsigned char)(packed >> 16);
+      out[x * 4 + 3] = (unsigned char)(packed >> 24);
+
+      sum = _mm_add_epi32(sum, _mm_load_si128((const __m128i *)(void *)(sums + (enter > last ? last : enter) * 4)));
+      sum = _mm_sub_epi32(sum, _mm_load_si128((const __m128i *)(void *)(sums + (leave < 0 ? 0 : leave) * 4)));
+    }
+
+    return;
+  }
+#endif
+
+  for (c = 0; c < stride; ++c)
+  {
+    unsigned int sum = 0;
+
+    for (d = -r; d <= r; ++d)
+    {
+      sum += (unsigned int)sums[(unsigned int)(d < 0 ? 0 : (d > last ? last : d)) * stride + c];
+    }
+
+    for (x = 0; x <= last; ++x)
+    {
+      int enter = x + r + 1;
+      int leave = x - r;
+
+      out[(unsigned int)x * stride + c] = (unsigned char)((sum * mul + (1u << 22)) >> 23);
+
+      sum += (unsigned int)sums[(unsigned int)(enter > last ? last : enter) * stride + c];
+      sum -= (unsigned int)sums[(unsigned int)(leave < 0 ? 0 : leave) * stride + c];
+    }
+  }
+}
+
+/* Mean over the (2 radius + 1)^2 window, repeated passes times. dst may be src. */
+IMAGINE_API IMAGINE_INLINE int imagine_blur_box(imagine *dst, imagine *src, unsigned int radius, unsigned int passes, unsigned char *scratch, unsigned int scratch_size)
+{
+  unsigned int needed = imagine_blur_box_scratch_size(src, radius);
+  unsigned int window = 2 * radius + 1;
+  unsigned int mul = ((1u << 23) + window * window / 2) / (window * window);
+  unsigned int width;
+  unsigned int height;
+  unsigned int row_count;
+  unsigned int pass;
+  unsigned char *in;
+  unsigned char *ring;
+  int *sums;
+
+  if (!needed || !src->pixels || !imagine_linear(src) || !dst || !dst->pixels || !scratch || scratch_size < needed || !passes)
+  {
+    return 0;
+  }
+
+  width = src->width;
+  height = src->height;
+  row_count = width * src->stride;
+
+  if (height > dst->pixels_capacity / row_count)
+  {
+    return 0;
+  }
+
+  IMAGINE_ZONE_BEGIN("imagine_blur_box");
+
+  sums = (int *)(void *)(scratch + ((16u - (unsigned int)((unsigned long)scratch & 15u)) & 15u));
+  ring = (unsigned char *)(sums) + imagine_resize_align(row_count * (unsigned int)sizeof(int));
+  in = src->pixels;
+
+  for (pass = 0; pass < passes; ++pass)
+  {
+    int r = (int)radius;
+    int last = (int)height - 1;
+    int k;
+    unsigned int i;
+
+    /* Logical row k (clamped into the image) lives in ring slot (k + r + 1) % window.
+     * The preload sums rows -r - 1..r - 1, each output row then adds row k + r and
+     * removes row k - r - 1 whose slot it takes over.
+     */
+    for (i = 0; i < row_count; ++i)
+    {
+      sums[i] = 0;
+    }
+
+    for (k = -r - 1; k < r; ++k)
+    {
+      unsigned char *slot = ring + (unsigned int)(k + r + 1) * row_count;
+      unsigned char *row = in + (unsigned int)(k < 0 ? 0 : (k > last ? last : k)) * row_count;
+
+      for (i = 0; i < row_count; ++i)
+      {
+        slot[i] = row[i];
+        sums[i] += row[i];
+      }
+    }
+
+    for (k = 0; k <= last; ++k)
+    {
+      int enter = k + r;
+
+      /* The entering row is read before out row k (possibly the same memory) is written */
+      imagine_blur_box_columns(sums, in + (unsigned int)(enter > last ? last : enter) * row_count, ring + (unsigned int)((enter + r + 1) % (int)window) * row_count, row_count);
+      imagine_blur_box_row(dst->pixels + (unsigned int)k * row_count, sums, width, src->stride, radius, mul);
+    }
+
+    in = dst->pixels;
+  }
+
+  dst->width = width;
+  dst->height = height;
+  dst->stride = src->stride;
+  dst->monochrome = src->monochrome;
+  dst->pixels_size = height * row_count;
+  imagine_linear_output(dst);
+
+  IMAGINE_ZONE_END("imagine_blur_box");
+
+  return 1;
+}
+
+IMAGINE_API IMAGINE_INLINE double imagine_exp(double x)
+{
+  double term = 1.0;
+  double sum = 1.0;
+  int halvings = 0;
+  int i;
+
+  /* exp(x) = exp(x / 2^n)^(2^n) with a short series for |x / 2^n| <= 0.5 */
+  while (x < -0.5 || x > 0.5)
+  {
+    x *= 0.5;
+    ++halvings;
+  }
+
+  for (i = 1; i < 10; ++i)
+  {
+    term *= x / (double)i;
+    sum += term;
+  }
+
+  while (halvings--)
+  {
+    sum *= sum;
+  }
+
+  return sum;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_gaussian_radius(double sigma)
+{
+  return sigma > 0.0 ? (unsigned int)imagine_ceil(3.0 * sigma) : 0;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_blur_gaussian_scratch_size(imagine *src, double sigma)
+{
+  unsigned int radius = imagine_gaussian_radius(sigma);
+
+  if (!src || !src->width || !src->height || !radius || radius > IMAGINE_GAUSSIAN_RADIUS_MAX ||
+      (src->stride != 1 && src->stride != 3 && src->stride != 4))
+  {
+    return 0;
+  }
+
+  return imagine_separable_scratch_size(src->width, src->height, src->stride,
+                                        2 * radius + 1 < src->width ? 2 * radius + 1 : src->width,
+                                        2 * radius + 1 < src->height ? 2 * radius + 1 : src->height);
+}
+
+/* Same size weight tables for a centered kernel of 2 radius + 1 taps, edge samples
+ * absorb the kernel weights outside the image.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_convolve_weights(unsigned int len, short *kernel, unsigned int radius, unsigned int taps, int *starts, short *weights)
+{
+  int last = (int)len - 1;
+  unsigned int i;
+  unsigned int k;
+
+  for (i = 0; i < len; ++i)
+  {
+    short *w = weights + i * taps;
+    int start = (int)i - (int)radius;
+
+    if (start > (int)len - (int)taps)
+    {
+      start = (int)len - (int)taps;
+    }
+
+    if (start < 0)
+    {
+      start = 0;
+    }
+
+    starts[i] = start;
+
+    for (k = 0; k < taps; ++k)
+    {
+      w[k] = 0;
+    }
+
+    for (k = 0; k <= 2 * radius; ++k)
+    {
+      int j = (int)(i + k) - (int)radius;
+      j = j < 0 ? 0 : (j > last ? last : j);
+      w[j - start] = (short)(w[j - start] + kernel[k]);
+    }
+  }
+}
+
+/* Gaussian blur with a Q14 kernel of radius ceil(3 sigma). dst may be src. */
+IMAGINE_API IMAGINE_INLINE int imagine_blur_gaussian(imagine *dst, imagine *src, double sigma, unsigned char *scratch, unsigned int scratch_size)
+{
+  short kernel[2 * IMAGINE_GAUSSIAN_RADIUS_MAX + 1];
+  imagine_separable sep;
+  unsigned int needed = imagine_blur_gaussian_scratch_size(src, sigma);
+  unsigned int radius = imagine_gaussian_radius(sigma);
+  unsigned int width;
+  unsigned int height;
+  unsigned int k;
+  double total = 0.0;
+  int sum = 0;
+
+  if (!needed || !src->pixels || !imagine_linear(src) || !dst || !dst->pixels || !scratch || scratch_size < needed)
+  {
+    return 0;
+  }
+
+  width = src->width;
+  height = src->height;
+
+  if (height > dst->pixels_capacity / (width * src->stride))
+  {
+    return 0;
+  }
+
+  IMAGINE_ZONE_BEGIN("imagine_blur_gaussian");
+
+  for (k = 0; k <= 2 * radius; ++k)
+  {
+    double d = (double)k - (double)radius;
+    total += imagine_exp(-d * d / (2.0 * sigma * sigma));
+  }
+
+  for (k = 0; k <= 2 * radius; ++k)
+  {
+    double d = (double)k - (double)radius;
+    kernel[k] = (short)imagine_floor(imagine_exp(-d * d / (2.0 * sigma * sigma)) / total * (double)(1 << IMAGINE_RESIZE_WEIGHT_BITS) + 0.5);
+    sum += kernel[k];
+  }
+
+  /* Rounding error goes to the center tap so the kernel sums to exactly 1.0 */
+  kernel[radius] = (short)(kernel[radius] + (1 << IMAGINE_RESIZE_WEIGHT_BITS) - sum);
+
+  sep.taps_x = 2 * radius + 1 < width ? 2 * radius + 1 : width;
+  sep.taps_y = 2 * radius + 1 < height ? 2 * radius + 1 : height;
+  imagine_separable_carve(&sep, scratch, width, height, src->stride);
+  imagine_convolve_weights(width, kernel, radius, sep.taps_x, sep.starts_x, sep.weights_x);
+  imagine_convolve_weights(height, kernel, radius, sep.taps_y, sep.starts_y, sep.weights_y);
+  imagine_separable_run(dst->pixels, src, width, height, &sep);
+
+  dst->width = width;
+  dst->height = height;
+  dst->stride = src->stride;
+  dst->monochrome = src->monochrome;
+  dst->pixels_size = width * height * src->stride;
+  imagine_linear_output(dst);
+
+  IMAGINE_ZONE_END("imagine_blur_gaussian");
+
+  return 1;
+}
+
+/* Unsharp mask: dst = src + amount * (src - gaussian(src)). amount 1.0 doubles the
+ * local contrast, dst must not be src (the blurred image is built in dst first).
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_sharpen(imagine *dst, imagine *src, double sigma, double amount, unsigned char *scratch, unsigned int scratch_size)
+{
+  int gain = imagine_floor(amount * 256.0 + 0.5); /* Q8 */
+  unsigned int count;
+  unsigned int i = 0;
+
+  if (!dst || !src || dst->pixels == src->pixels || gain < 0 || gain > 32767 ||
+      !imagine_blur_gaussian(dst, src, sigma, scratch, scratch_size))
+  {
+    return 0;
+  }
+
+  count = dst->pixels_size;
+
+#ifdef IMAGINE_SSE2
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i g = _mm_set1_epi16((short)gain);
+    __m128i round = _mm_set1_epi32(128);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src->pixels + i)), zero);
+      __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(dst->pixels + i)), zero);
+      __m128i d = _mm_sub_epi16(a, b);
+      __m128i plo = _mm_mullo_epi16(d, g);
+      __m128i phi = _mm_mulhi_epi16(d, g);
+      __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(plo, phi), round), 8);
+      __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(plo, phi), round), 8);
+      __m128i v = _mm_adds_epi16(a, _mm_packs_epi32(lo, hi));
+
+      _mm_storel_epi64((__m128i *)(dst->pixels + i), _mm_packus_epi16(v, v));
+    }
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    int a = src->pixels[i];
+    int v = (((a - (int)dst->pixels[i]) * gain + 128) >> 8);
+
+    v = v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+    v += a;
+    dst->pixels[i] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+  }
+
+  return 1;
+}
+
+IMAGINE_API IMAGINE_INLINE unsigned char imagine_sobel_pixel(unsigned char *r0, unsigned char *r1, unsigned char *r2, unsigned int x, unsigned int w)
+{
+  unsigned int xl = x ? x - 1 : 0;
+  unsigned int xr = x + 1 < w ? x + 1 : x;
+  int gx = (r0[xr] - r0[xl]) + 2 * (r1[xr] - r1[xl]) + (r2[xr] - r2[xl]);
+  int gy = (r2[xl] - r0[xl]) + 2 * (r2[x] - r0[x]) + (r2[xr] - r0[xr]);
+
+  return (unsigned char)(((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy) + 4) >> 3);
+}
+
+/* Sobel gradient magnitude (|gx| + |gy|) / 8 of a gray image (stride 1) into dst,
+ * 0..255 without clipping. dst must not be src.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_sobel(imagine *dst, imagine *src)
+{
+  unsigned int w;
+  unsigned int h;
+  unsigned int y;
+
+#ifdef IMAGINE_SSE2
+  __m128i zero = _mm_setzero_si128();
+  __m128i round = _mm_set1_epi16(4);
+#endif
+
+  if (!dst || !src || !src->pixels || !dst->pixels || dst->pixels == src->pixels || src->stride != 1 || !imagine_linear(src) ||
+      !src->width || !src->height || src->height > dst->pixels_capacity / src->width)
+  {
+    return 0;
+  }
+
+  w = src->width;
+  h = src->height;
+
+  IMAGINE_ZONE_BEGIN("imagine_sobel");
+
+  for (y = 0; y < h; ++y)
+  {
+    unsigned char *r0 = src->pixels + (y ? y - 1 : 0) * w;
+    unsigned char *r1 = src->pixels + y * w;
+    unsigned char *r2 = src->pixels + (y + 1 < h ? y + 1 : y) * w;
+    unsigned char *out = dst->pixels + y * w;
+    unsigned int x = 1;
+
+    out[0] = imagine_sobel_pixel(r0, r1, r2, 0, w);
+
+#ifdef IMAGINE_SSE2
+    /* Interior columns, 8 at a time: x - 1 and x + 8 stay inside the row */
+    for (; x + 9 <= w; x += 8)
+    {
+      __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r0 + x - 1)), zero);
+      __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r1 + x - 1)), zero);
+      __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r2 + x - 1)), zero);
+      __m128i b0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r0 + x)), zero);
+      __m128i b2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r2 + x)), zero);
+      __m128i c0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r0 + x + 1)), zero);
+      __m128i c1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r1 + x + 1)), zero);
+      __m128i c2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r2 + x + 1)), zero);
+      __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(c0, a0), _mm_sub_epi16(c2, a2)), _mm_slli_epi16(_mm_sub_epi16(c1, a1), 1));
+      __m128i gy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(a2, a0), _mm_sub_epi16(c2, c0)), _mm_slli_epi16(_mm_sub_epi16(b2, b0), 1));
+      __m128i m = _mm_add_epi16(_mm_max_epi16(gx, _mm_sub_epi16(zero, gx)), _mm_max_epi16(gy, _mm_sub_epi16(zero, gy)));
+
+      m = _mm_srli_epi16(_mm_add_epi16(m, round), 3);
+      _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(m, m));
+    }
+#endif
+
+    for (; x < w; ++x)
+    {
+      out[x] = imagine_sobel_pixel(r0, r1, r2, x, w);
+    }
+  }
+
+  dst->width = w;
+  dst->height = h;
+  dst->stride = 1;
+  dst->monochrome = 1;
+  dst->pixels_size = w * h;
+  imagine_linear_output(dst);
+
+  IMAGINE_ZONE_END("imagine_sobel");
+
+  return 1;
+}
+
+/* ########################################################################## */
+/* PERCEPTUAL HASH */
+/* ########################################################################## */
+/* 64 bit perceptual hashes for finding near duplicate images:
+ *
+ *   IMAGINE_HASH_AVERAGE     aHash, 8x8 luma thumbnail compared against its mean
+ *   IMAGINE_HASH_DIFFERENCE  dHash, 9x8 thumbnail, each bit is a right > left gradient
+ *   IMAGINE_HASH_DCT         pHash, 8x8 low frequencies of the DCT of a 32x32 thumbnail
+ *                            compared against their median
+ *
+ * Similar images have hashes with a small Hamming distance (a few bits out of 64).
+ *
+ * imagine_hash_image averages every pixel of a decoded image into the thumbnail.
+ * imagine_hash_load skips the decode: for uncompressed files (binary PGM/PPM, 24/32 bit
+ * BMP, TGA and DDS) it reads IMAGINE_HASH_SAMPLES^2 pixels per thumbnail cell straight
+ * from the file, so the cost depends on the thumbnail size and not on the image size.
+ * Other files return 0 and have to be decoded first.
+ */
+#define IMAGINE_HASH_AVERAGE 0
+#define IMAGINE_HASH_DIFFERENCE 1
+#define IMAGINE_HASH_DCT 2
+
+#ifndef IMAGINE_HASH_SAMPLES
+#define IMAGINE_HASH_SAMPLES 4 /* samples per thumbnail cell and axis of imagine_hash_load */
+#endif
+
+typedef struct imagine_hash
+{
+  unsigned char bits[8]; /* bit i is bits[i / 8] >> (i % 8) */
+
+} imagine_hash;
+
+/* Pixel layout of a decoded image or of the pixel data inside an uncompressed file */
+typedef struct imagine_hash_source
+{
+  unsigned char *first; /* top row */
+  long pitch;           /* bytes from one row to the next, negative for bottom up files */
+  unsigned int width;
+  unsigned int height;
+  unsigned int bytes;  /* bytes per pixel */
+  unsigned int red;    /* byte offsets of the channels, all 0 for gray */
+  unsigned int green;
+  unsigned int blue;
+  unsigned int maxval; /* sample range, rescaled to 255 like the netpbm loader does */
+
+} imagine_hash_source;
+
+/* BT.601 luma of one pixel */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_hash_luma(imagine_hash_source *src, unsigned char *p)
+{
+  unsigned int r = p[src->red];
+  unsigned int g = p[src->green];
+  unsigned int b = p[src->blue];
+
+  if (src->maxval != 255)
+  {
+    r = (255U * r) / src->maxval;
+    g = (255U * g) / src->maxval;
+    b = (255U * b) / src->maxval;
+  }
+
+  return (77U * r + 150U * g + 29U * b + 128U) >> 8;
+}
+
+/* Mean luma of out_w x out_h equal areas of src. samples 0 averages every pixel of an
+ * area, otherwise samples x samples evenly spaced pixels.
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_hash_thumbnail(unsigned char *out, unsigned int out_w, unsigned int out_h, imagine_hash_source *src, unsigned int samples)
+{
+  unsigned int cx, cy, x, y;
+
+  for (cy = 0; cy < out_h; ++cy)
+  {
+    unsigned int y0 = cy * src->height / out_h;
+    unsigned int y1 = (cy + 1) * src->height / out_h;
+
+    if (y1 <= y0)
+    {
+      y1 = y0 + 1;
+    }
+
+    for (cx = 0; cx < out_w; ++cx)
+    {
+      unsigned int x0 = cx * src->width / out_w;
+      unsigned int x1 = (cx + 1) * src->width / out_w;
+      unsigned int sum = 0;
+      unsigned int n;
+
+      if (x1 <= x0)
+      {
+        x1 = x0 + 1;
+      }
+
+      if (samples)
+      {
+        unsigned int sx, sy;
+
+        for (sy = 0; sy < samples; ++sy)
+        {
+          y = y0 + (2 * sy + 1) * (y1 - y0) / (2 * samples);
+
+          for (sx = 0; sx < samples; ++sx)
+          {
+            x = x0 + (2 * sx + 1) * (x1 - x0) / (2 * samples);
+            sum += imagine_hash_luma(src, src->first + (long)y * src->pitch + x * src->bytes);
+          }
+        }
+
+        n = samples * samples;
+      }
+      else
+      {
+        for (y = y0; y < y1; ++y)
+        {
+          unsigned char *row = src->first + (long)y * src->pitch;
+
+          for (x = x0; x < x1; ++x)
+          {
+            sum += imagine_hash_luma(src, row + x * src->bytes);
+          }
+        }
+
+        n = (y1 - y0) * (x1 - x0);
+      }
+
+      out[cy * out_w + cx] = (unsigned char)((sum + n / 2) / n);
+    }
+  }
+}
+
+/* Hash of kind IMAGINE_HASH_* over src, see imagine_hash_thumbnail for samples */
+IMAGINE_API IMAGINE_INLINE int imagine_hash_compute(imagine_hash *hash, imagine_hash_source *src, int kind, unsigned int samples)
+{
+  unsigned char thumb[32 * 32];
+  unsigned int i;
+
+  for (i = 0; i < 8; ++i)
+  {
+    hash->bits[i] = 0;
+  }
+
+  if (kind == IMAGINE_HASH_AVERAGE)
+  {
+    unsigned int total = 0;
+
+    imagine_hash_thumbnail(thumb, 8, 8, src, samples);
+
+    for (i = 0; i < 64; ++i)
+    {
+      total += thumb[i];
+    }
+
+    for (i = 0; i < 64; ++i)
+    {
+      hash->bits[i >> 3] |= (unsigned char)((thumb[i] * 64U > total) << (i & 7));
+    }
+  }
+  else if (kind == IMAGINE_HASH_DIFFERENCE)
+  {
+    imagine_hash_thumbnail(thumb, 9, 8, src, samples);
+
+    for (i = 0; i < 64; ++i)
+    {
+      unsigned char *left = thumb + (i >> 3) * 9 + (i & 7);
+
+      hash->bits[i >> 3] |= (unsigned char)((left[1] > left[0]) << (i & 7));
+    }
+  }
+  else if (kind == IMAGINE_HASH_DCT)
+  {
+    double pi = 3.14159265358979323846;
+    double basis[8][32];
+    double rows[32][8];
+    double coeff[64];
+    double sorted[64];
+    double median;
+    unsigned int u, v, k;
+
+    imagine_hash_thumbnail(thumb, 32, 32, src, samples);
+
+    /* DCT-II basis of the 8 lowest frequencies, cos(a) = sin(a + pi / 2) */
+    for (u = 0; u < 8; ++u)
+    {
+      for (k = 0; k < 32; ++k)
+      {
+        basis[u][k] = imagine_sin((double)((2 * k + 1) * u) * pi / 64.0 + 0.5 * pi);
+      }
+    }
+
+    /* Rows first, only the 8 needed columns of the transform are computed */
+    for (k = 0; k < 32; ++k)
+    {
+      for (u = 0; u < 8; ++u)
+      {
+        double s = 0.0;
+
+        for (i = 0; i < 32; ++i)
+        {
+          s += (double)thumb[k * 32 + i] * basis[u][i];
+        }
+
+        rows[k][u] = s;
+      }
+    }
+
+    for (v = 0; v < 8; ++v)
+    {
+      for (u = 0; u < 8; ++u)
+      {
+        double s = 0.0;
+
+        for (k = 0; k < 32; ++k)
+        {
+          s += rows[k][u] * basis[v][k];
+        }
+
+        coeff[v * 8 + u] = s;
+      }
+    }
+
+    /* Insertion sort for the median */
+    for (i = 0; i < 64; ++i)
+    {
+      double c = coeff[i];
+
+      k = i;
+
+      while (k > 0 && sorted[k - 1] > c)
+      {
+        sorted[k] = sorted[k - 1];
+        --k;
+      }
+
+      sorted[k] = c;
+    }
+
+    median = 0.5 * (sorted[31] + sorted[32]);
+
+    for (i = 0; i < 64; ++i)
+    {
+      hash->bits[i >> 3] |= (unsigned char)((coeff[i] > median) << (i & 7));
+    }
+  }
+  else
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Hash of kind IMAGINE_HASH_* of a decoded image */
+IMAGINE_API IMAGINE_INLINE int imagine_hash_image(imagine_hash *hash, imagine *img, int kind)
+{
+  imagine_hash_source src;
+
+  if (!hash || !img || !img->pixels || !img->width || !img->height || !img->stride || img->layout != IMAGINE_LAYOUT_LINEAR)
+  {
+    return 0;
+  }
+
+  src.first = imagine_row(img, 0);
+  src.pitch = (long)imagine_pitch(img);
+  src.width = img->width;
+  src.height = img->height;
+  src.bytes = img->stride;
+  src.red = 0;
+  src.green = img->stride >= 3 ? 1U : 0U;
+  src.blue = img->stride >= 3 ? 2U : 0U;
+  src.maxval = 255;
+
+  return imagine_hash_compute(hash, &src, kind, 0);
+}
+
+/* Locates the pixel data of an uncompressed file, checked like the loaders do.
+ * Returns 0 for formats or variants that need a real decode.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_hash_probe(imagine_hash_source *src, unsigned char *buffer, unsigned int size)
+{
+  unsigned int w, h, bits, data, row;
+  int bottom_up = 0;
+  int bgr = 1;
+
+  src->maxval = 255;
+
+  if (size >= 2 && buffer[0] == 'P' && (buffer[1] == '5' || buffer[1] == '6'))
+  {
+    unsigned char *end = buffer + size;
+    unsigned char *p = buffer + 2;
+
+    p = imagine_ppm_parse_uint(p, end, &w);
+    p = imagine_ppm_parse_uint(p, end, &h);
+    p = imagine_ppm_parse_uint(p, end, &src->maxval);
+    p = imagine_ppm_skip(p, end);
+
+    if (src->maxval == 0)
+    {
+      return 0;
+    }
+
+    bits = buffer[1] == '5' ? 8U : 24U;
+    data = (unsigned int)(p - buffer);
+    bgr = 0;
+  }
+  else if (size >= 54 && buffer[0] == 'B' && buffer[1] == 'M')
+  {
+    bits = imagine_read16(buffer + 28);
+
+    if (imagine_read16(buffer + 26) != 1 || imagine_read32(buffer + 30) != 0 || (bits != 24 && bits != 32))
+    {
+      return 0;
+    }
+
+    w = imagine_read32(buffer + 18);
+    h = imagine_read32(buffer + 22);
+    data = imagine_read32(buffer + 10);
+    bottom_up = 1;
+  }
+  else if (size >= 18 && (buffer[2] == 2 || buffer[2] == 3))
+  {
+    bits = buffer[16];
+
+    if (bits != 8 && bits != 24 && bits != 32)
+    {
+      return 0;
+    }
+
+    w = imagine_read16(buffer + 12);
+    h = imagine_read16(buffer + 14);
+    data = 18U + buffer[0];
+  }
+  else if (size >= 128 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ')
+  {
+    bits = imagine_read32(buffer + 88);
+
+    if (imagine_read32(buffer + 76) != 32 || imagine_read32(buffer + 84) != 0 || (bits != 8 && bits != 24 && bits != 32))
+    {
+      return 0;
+    }
+
+    h = imagine_read32(buffer + 12);
+    w = imagine_read32(buffer + 16);
+    data = 128;
+  }
+  else
+  {
+    return 0;
+  }
+
+  /* Header widths are untrusted, w * bits + 31 must not wrap */
+  if (w == 0 || h == 0 || w > (0xFFFFFFFFU - 31U) / bits)
+  {
+    return 0;
+  }
+
+  /* BMP rows are padded to 4 bytes */
+  row = bottom_up ? ((w * bits + 31) / 32) * 4 : w * (bits / 8);
+
+  if (row == 0 || data > size || (size - data) / row < h)
+  {
+    return 0;
+  }
+
+  src->first = buffer + data;
+  src->pitch = (long)row;
+  src->width = w;
+  src->height = h;
+  src->bytes = bits / 8;
+
+  if (bottom_up)
+  {
+    src->first += (h - 1) * row;
+    src->pitch = -src->pitch;
+  }
+
+  if (src->bytes == 1)
+  {
+    src->red = src->green = src->blue = 0;
+  }
+  else
+  {
+    src->red = bgr ? 2U : 0U;
+    src->green = 1;
+    src->blue = bgr ? 0U : 2U;
+  }
+
+  return 1;
+}
+
+/* Hash of kind IMAGINE_HASH_* straight from an uncompressed file, 0 when it needs a decode */
+IMAGINE_API IMAGINE_INLINE int imagine_hash_load(imagine_hash *hash, unsigned char *buffer, unsigned int size, int kind)
+{
+  imagine_hash_source src;
+  int result;
+
+  IMAGINE_ZONE_BEGIN("imagine_hash_load");
+
+  result = hash && buffer && imagine_hash_probe(&src, buffer, size) && imagine_hash_compute(hash, &src, kind, IMAGINE_HASH_SAMPLES);
+
+  IMAGINE_ZONE_END("imagine_hash_load");
+
+  return result;
+}
+
+/* Number of differing bits */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_hash_distance(imagine_hash *a, imagine_hash *b)
+{
+  unsigned int n = 0;
+  unsigned int i;
+
+  for (i = 0; i < 8; ++i)
+  {
+    unsigned int v = (unsigned int)(a->bits[i] ^ b->bits[i]);
+
+    v = v - ((v >> 1) & 0x55U);
+    v = (v & 0x33U) + ((v >> 2) & 0x33U);
+    n += (v + (v >> 4)) & 0x0FU;
+  }
+
+  return n;
+}
+
+/* Distance from query to each of count hashes. The SSE2 path counts the bits of two
+ * hashes per step (nibble adds, then _mm_sad_epu8 sums the bytes of each half).
+ */
+IMAGINE_API IMAGINE_INLINE void imagine_hash_distances(unsigned char *out, imagine_hash *query, imagine_hash *hashes, unsigned int count)
+{
+  unsigned int i = 0;
+
+#ifdef IMAGINE_SSE2
+  __m128i q = _mm_loadl_epi64((const __m128i *)query->bits);
+  __m128i m1 = _mm_set1_epi8(0x55);
+  __m128i m2 = _mm_set1_epi8(0x33);
+  __m128i m4 = _mm_set1_epi8(0x0F);
+  __m128i zero = _mm_setzero_si128();
+
+  q = _mm_unpacklo_epi64(q, q);
+
+  for (; i + 2 <= count; i += 2)
+  {
+    __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(hashes + i)), q);
+
+    v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+    v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+    v = _mm_sad_epu8(_mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4), zero);
+
+    out[i] = (unsigned char)_mm_cvtsi128_si32(v);
+    out[i + 1] = (unsigned char)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    out[i] = (unsigned char)imagine_hash_distance(query, hashes + i);
+  }
+}
+
+/* Index of the hash closest to query within max_distance bits, count when there is none */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_hash_find(imagine_hash *query, imagine_hash *hashes, unsigned int count, unsigned int max_distance)
+{
+  unsigned char distances[64];
+  unsigned int best = count;
+  unsigned int best_distance = (max_distance < 64 ? max_distance : 64) + 1;
+  unsigned int i, k;
+
+  for (i = 0; i < count; i += 64)
+  {
+    unsigned int n = count - i < 64 ? count - i : 64;
+
+    imagine_hash_distances(distances, query, hashes + i, n);
+
+    for (k = 0; k < n; ++k)
+    {
+      if (distances[k] < best_distance)
+      {
+        best_distance = distances[k];
+        best = i + k;
+      }
+    }
+  }
+
+  return best;
+}
+
+/* ########################################################################## */
+/* COMPOSITING */
+/* ########################################################################## */
+/* Alpha compositing of RGBA (stride 4) imagine buffers in exact 8 bit arithmetic:
+ *
+ *   imagine_premultiply    c = round(c * a / 255), in place
+ *   imagine_unpremultiply  c = round(c * 255 / a), in place, 0 where a is 0
+ *   imagine_composite      dst = src <mode> dst on premultiplied pixels, in place on dst
+ *
+ * Blend modes, s and d are premultiplied source and destination channels, sa and da
+ * their alphas (all in 0..1):
+ *
+ *   IMAGINE_BLEND_OVER      s + d (1 - sa)
+ *   IMAGINE_BLEND_MULTIPLY  s d + s (1 - da) + d (1 - sa)
+ *   IMAGINE_BLEND_SCREEN    s + d - s d
+ *   IMAGINE_BLEND_ADD       min(s + d, 1)
+ *
+ * Alpha goes through the same formula, which is sa + da - sa da for the first three.
+ * Products use x * y / 255 = (t + (t >> 8)) >> 8 with t = x * y + 128, the exactly
+ * rounded result for all 8 bit inputs, so the SSE2 path (two pixels per 16 bit
+ * vector) matches the scalar one bit for bit.
+ *
+ * Loaded BMP/ICO alpha is straight: premultiply before compositing and unpremultiply
+ * the result if straight alpha is needed again.
+ */
+#define IMAGINE_BLEND_OVER 0
+#define IMAGINE_BLEND_MULTIPLY 1
+#define IMAGINE_BLEND_SCREEN 2
+#define IMAGINE_BLEND_ADD 3
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_mul255(unsigned int x, unsigned int y)
+{
+  unsigned int t = x * y + 128;
+
+  return (t + (t >> 8)) >> 8;
+}
+
+/* One channel, clamped to 255 for pixels that are not validly premultiplied */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_blend(unsigned int s, unsigned int d, unsigned int sa, unsigned int da, int mode)
+{
+  unsigned int v;
+
+  if (mode == IMAGINE_BLEND_OVER)
+  {
+    v = s + imagine_mul255(d, 255 - sa);
+  }
+  else if (mode == IMAGINE_BLEND_MULTIPLY)
+  {
+    v = imagine_mul255(s, d) + imagine_mul255(s, 255 - da) + imagine_mul255(d, 255 - sa);
+  }
+  else if (mode == IMAGINE_BLEND_SCREEN)
+  {
+    v = s + d - imagine_mul255(s, d);
+  }
+  else
+  {
+    v = s + d;
+  }
+
+  return v > 255 ? 255 : v;
+}
+
+#ifdef IMAGINE_SSE2
+IMAGINE_API IMAGINE_INLINE __m128i imagine_mul255_epi16(__m128i x, __m128i y)
+{
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/* Alpha of both pixels spread over their four lanes */
+IMAGINE_API IMAGINE_INLINE __m128i imagine_alpha_epi16(__m128i v)
+{
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/* imagine_blend on two pixels widened to 16 bit lanes, the clamp is left to the pack */
+IMAGINE_API IMAGINE_INLINE __m128i imagine_blend_epi16(__m128i s, __m128i d, int mode)
+{
+  __m128i full = _mm_set1_epi16(255);
+
+  if (mode == IMAGINE_BLEND_OVER)
+  {
+    return _mm_add_epi16(s, imagine_mul255_epi16(d, _mm_sub_epi16(full, imagine_alpha_epi16(s))));
+  }
+  else if (mode == IMAGINE_BLEND_MULTIPLY)
+  {
+    __m128i sd = imagine_mul255_epi16(s, d);
+    __m128i s1 = imagine_mul255_epi16(s, _mm_sub_epi16(full, imagine_alpha_epi16(d)));
+    __m128i d1 = imagine_mul255_epi16(d, _mm_sub_epi16(full, imagine_alpha_epi16(s)));
+
+    return _mm_add_epi16(_mm_add_epi16(sd, s1), d1);
+  }
+  else if (mode == IMAGINE_BLEND_SCREEN)
+  {
+    return _mm_sub_epi16(_mm_add_epi16(s, d), imagine_mul255_epi16(s, d));
+  }
+
+  return _mm_add_epi16(s, d);
+}
+#endif
+
+/* Scales color by alpha in place, stride 4 only */
+IMAGINE_API IMAGINE_INLINE int imagine_premultiply(imagine *img)
+{
+  unsigned char *p;
+  unsigned int n, i = 0;
+
+  if (!img || !img->pixels || img->stride != 4 || !imagine_linear(img))
+  {
+    return 0;
+  }
+
+  p = img->pixels;
+  n = img->width * img->height;
+
+#ifdef IMAGINE_SSE2
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i keep = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+      lo = _mm_or_si128(_mm_and_si128(keep, lo), _mm_andnot_si128(keep, imagine_mul255_epi16(lo, imagine_alpha_epi16(lo))));
+      hi = _mm_or_si128(_mm_and_si128(keep, hi), _mm_andnot_si128(keep, imagine_mul255_epi16(hi, imagine_alpha_epi16(hi))));
+
+      _mm_storeu_si128((__m128i *)(p + i * 4), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+
+  for (; i < n; ++i)
+  {
+    unsigned char *px = p + i * 4;
+    unsigned int a = px[3];
+
+    px[0] = (unsigned char)imagine_mul255(px[0], a);
+    px[1] = (unsigned char)imagine_mul255(px[1], a);
+    px[2] = (unsigned char)imagine_mul255(px[2], a);
+  }
+
+  return 1;
+}
+
+/* Divides color by alpha in place, stride 4 only. Uses ceil(2^24 / a) reciprocals,
+ * exact for every channel <= alpha, larger channels saturate to 255.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_unpremultiply(imagine *img)
+{
+  unsigned int recip[256];
+  unsigned char *p;
+  unsigned int n, i, c;
+
+  if (!img || !img->pixels || img->stride != 4 || !imagine_linear(img))
+  {
+    return 0;
+  }
 
-        b = palette[idx * 4 + 0];
-        g = palette[idx * 4 + 1];
-        r = palette[idx * 4 + 2];
+  recip[0] = 0;
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-      }
-    }
-    else if (bitCount == 4)
-    {
-      for (x = 0; x < width; ++x)
-      {
-        unsigned int byteIndex = x >> 1;
-        unsigned char idx;
+  for (i = 1; i < 256; ++i)
+  {
+    recip[i] = ((1U << 24) + i - 1) / i;
+  }
 
-        if ((x & 1) == 0)
-        {
-          idx = (row[byteIndex] >> 4) & 0xF;
-        }
-        else
-        {
-          idx = row[byteIndex] & 0xF;
-        }
+  p = img->pixels;
+  n = img->width * img->height;
 
-        b = palette[idx * 4 + 0];
-        g = palette[idx * 4 + 1];
-        r = palette[idx * 4 + 2];
+  for (i = 0; i < n; ++i, p += 4)
+  {
+    unsigned int a = p[3];
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-      }
+    /* Opaque pixels are unchanged */
+    if (a == 255)
+    {
+      continue;
     }
-    else if (bitCount == 8)
+
+    for (c = 0; c < 3; ++c)
     {
-      for (x = 0; x < width; ++x)
-      {
-        unsigned char idx = row[x];
+      unsigned int v = p[c] < a ? p[c] : a;
 
-        if (idx >= paletteEntries)
-        {
-          idx = 0;
-        }
+      p[c] = (unsigned char)(((v * 255 + a / 2) * recip[a]) >> 24);
+    }
+  }
 
-        b = palette[idx * 4 + 0];
-        g = palette[idx * 4 + 1];
-        r = palette[idx * 4 + 2];
+  return 1;
+}
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-      }
-    }
-    else if (bitCount == 16)
-    {
-      for (x = 0; x < width; ++x)
-      {
-        unsigned short px = (unsigned short)(row[x * 2] | (row[x * 2 + 1] << 8));
+/* dst = src <mode> dst, both premultiplied RGBA of the same size */
+IMAGINE_API IMAGINE_INLINE int imagine_composite(imagine *dst, imagine *src, int mode)
+{
+  unsigned char *s, *d;
+  unsigned int n, i = 0, c;
 
-        r = (px >> 10) & 0x1F;
-        g = (px >> 5) & 0x1F;
-        b = (px >> 0) & 0x1F;
-        r = (r * 255) / 31;
-        g = (g * 255) / 31;
-        b = (b * 255) / 31;
+  if (!dst || !src || !dst->pixels || !src->pixels || dst->stride != 4 || src->stride != 4 || !imagine_linear(dst) || !imagine_linear(src) ||
+      dst->width != src->width || dst->height != src->height || mode < IMAGINE_BLEND_OVER || mode > IMAGINE_BLEND_ADD)
+  {
+    return 0;
+  }
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-      }
-    }
-    else if (bitCount == 24)
+  IMAGINE_ZONE_BEGIN("imagine_composite");
+
+  s = src->pixels;
+  d = dst->pixels;
+  n = dst->width * dst->height;
+
+#ifdef IMAGINE_SSE2
+  {
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= n; i += 4)
     {
-      for (x = 0; x < width; ++x)
-      {
-        b = row[x * 3 + 0];
-        g = row[x * 3 + 1];
-        r = row[x * 3 + 2];
+      __m128i vs = _mm_loadu_si128((const __m128i *)(s + i * 4));
+      __m128i vd = _mm_loadu_si128((const __m128i *)(d + i * 4));
+      __m128i lo = imagine_blend_epi16(_mm_unpacklo_epi8(vs, zero), _mm_unpacklo_epi8(vd, zero), mode);
+      __m128i hi = imagine_blend_epi16(_mm_unpackhi_epi8(vs, zero), _mm_unpackhi_epi8(vd, zero), mode);
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-      }
+      _mm_storeu_si128((__m128i *)(d + i * 4), _mm_packus_epi16(lo, hi));
     }
-    else if (bitCount == 32)
-    {
-      for (x = 0; x < width; ++x)
-      {
-        b = row[x * 4 + 0];
-        g = row[x * 4 + 1];
-        r = row[x * 4 + 2];
-        a = row[x * 4 + 3];
+  }
+#endif
 
-        *dst++ = (unsigned char)r;
-        *dst++ = (unsigned char)g;
-        *dst++ = (unsigned char)b;
-        *dst++ = (unsigned char)a; /* keep alpha */
-      }
+  for (; i < n; ++i)
+  {
+    unsigned char *ps = s + i * 4;
+    unsigned char *pd = d + i * 4;
+    unsigned int sa = ps[3];
+    unsigned int da = pd[3];
+
+    for (c = 0; c < 4; ++c)
+    {
+      pd[c] = (unsigned char)imagine_blend(ps[c], pd[c], sa, da, mode);
     }
   }
 
+  IMAGINE_ZONE_END("imagine_composite");
+
   return 1;
 }
 
 /* ########################################################################## */
-/* TGA LOADER (uncompressed RGB/gray) */
+/* QUANTIZATION / DITHERING */
 /* ########################################################################## */
-IMAGINE_API int imagine_load_tga(imagine *img, unsigned char *buffer, unsigned int size)
+/* Reduction of gray, RGB or RGBA images (alpha is ignored) to an index plane of
+ * width * height bytes and a palette of up to 256 colors, for indexed output:
+ *
+ *   imagine_palette_median_cut  palette of up to colors entries for an image
+ *   imagine_quantize            indices into any palette, optionally dithered
+ *   imagine_palette_expand      indices back to RGB, for previews and error checks
+ *
+ * Colors are binned into a 32x32x32 grid (5 bits per channel). Median cut splits
+ * boxes of that grid's histogram instead of the pixels, then one pass over the image
+ * averages the real pixels of every box into its palette color.
+ *
+ * Nearest palette lookups go through the same grid: a cell is filled the first time a
+ * pixel lands in it, so the search over the palette (SSE2, 4 entries per step) runs once
+ * per used cell instead of once per pixel. A cell holds the palette entry that is nearest
+ * everywhere in it or, where several entries share the cell, a short list of every entry
+ * that can be nearest somewhere in it, searched per pixel. Lookups always equal
+ * imagine_palette_nearest.
+ * Floyd-Steinberg diffuses the real error (pixel minus chosen palette color) along
+ * serpentine rows. Ordered dithering adds an 8x8 Bayer offset of about one palette
+ * step.
+ */
+#define IMAGINE_QUANTIZE_CELLS 32768 /* 5 bits per channel */
+#define IMAGINE_QUANTIZE_POOL 65024  /* Bytes of candidate lists of shared cells, after the grid in the scratch */
+#define IMAGINE_QUANTIZE_SHARED 0xFFFF /* Grid value of a shared cell whose list did not fit, searched in full */
+
+#define IMAGINE_DITHER_NONE 0
+#define IMAGINE_DITHER_FLOYD_STEINBERG 1
+#define IMAGINE_DITHER_ORDERED 2
+
+typedef struct imagine_palette
 {
-  unsigned char idlen, type, bpp;
-  unsigned int w, h;
-  unsigned char *src;
-  unsigned char *dst;
-  unsigned int x, y;
+  unsigned int count;
+  unsigned char colors[256][3]; /* RGB */
 
-  if (size < 18)
+} imagine_palette;
+
+/* Median cut box in grid coordinates, bounds inclusive */
+typedef struct imagine_quantize_box
+{
+  unsigned int lo[3];
+  unsigned int hi[3];
+  unsigned int count; /* pixels */
+
+} imagine_quantize_box;
+
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_cell(unsigned int r, unsigned int g, unsigned int b)
+{
+  return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+
+/* Bytes of scratch needed by imagine_palette_median_cut and imagine_quantize, 0 for invalid arguments */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_scratch_size(imagine *src)
+{
+  unsigned int work = IMAGINE_QUANTIZE_CELLS * (unsigned int)sizeof(unsigned int);
+
+  if (!src || !src->width || !src->height || (src->stride != 1 && src->stride != 3 && src->stride != 4))
   {
     return 0;
   }
 
-  idlen = buffer[0];
-  type = buffer[2];
+  /* Histogram for median cut or two rows of Floyd-Steinberg errors */
+  if ((src->width + 2) * 6 * (unsigned int)sizeof(int) > work)
+  {
+    work = (src->width + 2) * 6 * (unsigned int)sizeof(int);
+  }
 
-  w = imagine_read16(buffer + 12);
-  h = imagine_read16(buffer + 14);
+  return 16 + IMAGINE_QUANTIZE_CELLS * (unsigned int)sizeof(unsigned short) + IMAGINE_QUANTIZE_POOL + work;
+}
 
-  bpp = buffer[16];
+/* Splits the scratch into the lookup grid, the candidate pool and the work area */
+IMAGINE_API IMAGINE_INLINE int imagine_quantize_carve(unsigned short **grid, unsigned char **work, imagine *src, unsigned char *scratch, unsigned int scratch_size)
+{
+  unsigned int size = imagine_quantize_scratch_size(src);
+  unsigned char *p;
 
-  if (w == 0 || h == 0)
+  if (!size || !src->pixels || !imagine_linear(src) || !scratch || scratch_size < size)
   {
     return 0;
   }
 
-  if (!(type == 2 || type == 3))
+  p = scratch + ((16u - (unsigned int)((unsigned long)scratch & 15u)) & 15u);
+  *grid = (unsigned short *)p;
+  *work = p + IMAGINE_QUANTIZE_CELLS * sizeof(unsigned short) + IMAGINE_QUANTIZE_POOL;
+
+  return 1;
+}
+
+/* Shrinks box to its occupied cells and counts its pixels */
+IMAGINE_API IMAGINE_INLINE void imagine_quantize_box_fit(imagine_quantize_box *box, unsigned int *hist)
+{
+  unsigned int lo[3] = {31, 31, 31};
+  unsigned int hi[3] = {0, 0, 0};
+  unsigned int r, g, b, c;
+
+  box->count = 0;
+
+  for (r = box->lo[0]; r <= box->hi[0]; ++r)
   {
-    return 0;
+    for (g = box->lo[1]; g <= box->hi[1]; ++g)
+    {
+      unsigned int *row = hist + (r << 10) + (g << 5);
+
+      for (b = box->lo[2]; b <= box->hi[2]; ++b)
+      {
+        if (row[b])
+        {
+          box->count += row[b];
+          lo[0] = r < lo[0] ? r : lo[0];
+          hi[0] = r > hi[0] ? r : hi[0];
+          lo[1] = g < lo[1] ? g : lo[1];
+          hi[1] = g > hi[1] ? g : hi[1];
+          lo[2] = b < lo[2] ? b : lo[2];
+          hi[2] = b > hi[2] ? b : hi[2];
+        }
+      }
+    }
   }
 
-  if (bpp == 8)
+  if (box->count)
   {
-    img->stride = 1;
-    img->monochrome = 1;
+    for (c = 0; c < 3; ++c)
+    {
+      box->lo[c] = lo[c];
+      box->hi[c] = hi[c];
+    }
   }
-  else if (bpp == 24)
+}
+
+/* Builds a palette of at most colors (1..256) entries for src */
+IMAGINE_API IMAGINE_INLINE int imagine_palette_median_cut(imagine_palette *palette, imagine *src, unsigned int colors, unsigned char *scratch, unsigned int scratch_size)
+{
+  imagine_quantize_box boxes[256];
+  double sums[256][3];
+  unsigned int counts[256];
+  unsigned short *grid;
+  unsigned int *hist;
+  unsigned char *work;
+  unsigned int n, i, k, c, r, g, b;
+  unsigned int step, green, blue;
+
+  if (!palette || colors < 1 || colors > 256 || !imagine_quantize_carve(&grid, &work, src, scratch, scratch_size))
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    return 0;
   }
-  else if (bpp == 32)
+
+  IMAGINE_ZONE_BEGIN("imagine_palette_median_cut");
+
+  hist = (unsigned int *)work;
+  n = src->width * src->height;
+  step = src->stride;
+  green = step >= 3 ? 1U : 0U;
+  blue = step >= 3 ? 2U : 0U;
+
+  for (i = 0; i < IMAGINE_QUANTIZE_CELLS; ++i)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    hist[i] = 0;
   }
-  else
+
+  for (i = 0; i < n; ++i)
   {
-    return 0;
-  }
+    unsigned char *p = src->pixels + i * step;
 
-  img->width = w;
-  img->height = h;
-  img->pixels_size = w * h * img->stride;
+    hist[imagine_quantize_cell(p[0], p[green], p[blue])]++;
+  }
 
-  if (img->pixels_capacity < img->pixels_size)
+  for (c = 0; c < 3; ++c)
   {
-    return 0;
+    boxes[0].lo[c] = 0;
+    boxes[0].hi[c] = 31;
   }
 
-  src = buffer + 18 + idlen;
-  dst = img->pixels;
+  imagine_quantize_box_fit(&boxes[0], hist);
+  palette->count = 1;
 
-  for (y = 0; y < h; ++y)
+  while (palette->count < colors)
   {
-    for (x = 0; x < w; ++x)
+    imagine_quantize_box *box;
+    imagine_quantize_box *next;
+    unsigned int marginal[32];
+    unsigned int best = 0;
+    unsigned int best_score = 0;
+    unsigned int axis = 0;
+    unsigned int half, sum, cut;
+
+    /* Largest population times extent, boxes of a single cell cannot split */
+    for (k = 0; k < palette->count; ++k)
     {
-      if (bpp == 8)
-      {
-        *dst++ = *src++;
-      }
-      else if (bpp == 24)
+      for (c = 0; c < 3; ++c)
       {
-        unsigned char b = *src++;
-        unsigned char g = *src++;
-        unsigned char r = *src++;
+        unsigned int extent = boxes[k].hi[c] - boxes[k].lo[c];
+        unsigned int score = extent * (boxes[k].count > 0x00FFFFFFu ? 0x00FFFFFFu : boxes[k].count);
 
-        *dst++ = r;
-        *dst++ = g;
-        *dst++ = b;
+        if (score > best_score)
+        {
+          best_score = score;
+          best = k;
+          axis = c;
+        }
       }
-      else if (bpp == 32)
+    }
+
+    if (!best_score)
+    {
+      break;
+    }
+
+    box = &boxes[best];
+
+    for (k = 0; k < 32; ++k)
+    {
+      marginal[k] = 0;
+    }
+
+    for (r = box->lo[0]; r <= box->hi[0]; ++r)
+    {
+      for (g = box->lo[1]; g <= box->hi[1]; ++g)
       {
-        unsigned char b = *src++;
-        unsigned char g = *src++;
-        unsigned char r = *src++;
+        for (b = box->lo[2]; b <= box->hi[2]; ++b)
+        {
+          marginal[axis == 0 ? r : axis == 1 ? g : b] += hist[(r << 10) + (g << 5) + b];
+        }
+      }
+    }
 
-        src++; /* skip alpha */
-        *dst++ = r;
-        *dst++ = g;
-        *dst++ = b;
+    /* Median along the axis, leaving at least one slice on each side */
+    half = box->count / 2;
+    sum = 0;
+
+    for (cut = box->lo[axis]; cut < box->hi[axis] - 1; ++cut)
+    {
+      sum += marginal[cut];
+
+      if (sum >= half)
+      {
+        break;
       }
     }
+
+    next = &boxes[palette->count++];
+    *next = *box;
+    box->hi[axis] = cut;
+    next->lo[axis] = cut + 1;
+
+    imagine_quantize_box_fit(box, hist);
+    imagine_quantize_box_fit(next, hist);
   }
 
-  return 1;
-}
+  /* Palette colors are the means of the real pixels in each box */
+  for (k = 0; k < palette->count; ++k)
+  {
+    for (r = boxes[k].lo[0]; r <= boxes[k].hi[0]; ++r)
+    {
+      for (g = boxes[k].lo[1]; g <= boxes[k].hi[1]; ++g)
+      {
+        for (b = boxes[k].lo[2]; b <= boxes[k].hi[2]; ++b)
+        {
+          grid[(r << 10) + (g << 5) + b] = (unsigned short)k;
+        }
+      }
+    }
 
-/* ########################################################################## */
-/* PCX LOADER (RLE, 8-bit or 24-bit) */
-/* ########################################################################## */
-IMAGINE_API int imagine_load_pcx(imagine *img, unsigned char *buffer, unsigned int size)
-{
-  unsigned char bpp, planes;
-  unsigned short xmin, ymin, xmax, ymax, w, h, bytes_per_line;
-  unsigned char *src, *end, *dst;
-  unsigned int y, p;
+    counts[k] = 0;
+    sums[k][0] = sums[k][1] = sums[k][2] = 0.0;
+  }
 
-  if (size < 128 || buffer[0] != 0x0A)
+  for (i = 0; i < n; ++i)
   {
-    return 0;
+    unsigned char *p = src->pixels + i * step;
+
+    k = grid[imagine_quantize_cell(p[0], p[green], p[blue])];
+    counts[k]++;
+    sums[k][0] += (double)p[0];
+    sums[k][1] += (double)p[green];
+    sums[k][2] += (double)p[blue];
   }
 
-  bpp = buffer[3];
-  xmin = imagine_read16(buffer + 4);
-  ymin = imagine_read16(buffer + 6);
-  xmax = imagine_read16(buffer + 8);
-  ymax = imagine_read16(buffer + 10);
-  w = (unsigned short)(xmax - xmin + 1);
-  h = (unsigned short)(ymax - ymin + 1);
-  planes = buffer[65];
-  bytes_per_line = imagine_read16(buffer + 66);
+  for (k = 0; k < palette->count; ++k)
+  {
+    for (c = 0; c < 3; ++c)
+    {
+      palette->colors[k][c] = (unsigned char)(counts[k] ? (unsigned int)(sums[k][c] / (double)counts[k] + 0.5) : 0U);
+    }
+  }
 
-  if (w == 0 || h == 0)
+  IMAGINE_ZONE_END("imagine_palette_median_cut");
+
+  return 1;
+}
+
+/* Brute force index of the palette color closest to r, g, b */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_palette_nearest(imagine_palette *palette, int r, int g, int b)
+{
+  unsigned int best = 0;
+  int best_distance = 3 * 256 * 256;
+  unsigned int k;
+
+  for (k = 0; k < palette->count; ++k)
   {
-    return 0;
+    int dr = r - (int)palette->colors[k][0];
+    int dg = g - (int)palette->colors[k][1];
+    int db = b - (int)palette->colors[k][2];
+    int distance = dr * dr + dg * dg + db * db;
+
+    if (distance < best_distance)
+    {
+      best_distance = distance;
+      best = k;
+    }
   }
 
-  if (planes == 1 && bpp == 8)
+  return best;
+}
+
+/* Palette prepared for the SSE2 search: per block of 4 entries the (r, g) and (b, 0)
+ * word pairs, so _mm_madd_epi16 of the differences gives 4 squared distances.
+ */
+typedef struct imagine_quantize_search
+{
+  imagine_palette *palette;
+  unsigned char *pool; /* Candidate lists of shared grid cells, 0 searches shared cells in full */
+  unsigned int pool_used;
+
+#ifdef IMAGINE_SSE2
+  __m128i rg[64];
+  __m128i b[64];
+  unsigned int blocks;
+#endif
+
+} imagine_quantize_search;
+
+IMAGINE_API IMAGINE_INLINE void imagine_quantize_search_init(imagine_quantize_search *search, imagine_palette *palette)
+{
+#ifdef IMAGINE_SSE2
+  short rg[512];
+  short b[512];
+  unsigned int k;
+
+  /* Padding entries sit far outside the color cube and never win */
+  for (k = 0; k < 256; ++k)
   {
-    img->stride = 1;
-    img->monochrome = 1;
+    rg[2 * k] = rg[2 * k + 1] = b[2 * k] = (short)(k < palette->count ? 0 : 4000);
+    b[2 * k + 1] = 0;
   }
-  else if (planes == 3 && bpp == 8)
+
+  for (k = 0; k < palette->count; ++k)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    rg[2 * k] = (short)palette->colors[k][0];
+    rg[2 * k + 1] = (short)palette->colors[k][1];
+    b[2 * k] = (short)palette->colors[k][2];
   }
-  else
+
+  search->blocks = (palette->count + 3) / 4;
+
+  for (k = 0; k < search->blocks; ++k)
   {
-    return 0;
+    search->rg[k] = _mm_loadu_si128((const __m128i *)(rg + 8 * k));
+    search->b[k] = _mm_loadu_si128((const __m128i *)(b + 8 * k));
   }
+#endif
 
-  img->width = w;
-  img->height = h;
-  img->pixels_size = w * h * img->stride;
+  search->palette = palette;
+  search->pool = 0;
+  search->pool_used = 0;
+}
 
-  if (img->pixels_capacity < img->pixels_size)
+/* Same result as imagine_palette_nearest (first entry of the smallest distance) */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_nearest(imagine_quantize_search *search, int r, int g, int b)
+{
+#ifdef IMAGINE_SSE2
+  __m128i qrg = _mm_set1_epi32(r | (g << 16));
+  __m128i qb = _mm_set1_epi32(b);
+  __m128i best = _mm_set1_epi32(0x7FFFFFFF);
+  __m128i best_index = _mm_setzero_si128();
+  __m128i index = _mm_set_epi32(3, 2, 1, 0);
+  __m128i four = _mm_set1_epi32(4);
+  int distances[4];
+  int indices[4];
+  unsigned int k, result;
+
+  for (k = 0; k < search->blocks; ++k)
   {
-    return 0;
+    __m128i d0 = _mm_sub_epi16(qrg, search->rg[k]);
+    __m128i d1 = _mm_sub_epi16(qb, search->b[k]);
+    __m128i distance = _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1));
+    __m128i less = _mm_cmplt_epi32(distance, best);
+
+    best = _mm_or_si128(_mm_and_si128(less, distance), _mm_andnot_si128(less, best));
+    best_index = _mm_or_si128(_mm_and_si128(less, index), _mm_andnot_si128(less, best_index));
+    index = _mm_add_epi32(index, four);
   }
 
-  src = buffer + 128;
-  end = buffer + size;
-  dst = img->pixels;
+  _mm_storeu_si128((__m128i *)distances, best);
+  _mm_storeu_si128((__m128i *)indices, best_index);
 
-  for (y = 0; y < h; ++y)
+  result = 0;
+
+  for (k = 1; k < 4; ++k)
   {
-    for (p = 0; p < planes; ++p)
+    if (distances[k] < distances[result] || (distances[k] == distances[result] && indices[k] < indices[result]))
     {
-      unsigned int filled = 0;
+      result = k;
+    }
+  }
 
-      while (filled < bytes_per_line && src < end)
-      {
-        unsigned char c = *src++;
+  return (unsigned int)indices[result];
+#else
+  return imagine_palette_nearest(search->palette, r, g, b);
+#endif
+}
 
-        if ((c & 0xC0) == 0xC0)
-        {
-          unsigned int run = c & 0x3F;
-          unsigned char val;
+/* Whether entry j is at least as near as entry k (ties to the lower index, like
+ * imagine_palette_nearest) for some color of the 8x8x8 cell starting at lo. The distance
+ * difference |p - k|^2 - |p - j|^2 = 2 p (j - k) + |k|^2 - |j|^2 is linear in p, so it
+ * is largest at one corner of the cell.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_quantize_contends(imagine_palette *palette, unsigned int j, unsigned int k, int lo[3])
+{
+  unsigned char *cj = palette->colors[j];
+  unsigned char *ck = palette->colors[k];
+  int worst = 0;
+  unsigned int c;
 
-          if (src >= end)
-          {
-            return 0;
-          }
+  for (c = 0; c < 3; ++c)
+  {
+    int d = (int)cj[c] - (int)ck[c];
 
-          val = *src++;
-          while (run-- && filled < bytes_per_line)
-          {
-            if (p < img->stride && filled < w)
-            {
-              dst[(y * w + filled) * img->stride + p] = val;
-            }
+    worst += 2 * (d > 0 ? lo[c] + 7 : lo[c]) * d + (int)ck[c] * (int)ck[c] - (int)cj[c] * (int)cj[c];
+  }
 
-            filled++;
-          }
-        }
-        else
-        {
-          if (p < img->stride && filled < w)
-          {
-            dst[(y * w + filled) * img->stride + p] = c;
-          }
+  return worst > 0 || (worst == 0 && j < k);
+}
 
-          filled++;
-        }
+/* Indices of the palette entries within squared distance limit of r, g, b in ascending
+ * order, returns their count
+ */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_within(imagine_quantize_search *search, int r, int g, int b, int limit, unsigned char *indices)
+{
+  unsigned int n = 0;
+  unsigned int k;
+#ifdef IMAGINE_SSE2
+  __m128i qrg = _mm_set1_epi32(r | (g << 16));
+  __m128i qb = _mm_set1_epi32(b);
+  __m128i bound = _mm_set1_epi32(limit + 1);
+
+  for (k = 0; k < search->blocks; ++k)
+  {
+    __m128i d0 = _mm_sub_epi16(qrg, search->rg[k]);
+    __m128i d1 = _mm_sub_epi16(qb, search->b[k]);
+    __m128i distance = _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1));
+    int mask = _mm_movemask_epi8(_mm_cmplt_epi32(distance, bound));
+    unsigned int lane;
+
+    /* Padding entries are far outside the color cube and never within limit */
+    for (lane = 0; mask; ++lane, mask >>= 4)
+    {
+      if (mask & 1)
+      {
+        indices[n++] = (unsigned char)(4 * k + lane);
       }
     }
   }
-
-  if (planes == 1 && bpp == 8)
+#else
+  for (k = 0; k < search->palette->count; ++k)
   {
-    unsigned char *pal;
-    unsigned char lut[256];
-    unsigned int i, n;
+    int dr = r - (int)search->palette->colors[k][0];
+    int dg = g - (int)search->palette->colors[k][1];
+    int db = b - (int)search->palette->colors[k][2];
 
-    if (size < 769)
+    if (dr * dr + dg * dg + db * db <= limit)
     {
-      return 0;
+      indices[n++] = (unsigned char)k;
     }
+  }
+#endif
 
-    pal = buffer + size - 769;
+  return n;
+}
 
-    if (*pal != 0x0C)
+/* Fills a grid cell: the entry k nearest to its center owns the cell unless another entry
+ * contends with k somewhere in it. The entries that can be nearest are then k and its
+ * contenders, stored in ascending index order as a count byte and the indices.
+ * Cell colors are at most 4 * sqrt(3) < 7 from the center (lo + 4), so a contender j is
+ * within sqrt(|c - k|^2) + 14 of the center, which limits the exact test to a few entries.
+ */
+IMAGINE_API IMAGINE_INLINE unsigned short imagine_quantize_fill(imagine_quantize_search *search, int r, int g, int b)
+{
+  imagine_palette *palette = search->palette;
+  unsigned char candidates[256];
+  unsigned char *list = 0;
+  unsigned char *color;
+  int lo[3];
+  int nearest;
+  int reach = 0;
+  int step;
+  unsigned int k, i, count;
+  unsigned int n = 0;
+
+  lo[0] = r & ~7;
+  lo[1] = g & ~7;
+  lo[2] = b & ~7;
+  k = imagine_quantize_nearest(search, lo[0] + 4, lo[1] + 4, lo[2] + 4);
+  color = palette->colors[k];
+  nearest = (lo[0] + 4 - color[0]) * (lo[0] + 4 - color[0]) + (lo[1] + 4 - color[1]) * (lo[1] + 4 - color[1]) + (lo[2] + 4 - color[2]) * (lo[2] + 4 - color[2]);
+
+  /* reach = ceil(sqrt(nearest)), at most 442 */
+  for (step = 256; step; step >>= 1)
+  {
+    if ((reach + step) * (reach + step) <= nearest)
     {
-      return 0;
+      reach += step;
     }
+  }
 
-    pal++;
+  reach += reach * reach < nearest ? 1 : 0;
+  count = imagine_quantize_within(search, lo[0] + 4, lo[1] + 4, lo[2] + 4, (reach + 14) * (reach + 14), candidates);
 
-    for (i = 0; i < 256; ++i)
-    {
-      unsigned char r = pal[i * 3 + 0];
-      unsigned char g = pal[i * 3 + 1];
-      unsigned char b = pal[i * 3 + 2];
+  if (search->pool && search->pool_used + 1 + count <= IMAGINE_QUANTIZE_POOL)
+  {
+    list = search->pool + search->pool_used;
+  }
 
-      lut[i] = (unsigned char)((r + g + b) / 3);
-    }
+  for (i = 0; i < count; ++i)
+  {
+    if (candidates[i] == k || imagine_quantize_contends(palette, candidates[i], k, lo))
+    {
+      if (!list && candidates[i] != k)
+      {
+        return IMAGINE_QUANTIZE_SHARED; /* No room for the list, search in full */
+      }
 
-    n = w * h;
+      if (list)
+      {
+        list[1 + n] = candidates[i];
+      }
 
-    for (i = 0; i < n; ++i)
-    {
-      img->pixels[i] = lut[img->pixels[i]];
+      ++n;
     }
   }
 
-  return 1;
+  if (n == 1)
+  {
+    return (unsigned short)(1 + k);
+  }
+
+  list[0] = (unsigned char)(n - 1);
+  search->pool_used += 1 + n;
+
+  return (unsigned short)(257 + (list - search->pool));
 }
 
-/* ########################################################################## */
-/* ICO LOADER (BMP only) */
-/* ########################################################################## */
-IMAGINE_API int imagine_load_ico(imagine *img, unsigned char *buffer, unsigned int size)
+/* imagine_quantize_lookup for cells not yet filled or shared between entries */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_lookup_shared(unsigned short *cell, imagine_quantize_search *search, int r, int g, int b)
 {
-  unsigned short reserved, type, count;
-  unsigned int offset;
+  unsigned char *list;
+  unsigned int best = 0;
+  int best_distance = 3 * 256 * 256;
+  unsigned int i, n;
 
-  if (size < 6)
+  if (!*cell)
   {
-    return 0;
-  }
+    *cell = imagine_quantize_fill(search, r, g, b);
 
-  reserved = imagine_read16(buffer);
-  type = imagine_read16(buffer + 2);
-  count = imagine_read16(buffer + 4);
+    if (*cell <= 256)
+    {
+      return *cell - 1U;
+    }
+  }
 
-  if (reserved != 0 || type != 1 || count < 1 || size < 22)
+  if (*cell == IMAGINE_QUANTIZE_SHARED)
   {
-    return 0;
+    return imagine_quantize_nearest(search, r, g, b);
   }
 
-  offset = imagine_read32(buffer + 18);
+  list = search->pool + (*cell - 257);
+  n = 1U + list[0];
 
-  if (offset >= size)
+  for (i = 1; i <= n; ++i)
   {
-    return 0;
+    unsigned char *color = search->palette->colors[list[i]];
+    int dr = r - (int)color[0];
+    int dg = g - (int)color[1];
+    int db = b - (int)color[2];
+    int distance = dr * dr + dg * dg + db * db;
+
+    /* Selects instead of branches, which candidate wins is data dependent */
+    best = distance < best_distance ? list[i] : best;
+    best_distance = distance < best_distance ? distance : best_distance;
   }
 
-  if (buffer[offset] == 0x89 && buffer[offset + 1] == 'P')
+  return best;
+}
+
+/* Palette index through the grid. Entries hold 0 until first use, index + 1, 257 + the
+ * pool offset of a candidate list or IMAGINE_QUANTIZE_SHARED.
+ */
+IMAGINE_API IMAGINE_INLINE unsigned int imagine_quantize_lookup(unsigned short *grid, imagine_quantize_search *search, int r, int g, int b)
+{
+  unsigned short *cell = grid + imagine_quantize_cell((unsigned int)r, (unsigned int)g, (unsigned int)b);
+
+  if (*cell - 1U < 256U)
   {
-    return 0;
+    return *cell - 1U;
   }
 
-  return imagine_load_bmp(img, buffer + offset, size - offset);
+  return imagine_quantize_lookup_shared(cell, search, r, g, b);
 }
 
-/* ########################################################################## */
-/* DDS LOADER (raw RGB/gray, no compression) */
-/* ########################################################################## */
-IMAGINE_API int imagine_load_dds(imagine *img, unsigned char *buffer, unsigned int size)
+IMAGINE_API IMAGINE_INLINE int imagine_quantize_clamp(int v)
 {
-  unsigned int h, w, pf_size, fourcc, bpp;
-  unsigned char *src, *end, *dst;
-  unsigned int x, y;
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
 
-  if (size < 128 || !(buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' '))
+/* Diffused error / 16 rounded. |e| stays below 16 * 256, the bias keeps the shift on
+ * a positive value.
+ */
+IMAGINE_API IMAGINE_INLINE int imagine_quantize_div16(int e)
+{
+  return ((e + 8 + 65536) >> 4) - 4096;
+}
+
+/* Writes width * height palette indices of src to indices */
+IMAGINE_API IMAGINE_INLINE int imagine_quantize(unsigned char *indices, imagine *src, imagine_palette *palette, int dither, unsigned char *scratch, unsigned int scratch_size)
+{
+  static const unsigned char bayer[64] = {
+      0, 32, 8, 40, 2, 34, 10, 42,
+      48, 16, 56, 24, 50, 18, 58, 26,
+      12, 44, 4, 36, 14, 46, 6, 38,
+      60, 28, 52, 20, 62, 30, 54, 22,
+      3, 35, 11, 43, 1, 33, 9, 41,
+      51, 19, 59, 27, 49, 17, 57, 25,
+      15, 47, 7, 39, 13, 45, 5, 37,
+      63, 31, 55, 23, 61, 29, 53, 21};
+  imagine_quantize_search search;
+  unsigned short *grid;
+  unsigned char *work;
+  unsigned int w, h, x, y, i, step, green, blue;
+
+  if (!indices || !palette || palette->count < 1 || palette->count > 256 || dither < IMAGINE_DITHER_NONE || dither > IMAGINE_DITHER_ORDERED ||
+      !imagine_quantize_carve(&grid, &work, src, scratch, scratch_size))
   {
     return 0;
   }
 
-  h = imagine_read32(buffer + 12);
-  w = imagine_read32(buffer + 16);
-  pf_size = imagine_read32(buffer + 76);
-  fourcc = imagine_read32(buffer + 84);
-  bpp = imagine_read32(buffer + 88);
+  IMAGINE_ZONE_BEGIN("imagine_quantize");
 
-  if (w == 0 || h == 0 || pf_size != 32 || fourcc != 0)
-  {
-    return 0;
-  }
+  w = src->width;
+  h = src->height;
+  step = src->stride;
+  green = step >= 3 ? 1U : 0U;
+  blue = step >= 3 ? 2U : 0U;
 
-  if (bpp == 24)
-  {
-    img->stride = 3;
-    img->monochrome = 0;
-  }
-  else if (bpp == 32)
+  imagine_quantize_search_init(&search, palette);
+  search.pool = (unsigned char *)(grid + IMAGINE_QUANTIZE_CELLS);
+
+  for (i = 0; i < IMAGINE_QUANTIZE_CELLS; ++i)
   {
-    img->stride = 3;
-    img->monochrome = 0;
+    grid[i] = 0;
   }
-  else if (bpp == 8)
+
+  if (dither == IMAGINE_DITHER_NONE)
   {
-    img->stride = 1;
-    img->monochrome = 1;
+    for (i = 0; i < w * h; ++i)
+    {
+      unsigned char *p = src->pixels + i * step;
+
+      indices[i] = (unsigned char)imagine_quantize_lookup(grid, &search, p[0], p[green], p[blue]);
+    }
   }
-  else
+  else if (dither == IMAGINE_DITHER_ORDERED)
   {
-    return 0;
-  }
+    /* Offset spread of one palette step, taking the palette as a cube of s^3 colors */
+    int spread;
+    unsigned int s = 1;
 
-  img->width = w;
-  img->height = h;
-  img->pixels_size = w * h * img->stride;
+    while (s * s * s < palette->count)
+    {
+      ++s;
+    }
 
-  if (img->pixels_capacity < img->pixels_size)
-  {
-    return 0;
-  }
+    spread = (int)(256 / s);
 
-  src = buffer + 128;
-  end = buffer + size;
+    for (y = 0; y < h; ++y)
+    {
+      for (x = 0; x < w; ++x)
+      {
+        unsigned char *p = src->pixels + (y * w + x) * step;
+        int offset = ((int)(2 * bayer[(y & 7) * 8 + (x & 7)] + 1) - 64) * spread / 128;
 
-  if ((unsigned int)(end - src) < img->pixels_size)
-  {
-    return 0;
+        indices[y * w + x] = (unsigned char)imagine_quantize_lookup(grid, &search,
+                                                                    imagine_quantize_clamp(p[0] + offset),
+                                                                    imagine_quantize_clamp(p[green] + offset),
+                                                                    imagine_quantize_clamp(p[blue] + offset));
+      }
+    }
   }
+  else
+  {
+    /* Errors * 16 of the current and the next row, one pixel of padding on both sides */
+    int *cur = (int *)work;
+    int *next = cur + (w + 2) * 3;
 
-  dst = img->pixels;
+    for (i = 0; i < (w + 2) * 6; ++i)
+    {
+      cur[i] = 0;
+    }
 
-  for (y = 0; y < h; ++y)
-  {
-    for (x = 0; x < w; ++x)
+    for (y = 0; y < h; ++y)
     {
-      if (bpp == 24)
-      {
-        unsigned char b = *src++, g = *src++, r = *src++;
+      int dir = (y & 1) ? -1 : 1;
+      int *swap;
 
-        *dst++ = r;
-        *dst++ = g;
-        *dst++ = b;
-      }
-      else if (bpp == 32)
+      for (i = 0; i < w; ++i)
       {
-        unsigned char b = *src++, g = *src++, r = *src++;
-
-        src++;
-        *dst++ = r;
-        *dst++ = g;
-        *dst++ = b;
+        unsigned int xx = (y & 1) ? w - 1 - i : i;
+        unsigned char *p = src->pixels + (y * w + xx) * step;
+        int *e = cur + (xx + 1) * 3;
+        int *ahead = e + dir * 3;
+        int *below = next + (xx + 1) * 3;
+        int *behind = below - dir * 3;
+        int *diagonal = below + dir * 3;
+        int r = imagine_quantize_clamp(p[0] + imagine_quantize_div16(e[0]));
+        int g = imagine_quantize_clamp(p[green] + imagine_quantize_div16(e[1]));
+        int b = imagine_quantize_clamp(p[blue] + imagine_quantize_div16(e[2]));
+        unsigned int k = imagine_quantize_lookup(grid, &search, r, g, b);
+
+        indices[y * w + xx] = (unsigned char)k;
+
+        r -= (int)palette->colors[k][0];
+        g -= (int)palette->colors[k][1];
+        b -= (int)palette->colors[k][2];
+
+        ahead[0] += r * 7;
+        ahead[1] += g * 7;
+        ahead[2] += b * 7;
+        behind[0] += r * 3;
+        behind[1] += g * 3;
+        behind[2] += b * 3;
+        below[0] += r * 5;
+        below[1] += g * 5;
+        below[2] += b * 5;
+        diagonal[0] += r;
+        diagonal[1] += g;
+        diagonal[2] += b;
       }
-      else if (bpp == 8)
+
+      swap = cur;
+      cur = next;
+      next = swap;
+
+      for (i = 0; i < (w + 2) * 3; ++i)
       {
-        *dst++ = *src++;
+        next[i] = 0;
       }
     }
   }
 
+  IMAGINE_ZONE_END("imagine_quantize");
+
   return 1;
 }
 
-/* ########################################################################## */
-/* DISPATCHER */
-/* ########################################################################## */
-IMAGINE_API IMAGINE_INLINE int imagine_load(imagine *img, unsigned char *buf, unsigned int size)
+/* Palette colors of width * height indices into dst (stride 3) */
+IMAGINE_API IMAGINE_INLINE int imagine_palette_expand(imagine *dst, unsigned char *indices, unsigned int width, unsigned int height, imagine_palette *palette)
 {
-  if (size >= 2 && buf[0] == 'P')
-  {
-    if (buf[1] >= '1' && buf[1] <= '6')
-    {
-      return imagine_load_netpbm(img, buf, size);
-    }
-
-    if (buf[1] == '7')
-    {
-      return imagine_load_netpbm(img, buf, size); /* PAM partial */
-    }
-  }
-
-  if (size >= 2 && buf[0] == 'B' && buf[1] == 'M')
-  {
-    return imagine_load_bmp(img, buf, size);
-  }
+  imagine src = {0};
+  unsigned int n, i;
 
-  if (size >= 18 && (buf[2] == 2 || buf[2] == 3))
-  {
-    return imagine_load_tga(img, buf, size);
-  }
+  src.pixels = indices;
+  src.width = width;
+  src.height = height;
 
-  if (size >= 4 && buf[0] == 0x0A)
+  if (!palette || !(n = imagine_color_prepare(dst, &src, 3, 0)))
   {
-    return imagine_load_pcx(img, buf, size);
+    return 0;
   }
 
-  if (size >= 4 && buf[0] == 'D' && buf[1] == 'D' && buf[2] == 'S')
+  for (i = 0; i < n; ++i)
   {
-    return imagine_load_dds(img, buf, size);
-  }
+    unsigned char *c = palette->colors[indices[i] < palette->count ? indices[i] : 0];
 
-  if (size >= 6 && imagine_read16(buf + 2) == 1)
-  {
-    return imagine_load_ico(img, buf, size);
+    dst->pixels[i * 3 + 0] = c[0];
+    dst->pixels[i * 3 + 1] = c[1];
+    dst->pixels[i * 3 + 2] = c[2];
   }
 
-  return 0;
+  return 1;
 }
 
 #endif /* IMAGINE_H */
@@ -6,3 +6,20 @@ set SOURCE_NAME=imagine_test
 
 cc -s -O2 %DEF_FLAGS_COMPILER% -o %SOURCE_NAME%.exe %SOURCE_NAME%.c %DEF_FLAGS_LINKER%
 %SOURCE_NAME%.exe
+
+REM Statistics and histogram build on the scalar paths: runs the stats and histogram tests
+cc -s -O2 %DEF_FLAGS_COMPILER% -DIMAGINE_STATS -DIMAGINE_HISTOGRAM -DIMAGINE_NO_SIMD -o %SOURCE_NAME%_stats.exe %SOURCE_NAME%.c %DEF_FLAGS_LINKER%
+%SOURCE_NAME%_stats.exe
+
+REM Profiler build: runs the performance gate, zones, bench, percentile and compare tests
+cc -s -O2 %DEF_FLAGS_COMPILER% -DPERF_STATS_ENABLE -DPERF_STATS_HISTOGRAM -o %SOURCE_NAME%_perf.exe %SOURCE_NAME%.c %DEF_FLAGS_LINKER%
+%SOURCE_NAME%_perf.exe
+
+REM Multithreaded profiler build: per-thread tables and the merge (the threads test itself needs pthreads)
+cc -s -O2 %DEF_FLAGS_COMPILER% -DPERF_STATS_ENABLE -DPERF_STATS_HISTOGRAM -DPERF_STATS_THREADS=8 -o %SOURCE_NAME%_threads.exe %SOURCE_NAME%.c %DEF_FLAGS_LINKER%
+%SOURCE_NAME%_threads.exe
+
+REM Decode benchmark (synthetic images up to 8192x8192, add -DIMAGINE_BENCH_MAX_DIM=1024 for a quick run)
+set BENCH_NAME=imagine_bench
+
+cc -s -O2 %DEF_FLAGS_COMPILER% -o %BENCH_NAME%.exe %BENCH_NAME%.c %DEF_FLAGS_LINKER%
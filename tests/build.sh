@@ -0,0 +1,22 @@
+#!/bin/sh
+# Builds and runs the tests, then builds the decode benchmark (run ./imagine_bench)
+# Add -DIMAGINE_BENCH_MAX_DIM=1024 to the benchmark build for a quick run
+
+DEF_FLAGS_COMPILER="-std=c89 -pedantic -Wall -Wextra -Werror -Wvla -Wconversion -Wdouble-promotion -Wsign-conversion -Wmissing-field-initializers -Wuninitialized -Winit-self -Wunused -Wunused-macros -Wunused-local-typedefs"
+DEF_FLAGS_LINKER=""
+SOURCE_NAME=imagine_test
+BENCH_NAME=imagine_bench
+
+cc -s -O2 $DEF_FLAGS_COMPILER -o $SOURCE_NAME $SOURCE_NAME.c $DEF_FLAGS_LINKER && ./$SOURCE_NAME || exit 1
+
+# Statistics and histogram build on the scalar paths: runs the stats and histogram tests
+cc -s -O2 $DEF_FLAGS_COMPILER -DIMAGINE_STATS -DIMAGINE_HISTOGRAM -DIMAGINE_NO_SIMD -o ${SOURCE_NAME}_stats $SOURCE_NAME.c $DEF_FLAGS_LINKER && ./${SOURCE_NAME}_stats || exit 1
+
+# Profiler build: runs the performance gate, calibration, hardware counter (skipped without PMU access),
+# zones, bench, percentile and compare tests
+cc -s -O2 $DEF_FLAGS_COMPILER -DPERF_STATS_ENABLE -DPERF_STATS_HISTOGRAM -DPERF_HW_COUNTERS -o ${SOURCE_NAME}_perf $SOURCE_NAME.c $DEF_FLAGS_LINKER && ./${SOURCE_NAME}_perf || exit 1
+
+# Multithreaded profiler build: per-thread tables, slot claiming and the merge, run by the threads test
+cc -s -O2 $DEF_FLAGS_COMPILER -DPERF_STATS_ENABLE -DPERF_STATS_HISTOGRAM -DPERF_STATS_THREADS=8 -o ${SOURCE_NAME}_threads $SOURCE_NAME.c $DEF_FLAGS_LINKER -lpthread && ./${SOURCE_NAME}_threads || exit 1
+
+cc -s -O2 $DEF_FLAGS_COMPILER -o $BENCH_NAME $BENCH_NAME.c $DEF_FLAGS_LINKER
@@ -0,0 +1,637 @@
+/* imagine.h - v0.2 - public domain data structures - nickscha 2025
+
+A C89 standard compliant, single header, nostdlib (no C Standard Library) Image Library (IMAGINE).
+
+This Benchmark decodes deterministic, in-memory generated images of every supported format
+variant at sizes from 16x16 up to IMAGINE_BENCH_MAX_DIM and reports Mpix/s and MB/s (input bytes).
+
+  -DIMAGINE_BENCH_MAX_DIM=1024 limits the largest size (default 8192, needs ~0.6 GB of memory)
+
+Variants whose encoded size exceeds the input buffer (ASCII netpbm at the largest sizes) are skipped.
+
+LICENSE
+
+  Placed in the public domain and also MIT licensed.
+  See end of file for detailed license information.
+
+*/
+#include "../deps/pio.h"  /* Read/Write Files            */
+#include "../deps/perf.h" /* Simple Performance profiler */
+#include "../imagine.h"   /* Image Library               */
+
+#ifndef IMAGINE_BENCH_MAX_DIM
+#define IMAGINE_BENCH_MAX_DIM 8192
+#endif
+
+#ifndef IMAGINE_BENCH_PIXEL_BUDGET
+#define IMAGINE_BENCH_PIXEL_BUDGET (1UL << 24) /* Pixels decoded per variant and size, sets the iterations */
+#endif
+
+#define IMAGINE_BENCH_MIN_ITERATIONS 3
+#define IMAGINE_BENCH_MAX_ITERATIONS 1000
+#define IMAGINE_BENCH_HEADER_SIZE 2048 /* Headers and palettes */
+#define IMAGINE_BENCH_INPUT_SIZE (IMAGINE_BENCH_HEADER_SIZE + 4UL * IMAGINE_BENCH_MAX_DIM * IMAGINE_BENCH_MAX_DIM)
+#define IMAGINE_BENCH_OUTPUT_SIZE (4UL * IMAGINE_BENCH_MAX_DIM * IMAGINE_BENCH_MAX_DIM)
+
+static unsigned char imagine_bench_input[IMAGINE_BENCH_INPUT_SIZE];
+static unsigned char imagine_bench_output[IMAGINE_BENCH_OUTPUT_SIZE];
+
+/* ########################################################################## */
+/* WRITER */
+/* ########################################################################## */
+typedef struct imagine_bench_writer
+{
+  unsigned char *data;
+  unsigned long size;
+  unsigned long capacity;
+  int overflow;
+
+} imagine_bench_writer;
+
+static void imagine_bench_put8(imagine_bench_writer *w, unsigned int value)
+{
+  if (w->size >= w->capacity)
+  {
+    w->overflow = 1;
+    return;
+  }
+
+  w->data[w->size++] = (unsigned char)value;
+}
+
+static void imagine_bench_put16(imagine_bench_writer *w, unsigned int value)
+{
+  imagine_bench_put8(w, value & 0xFF);
+  imagine_bench_put8(w, (value >> 8) & 0xFF);
+}
+
+static void imagine_bench_put32(imagine_bench_writer *w, unsigned int value)
+{
+  imagine_bench_put16(w, value & 0xFFFF);
+  imagine_bench_put16(w, (value >> 16) & 0xFFFF);
+}
+
+static void imagine_bench_put_zeros(imagine_bench_writer *w, unsigned int count)
+{
+  while (count--)
+  {
+    imagine_bench_put8(w, 0);
+  }
+}
+
+/* Decimal number followed by a separator (netpbm) */
+static void imagine_bench_put_uint(imagine_bench_writer *w, unsigned int value, unsigned char separator)
+{
+  unsigned char digits[10];
+  unsigned int count = 0;
+
+  do
+  {
+    digits[count++] = (unsigned char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+
+  while (count)
+  {
+    imagine_bench_put8(w, digits[--count]);
+  }
+
+  imagine_bench_put8(w, separator);
+}
+
+/* ########################################################################## */
+/* SYNTHETIC CONTENT */
+/* ########################################################################## */
+
+/* Diagonal gradient per channel with a few bits of hashed noise: deterministic,
+ * no long runs (so RLE formats are mostly literal) and every palette index is used.
+ */
+static unsigned char imagine_bench_sample(unsigned int x, unsigned int y, unsigned int channel)
+{
+  unsigned int hash = x * 73856093U ^ y * 19349663U ^ channel * 83492791U;
+
+  hash ^= hash >> 13;
+  hash *= 0x5BD1E995U;
+  hash ^= hash >> 15;
+
+  return (unsigned char)((x + 2 * y + channel * 85 + (hash & 0x1F)) & 0xFF);
+}
+
+/* ########################################################################## */
+/* GENERATORS (param selects the variant) */
+/* ########################################################################## */
+static void imagine_bench_netpbm(imagine_bench_writer *w, unsigned int dim, unsigned int fmt)
+{
+  unsigned int x, y, c;
+
+  imagine_bench_put8(w, 'P');
+  imagine_bench_put8(w, fmt);
+  imagine_bench_put8(w, '\n');
+  imagine_bench_put_uint(w, dim, ' ');
+  imagine_bench_put_uint(w, dim, '\n');
+
+  if (fmt != '1' && fmt != '4')
+  {
+    imagine_bench_put_uint(w, 255, '\n');
+  }
+
+  for (y = 0; y < dim && !w->overflow; ++y)
+  {
+    if (fmt == '4')
+    {
+      for (x = 0; x < dim; x += 8)
+      {
+        unsigned int byte = 0;
+
+        for (c = 0; c < 8; ++c)
+        {
+          unsigned int bit = x + c < dim ? imagine_bench_sample(x + c, y, 0) & 1U : 0;
+          byte |= bit << (7 - c);
+        }
+
+        imagine_bench_put8(w, byte);
+      }
+
+      continue;
+    }
+
+    for (x = 0; x < dim; ++x)
+    {
+      if (fmt == '1')
+      {
+        imagine_bench_put_uint(w, imagine_bench_sample(x, y, 0) & 1U, x + 1 < dim ? ' ' : '\n');
+      }
+      else if (fmt == '2')
+      {
+        imagine_bench_put_uint(w, imagine_bench_sample(x, y, 0), x + 1 < dim ? ' ' : '\n');
+      }
+      else if (fmt == '3')
+      {
+        imagine_bench_put_uint(w, imagine_bench_sample(x, y, 0), ' ');
+        imagine_bench_put_uint(w, imagine_bench_sample(x, y, 1), ' ');
+        imagine_bench_put_uint(w, imagine_bench_sample(x, y, 2), x + 1 < dim ? ' ' : '\n');
+      }
+      else if (fmt == '5')
+      {
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+      }
+      else
+      {
+        for (c = 0; c < 3; ++c)
+        {
+          imagine_bench_put8(w, imagine_bench_sample(x, y, c));
+        }
+      }
+    }
+  }
+}
+
+static void imagine_bench_bmp(imagine_bench_writer *w, unsigned int dim, unsigned int bits)
+{
+  unsigned int palette_entries = bits <= 8 ? 1U << bits : 0;
+  unsigned int row_size = ((dim * bits + 31) / 32) * 4;
+  unsigned int offset = 54 + palette_entries * 4;
+  unsigned int x, y, i;
+
+  /* BITMAPFILEHEADER */
+  imagine_bench_put8(w, 'B');
+  imagine_bench_put8(w, 'M');
+  imagine_bench_put32(w, offset + row_size * dim);
+  imagine_bench_put32(w, 0);
+  imagine_bench_put32(w, offset);
+
+  /* BITMAPINFOHEADER */
+  imagine_bench_put32(w, 40);
+  imagine_bench_put32(w, dim);
+  imagine_bench_put32(w, dim);
+  imagine_bench_put16(w, 1);
+  imagine_bench_put16(w, bits);
+  imagine_bench_put32(w, 0); /* BI_RGB */
+  imagine_bench_put32(w, row_size * dim);
+  imagine_bench_put32(w, 2835);
+  imagine_bench_put32(w, 2835);
+  imagine_bench_put32(w, 0);
+  imagine_bench_put32(w, 0);
+
+  /* Palette (BGRA) */
+  for (i = 0; i < palette_entries; ++i)
+  {
+    unsigned int value = (i * 255) / (palette_entries - 1);
+
+    imagine_bench_put8(w, value);
+    imagine_bench_put8(w, 255 - value);
+    imagine_bench_put8(w, (value * 7) & 0xFF);
+    imagine_bench_put8(w, 0);
+  }
+
+  for (y = 0; y < dim && !w->overflow; ++y)
+  {
+    unsigned long row_start = w->size;
+
+    if (bits < 8)
+    {
+      unsigned int per_byte = 8 / bits;
+
+      for (x = 0; x < dim; x += per_byte)
+      {
+        unsigned int byte = 0;
+
+        for (i = 0; i < per_byte; ++i)
+        {
+          unsigned int index = x + i < dim ? imagine_bench_sample(x + i, y, 0) & ((1U << bits) - 1) : 0;
+          byte |= index << (8 - bits * (i + 1));
+        }
+
+        imagine_bench_put8(w, byte);
+      }
+    }
+    else
+    {
+      for (x = 0; x < dim; ++x)
+      {
+        if (bits == 8)
+        {
+          imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+        }
+        else if (bits == 16)
+        {
+          unsigned int r = imagine_bench_sample(x, y, 0) >> 3;
+          unsigned int g = imagine_bench_sample(x, y, 1) >> 3;
+          unsigned int b = imagine_bench_sample(x, y, 2) >> 3;
+
+          imagine_bench_put16(w, (r << 10) | (g << 5) | b);
+        }
+        else
+        {
+          imagine_bench_put8(w, imagine_bench_sample(x, y, 2));
+          imagine_bench_put8(w, imagine_bench_sample(x, y, 1));
+          imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+
+          if (bits == 32)
+          {
+            imagine_bench_put8(w, 255);
+          }
+        }
+      }
+    }
+
+    imagine_bench_put_zeros(w, row_size - (unsigned int)(w->size - row_start));
+  }
+}
+
+static void imagine_bench_tga(imagine_bench_writer *w, unsigned int dim, unsigned int bpp)
+{
+  unsigned int x, y;
+
+  imagine_bench_put8(w, 0);                 /* id length */
+  imagine_bench_put8(w, 0);                 /* no color map */
+  imagine_bench_put8(w, bpp == 8 ? 3 : 2);  /* uncompressed gray / true color */
+  imagine_bench_put_zeros(w, 5);            /* color map specification */
+  imagine_bench_put16(w, 0);                /* x origin */
+  imagine_bench_put16(w, 0);                /* y origin */
+  imagine_bench_put16(w, dim);
+  imagine_bench_put16(w, dim);
+  imagine_bench_put8(w, bpp);
+  imagine_bench_put8(w, bpp == 32 ? 8 : 0); /* alpha bits */
+
+  for (y = 0; y < dim && !w->overflow; ++y)
+  {
+    for (x = 0; x < dim; ++x)
+    {
+      if (bpp == 8)
+      {
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+      }
+      else
+      {
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 2));
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 1));
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+
+        if (bpp == 32)
+        {
+          imagine_bench_put8(w, 255);
+        }
+      }
+    }
+  }
+}
+
+static void imagine_bench_pcx(imagine_bench_writer *w, unsigned int dim, unsigned int planes)
+{
+  unsigned int bytes_per_line = (dim + 1) & ~1U; /* Even */
+  unsigned int x, y, p, i;
+
+  imagine_bench_put8(w, 0x0A); /* manufacturer */
+  imagine_bench_put8(w, 5);    /* version */
+  imagine_bench_put8(w, 1);    /* RLE */
+  imagine_bench_put8(w, 8);    /* bits per plane */
+  imagine_bench_put16(w, 0);
+  imagine_bench_put16(w, 0);
+  imagine_bench_put16(w, dim - 1);
+  imagine_bench_put16(w, dim - 1);
+  imagine_bench_put16(w, 72);
+  imagine_bench_put16(w, 72);
+  imagine_bench_put_zeros(w, 48); /* EGA palette */
+  imagine_bench_put8(w, 0);
+  imagine_bench_put8(w, planes);
+  imagine_bench_put16(w, bytes_per_line);
+  imagine_bench_put16(w, 1);
+  imagine_bench_put_zeros(w, 58);
+
+  for (y = 0; y < dim && !w->overflow; ++y)
+  {
+    for (p = 0; p < planes; ++p)
+    {
+      x = 0;
+
+      while (x < bytes_per_line)
+      {
+        unsigned int value = x < dim ? imagine_bench_sample(x, y, p) : 0;
+        unsigned int run = 1;
+
+        while (x + run < bytes_per_line && run < 63 && (x + run < dim ? imagine_bench_sample(x + run, y, p) : 0U) == value)
+        {
+          run++;
+        }
+
+        if (run > 1 || (value & 0xC0) == 0xC0)
+        {
+          imagine_bench_put8(w, 0xC0 | run);
+        }
+
+        imagine_bench_put8(w, value);
+        x += run;
+      }
+    }
+  }
+
+  /* 256 color palette of 8 bit single plane images */
+  if (planes == 1)
+  {
+    imagine_bench_put8(w, 0x0C);
+
+    for (i = 0; i < 256; ++i)
+    {
+      imagine_bench_put8(w, i);
+      imagine_bench_put8(w, i);
+      imagine_bench_put8(w, i);
+    }
+  }
+}
+
+static void imagine_bench_dds(imagine_bench_writer *w, unsigned int dim, unsigned int bpp)
+{
+  unsigned int x, y;
+
+  imagine_bench_put8(w, 'D');
+  imagine_bench_put8(w, 'D');
+  imagine_bench_put8(w, 'S');
+  imagine_bench_put8(w, ' ');
+  imagine_bench_put32(w, 124);                     /* header size */
+  imagine_bench_put32(w, 0x100F);                  /* caps, height, width, pitch, pixel format */
+  imagine_bench_put32(w, dim);
+  imagine_bench_put32(w, dim);
+  imagine_bench_put32(w, dim * (bpp / 8));         /* pitch */
+  imagine_bench_put_zeros(w, 4 + 4 + 44);          /* depth, mip count, reserved */
+  imagine_bench_put32(w, 32);                      /* pixel format size */
+  imagine_bench_put32(w, bpp == 8 ? 0x20000 : (bpp == 32 ? 0x41 : 0x40));
+  imagine_bench_put32(w, 0);                       /* fourcc */
+  imagine_bench_put32(w, bpp);
+  imagine_bench_put32(w, bpp == 8 ? 0xFF : 0xFF0000);
+  imagine_bench_put32(w, bpp == 8 ? 0 : 0xFF00);
+  imagine_bench_put32(w, bpp == 8 ? 0 : 0xFF);
+  imagine_bench_put32(w, bpp == 32 ? 0xFF000000 : 0);
+  imagine_bench_put32(w, 0x1000);                  /* caps */
+  imagine_bench_put_zeros(w, 16);
+
+  for (y = 0; y < dim && !w->overflow; ++y)
+  {
+    for (x = 0; x < dim; ++x)
+    {
+      if (bpp == 8)
+      {
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+      }
+      else
+      {
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 2));
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 1));
+        imagine_bench_put8(w, imagine_bench_sample(x, y, 0));
+
+        if (bpp == 32)
+        {
+          imagine_bench_put8(w, 255);
+        }
+      }
+    }
+  }
+}
+
+/* Single entry icon directory followed by a complete 32 bit BMP (the form imagine_load_ico reads) */
+static void imagine_bench_ico(imagine_bench_writer *w, unsigned int dim, unsigned int bits)
+{
+  unsigned long size_offset;
+  unsigned long bmp_start;
+
+  imagine_bench_put16(w, 0);
+  imagine_bench_put16(w, 1);
+  imagine_bench_put16(w, 1);
+
+  imagine_bench_put8(w, dim < 256 ? dim : 0);
+  imagine_bench_put8(w, dim < 256 ? dim : 0);
+  imagine_bench_put8(w, 0);
+  imagine_bench_put8(w, 0);
+  imagine_bench_put16(w, 1);
+  imagine_bench_put16(w, bits);
+  size_offset = w->size;
+  imagine_bench_put32(w, 0);
+  imagine_bench_put32(w, 22);
+
+  bmp_start = w->size;
+  imagine_bench_bmp(w, dim, bits);
+
+  if (!w->overflow)
+  {
+    unsigned long bmp_size = w->size - bmp_start;
+
+    w->data[size_offset + 0] = (unsigned char)(bmp_size & 0xFF);
+    w->data[size_offset + 1] = (unsigned char)((bmp_size >> 8) & 0xFF);
+    w->data[size_offset + 2] = (unsigned char)((bmp_size >> 16) & 0xFF);
+    w->data[size_offset + 3] = (unsigned char)((bmp_size >> 24) & 0xFF);
+  }
+}
+
+/* ########################################################################## */
+/* BENCHMARK */
+/* ########################################################################## */
+typedef void (*imagine_bench_generator)(imagine_bench_writer *w, unsigned int dim, unsigned int param);
+
+typedef struct imagine_bench_variant
+{
+  char *name;
+  imagine_bench_generator generate;
+  unsigned int param;
+
+} imagine_bench_variant;
+
+static imagine_bench_variant imagine_bench_variants[] = {
+    {"P1 ascii bitmap", imagine_bench_netpbm, '1'},
+    {"P2 ascii gray", imagine_bench_netpbm, '2'},
+    {"P3 ascii rgb", imagine_bench_netpbm, '3'},
+    {"P4 bitmap", imagine_bench_netpbm, '4'},
+    {"P5 gray", imagine_bench_netpbm, '5'},
+    {"P6 rgb", imagine_bench_netpbm, '6'},
+    {"BMP 1 bit", imagine_bench_bmp, 1},
+    {"BMP 4 bit", imagine_bench_bmp, 4},
+    {"BMP 8 bit", imagine_bench_bmp, 8},
+    {"BMP 16 bit", imagine_bench_bmp, 16},
+    {"BMP 24 bit", imagine_bench_bmp, 24},
+    {"BMP 32 bit", imagine_bench_bmp, 32},
+    {"TGA 8 bit", imagine_bench_tga, 8},
+    {"TGA 24 bit", imagine_bench_tga, 24},
+    {"TGA 32 bit", imagine_bench_tga, 32},
+    {"PCX gray", imagine_bench_pcx, 1},
+    {"PCX rgb", imagine_bench_pcx, 3},
+    {"DDS 8 bit", imagine_bench_dds, 8},
+    {"DDS 24 bit", imagine_bench_dds, 24},
+    {"DDS 32 bit", imagine_bench_dds, 32},
+    {"ICO 32 bit", imagine_bench_ico, 32}};
+
+static unsigned int imagine_bench_dims[] = {16, 64, 256, 1024, 4096, 8192};
+
+/* Returns 0 if the generated image does not decode */
+static int imagine_bench_run(imagine_bench_variant *variant, unsigned int dim)
+{
+  imagine_bench_writer writer;
+  perf_bench bench = {0};
+  unsigned long pixels = (unsigned long)dim * dim;
+  unsigned long iterations = IMAGINE_BENCH_PIXEL_BUDGET / pixels;
+  unsigned int size;
+  char name[64];
+  char number[16];
+  unsigned long pos = 0;
+
+  imagine img = {0};
+  img.pixels = imagine_bench_output;
+  img.pixels_capacity = (unsigned int)IMAGINE_BENCH_OUTPUT_SIZE;
+
+  writer.data = imagine_bench_input;
+  writer.size = 0;
+  writer.capacity = IMAGINE_BENCH_INPUT_SIZE;
+  writer.overflow = 0;
+
+  variant->generate(&writer, dim, variant->param);
+
+  name[0] = '\0';
+  pos += perf_append_string(name, pos, sizeof(name), variant->name);
+  pos += perf_append_string(name, pos, sizeof(name), " ");
+  pos += perf_append_string(name, pos, sizeof(name), perf_format_ulong(dim, number, sizeof(number)));
+  pos += perf_append_string(name, pos, sizeof(name), "x");
+  pos += perf_append_string(name, pos, sizeof(name), perf_format_ulong(dim, number, sizeof(number)));
+
+  if (writer.overflow)
+  {
+    perf_log_write(name);
+    perf_log_write(": skipped, encoded image exceeds the input buffer\n");
+    return 1;
+  }
+
+  size = (unsigned int)writer.size;
+
+  if (!imagine_load(&img, imagine_bench_input, size) || img.width != dim || img.height != dim)
+  {
+    perf_log_write(name);
+    perf_log_write(": FAILED to decode\n");
+    return 0;
+  }
+
+  if (iterations < IMAGINE_BENCH_MIN_ITERATIONS)
+  {
+    iterations = IMAGINE_BENCH_MIN_ITERATIONS;
+  }
+  else if (iterations > IMAGINE_BENCH_MAX_ITERATIONS)
+  {
+    iterations = IMAGINE_BENCH_MAX_ITERATIONS;
+  }
+
+  bench.bytes = size;
+  bench.pixels = pixels;
+
+  PERF_BENCH_BEGIN(bench, name, iterations, 1)
+  {
+    imagine_load(&img, imagine_bench_input, size);
+  }
+  PERF_BENCH_END(bench)
+
+  return 1;
+}
+
+int main(void)
+{
+  unsigned long v;
+  unsigned long d;
+  int failures = 0;
+
+  for (v = 0; v < sizeof(imagine_bench_variants) / sizeof(imagine_bench_variants[0]); ++v)
+  {
+    for (d = 0; d < sizeof(imagine_bench_dims) / sizeof(imagine_bench_dims[0]); ++d)
+    {
+      if (imagine_bench_dims[d] > IMAGINE_BENCH_MAX_DIM)
+      {
+        break;
+      }
+
+      if (!imagine_bench_run(&imagine_bench_variants[v], imagine_bench_dims[d]))
+      {
+        failures++;
+      }
+
+      perf_log_flush();
+    }
+  }
+
+  return failures;
+}
+
+/*
+   -----------------------------------------------------------------------------
+   This software is available under 2 licenses -- choose whichever you prefer.
+   ------------------------------------------------------------------------------
+   ALTERNATIVE A - MIT License
+   Copyright (c) 2025 nickscha
+   Permission is hereby granted, free of charge, to any person obtaining a copy of
+   this software and associated documentation files (the "Software"), to deal in
+   the Software without restriction, including without limitation the rights to
+   use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is furnished to do
+   so, subject to the following conditions:
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   ------------------------------------------------------------------------------
+   ALTERNATIVE B - Public Domain (www.unlicense.org)
+   This is free and unencumbered software released into the public domain.
+   Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+   software, either in source code form or as a compiled binary, for any purpose,
+   commercial or non-commercial, and by any means.
+   In jurisdictions that recognize copyright laws, the author or authors of this
+   software dedicate any and all copyright interest in the software to the public
+   domain. We make this dedication for the benefit of the public at large and to
+   the detriment of our heirs and successors. We intend this dedication to be an
+   overt act of relinquishment in perpetuity of all present and future rights to
+   this software under copyright law.
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+   ------------------------------------------------------------------------------
+*/
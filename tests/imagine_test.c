@@ -10,13 +10,69 @@ LICENSE
   See end of file for detailed license information.
 
 */
+#ifdef PERF_STATS_ENABLE
+#define PERF_DISBALE_INTERMEDIATE_PRINT /* Only the aggregated stats of the performance gate */
+#define PERF_ZONES_ENABLE
+#define IMAGINE_ZONE_BEGIN(name) PERF_ZONE_BEGIN(name)
+#define IMAGINE_ZONE_END(name) PERF_ZONE_END(name)
+#endif
+
+#include "../deps/pio.h"  /* Read/Write Files            */
+#include "../deps/perf.h" /* Simple Performance profiler */
 #include "../imagine.h"   /* Image Library               */
 #include "../deps/test.h" /* Simple Testing framework    */
-#include "../deps/perf.h" /* Simple Performance profiler */
-#include "../deps/pio.h"  /* Read/Write Files            */
+
+#if defined(PERF_STATS_ENABLE) && defined(PERF_STATS_THREADS) && !defined(_WIN32)
+#include <pthread.h> /* Recording threads of the multithreaded profiler test */
+#endif
 
 #define BUF_SIZE 128 * 128
 
+/* Writes a w x h P6 whose sample i is i * 13 + 1 into buf, returns the file size */
+static unsigned int imagine_test_make_p6(unsigned char *buf, unsigned int w, unsigned int h)
+{
+  unsigned char digits[10];
+  unsigned int dimensions[2];
+  unsigned int size = 0;
+  unsigned int d, i, n;
+
+  dimensions[0] = w;
+  dimensions[1] = h;
+  buf[size++] = 'P';
+  buf[size++] = '6';
+  buf[size++] = '\n';
+
+  for (d = 0; d < 2; ++d)
+  {
+    n = 0;
+
+    do
+    {
+      digits[n++] = (unsigned char)('0' + dimensions[d] % 10);
+      dimensions[d] /= 10;
+    } while (dimensions[d]);
+
+    while (n)
+    {
+      buf[size++] = digits[--n];
+    }
+
+    buf[size++] = (unsigned char)(d == 0 ? ' ' : '\n');
+  }
+
+  buf[size++] = '2';
+  buf[size++] = '5';
+  buf[size++] = '5';
+  buf[size++] = '\n';
+
+  for (i = 0; i < w * h * 3; ++i)
+  {
+    buf[size + i] = (unsigned char)(i * 13 + 1);
+  }
+
+  return size + w * h * 3;
+}
+
 static void imagine_test_load(void)
 {
   unsigned char pixels[BUF_SIZE];
@@ -337,11 +393,2429 @@ static void imagine_test_all_bmp(void)
   assert(img.pixels[15] == 0);
 }
 
-int main(void)
+static void imagine_test_pio_map(void)
 {
-  imagine_test_load();
-  imagine_test_all_netpbm();
-  imagine_test_all_bmp();
+  unsigned char pixels[BUF_SIZE];
+  unsigned char *data;
+  unsigned long size;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  if (!pio_map("images/test-p6.ppm", &data, &size))
+  {
+    assert(pio_map("tests/images/test-p6.ppm", &data, &size));
+  }
+
+  assert(size > 0);
+  assert(imagine_load(&img, data, (unsigned int)size));
+  assert(img.width == 2);
+  assert(img.height == 2);
+  assert(img.stride == 3);
+  assert(img.pixels[0] == 255);
+  assert(img.pixels[4] == 255);
+  assert(pio_unmap(data, size));
+}
+
+static void imagine_test_pio_stream(void)
+{
+  unsigned char pixels[BUF_SIZE];
+  unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+  unsigned char stream_buffer[16]; /* Deliberately small to force flushes and gather writes */
+  unsigned char header[] = "P6\n4 3\n255\n";
+  unsigned char row[4 * 3];
+  pio_segment segments[2];
+  pio_stream stream;
+  unsigned int x, y;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  assert(pio_stream_open(&stream, "imagine_test_stream.ppm", stream_buffer, sizeof(stream_buffer)));
+  assert(pio_stream_write(&stream, header, sizeof(header) - 1));
+
+  for (y = 0; y < 3; ++y)
+  {
+    for (x = 0; x < sizeof(row); ++x)
+    {
+      row[x] = (unsigned char)(y * 50 + x);
+    }
+
+    /* Split each row into two segments to exercise the gather path */
+    segments[0].data = row;
+    segments[0].size = 5;
+    segments[1].data = row + 5;
+    segments[1].size = sizeof(row) - 5;
+    assert(pio_stream_writev(&stream, segments, 2));
+  }
+
+  assert(pio_stream_close(&stream, 1));
+  assert(stream.written == sizeof(header) - 1 + 3 * sizeof(row));
+
+  assert(pio_read("imagine_test_stream.ppm", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  assert(binary_buffer_size == sizeof(header) - 1 + 3 * sizeof(row));
+  assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+  assert(img.width == 4);
+  assert(img.height == 3);
+  assert(img.stride == 3);
+  assert(img.pixels[0] == 0);
+  assert(img.pixels[11] == 11);
+  assert(img.pixels[12] == 50);
+  assert(img.pixels[35] == 111);
+}
+
+static void imagine_test_pio_dir(void)
+{
+  pio_dir dir;
+  pio_dir_entry entries[4]; /* Smaller than the number of matches to exercise batching */
+  char names[256];
+  char path[256];
+  unsigned long count;
+  unsigned long total = 0;
+  unsigned long i;
+  char *base = "images";
+
+  if (!pio_dir_open(&dir, base, ".BMP", PIO_DIR_SIZES))
+  {
+    base = "tests/images";
+    assert(pio_dir_open(&dir, base, ".BMP", PIO_DIR_SIZES));
+  }
+
+  while (pio_dir_next(&dir, entries, 4, names, sizeof(names), &count))
+  {
+    for (i = 0; i < count; ++i)
+    {
+      unsigned long base_length = pio_strlen(base);
+      unsigned long name_length = pio_strlen(entries[i].name);
+
+      assert(!entries[i].is_directory);
+      assert(entries[i].size > 0);
+
+      pio_copy((unsigned char *)path, (unsigned char *)base, base_length);
+      path[base_length] = '/';
+      pio_copy((unsigned char *)path + base_length + 1, (unsigned char *)entries[i].name, name_length + 1);
+
+      assert(entries[i].size == pio_file_size(path));
+    }
+
+    total += count;
+  }
+
+  pio_dir_close(&dir);
+
+  /* tests/images contains the 1/4/8/16/24/32 bit bmp files */
+  assert(total == 6);
+  assert(dir.skipped == 0);
+
+  /* 18 bytes hold "test-bmp-8bit.bmp", the 16/24/32 bit names are one byte longer */
+  total = 0;
+  assert(pio_dir_open(&dir, base, ".BMP", 0));
+
+  while (pio_dir_next(&dir, entries, 4, names, 18, &count))
+  {
+    total += count;
+  }
+
+  pio_dir_close(&dir);
+
+  assert(total == 3);
+  assert(dir.skipped == 3);
+
+  /* A file is not a directory */
+  i = pio_strlen(base);
+  pio_copy((unsigned char *)path, (unsigned char *)base, i);
+  pio_copy((unsigned char *)path + i, (unsigned char *)"/test.pcx", 10);
+  assert(!pio_dir_open(&dir, path, 0, 0));
+}
+
+static void imagine_test_resize(void)
+{
+  static unsigned char scratch[32 * 1024];
+  unsigned char src_pixels[37 * 29 * 4];
+  unsigned char dst_pixels[64 * 64 * 4];
+  unsigned int filter;
+  unsigned int stride;
+  unsigned int hash;
+  unsigned int mismatches = 0;
+  unsigned int i;
+
+  imagine src = {0};
+  imagine dst = {0};
+  src.pixels = src_pixels;
+  dst.pixels = dst_pixels;
+  dst.pixels_capacity = sizeof(dst_pixels);
+
+  /* Flat images stay flat in every filter, stride and direction */
+  for (stride = 1; stride <= 4; ++stride)
+  {
+    if (stride == 2)
+    {
+      continue;
+    }
+
+    src.width = 7;
+    src.height = 5;
+    src.stride = stride;
+    src.monochrome = (unsigned char)(stride == 1);
+
+    for (i = 0; i < 7 * 5 * stride; ++i)
+    {
+      src_pixels[i] = (unsigned char)(10 + (i % stride) * 80);
+    }
+
+    for (filter = IMAGINE_FILTER_BOX; filter <= IMAGINE_FILTER_LANCZOS; ++filter)
+    {
+      unsigned int size = imagine_resize_scratch_size(&src, 13, 3, (int)filter);
+
+      assert(size > 0 && size <= sizeof(scratch));
+      assert(imagine_resize(&dst, &src, 13, 3, (int)filter, scratch, size));
+      assert(dst.width == 13 && dst.height == 3 && dst.stride == stride);
+      assert(dst.monochrome == src.monochrome);
+      assert(dst.pixels_size == 13 * 3 * stride);
+
+      for (i = 0; i < dst.pixels_size; ++i)
+      {
+        mismatches += (dst_pixels[i] == 10 + (i % stride) * 80) ? 0u : 1u;
+      }
+
+      /* Same size is an exact copy */
+      for (i = 0; i < 7 * 5 * stride; ++i)
+      {
+        src_pixels[i] = (unsigned char)(i * 37);
+      }
+
+      assert(imagine_resize(&dst, &src, 7, 5, (int)filter, scratch, sizeof(scratch)));
+
+      for (i = 0; i < 7 * 5 * stride; ++i)
+      {
+        mismatches += (dst_pixels[i] == src_pixels[i]) ? 0u : 1u;
+        src_pixels[i] = (unsigned char)(10 + (i % stride) * 80);
+      }
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* Box downscale by 2 is a 2x2 average */
+  src.width = 4;
+  src.height = 4;
+  src.stride = 1;
+
+  for (i = 0; i < 16; ++i)
+  {
+    src_pixels[i] = (unsigned char)(i * 10);
+  }
+
+  assert(imagine_resize(&dst, &src, 2, 2, IMAGINE_FILTER_BOX, scratch, sizeof(scratch)));
+  assert(dst_pixels[0] == 25 && dst_pixels[1] == 45 && dst_pixels[2] == 105 && dst_pixels[3] == 125);
+
+  /* Bilinear upscale by 2 with edge clamping */
+  src.width = 2;
+  src.height = 1;
+  src_pixels[0] = 0;
+  src_pixels[1] = 255;
+
+  assert(imagine_resize(&dst, &src, 4, 1, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+  assert(dst_pixels[0] == 0 && dst_pixels[1] == 64 && dst_pixels[2] == 191 && dst_pixels[3] == 255);
+
+  /* Fixed output for a noisy RGBA image, identical with and without IMAGINE_NO_SIMD */
+  src.width = 37;
+  src.height = 29;
+  src.stride = 4;
+
+  for (i = 0; i < sizeof(src_pixels); ++i)
+  {
+    src_pixels[i] = (unsigned char)((i * 2654435761u) >> 24);
+  }
+
+  hash = 2166136261u;
+
+  for (filter = IMAGINE_FILTER_BOX; filter <= IMAGINE_FILTER_LANCZOS; ++filter)
+  {
+    assert(imagine_resize(&dst, &src, 50, 13, (int)filter, scratch, sizeof(scratch)));
+
+    for (i = 0; i < dst.pixels_size; ++i)
+    {
+      hash = (hash ^ dst_pixels[i]) * 16777619u;
+    }
+
+    assert(imagine_resize(&dst, &src, 11, 64, (int)filter, scratch, sizeof(scratch)));
+
+    for (i = 0; i < dst.pixels_size; ++i)
+    {
+      hash = (hash ^ dst_pixels[i]) * 16777619u;
+    }
+  }
+
+  assert(hash == 177751839u);
+
+  /* Invalid arguments */
+  assert(!imagine_resize(&dst, &src, 50, 13, IMAGINE_FILTER_LANCZOS, scratch, imagine_resize_scratch_size(&src, 50, 13, IMAGINE_FILTER_LANCZOS) - 1));
+  assert(!imagine_resize(&dst, &src, 64, 65, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+  assert(!imagine_resize(&dst, &src, 0, 13, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+  assert(!imagine_resize(&dst, &src, 50, 13, 4, scratch, sizeof(scratch)));
+  src.stride = 2;
+  assert(!imagine_resize_scratch_size(&src, 50, 13, IMAGINE_FILTER_BOX));
+}
+
+static int imagine_test_near(unsigned char a, unsigned char b, int tolerance)
+{
+  int d = (int)a - (int)b;
+  return d >= -tolerance && d <= tolerance;
+}
+
+static void imagine_test_color(void)
+{
+  unsigned char src_pixels[37 * 29 * 4];
+  unsigned char dst_pixels[37 * 29 * 4];
+  unsigned char planes[3 * 3 + 2 * 2 * 2];
+  unsigned int stride;
+  unsigned int hash = 2166136261u;
+  unsigned int mismatches = 0;
+  unsigned int i;
+
+  imagine src = {0};
+  imagine dst = {0};
+  src.pixels = src_pixels;
+  dst.pixels = dst_pixels;
+  dst.pixels_capacity = sizeof(dst_pixels);
+
+  /* Gray input keeps its value in luma and gets neutral chroma, in every mode */
+  src.width = 16;
+  src.height = 16;
+  src.stride = 3;
+
+  for (i = 0; i < 256; ++i)
+  {
+    src_pixels[i * 3 + 0] = src_pixels[i * 3 + 1] = src_pixels[i * 3 + 2] = (unsigned char)i;
+  }
+
+  assert(imagine_convert_gray(&dst, &src, IMAGINE_COLOR_BT601));
+  assert(dst.stride == 1 && dst.monochrome == 1 && dst.pixels_size == 256);
+
+  for (i = 0; i < 256; ++i)
+  {
+    mismatches += (dst_pixels[i] == i) ? 0u : 1u;
+  }
+
+  assert(imagine_convert_gray(&dst, &src, IMAGINE_COLOR_BT709));
+
+  for (i = 0; i < 256; ++i)
+  {
+    mismatches += (dst_pixels[i] == i) ? 0u : 1u;
+  }
+
+  assert(imagine_convert_ycbcr(&dst, &src, IMAGINE_COLOR_BT709));
+
+  for (i = 0; i < 256; ++i)
+  {
+    mismatches += (dst_pixels[i * 3] == i && dst_pixels[i * 3 + 1] == 128 && dst_pixels[i * 3 + 2] == 128) ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  assert(imagine_convert_ycbcr(&dst, &src, IMAGINE_COLOR_BT601 | IMAGINE_COLOR_LIMITED));
+  assert(dst_pixels[0] == 16 && dst_pixels[255 * 3] == 235);
+  assert(dst_pixels[1] == 128 && dst_pixels[255 * 3 + 2] == 128);
+
+  /* Primaries */
+  src.width = 3;
+  src.height = 1;
+  src_pixels[0] = 255;
+  src_pixels[1] = 0;
+  src_pixels[2] = 0;
+  src_pixels[3] = 0;
+  src_pixels[4] = 255;
+  src_pixels[5] = 0;
+  src_pixels[6] = 0;
+  src_pixels[7] = 0;
+  src_pixels[8] = 255;
+
+  assert(imagine_convert_gray(&dst, &src, IMAGINE_COLOR_BT601));
+  assert(dst_pixels[0] == 76 && dst_pixels[1] == 150 && dst_pixels[2] == 29);
+  assert(imagine_convert_gray(&dst, &src, IMAGINE_COLOR_BT709));
+  assert(dst_pixels[0] == 54 && dst_pixels[1] == 182 && dst_pixels[2] == 18);
+  assert(imagine_convert_ycbcr(&dst, &src, IMAGINE_COLOR_BT601));
+  assert(dst_pixels[0] == 76 && dst_pixels[1] == 85 && dst_pixels[2] == 255);
+
+  assert(imagine_convert_hsv(&dst, &src));
+  assert(dst_pixels[0] == 0 && dst_pixels[1] == 255 && dst_pixels[2] == 255);
+  assert(dst_pixels[3] == 85 && dst_pixels[6] == 171);
+  assert(imagine_convert_hsv_rgb(&dst, &dst));
+
+  for (i = 0; i < 9; ++i)
+  {
+    assert(imagine_test_near(dst_pixels[i], src_pixels[i], 2));
+  }
+
+  /* Round trips in place on a noisy image, alpha untouched */
+  src.width = 37;
+  src.height = 29;
+
+  for (stride = 3; stride <= 4; ++stride)
+  {
+    int mode;
+
+    src.stride = stride;
+
+    for (i = 0; i < 37 * 29 * stride; ++i)
+    {
+      src_pixels[i] = (unsigned char)((i * 2654435761u) >> 24);
+    }
+
+    for (mode = 0; mode < 4; ++mode)
+    {
+      pio_copy(dst_pixels, src_pixels, 37 * 29 * stride);
+      dst.width = src.width;
+      dst.height = src.height;
+      dst.stride = stride;
+
+      assert(imagine_convert_ycbcr(&dst, &dst, mode));
+
+      for (i = 0; i < dst.pixels_size; ++i)
+      {
+        hash = (hash ^ dst_pixels[i]) * 16777619u;
+      }
+
+      assert(imagine_convert_ycbcr_rgb(&dst, &dst, mode));
+
+      for (i = 0; i < dst.pixels_size; ++i)
+      {
+        hash = (hash ^ dst_pixels[i]) * 16777619u;
+
+        /* Limited range keeps fewer levels */
+        if (stride == 4 && i % 4 == 3)
+        {
+          mismatches += (dst_pixels[i] == src_pixels[i]) ? 0u : 1u;
+        }
+        else
+        {
+          mismatches += imagine_test_near(dst_pixels[i], src_pixels[i], (mode & IMAGINE_COLOR_LIMITED) ? 2 : 1) ? 0u : 1u;
+        }
+      }
+    }
+
+    assert(imagine_convert_gray(&dst, &src, IMAGINE_COLOR_BT709));
+
+    for (i = 0; i < dst.pixels_size; ++i)
+    {
+      hash = (hash ^ dst_pixels[i]) * 16777619u;
+    }
+
+    pio_copy(dst_pixels, src_pixels, 37 * 29 * stride);
+    assert(imagine_convert_hsv(&dst, &src));
+    assert(imagine_convert_hsv_rgb(&dst, &dst));
+
+    for (i = 0; i < dst.pixels_size; ++i)
+    {
+      mismatches += imagine_test_near(dst_pixels[i], src_pixels[i], 3) ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+  assert(hash == 3332106582u);
+
+  /* In place gray to RGB grows the buffer from the end */
+  src.width = 4;
+  src.height = 1;
+  src.stride = 1;
+  src.pixels_capacity = sizeof(src_pixels);
+  src_pixels[0] = 1;
+  src_pixels[1] = 2;
+  src_pixels[2] = 3;
+  src_pixels[3] = 4;
+
+  assert(imagine_convert_rgb(&src, &src));
+  assert(src.stride == 3 && src.pixels_size == 12 && src.monochrome == 0);
+
+  for (i = 0; i < 12; ++i)
+  {
+    assert(src_pixels[i] == i / 3 + 1);
+  }
+
+  /* 4:2:0 of a 3x3 image: 2x2, 2x1, 1x2 and 1x1 chroma blocks */
+  src.width = 3;
+  src.height = 3;
+  src.stride = 3;
+
+  for (i = 0; i < 9; ++i)
+  {
+    src_pixels[i * 3 + 0] = src_pixels[i * 3 + 1] = src_pixels[i * 3 + 2] = (unsigned char)(i * 20);
+  }
+
+  src_pixels[8 * 3 + 0] = 255;
+  src_pixels[8 * 3 + 1] = src_pixels[8 * 3 + 2] = 0;
+
+  assert(imagine_convert_ycbcr420(&src, planes, planes + 9, planes + 13, IMAGINE_COLOR_BT601));
+
+  for (i = 0; i < 8; ++i)
+  {
+    assert(planes[i] == i * 20);
+  }
+
+  assert(planes[8] == 76);
+  assert(planes[9] == 128 && planes[10] == 128 && planes[11] == 128 && planes[13] == 128);
+  assert(planes[12] == 85 && planes[16] == 255);
+
+  /* Invalid input */
+  src.stride = 1;
+  assert(!imagine_convert_ycbcr(&dst, &src, IMAGINE_COLOR_BT601));
+  assert(!imagine_convert_hsv(&dst, &src));
+  src.stride = 3;
+  assert(!imagine_convert_rgb(&dst, &src));
+  dst.pixels_capacity = 3 * 3 * 3 - 1;
+  assert(!imagine_convert_ycbcr(&dst, &src, IMAGINE_COLOR_BT601));
+}
+
+static void imagine_test_rotate(void)
+{
+  static unsigned char src_pixels[37 * 29 * 4];
+  static unsigned char dst_pixels[37 * 29 * 4];
+  static unsigned char tmp_pixels[37 * 29 * 4];
+  unsigned int sizes[4][2] = {{37, 29}, {16, 8}, {1, 13}, {9, 1}};
+  unsigned int stride;
+  unsigned int s;
+
+  imagine src = {0};
+  imagine dst = {0};
+  imagine tmp = {0};
+  src.pixels = src_pixels;
+  dst.pixels = dst_pixels;
+  dst.pixels_capacity = sizeof(dst_pixels);
+  tmp.pixels = tmp_pixels;
+  tmp.pixels_capacity = sizeof(tmp_pixels);
+
+  for (stride = 1; stride <= 4; ++stride)
+  {
+    for (s = 0; s < 4; ++s)
+    {
+      unsigned int w = sizes[s][0];
+      unsigned int h = sizes[s][1];
+      unsigned int mismatches = 0;
+      unsigned int x;
+      unsigned int y;
+      unsigned int c;
+
+      if (stride == 2)
+      {
+        continue;
+      }
+
+      src.width = w;
+      src.height = h;
+      src.stride = stride;
+
+      for (x = 0; x < w * h * stride; ++x)
+      {
+        src_pixels[x] = (unsigned char)((x * 2654435761u) >> 24);
+      }
+
+      assert(imagine_transpose(&dst, &src));
+      assert(dst.width == h && dst.height == w && dst.stride == stride && dst.pixels_size == w * h * stride);
+
+      for (y = 0; y < h; ++y)
+      {
+        for (x = 0; x < w; ++x)
+        {
+          for (c = 0; c < stride; ++c)
+          {
+            mismatches += dst_pixels[(x * h + y) * stride + c] == src_pixels[(y * w + x) * stride + c] ? 0u : 1u;
+          }
+        }
+      }
+
+      assert(imagine_rotate90(&dst, &src));
+      assert(dst.width == h && dst.height == w);
+
+      for (y = 0; y < h; ++y)
+      {
+        for (x = 0; x < w; ++x)
+        {
+          for (c = 0; c < stride; ++c)
+          {
+            mismatches += dst_pixels[(x * h + (h - 1 - y)) * stride + c] == src_pixels[(y * w + x) * stride + c] ? 0u : 1u;
+          }
+        }
+      }
+
+      /* 270 undoes 90 */
+      assert(imagine_rotate270(&tmp, &dst));
+      assert(tmp.width == w && tmp.height == h);
+
+      for (x = 0; x < w * h * stride; ++x)
+      {
+        mismatches += tmp_pixels[x] == src_pixels[x] ? 0u : 1u;
+      }
+
+      /* Two quarter turns equal the in place 180 and both flips */
+      assert(imagine_rotate90(&tmp, &dst));
+      pio_copy(dst_pixels, src_pixels, w * h * stride);
+      dst.width = w;
+      dst.height = h;
+      assert(imagine_rotate180(&dst));
+
+      for (x = 0; x < w * h * stride; ++x)
+      {
+        mismatches += tmp_pixels[x] == dst_pixels[x] ? 0u : 1u;
+      }
+
+      assert(imagine_flip_horizontal(&dst));
+      assert(imagine_flip_vertical(&dst));
+
+      for (x = 0; x < w * h * stride; ++x)
+      {
+        mismatches += dst_pixels[x] == src_pixels[x] ? 0u : 1u;
+      }
+
+      assert(imagine_flip_horizontal(&dst));
+
+      for (y = 0; y < h; ++y)
+      {
+        for (x = 0; x < w; ++x)
+        {
+          for (c = 0; c < stride; ++c)
+          {
+            mismatches += dst_pixels[(y * w + (w - 1 - x)) * stride + c] == src_pixels[(y * w + x) * stride + c] ? 0u : 1u;
+          }
+        }
+      }
+
+      assert(mismatches == 0);
+    }
+  }
+
+  /* Quarter turns need a second buffer large enough for the image */
+  assert(!imagine_rotate90(&src, &src));
+  dst.pixels_capacity = 9 * 1 * 4 - 1;
+  assert(!imagine_transpose(&dst, &src));
+
+  /* ... that does not overlap the source anywhere */
+  src.width = 5;
+  src.height = 3;
+  src.stride = 4;
+  dst.pixels = src_pixels + 1;
+  dst.pixels_capacity = 5 * 3 * 4;
+  assert(!imagine_rotate90(&dst, &src));
+  dst.pixels = src_pixels + 5 * 3 * 4 - 1;
+  assert(!imagine_rotate270(&dst, &src));
+  dst.pixels = src_pixels + 5 * 3 * 4;
+  assert(imagine_transpose(&dst, &src)); /* Adjacent but disjoint */
+
+  /* Pixel counts that wrap around are rejected, 65536 * 65537 would count 65536 pixels */
+  dst.pixels = dst_pixels;
+  dst.pixels_capacity = sizeof(dst_pixels);
+  src.width = 65536;
+  src.height = 65537;
+  src.stride = 1;
+  assert(!imagine_transpose(&dst, &src));
+}
+
+static void imagine_test_filters(void)
+{
+  static unsigned char scratch[64 * 1024];
+  static unsigned char src_pixels[37 * 29 * 4];
+  static unsigned char dst_pixels[37 * 29 * 4];
+  static unsigned char tmp_pixels[37 * 29 * 4];
+  unsigned int hash = 2166136261u;
+  unsigned int mismatches = 0;
+  unsigned int stride;
+  unsigned int x;
+  unsigned int y;
+  unsigned int c;
+
+  imagine src = {0};
+  imagine dst = {0};
+  imagine tmp = {0};
+  src.pixels = src_pixels;
+  src.pixels_capacity = sizeof(src_pixels);
+  dst.pixels = dst_pixels;
+  dst.pixels_capacity = sizeof(dst_pixels);
+  tmp.pixels = tmp_pixels;
+  tmp.pixels_capacity = sizeof(tmp_pixels);
+
+  src.width = 37;
+  src.height = 29;
+
+  for (stride = 1; stride <= 4; ++stride)
+  {
+    unsigned int radius;
+
+    if (stride == 2)
+    {
+      continue;
+    }
+
+    src.stride = stride;
+
+    for (x = 0; x < 37 * 29 * stride; ++x)
+    {
+      src_pixels[x] = (unsigned char)((x * 2654435761u) >> 24);
+    }
+
+    /* Box blur against a direct sum over the clamped window */
+    for (radius = 1; radius <= 40; radius += 13)
+    {
+      unsigned int window = 2 * radius + 1;
+      unsigned int mul = ((1u << 23) + window * window / 2) / (window * window);
+
+      assert(imagine_blur_box_scratch_size(&src, radius) <= sizeof(scratch));
+      assert(imagine_blur_box(&dst, &src, radius, 1, scratch, sizeof(scratch)));
+      assert(dst.width == 37 && dst.height == 29 && dst.stride == stride);
+
+      for (y = 0; y < 29; ++y)
+      {
+        for (x = 0; x < 37; ++x)
+        {
+          for (c = 0; c < stride; ++c)
+          {
+            unsigned int sum = 0;
+            int dy;
+            int dx;
+
+            for (dy = -(int)radius; dy <= (int)radius; ++dy)
+            {
+              for (dx = -(int)radius; dx <= (int)radius; ++dx)
+              {
+                int sy = (int)y + dy;
+                int sx = (int)x + dx;
+                sy = sy < 0 ? 0 : (sy > 28 ? 28 : sy);
+                sx = sx < 0 ? 0 : (sx > 36 ? 36 : sx);
+                sum += src_pixels[((unsigned int)sy * 37 + (unsigned int)sx) * stride + c];
+              }
+            }
+
+            mismatches += dst_pixels[(y * 37 + x) * stride + c] == (sum * mul + (1u << 22)) >> 23 ? 0u : 1u;
+          }
+        }
+      }
+
+      /* Two passes in place equal two passes through a second buffer */
+      assert(imagine_blur_box(&tmp, &dst, radius, 1, scratch, sizeof(scratch)));
+      pio_copy(dst_pixels, src_pixels, 37 * 29 * stride);
+      dst.stride = stride;
+      assert(imagine_blur_box(&dst, &dst, radius, 2, scratch, sizeof(scratch)));
+
+      for (x = 0; x < 37 * 29 * stride; ++x)
+      {
+        mismatches += dst_pixels[x] == tmp_pixels[x] ? 0u : 1u;
+        hash = (hash ^ dst_pixels[x]) * 16777619u;
+      }
+    }
+
+    /* Gaussian in place equals out of place */
+    assert(imagine_blur_gaussian_scratch_size(&src, 2.0) <= sizeof(scratch));
+    assert(imagine_blur_gaussian(&dst, &src, 2.0, scratch, sizeof(scratch)));
+    pio_copy(tmp_pixels, src_pixels, 37 * 29 * stride);
+    tmp.width = 37;
+    tmp.height = 29;
+    tmp.stride = stride;
+    assert(imagine_blur_gaussian(&tmp, &tmp, 2.0, scratch, sizeof(scratch)));
+
+    for (x = 0; x < 37 * 29 * stride; ++x)
+    {
+      mismatches += dst_pixels[x] == tmp_pixels[x] ? 0u : 1u;
+      hash = (hash ^ dst_pixels[x]) * 16777619u;
+    }
+
+    /* Sharpen with amount 0 is a copy */
+    assert(imagine_sharpen(&dst, &src, 1.0, 0.0, scratch, sizeof(scratch)));
+
+    for (x = 0; x < 37 * 29 * stride; ++x)
+    {
+      mismatches += dst_pixels[x] == src_pixels[x] ? 0u : 1u;
+    }
+
+    assert(imagine_sharpen(&dst, &src, 1.5, 1.0, scratch, sizeof(scratch)));
+
+    for (x = 0; x < 37 * 29 * stride; ++x)
+    {
+      hash = (hash ^ dst_pixels[x]) * 16777619u;
+    }
+  }
+
+  /* Sobel against the 3x3 kernels with clamped edges */
+  src.stride = 1;
+  assert(imagine_sobel(&dst, &src));
+  assert(dst.stride == 1 && dst.monochrome == 1 && dst.pixels_size == 37 * 29);
+
+  for (y = 0; y < 29; ++y)
+  {
+    for (x = 0; x < 37; ++x)
+    {
+      int gx = 0;
+      int gy = 0;
+      int dy;
+      int dx;
+
+      for (dy = -1; dy <= 1; ++dy)
+      {
+        for (dx = -1; dx <= 1; ++dx)
+        {
+          int sy = (int)y + dy;
+          int sx = (int)x + dx;
+          int v;
+          sy = sy < 0 ? 0 : (sy > 28 ? 28 : sy);
+          sx = sx < 0 ? 0 : (sx > 36 ? 36 : sx);
+          v = src_pixels[(unsigned int)sy * 37 + (unsigned int)sx];
+          gx += dx * (2 - dy * dy) * v;
+          gy += dy * (2 - dx * dx) * v;
+        }
+      }
+
+      gx = gx < 0 ? -gx : gx;
+      gy = gy < 0 ? -gy : gy;
+      mismatches += dst_pixels[y * 37 + x] == (unsigned int)(gx + gy + 4) >> 3 ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+  assert(hash == 180613806u);
+
+  /* Flat areas stay flat, a step edge gets overshoot from the unsharp mask */
+  src.width = 16;
+  src.height = 4;
+
+  for (x = 0; x < 64; ++x)
+  {
+    src_pixels[x] = (unsigned char)((x % 16) < 8 ? 50 : 200);
+  }
+
+  assert(imagine_blur_gaussian(&dst, &src, 0.8, scratch, sizeof(scratch)));
+  assert(dst_pixels[0] == 50 && dst_pixels[15] == 200 && dst_pixels[7] > 50 && dst_pixels[8] < 200);
+  assert(imagine_sharpen(&dst, &src, 0.8, 1.0, scratch, sizeof(scratch)));
+  assert(dst_pixels[0] == 50 && dst_pixels[15] == 200 && dst_pixels[7] < 50 && dst_pixels[8] > 200);
+  assert(imagine_sobel(&dst, &src));
+  assert(dst_pixels[0] == 0 && dst_pixels[7] == 75 && dst_pixels[8] == 75 && dst_pixels[15] == 0);
+
+  /* Invalid arguments */
+  assert(!imagine_blur_box(&dst, &src, 0, 1, scratch, sizeof(scratch)));
+  assert(!imagine_blur_box(&dst, &src, IMAGINE_BOX_RADIUS_MAX + 1, 1, scratch, sizeof(scratch)));
+  assert(!imagine_blur_box(&dst, &src, 1, 1, scratch, imagine_blur_box_scratch_size(&src, 1) - 1));
+  assert(!imagine_blur_gaussian(&dst, &src, 0.0, scratch, sizeof(scratch)));
+  assert(!imagine_blur_gaussian(&dst, &src, 30.0, scratch, sizeof(scratch)));
+  assert(!imagine_sharpen(&src, &src, 1.0, 1.0, scratch, sizeof(scratch)));
+  assert(!imagine_sobel(&src, &src));
+  src.stride = 3;
+  assert(!imagine_sobel(&dst, &src));
+}
+
+static imagine_histogram imagine_test_hist_a;
+static imagine_histogram imagine_test_hist_b;
+
+static void imagine_test_histogram(void)
+{
+  static unsigned char pixels[37 * 5 * 4];
+  unsigned int reference[4][256];
+  unsigned int stride;
+  unsigned int mismatches = 0;
+  unsigned int i;
+  unsigned int c;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.width = 37;
+  img.height = 5;
+
+  for (stride = 1; stride <= 4; ++stride)
+  {
+    unsigned int n = img.width * img.height * stride;
+    double sums[4] = {0.0, 0.0, 0.0, 0.0};
+
+    img.stride = stride;
+
+    for (c = 0; c < 4; ++c)
+    {
+      for (i = 0; i < 256; ++i)
+      {
+        reference[c][i] = 0;
+      }
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+      pixels[i] = (unsigned char)((i * 7u + (i % stride) * 50u + 20u) & 255u);
+      reference[i % stride][pixels[i]]++;
+      sums[i % stride] += (double)pixels[i];
+    }
+
+    assert(imagine_histogram_compute(&imagine_test_hist_a, &img));
+    assert(imagine_test_hist_a.channels == stride);
+    assert(imagine_test_hist_a.count == img.width * img.height);
+
+    for (c = 0; c < stride; ++c)
+    {
+      unsigned int lo = 255;
+      unsigned int hi = 0;
+
+      for (i = 0; i < 256; ++i)
+      {
+        mismatches += imagine_test_hist_a.bins[c][i] == reference[c][i] ? 0u : 1u;
+
+        if (reference[c][i])
+        {
+          lo = i < lo ? i : lo;
+          hi = i;
+        }
+      }
+
+      assert(imagine_test_hist_a.min[c] == lo);
+      assert(imagine_test_hist_a.max[c] == hi);
+      assert(imagine_test_hist_a.sum[c] == sums[c]);
+      assert(imagine_test_hist_a.mean[c] * (double)(img.width * img.height) - sums[c] < 0.001);
+      assert(sums[c] - imagine_test_hist_a.mean[c] * (double)(img.width * img.height) < 0.001);
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* All black: min, max and mean are zero */
+  img.stride = 1;
+
+  for (i = 0; i < img.width * img.height; ++i)
+  {
+    pixels[i] = 0;
+  }
+
+  assert(imagine_histogram_compute(&imagine_test_hist_a, &img));
+  assert(imagine_test_hist_a.bins[0][0] == img.width * img.height);
+  assert(imagine_test_hist_a.min[0] == 0 && imagine_test_hist_a.max[0] == 0);
+  assert(imagine_test_hist_a.mean[0] == 0.0);
+
+  /* Accumulating in pieces gives the same result as one pass */
+  imagine_histogram_reset(&imagine_test_hist_b);
+  assert(imagine_histogram_add(&imagine_test_hist_b, pixels, 10, 1));
+  assert(imagine_histogram_add(&imagine_test_hist_b, pixels + 10, img.width * img.height - 10, 1));
+  assert(!imagine_histogram_add(&imagine_test_hist_b, pixels, 4, 3)); /* stride may not change */
+  imagine_histogram_finish(&imagine_test_hist_b);
+  assert(imagine_test_hist_b.bins[0][0] == img.width * img.height);
+
+#ifdef IMAGINE_HISTOGRAM
+  {
+    static char *files[] = {
+        "images/test-p1.pbm", "images/test-p2.pgm", "images/test-p3.ppm", "images/test-p4.pbm",
+        "images/test-p5.pgm", "images/test-p6.ppm", "images/test-bmp-24bit.bmp", "images/test-bmp-32bit.bmp",
+        "images/test.tga", "images/test.pcx", "images/test.dds"};
+    static unsigned char decoded[BUF_SIZE];
+    static unsigned char binary_buffer[BUF_SIZE];
+    unsigned long binary_buffer_size;
+    unsigned int f;
+
+    imagine loaded = {0};
+    loaded.pixels = decoded;
+    loaded.pixels_capacity = BUF_SIZE;
+    loaded.histogram = &imagine_test_hist_b;
+
+    for (f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+    {
+      if (!pio_read(files[f], binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+      {
+        char path[64] = "tests/";
+        unsigned int k = 0;
+
+        while (files[f][k] && k < 57)
+        {
+          path[6 + k] = files[f][k];
+          ++k;
+        }
+
+        path[6 + k] = 0;
+        assert(pio_read(path, binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+      }
+
+      assert(imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size));
+      assert(imagine_histogram_compute(&imagine_test_hist_a, &loaded));
+      assert(imagine_test_hist_b.count == imagine_test_hist_a.count);
+
+      for (c = 0; c < 4; ++c)
+      {
+        for (i = 0; i < 256; ++i)
+        {
+          mismatches += imagine_test_hist_a.bins[c][i] == imagine_test_hist_b.bins[c][i] ? 0u : 1u;
+        }
+      }
+    }
+
+    assert(mismatches == 0);
+  }
+#endif
+}
+
+static void imagine_test_hash(void)
+{
+  static char *files[] = {
+      "images/test-p5.pgm", "images/test-p6.ppm", "images/test-bmp-24bit.bmp", "images/test-bmp-32bit.bmp",
+      "images/test.tga", "images/test.dds"};
+  static unsigned char binary_buffer[BUF_SIZE];
+  static unsigned char pixels[BUF_SIZE];
+  static unsigned char file[16 + 96 * 64 * 3];
+  static unsigned char large_pixels[96 * 64 * 3];
+  static unsigned char small_pixels[48 * 32 * 3];
+  static unsigned char scratch[16384];
+  static unsigned char header[256];
+  static imagine_hash hashes[67];
+  unsigned char distances[67];
+  unsigned long binary_buffer_size;
+  imagine_hash a, b, q;
+  unsigned int file_size;
+  unsigned int mismatches = 0;
+  unsigned int f, i, x, y;
+  int kind;
+
+  imagine img = {0};
+  imagine small = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+  small.pixels = small_pixels;
+  small.pixels_capacity = sizeof(small_pixels);
+
+  /* Tiny files: one pixel per thumbnail cell, so reading the file equals hashing the decode */
+  for (f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+  {
+    if (!pio_read(files[f], binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+    {
+      char path[64] = "tests/";
+
+      for (i = 0; files[f][i] && i < 57; ++i)
+      {
+        path[6 + i] = files[f][i];
+      }
+
+      path[6 + i] = 0;
+      assert(pio_read(path, binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+    }
+
+    assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+
+    for (kind = IMAGINE_HASH_AVERAGE; kind <= IMAGINE_HASH_DCT; ++kind)
+    {
+      assert(imagine_hash_image(&a, &img, kind));
+      assert(imagine_hash_load(&b, binary_buffer, (unsigned int)binary_buffer_size, kind));
+      mismatches += imagine_hash_distance(&a, &b) == 0 ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* Needs a real decode: RLE PCX, ASCII netpbm, truncated data */
+  assert(!imagine_hash_load(&a, (unsigned char *)"P2\n2 2\n255\n0 1 2 3\n", 20, IMAGINE_HASH_AVERAGE));
+  assert(!imagine_hash_load(&a, binary_buffer, 20, IMAGINE_HASH_AVERAGE));
+
+  /* Header widths whose row size wraps to 0: 0x08000000 * 32 bits (BMP), 0x40000000 * 4 bytes (DDS) */
+  header[0] = 'B';
+  header[1] = 'M';
+  header[10] = 54;
+  header[21] = 0x08;
+  header[22] = 1;
+  header[26] = 1;
+  header[28] = 32;
+  assert(!imagine_hash_load(&a, header, sizeof(header), IMAGINE_HASH_AVERAGE));
+
+  for (i = 0; i < sizeof(header); ++i)
+  {
+    header[i] = 0;
+  }
+
+  header[0] = 'D';
+  header[1] = 'D';
+  header[2] = 'S';
+  header[3] = ' ';
+  header[12] = 1;
+  header[19] = 0x40;
+  header[76] = 32;
+  header[88] = 32;
+  assert(!imagine_hash_load(&a, header, sizeof(header), IMAGINE_HASH_AVERAGE));
+
+  /* 96x64 P6 built in memory: sampled file hash, full decode hash and a half size copy agree */
+  file_size = imagine_test_make_p6(file, 96, 64);
+
+  for (y = 0; y < 64; ++y)
+  {
+    for (x = 0; x < 96; ++x)
+    {
+      unsigned char *p = file + file_size - 96 * 64 * 3 + (y * 96 + x) * 3;
+      unsigned int dx = x > 60 ? x - 60 : 60 - x;
+      unsigned int dy = y > 24 ? y - 24 : 24 - y;
+
+      p[0] = (unsigned char)(dx * dx + dy * dy < 300 ? 250 : x * 2);
+      p[1] = (unsigned char)(y * 3 + 40);
+      p[2] = (unsigned char)((x / 12 + y / 16) & 1 ? 200 : 30);
+    }
+  }
+
+  img.pixels = large_pixels;
+  img.pixels_capacity = sizeof(large_pixels);
+  assert(imagine_load(&img, file, file_size));
+  assert(imagine_resize(&small, &img, 48, 32, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+
+  for (kind = IMAGINE_HASH_AVERAGE; kind <= IMAGINE_HASH_DCT; ++kind)
+  {
+    imagine_hash c;
+
+    assert(imagine_hash_image(&a, &img, kind));
+    assert(imagine_hash_load(&b, file, file_size, kind));
+    assert(imagine_hash_image(&c, &small, kind));
+    assert(imagine_hash_distance(&a, &b) <= 6);
+    assert(imagine_hash_distance(&a, &c) <= 6);
+
+    /* A mirrored image is a different image */
+    assert(imagine_flip_horizontal(&img));
+    assert(imagine_hash_image(&c, &img, kind));
+    assert(imagine_hash_distance(&a, &c) >= 16);
+    assert(imagine_flip_horizontal(&img));
+  }
+
+  assert(!imagine_hash_image(&a, &img, 3));
+
+  /* SIMD distances against the scalar count, odd count for the tail */
+  for (i = 0; i < 67; ++i)
+  {
+    for (x = 0; x < 8; ++x)
+    {
+      hashes[i].bits[x] = (unsigned char)((i * 37u + x * 101u) * 2654435761u >> 24);
+    }
+  }
+
+  q = hashes[5];
+  imagine_hash_distances(distances, &q, hashes, 67);
+
+  for (i = 0; i < 67; ++i)
+  {
+    unsigned int n = 0;
+
+    for (x = 0; x < 64; ++x)
+    {
+      n += (unsigned int)(((hashes[i].bits[x >> 3] ^ q.bits[x >> 3]) >> (x & 7)) & 1);
+    }
+
+    mismatches += distances[i] == n ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+  assert(distances[5] == 0);
+  assert(imagine_hash_find(&q, hashes, 67, 0) == 5);
+
+  q.bits[7] ^= 0x81; /* two bits off */
+  assert(imagine_hash_find(&q, hashes, 67, 1) == 67);
+  assert(imagine_hash_find(&q, hashes, 67, 2) == 5);
+  assert(imagine_hash_find(&q, hashes, 0, 64) == 0);
+}
+
+static void imagine_test_composite(void)
+{
+  static unsigned char all_pixels[256 * 256 * 4];
+  static unsigned char src_pixels[37 * 3 * 4];
+  static unsigned char dst_pixels[37 * 3 * 4];
+  static unsigned char expected[37 * 3 * 4];
+  unsigned int mismatches = 0;
+  unsigned int i, c;
+  int mode;
+
+  imagine all = {0};
+  imagine src = {0};
+  imagine dst = {0};
+  all.pixels = all_pixels;
+  all.width = 256;
+  all.height = 256;
+  all.stride = 4;
+
+  /* Every color / alpha pair: premultiply is round(c a / 255), unpremultiply divides back */
+  for (i = 0; i < 256 * 256; ++i)
+  {
+    all_pixels[i * 4 + 0] = (unsigned char)(i & 255);
+    all_pixels[i * 4 + 1] = (unsigned char)(255 - (i & 255));
+    all_pixels[i * 4 + 2] = (unsigned char)((i * 7) & 255);
+    all_pixels[i * 4 + 3] = (unsigned char)(i >> 8);
+  }
+
+  assert(imagine_premultiply(&all));
+
+  for (i = 0; i < 256 * 256; ++i)
+  {
+    unsigned int a = i >> 8;
+
+    mismatches += all_pixels[i * 4 + 0] == (2 * (i & 255) * a + 255) / 510 ? 0u : 1u;
+    mismatches += all_pixels[i * 4 + 1] == (2 * (255 - (i & 255)) * a + 255) / 510 ? 0u : 1u;
+    mismatches += all_pixels[i * 4 + 2] == (2 * ((i * 7) & 255) * a + 255) / 510 ? 0u : 1u;
+    mismatches += all_pixels[i * 4 + 3] == a ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  /* Premultiplied values v <= a of every alpha */
+  for (i = 0; i < 256 * 256; ++i)
+  {
+    unsigned int a = i >> 8;
+
+    all_pixels[i * 4 + 0] = (unsigned char)((i & 255) <= a ? (i & 255) : a);
+    all_pixels[i * 4 + 1] = (unsigned char)(a / 2);
+    all_pixels[i * 4 + 2] = (unsigned char)a;
+  }
+
+  assert(imagine_unpremultiply(&all));
+
+  for (i = 0; i < 256 * 256; ++i)
+  {
+    unsigned int a = i >> 8;
+    unsigned int v = (i & 255) <= a ? (i & 255) : a;
+
+    mismatches += all_pixels[i * 4 + 0] == (a ? (v * 255 + a / 2) / a : 0) ? 0u : 1u;
+    mismatches += all_pixels[i * 4 + 1] == (a ? ((a / 2) * 255 + a / 2) / a : 0) ? 0u : 1u;
+    mismatches += all_pixels[i * 4 + 2] == (a ? 255u : 0u) ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  /* Compositing, checked per channel against imagine_blend (covers the SSE2 path and the tail) */
+  src.pixels = src_pixels;
+  dst.pixels = dst_pixels;
+  src.width = dst.width = 37;
+  src.height = dst.height = 3;
+  src.stride = dst.stride = 4;
+
+  for (mode = IMAGINE_BLEND_OVER; mode <= IMAGINE_BLEND_ADD; ++mode)
+  {
+    for (i = 0; i < 37 * 3; ++i)
+    {
+      unsigned int sa = (i * 53) & 255;
+      unsigned int da = (i * 29 + 100) & 255;
+
+      for (c = 0; c < 3; ++c)
+      {
+        src_pixels[i * 4 + c] = (unsigned char)(((i * 31 + c * 77) & 255) * sa / 255);
+        dst_pixels[i * 4 + c] = (unsigned char)(((i * 13 + c * 91) & 255) * da / 255);
+      }
+
+      src_pixels[i * 4 + 3] = (unsigned char)sa;
+      dst_pixels[i * 4 + 3] = (unsigned char)da;
+
+      for (c = 0; c < 4; ++c)
+      {
+        expected[i * 4 + c] = (unsigned char)imagine_blend(src_pixels[i * 4 + c], dst_pixels[i * 4 + c], sa, da, mode);
+      }
+    }
+
+    assert(imagine_composite(&dst, &src, mode));
+
+    for (i = 0; i < 37 * 3 * 4; ++i)
+    {
+      mismatches += dst_pixels[i] == expected[i] ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* Known values: over with transparent and opaque sources, multiply by white, add saturates */
+  assert(imagine_blend(0, 90, 0, 200, IMAGINE_BLEND_OVER) == 90);
+  assert(imagine_blend(40, 90, 255, 200, IMAGINE_BLEND_OVER) == 40);
+  assert(imagine_blend(128, 200, 128, 255, IMAGINE_BLEND_OVER) == 128 + 100);
+  assert(imagine_blend(255, 90, 255, 255, IMAGINE_BLEND_MULTIPLY) == 90);
+  assert(imagine_blend(0, 90, 255, 255, IMAGINE_BLEND_SCREEN) == 90);
+  assert(imagine_blend(255, 90, 255, 255, IMAGINE_BLEND_SCREEN) == 255);
+  assert(imagine_blend(200, 90, 255, 255, IMAGINE_BLEND_ADD) == 255);
+  assert(imagine_blend(128, 128, 128, 128, IMAGINE_BLEND_OVER) == 192);
+
+  src.stride = 3;
+  assert(!imagine_composite(&dst, &src, IMAGINE_BLEND_OVER));
+  assert(!imagine_premultiply(&src));
+  src.stride = 4;
+  assert(!imagine_composite(&dst, &src, 4));
+}
+
+static void imagine_test_quantize(void)
+{
+  static unsigned char src_pixels[64 * 48 * 4];
+  static unsigned char out_pixels[64 * 48 * 3];
+  static unsigned char indices[64 * 48];
+  static unsigned char scratch[65536 + 65024 + 131072 + 16];
+  static unsigned char colors[6][3] = {{0, 0, 0}, {255, 255, 255}, {200, 30, 40}, {20, 180, 60}, {30, 60, 220}, {250, 220, 10}};
+  imagine_palette palette;
+  unsigned int size, i, c, x, y;
+  unsigned int mismatches = 0;
+  int dither;
+
+  imagine src = {0};
+  imagine out = {0};
+  src.pixels = src_pixels;
+  out.pixels = out_pixels;
+  out.pixels_capacity = sizeof(out_pixels);
+
+  /* Six flat colors: six palette entries and an exact round trip */
+  src.width = 40;
+  src.height = 30;
+  src.stride = 3;
+
+  for (y = 0; y < 30; ++y)
+  {
+    for (x = 0; x < 40; ++x)
+    {
+      for (c = 0; c < 3; ++c)
+      {
+        src_pixels[(y * 40 + x) * 3 + c] = colors[(x / 10 + y / 15 * 3) % 6][c];
+      }
+    }
+  }
+
+  size = imagine_quantize_scratch_size(&src);
+  assert(size > 0 && size <= sizeof(scratch));
+  assert(imagine_palette_median_cut(&palette, &src, 16, scratch, size));
+  assert(palette.count == 6);
+
+  for (dither = IMAGINE_DITHER_NONE; dither <= IMAGINE_DITHER_FLOYD_STEINBERG; ++dither)
+  {
+    assert(imagine_quantize(indices, &src, &palette, dither, scratch, size));
+    assert(imagine_palette_expand(&out, indices, 40, 30, &palette));
+
+    for (i = 0; i < 40 * 30 * 3; ++i)
+    {
+      mismatches += out_pixels[i] == src_pixels[i] ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+  assert(out.stride == 3 && out.width == 40 && out.height == 30);
+
+  /* Smooth RGBA gradient into 16 colors: dithering keeps the mean color */
+  src.width = 64;
+  src.height = 48;
+  src.stride = 4;
+
+  for (y = 0; y < 48; ++y)
+  {
+    for (x = 0; x < 64; ++x)
+    {
+      unsigned char *p = src_pixels + (y * 64 + x) * 4;
+
+      p[0] = (unsigned char)(x * 4);
+      p[1] = (unsigned char)(y * 5);
+      p[2] = (unsigned char)(255 - x * 2 - y);
+      p[3] = (unsigned char)x; /* ignored */
+    }
+  }
+
+  size = imagine_quantize_scratch_size(&src);
+  assert(imagine_palette_median_cut(&palette, &src, 16, scratch, size));
+  assert(palette.count == 16);
+
+  for (dither = IMAGINE_DITHER_NONE; dither <= IMAGINE_DITHER_ORDERED; ++dither)
+  {
+    double sum_in[3] = {0.0, 0.0, 0.0};
+    double sum_out[3] = {0.0, 0.0, 0.0};
+    unsigned int worst = 0;
+
+    assert(imagine_quantize(indices, &src, &palette, dither, scratch, size));
+    assert(imagine_palette_expand(&out, indices, 64, 48, &palette));
+
+    for (i = 0; i < 64 * 48; ++i)
+    {
+      for (c = 0; c < 3; ++c)
+      {
+        unsigned int a = src_pixels[i * 4 + c];
+        unsigned int b = out_pixels[i * 3 + c];
+        unsigned int d = a > b ? a - b : b - a;
+
+        sum_in[c] += (double)a;
+        sum_out[c] += (double)b;
+        worst = d > worst ? d : worst;
+      }
+    }
+
+    for (c = 0; c < 3; ++c)
+    {
+      double mean_error = (sum_out[c] - sum_in[c]) / (64.0 * 48.0);
+
+      assert(mean_error < (dither == IMAGINE_DITHER_FLOYD_STEINBERG ? 1.0 : 4.0));
+      assert(mean_error > (dither == IMAGINE_DITHER_FLOYD_STEINBERG ? -1.0 : -4.0));
+    }
+
+    assert(dither != IMAGINE_DITHER_NONE || worst < 64);
+  }
+
+  /* SSE2 palette search against the brute force one, 13 entries leave a partial block */
+  palette.count = 13;
+  {
+    imagine_quantize_search search;
+
+    imagine_quantize_search_init(&search, &palette);
+
+    for (i = 0; i < 32768; i += 3)
+    {
+      int r = (int)((i >> 10) * 8 + 3);
+      int g = (int)(((i >> 5) & 31) * 8 + 5);
+      int b = (int)((i & 31) * 8 + 1);
+
+      mismatches += imagine_quantize_nearest(&search, r, g, b) == imagine_palette_nearest(&palette, r, g, b) ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* Gray input, fixed palette */
+  src.width = 256;
+  src.height = 1;
+  src.stride = 1;
+
+  for (i = 0; i < 256; ++i)
+  {
+    src_pixels[i] = (unsigned char)i;
+  }
+
+  palette.count = 2;
+  palette.colors[0][0] = palette.colors[0][1] = palette.colors[0][2] = 0;
+  palette.colors[1][0] = palette.colors[1][1] = palette.colors[1][2] = 255;
+  size = imagine_quantize_scratch_size(&src);
+  assert(imagine_quantize(indices, &src, &palette, IMAGINE_DITHER_NONE, scratch, size));
+  assert(indices[0] == 0 && indices[100] == 0 && indices[160] == 1 && indices[255] == 1);
+
+  /* All 256 grays: several entries share every grid cell, each gray still maps to itself */
+  palette.count = 256;
+
+  for (i = 0; i < 256; ++i)
+  {
+    palette.colors[i][0] = palette.colors[i][1] = palette.colors[i][2] = (unsigned char)i;
+  }
+
+  assert(imagine_quantize(indices, &src, &palette, IMAGINE_DITHER_NONE, scratch, size));
+
+  for (i = 0; i < 256; ++i)
+  {
+    mismatches += indices[i] == i ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  /* Arbitrary palette with a duplicate entry: grid lookups equal the brute force search */
+  palette.count = 200;
+
+  for (i = 0; i < 200; ++i)
+  {
+    for (c = 0; c < 3; ++c)
+    {
+      palette.colors[i][c] = (unsigned char)(((i * 3 + c) * 2654435761u) >> 24);
+    }
+  }
+
+  palette.colors[150][0] = palette.colors[20][0];
+  palette.colors[150][1] = palette.colors[20][1];
+  palette.colors[150][2] = palette.colors[20][2];
+
+  src.width = 64;
+  src.height = 48;
+  src.stride = 3;
+  size = imagine_quantize_scratch_size(&src);
+
+  for (y = 0; y < 16; ++y)
+  {
+    for (i = 0; i < 64 * 48 * 3; ++i)
+    {
+      src_pixels[i] = (unsigned char)(((y * 64 * 48 * 3 + i) * 2246822519u) >> 24);
+    }
+
+    src_pixels[0] = palette.colors[150][0];
+    src_pixels[1] = palette.colors[150][1];
+    src_pixels[2] = palette.colors[150][2];
+
+    assert(imagine_quantize(indices, &src, &palette, IMAGINE_DITHER_NONE, scratch, size));
+    assert(indices[0] == 20);
+
+    for (i = 0; i < 64 * 48; ++i)
+    {
+      unsigned char *p = src_pixels + i * 3;
+
+      mismatches += indices[i] == imagine_palette_nearest(&palette, p[0], p[1], p[2]) ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+
+  src.width = 256;
+  src.height = 1;
+  src.stride = 1;
+  size = imagine_quantize_scratch_size(&src);
+
+  assert(!imagine_quantize(indices, &src, &palette, IMAGINE_DITHER_NONE, scratch, size - 17));
+  assert(!imagine_quantize(indices, &src, &palette, 3, scratch, size));
+  assert(!imagine_palette_median_cut(&palette, &src, 0, scratch, size));
+}
+
+static void imagine_test_layout(void)
+{
+  static unsigned char linear_pixels[70 * 45 * 3];
+  static unsigned char tiled_pixels[70 * 45 * 3];
+  static unsigned char back_pixels[70 * 45 * 3];
+  static unsigned char file[16 + 40 * 20 * 3];
+  static unsigned char loaded_pixels[40 * 20 * 3 + 8 * 40 * 3];
+  static unsigned char scratch[16384];
+  unsigned int file_size;
+  unsigned int mismatches = 0;
+  unsigned int i, x, y, tw, th;
+  int layout;
+
+  imagine linear = {0};
+  imagine tiled = {0};
+  imagine back = {0};
+  imagine loaded = {0};
+  imagine huge = {0};
+  linear.pixels = linear_pixels;
+  linear.width = 70;
+  linear.height = 45;
+  linear.stride = 3;
+  linear.pixels_size = sizeof(linear_pixels);
+  tiled.pixels = tiled_pixels;
+  tiled.pixels_capacity = sizeof(tiled_pixels);
+  back.pixels = back_pixels;
+  back.pixels_capacity = sizeof(back_pixels);
+
+  for (i = 0; i < 70 * 45 * 3; ++i)
+  {
+    linear_pixels[i] = (unsigned char)(i * 7 + i / 251);
+  }
+
+  /* Both layouts with two tile sizes: accessors match and the round trip is exact */
+  for (layout = IMAGINE_LAYOUT_TILED; layout <= IMAGINE_LAYOUT_MORTON; ++layout)
+  {
+    for (i = 8; i <= 32; i *= 4)
+    {
+      assert(imagine_relayout(&tiled, &linear, layout, i));
+      assert(tiled.layout == layout && tiled.tile == i && tiled.pixels_size == linear.pixels_size);
+
+      for (y = 0; y < 45; ++y)
+      {
+        for (x = 0; x < 70; ++x)
+        {
+          unsigned char *a = imagine_pixel(&linear, x, y);
+          unsigned char *b = imagine_pixel(&tiled, x, y);
+
+          mismatches += (a[0] == b[0] && a[1] == b[1] && a[2] == b[2]) ? 0u : 1u;
+        }
+      }
+
+      assert(imagine_relayout(&back, &tiled, IMAGINE_LAYOUT_LINEAR, 0));
+      assert(back.layout == IMAGINE_LAYOUT_LINEAR);
+
+      for (x = 0; x < 70 * 45 * 3; ++x)
+      {
+        mismatches += back_pixels[x] == linear_pixels[x] ? 0u : 1u;
+      }
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* Morton order inside a full tile, row order in the narrower edge tile */
+  assert(imagine_relayout(&tiled, &linear, IMAGINE_LAYOUT_MORTON, 8));
+  assert(imagine_pixel_offset(&tiled, 1, 0) == 3);
+  assert(imagine_pixel_offset(&tiled, 0, 1) == 6);
+  assert(imagine_pixel_offset(&tiled, 1, 1) == 9);
+  assert(imagine_pixel_offset(&tiled, 2, 0) == 12);
+  assert(imagine_tile(&tiled, 8, 0, &tw, &th) == tiled_pixels + 64 * 8 * 3);
+  assert(tw == 6 && th == 8);
+  assert(imagine_pixel_offset(&tiled, 65, 1) == (64 * 8 + 6 + 1) * 3);
+  assert(imagine_tile(&tiled, 0, 5, &tw, &th) == tiled_pixels + 40 * 70 * 3);
+  assert(tw == 8 && th == 5);
+  assert(imagine_tile(&tiled, 9, 0, &tw, &th) == 0);
+
+  assert(!imagine_relayout(&back, &tiled, IMAGINE_LAYOUT_TILED, 8)); /* one side must be linear */
+  assert(!imagine_relayout(&back, &linear, IMAGINE_LAYOUT_TILED, 12));
+
+  /* Loaders write the layout directly: 40x20 P6 in 8x8 tiles equals the converted linear load */
+  file_size = imagine_test_make_p6(file, 40, 20);
+
+  loaded.pixels = loaded_pixels;
+  loaded.pixels_capacity = 40 * 20 * 3;
+  assert(imagine_load(&loaded, file, file_size));
+  assert(imagine_relayout(&tiled, &loaded, IMAGINE_LAYOUT_MORTON, 8));
+
+  loaded.layout = IMAGINE_LAYOUT_MORTON;
+  loaded.tile = 8;
+  assert(!imagine_load(&loaded, file, file_size)); /* no room for the band */
+
+  loaded.pixels_capacity = sizeof(loaded_pixels);
+  assert(imagine_load(&loaded, file, file_size));
+
+  for (i = 0; i < 40 * 20 * 3; ++i)
+  {
+    mismatches += loaded_pixels[i] == tiled_pixels[i] ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  /* Processing functions read linear images only and write linear ones */
+  assert(!imagine_convert_gray(&back, &loaded, IMAGINE_COLOR_BT601));
+  assert(!imagine_resize(&back, &loaded, 20, 10, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+  assert(!imagine_flip_horizontal(&loaded));
+  assert(tiled.layout == IMAGINE_LAYOUT_MORTON && tiled.tile == 8);
+  assert(imagine_resize(&tiled, &linear, 20, 10, IMAGINE_FILTER_BILINEAR, scratch, sizeof(scratch)));
+  assert(tiled.layout == IMAGINE_LAYOUT_LINEAR && tiled.tile == 0);
+  assert(imagine_convert_gray(&back, &tiled, IMAGINE_COLOR_BT601));
+  assert(back.width == 20 && back.height == 10 && back.stride == 1);
+
+  /* Sizes from the file must not wrap: tile rows, planes and packed rows */
+  huge.pixels_capacity = 0xFFFFFFFFU;
+  huge.width = 5592406; /* 256 * 3 * width wraps to 512 */
+  huge.height = 1;
+  huge.stride = 3;
+  huge.layout = IMAGINE_LAYOUT_TILED;
+  huge.tile = 256;
+  assert(!imagine_layout_prepare(&huge));
+  huge.tile = 8;
+  assert(imagine_layout_prepare(&huge) && huge.pixels_size == 5592406U * 3U);
+
+  huge.width = 65536;
+  huge.height = 65537; /* width * height wraps to 65536 */
+  huge.layout = IMAGINE_LAYOUT_PLANAR;
+  assert(!imagine_layout_prepare(&huge));
+  huge.layout = IMAGINE_LAYOUT_LINEAR;
+  assert(!imagine_layout_prepare(&huge));
+}
+
+static void imagine_test_planar(void)
+{
+  static char *files[] = {"tests/images/test-bmp-24bit.bmp", "tests/images/test-bmp-32bit.bmp",
+                          "tests/images/test-bmp-8bit.bmp",  "tests/images/test-p3.ppm",
+                          "tests/images/test-p6.ppm",        "tests/images/test.tga",
+                          "tests/images/test.dds",           "tests/images/test.pcx"};
+  static unsigned char linear_pixels[37 * 9 * 4];
+  static unsigned char planar_pixels[4 * 336 + 37 * 4];
+  static unsigned char back_pixels[37 * 9 * 4];
+  static unsigned char loaded_pixels[BUF_SIZE * 4 + 16];
+  static unsigned char expected_pixels[BUF_SIZE * 4 + 16];
+  static unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+  unsigned int mismatches = 0;
+  unsigned int i, c, x, y, f;
+
+  imagine linear = {0};
+  imagine planar = {0};
+  imagine back = {0};
+  imagine loaded = {0};
+  imagine expected = {0};
+  linear.pixels = linear_pixels;
+  linear.width = 37;
+  linear.height = 9;
+  planar.pixels = planar_pixels;
+  planar.pixels_capacity = sizeof(planar_pixels);
+  back.pixels = back_pixels;
+  back.pixels_capacity = sizeof(back_pixels);
+
+  for (i = 0; i < 37 * 9 * 4; ++i)
+  {
+    linear_pixels[i] = (unsigned char)(i * 11 + i / 199);
+  }
+
+  /* Odd width: every row ends in the scalar tail of the split */
+  for (linear.stride = 3; linear.stride <= 4; ++linear.stride)
+  {
+    linear.pixels_size = 37 * 9 * linear.stride;
+    assert(imagine_relayout(&planar, &linear, IMAGINE_LAYOUT_PLANAR, 0));
+    assert(planar.layout == IMAGINE_LAYOUT_PLANAR && planar.pixels_size == linear.stride * 336);
+    assert(imagine_plane_size(&planar) == 336);
+    assert(imagine_plane(&planar, linear.stride) == 0);
+
+    for (c = 0; c < linear.stride; ++c)
+    {
+      unsigned char *plane = imagine_plane(&planar, c);
+
+      assert((unsigned int)(plane - planar_pixels) % 16 == 0);
+
+      for (y = 0; y < 9; ++y)
+      {
+        for (x = 0; x < 37; ++x)
+        {
+          mismatches += plane[y * 37 + x] == imagine_pixel(&linear, x, y)[c] ? 0u : 1u;
+        }
+      }
+    }
+
+    assert(imagine_pixel(&planar, 5, 2) == planar_pixels + 2 * 37 + 5);
+    assert(imagine_tile(&planar, 0, 0, &x, &y) == 0);
+
+    assert(imagine_relayout(&back, &planar, IMAGINE_LAYOUT_LINEAR, 0));
+    assert(back.pixels_size == linear.pixels_size);
+
+    for (i = 0; i < linear.pixels_size; ++i)
+    {
+      mismatches += back_pixels[i] == linear_pixels[i] ? 0u : 1u;
+    }
+  }
+
+  assert(mismatches == 0);
+  assert(!imagine_relayout(&back, &planar, IMAGINE_LAYOUT_TILED, 8)); /* one side must be linear */
+
+  /* Loaders write planes directly: equal to the converted linear load */
+  for (f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+  {
+    if (!pio_read(files[f] + 6, binary_buffer, (unsigned long)sizeof(binary_buffer), &binary_buffer_size))
+    {
+      assert(pio_read(files[f], binary_buffer, (unsigned long)sizeof(binary_buffer), &binary_buffer_size));
+    }
+
+    loaded.layout = IMAGINE_LAYOUT_LINEAR;
+    loaded.pixels = loaded_pixels;
+    loaded.pixels_capacity = sizeof(loaded_pixels);
+    assert(imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size));
+
+    expected.pixels = expected_pixels;
+    expected.pixels_capacity = sizeof(expected_pixels);
+    assert(imagine_relayout(&expected, &loaded, IMAGINE_LAYOUT_PLANAR, 0));
+
+    loaded.layout = IMAGINE_LAYOUT_PLANAR;
+    loaded.pixels_capacity = expected.pixels_size + (loaded.stride > 1 ? loaded.width * loaded.stride : 0U) - 1;
+    assert(!imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size)); /* no room for the staging row */
+
+    loaded.pixels_capacity++;
+    assert(imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size));
+    assert(loaded.pixels_size == expected.pixels_size);
+
+    for (c = 0; c < loaded.stride; ++c)
+    {
+      for (i = 0; i < loaded.width * loaded.height; ++i)
+      {
+        mismatches += imagine_plane(&loaded, c)[i] == imagine_plane(&expected, c)[i] ? 0u : 1u;
+      }
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* 40x20 RGB as P6 (staging row split) and as 3 plane PCX (planes written directly) */
+  for (f = 0; f < 2; ++f)
+  {
+    for (i = 0; i < sizeof(binary_buffer); ++i)
+    {
+      binary_buffer[i] = 0;
+    }
+
+    if (f == 0)
+    {
+      binary_buffer_size = imagine_test_make_p6(binary_buffer, 40, 20);
+    }
+    else
+    {
+      binary_buffer[0] = 0x0A;
+      binary_buffer[1] = 5;
+      binary_buffer[2] = 1;
+      binary_buffer[3] = 8;
+      binary_buffer[8] = 39;
+      binary_buffer[10] = 19;
+      binary_buffer[65] = 3;
+      binary_buffer[66] = 40;
+      binary_buffer_size = 128 + 40 * 20 * 3;
+
+      for (i = 0; i < 40 * 20 * 3; ++i)
+      {
+        binary_buffer[128 + i] = (unsigned char)((i * 13 + 1) & 0x7F); /* literals only */
+      }
+    }
+
+    loaded.layout = IMAGINE_LAYOUT_LINEAR;
+    loaded.pixels_capacity = sizeof(loaded_pixels);
+    assert(imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size));
+    assert(imagine_relayout(&expected, &loaded, IMAGINE_LAYOUT_PLANAR, 0));
+
+#ifdef IMAGINE_HISTOGRAM
+    loaded.histogram = &imagine_test_hist_b;
+#endif
+
+    loaded.layout = IMAGINE_LAYOUT_PLANAR;
+    assert(imagine_load(&loaded, binary_buffer, (unsigned int)binary_buffer_size));
+    assert(loaded.stride == 3 && loaded.pixels_size == 3 * 800);
+
+    for (i = 0; i < loaded.pixels_size; ++i)
+    {
+      mismatches += loaded_pixels[i] == expected_pixels[i] ? 0u : 1u;
+    }
+
+#ifdef IMAGINE_HISTOGRAM
+    loaded.histogram = 0;
+    assert(imagine_histogram_compute(&imagine_test_hist_a, &expected));
+    assert(imagine_test_hist_b.count == 800 && imagine_test_hist_a.count == 800);
+
+    for (c = 0; c < 3; ++c)
+    {
+      for (i = 0; i < 256; ++i)
+      {
+        mismatches += imagine_test_hist_a.bins[c][i] == imagine_test_hist_b.bins[c][i] ? 0u : 1u;
+      }
+    }
+#endif
+  }
+
+  assert(mismatches == 0);
+}
+
+static void imagine_test_pitch(void)
+{
+  static char *files[] = {"tests/images/test-p1.pbm",        "tests/images/test-p2.pgm",
+                          "tests/images/test-p3.ppm",        "tests/images/test-p4.pbm",
+                          "tests/images/test-p5.pgm",        "tests/images/test-p6.ppm",
+                          "tests/images/test-bmp-8bit.bmp",  "tests/images/test-bmp-24bit.bmp",
+                          "tests/images/test-bmp-32bit.bmp", "tests/images/test.tga",
+                          "tests/images/test.pcx",           "tests/images/test.dds"};
+  static unsigned char reference_pixels[64 * 32 * 3];
+  static unsigned char canvas_pixels[64 * 32 * 3 + 64];
+  static unsigned char packed_pixels[64 * 32 * 3];
+  static unsigned char binary_buffer[BUF_SIZE];
+  static unsigned char tall_header[] = "P5\n1 262145\n255\n";
+  unsigned long binary_buffer_size;
+  unsigned int mismatches = 0;
+  unsigned int i, x, y, f, row;
+  imagine_hash a, b;
+
+  imagine reference = {0};
+  imagine aligned = {0};
+  imagine canvas = {0};
+  imagine view = {0};
+  imagine packed = {0};
+  imagine tall = {0};
+  reference.pixels = reference_pixels;
+
+  assert(imagine_aligned_pitch(37, 3, 64) == 128);
+  assert(imagine_aligned_pitch(64, 1, 64) == 64);
+  assert(!imagine_align_pixels(&aligned, canvas_pixels + 1, sizeof(canvas_pixels) - 1, 48));
+  assert(imagine_align_pixels(&aligned, canvas_pixels + 1, sizeof(canvas_pixels) - 1, 64));
+  assert(((unsigned long)aligned.pixels & 63) == 0);
+  assert(aligned.pixels_capacity == sizeof(canvas_pixels) - (unsigned int)(aligned.pixels - canvas_pixels));
+
+  /* Every loader writes 64 byte aligned rows and leaves the row padding alone */
+  for (f = 0; f < sizeof(files) / sizeof(files[0]); ++f)
+  {
+    if (!pio_read(files[f] + 6, binary_buffer, (unsigned long)sizeof(binary_buffer), &binary_buffer_size))
+    {
+      assert(pio_read(files[f], binary_buffer, (unsigned long)sizeof(binary_buffer), &binary_buffer_size));
+    }
+
+    reference.pixels_capacity = sizeof(reference_pixels);
+    assert(imagine_load(&reference, binary_buffer, (unsigned int)binary_buffer_size));
+
+    for (i = 0; i < aligned.pixels_capacity; ++i)
+    {
+      aligned.pixels[i] = 0xEE;
+    }
+
+    aligned.pitch = imagine_aligned_pitch(reference.width, reference.stride, 64);
+    assert(imagine_load(&aligned, binary_buffer, (unsigned int)binary_buffer_size));
+    assert(aligned.pixels_size == (aligned.height - 1) * aligned.pitch + aligned.width * aligned.stride);
+    row = reference.width * reference.stride;
+
+    for (y = 0; y < reference.height; ++y)
+    {
+      for (i = 0; i < aligned.pitch; ++i)
+      {
+        unsigned char expected = i < row ? reference_pixels[y * row + i] : (unsigned char)0xEE;
+
+        mismatches += aligned.pixels[y * aligned.pitch + i] == expected ? 0u : 1u;
+      }
+    }
+  }
+
+  assert(mismatches == 0);
+
+  /* 40x20 P6 decoded into a 64x32 canvas at (7, 5) */
+  binary_buffer_size = imagine_test_make_p6(binary_buffer, 40, 20);
+
+  reference.pixels_capacity = sizeof(reference_pixels);
+  assert(imagine_load(&reference, binary_buffer, (unsigned int)binary_buffer_size));
+
+  canvas.pixels = canvas_pixels;
+  canvas.pixels_capacity = 64 * 32 * 3;
+  canvas.width = 64;
+  canvas.height = 32;
+  canvas.stride = 3;
+
+  for (i = 0; i < canvas.pixels_capacity; ++i)
+  {
+    canvas_pixels[i] = 0xEE;
+  }
+
+  assert(!imagine_view(&view, &canvas, 64, 0));
+  assert(imagine_view(&view, &canvas, 30, 5));
+  assert(!imagine_load(&view, binary_buffer, (unsigned int)binary_buffer_size)); /* rows would run past the pitch */
+
+  view.layout = IMAGINE_LAYOUT_TILED;
+  view.tile = 8;
+  assert(!imagine_load(&view, binary_buffer, (unsigned int)binary_buffer_size)); /* only linear images have a pitch */
+
+#ifdef IMAGINE_HISTOGRAM
+  view.histogram = &imagine_test_hist_b;
+#endif
+
+  assert(imagine_view(&view, &canvas, 7, 5));
+  assert(view.pitch == 64 * 3 && view.offset == (5 * 64 + 7) * 3);
+  assert(imagine_load(&view, binary_buffer, (unsigned int)binary_buffer_size));
+  assert(view.pixels_size == view.offset + 19 * 64 * 3 + 40 * 3);
+
+  for (y = 0; y < 32; ++y)
+  {
+    for (x = 0; x < 64; ++x)
+    {
+      unsigned char *p = imagine_pixel(&canvas, x, y);
+      int inside = x >= 7 && x < 47 && y >= 5 && y < 25;
+
+      for (i = 0; i < 3; ++i)
+      {
+        mismatches += p[i] == (inside ? imagine_pixel(&reference, x - 7, y - 5)[i] : 0xEE) ? 0u : 1u;
+      }
+    }
+  }
+
+  assert(mismatches == 0);
+  assert(imagine_pixel(&view, 0, 0) == imagine_pixel(&canvas, 7, 5));
+
+  /* Readers follow the pitch */
+  assert(imagine_hash_image(&a, &reference, IMAGINE_HASH_DCT));
+  assert(imagine_hash_image(&b, &view, IMAGINE_HASH_DCT));
+  assert(imagine_hash_distance(&a, &b) == 0);
+
+#ifdef IMAGINE_HISTOGRAM
+  view.histogram = 0;
+  assert(imagine_histogram_compute(&imagine_test_hist_a, &reference));
+
+  for (i = 0; i < 3 * 256; ++i)
+  {
+    mismatches += imagine_test_hist_a.bins[i / 256][i % 256] == imagine_test_hist_b.bins[i / 256][i % 256] ? 0u : 1u;
+  }
+
+  assert(imagine_histogram_compute(&imagine_test_hist_b, &view));
+
+  for (i = 0; i < 3 * 256; ++i)
+  {
+    mismatches += imagine_test_hist_a.bins[i / 256][i % 256] == imagine_test_hist_b.bins[i / 256][i % 256] ? 0u : 1u;
+  }
+#endif
+
+  /* Relayout repacks the rows */
+  packed.pixels = packed_pixels;
+  packed.pixels_capacity = sizeof(packed_pixels);
+  assert(imagine_relayout(&packed, &view, IMAGINE_LAYOUT_LINEAR, 0));
+  assert(packed.pitch == 0 && packed.offset == 0 && packed.pixels_size == 40 * 20 * 3);
+  assert(!imagine_relayout(&packed, &view, IMAGINE_LAYOUT_MORTON, 8));
+
+  for (i = 0; i < 40 * 20 * 3; ++i)
+  {
+    mismatches += packed_pixels[i] == reference_pixels[i] ? 0u : 1u;
+  }
+
+  assert(mismatches == 0);
+
+  /* Processing functions read packed rows only and write packed rows */
+  assert(!imagine_convert_gray(&reference, &view, IMAGINE_COLOR_BT601));
+  assert(!imagine_flip_vertical(&view));
+  assert(!imagine_rotate90(&reference, &view));
+  assert(imagine_convert_gray(&view, &packed, IMAGINE_COLOR_BT601));
+  assert(view.pitch == 0 && view.offset == 0 && view.layout == IMAGINE_LAYOUT_LINEAR);
+  assert(view.width == 40 && view.height == 20 && view.pixels_size == 40 * 20);
+
+  /* A height from the file times the pitch must not wrap past a small buffer */
+  for (i = 0; i < sizeof(tall_header) - 1; ++i)
+  {
+    binary_buffer[i] = tall_header[i];
+  }
+
+  for (; i < 64; ++i)
+  {
+    binary_buffer[i] = 0x55;
+  }
+
+  tall.pixels = packed_pixels;
+  tall.pixels_capacity = 4096;
+  tall.pitch = 16384;
+  assert(!imagine_load(&tall, binary_buffer, 64));
+  tall.pitch = 0;
+  tall.offset = 4000;
+  assert(!imagine_load(&tall, binary_buffer, 64));
+}
+
+#ifdef IMAGINE_STATS
+static void imagine_test_stats(void)
+{
+  unsigned char pixels[BUF_SIZE];
+  unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  /* PCX gray: RLE pixels followed by a palette conversion pass */
+  if (!pio_read("images/test.pcx", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test.pcx", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+  assert(pio_strlen(img.stats.loader) == 3 && img.stats.loader[0] == 'p');
+  assert(img.stats.rows_decoded == img.height);
+  assert(img.stats.bytes_consumed == binary_buffer_size);
+  assert(img.stats.paths == (IMAGINE_PATH_RLE | IMAGINE_PATH_PALETTE));
+  assert(img.stats.stage == IMAGINE_STAGE_COUNT);
+
+  /* BMP 24 bit, then truncated inside the pixel data */
+  if (!pio_read("images/test-bmp-24bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test-bmp-24bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+  assert(img.stats.loader[0] == 'b');
+  assert(img.stats.rows_decoded == 2);
+  assert(img.stats.bytes_consumed == binary_buffer_size);
+  assert(img.stats.paths == (IMAGINE_PATH_BOTTOM_UP | IMAGINE_PATH_SWIZZLE));
+
+  assert(!imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size - 8));
+  assert(img.stats.rows_decoded == 0); /* bottom row is last in the file */
+  assert(img.stats.stage == IMAGINE_STAGE_COUNT);
+
+  /* Unknown format: nothing attributed to a loader */
+  binary_buffer[0] = 'X';
+  binary_buffer[1] = 'X';
+  binary_buffer[2] = 0;
+  binary_buffer[3] = 0;
+  assert(!imagine_load(&img, binary_buffer, 4));
+  assert(img.stats.loader == 0);
+  assert(img.stats.bytes_consumed == 0);
+  assert(img.stats.paths == 0);
+}
+#endif
+
+#ifdef PERF_STATS_ENABLE
+/* Performance gate: profiles decoding, writes the stats to imagine_perf.csv and,
+ * if an imagine_perf_baseline.csv from a previous run exists, fails on median regressions.
+ */
+#define PERF_GATE_ITERATIONS 200
+#define PERF_GATE_THRESHOLD 0.10
+
+static void imagine_test_perf_gate(void)
+{
+  static char baseline[64 * 1024];
+  unsigned char pixels[BUF_SIZE];
+  unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+  unsigned long baseline_size;
+  unsigned char stream_buffer[1024];
+  pio_stream stream;
+  int i;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  if (!pio_read("images/test-p6.ppm", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test-p6.ppm", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  for (i = 0; i < PERF_GATE_ITERATIONS; ++i)
+  {
+    PERF_PROFILE_WITH_THROUGHPUT(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size), "imagine_load_p6", binary_buffer_size, img.pixels_size, img.width * img.height);
+  }
+
+
+  if (!pio_read("images/test-bmp-8bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test-bmp-8bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  for (i = 0; i < PERF_GATE_ITERATIONS; ++i)
+  {
+    PERF_PROFILE_WITH_THROUGHPUT(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size), "imagine_load_bmp8", binary_buffer_size, img.pixels_size, img.width * img.height);
+  }
+
+  assert(pio_stream_open(&stream, "imagine_perf.csv", stream_buffer, sizeof(stream_buffer)));
+  perf_stats_export_csv(perf_sink_pio, &stream);
+  assert(pio_stream_close(&stream, 0));
+  assert(stream.error == 0);
+
+  /* The export merged the stats, throughput is attached to every sample (bmp8 is the last load) */
+  for (i = 0; i < (int)perf_stats_entry_count; ++i)
+  {
+    if (perf_string_equals(perf_stats_entries[i].name, "imagine_load_bmp8"))
+    {
+      assert(perf_stats_entries[i].tp_count == PERF_GATE_ITERATIONS);
+      assert(perf_stats_entries[i].tp_items == (perf_u64)PERF_GATE_ITERATIONS * img.width * img.height);
+      assert(perf_stats_entries[i].tp_bytes_in == (perf_u64)PERF_GATE_ITERATIONS * binary_buffer_size);
+      assert(perf_stats_gbs(&perf_stats_entries[i]) > 0.0);
+    }
+  }
+
+  if (pio_read("imagine_perf_baseline.csv", (unsigned char *)baseline, sizeof(baseline), &baseline_size))
+  {
+    assert(perf_stats_compare(baseline, baseline_size, PERF_GATE_THRESHOLD, perf_sink_print, 0) == 0);
+  }
+}
+
+typedef struct imagine_test_trace
+{
+  char data[8192];
+  unsigned long size;
+
+} imagine_test_trace;
+
+static void imagine_test_trace_sink(void *user, char *str)
+{
+  imagine_test_trace *trace = (imagine_test_trace *)user;
+
+  while (*str && trace->size + 1 < sizeof(trace->data))
+  {
+    trace->data[trace->size++] = *str++;
+  }
+
+  trace->data[trace->size] = '\0';
+}
+
+static unsigned long imagine_test_count(char *haystack, char *needle)
+{
+  unsigned long count = 0;
+  unsigned long needle_length = pio_strlen(needle);
+
+  while (*haystack)
+  {
+    unsigned long i = 0;
+
+    while (i < needle_length && haystack[i] == needle[i])
+    {
+      i++;
+    }
+
+    count += (i == needle_length);
+    haystack++;
+  }
+
+  return count;
+}
+
+static void imagine_test_perf_zones(void)
+{
+  static imagine_test_trace trace;
+  unsigned char pixels[BUF_SIZE];
+  unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  if (!pio_read("images/test.pcx", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test.pcx", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  perf_zones_reset();
+
+  PERF_ZONE_BEGIN("test_zone");
+  assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+  PERF_ZONE_END("test_zone");
+
+  /* test_zone > imagine_load > pcx_rle, pcx_palette */
+  assert(perf_zones_count() == 8);
+
+  trace.size = 0;
+  perf_zones_export_trace(imagine_test_trace_sink, &trace);
+
+  assert(imagine_test_count(trace.data, "\"traceEvents\":[") == 1);
+  assert(imagine_test_count(trace.data, "\"ph\":\"B\"") == 4);
+  assert(imagine_test_count(trace.data, "\"ph\":\"E\"") == 4);
+  assert(imagine_test_count(trace.data, "\"name\":\"imagine_load\"") == 2);
+  assert(imagine_test_count(trace.data, "\"name\":\"pcx_rle\"") == 2);
+  assert(imagine_test_count(trace.data, "\"name\":\"pcx_palette\"") == 2);
+}
+
+static void imagine_test_perf_bench(void)
+{
+  static unsigned char flush[256 * 1024];
+  unsigned char pixels[BUF_SIZE];
+  unsigned char binary_buffer[BUF_SIZE];
+  unsigned long binary_buffer_size;
+  perf_bench bench = {0};
+
+  imagine img = {0};
+  img.pixels = pixels;
+  img.pixels_capacity = BUF_SIZE;
+
+  if (!pio_read("images/test-bmp-24bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size))
+  {
+    assert(pio_read("tests/images/test-bmp-24bit.bmp", binary_buffer, (unsigned long)BUF_SIZE, &binary_buffer_size));
+  }
+
+  assert(imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size));
+
+  bench.bytes = binary_buffer_size;
+  bench.pixels = img.width * img.height;
+  bench.flush_buffer = flush;
+  bench.flush_size = sizeof(flush);
+
+  PERF_BENCH_BEGIN(bench, "imagine_load_bmp24", 50, 5)
+  {
+    imagine_load(&img, binary_buffer, (unsigned int)binary_buffer_size);
+  }
+  PERF_BENCH_END(bench)
+
+  perf_log_flush();
+
+  assert(bench.count == 50);
+  assert(bench.samples_count == 50);
+  assert(bench.min_ns > 0.0);
+  assert(bench.min_ns <= bench.median_ns);
+  assert(bench.min_ns <= bench.mean_ns);
+  assert(bench.stddev_ns >= 0.0);
+}
+
+static perf_stats_entry *imagine_test_perf_entry(char *name)
+{
+  unsigned long i;
+
+  perf_stats_merge();
+
+  for (i = 0; i < perf_stats_entry_count; ++i)
+  {
+    if (perf_string_equals(perf_stats_entries[i].name, name))
+    {
+      return &perf_stats_entries[i];
+    }
+  }
+
+  return 0;
+}
+
+static void imagine_test_perf_compare(void)
+{
+  static char file[] = "compare.c";
+  static char duplicate[] = "duplicate";
+  static char moved[] = "moved";
+  static char baseline[] = "file,line,name,count,cycles_min,cycles_max,cycles_avg,time_ms_min,time_ms_max,time_ms_mean,time_ms_stddev,time_ms_p50,time_ms_p90,time_ms_p99,time_ms_p999\n"
+                           "\"compare.c\",10,\"duplicate\",20,1,1,1,5,5,5.0,0.01,5.0,5,5,5\n"
+                           "\"compare.c\",20,\"duplicate\",20,1,1,1,1,1,1.0,0.01,1.0,1,1,1\n"
+                           "\"compare.c\",30,\"moved\",20,1,1,1,2,2,2.0,0.01,2.0,2,2,2\n";
+  static imagine_test_trace report;
+  unsigned long k;
+
+  /* Two sites with one name: line 10 got faster, line 20 regressed 5x */
+  for (k = 0; k < 20; ++k)
+  {
+    perf_stats_store_result(file, 10, 1, 1.0 + (double)k * 0.0001, duplicate);
+    perf_stats_store_result(file, 20, 1, 5.0 + (double)k * 0.0001, duplicate);
+    perf_stats_store_result(file, 40, 1, 2.0 + (double)k * 0.0001, moved);
+  }
+
+  report.size = 0;
+  assert(perf_stats_compare(baseline, sizeof(baseline) - 1, PERF_GATE_THRESHOLD, imagine_test_trace_sink, &report) == 1);
+  assert(imagine_test_count(report.data, "compare.c:20 [perf] REGRESSION") == 1);
+  assert(imagine_test_count(report.data, "compare.c:10 [perf] ok") == 1);
+  assert(imagine_test_count(report.data, "compare.c:40 [perf] ok") == 1); /* unique name, line moved */
+}
+
+static void imagine_test_perf_percentile(void)
+{
+  perf_stats_entry *e;
+  unsigned long k;
+
+  /* 1 us .. 1 ms in 1 us steps: the p-th percentile is p ms */
+  for (k = 1; k <= 1000; ++k)
+  {
+    perf_stats_store_result(__FILE__, __LINE__, k, (double)k * 0.001, "percentile_ramp");
+  }
+
+  e = imagine_test_perf_entry("percentile_ramp");
+  assert(e && e->count == 1000);
+
+#ifdef PERF_STATS_HISTOGRAM
+  /* Bucket middles are within half a bucket (6.25% with 3 sub bits) of the exact value */
+  assert(perf_stats_percentile(e, 0.5) >= 0.5 * 0.9375 && perf_stats_percentile(e, 0.5) <= 0.5 * 1.0625);
+  assert(perf_stats_percentile(e, 0.9) >= 0.9 * 0.9375 && perf_stats_percentile(e, 0.9) <= 0.9 * 1.0625);
+  assert(perf_stats_percentile(e, 0.99) >= 0.99 * 0.9375 && perf_stats_percentile(e, 0.99) <= 0.99 * 1.0625);
+  assert(perf_stats_percentile(e, 0.0) >= e->time_ms_min);
+  assert(perf_stats_percentile(e, 1.0) <= e->time_ms_max);
+
+  /* Samples beyond 32 bit ns (4.29 s) keep their bucket, huge ones land in the last */
+  assert(perf_histogram_bucket_ns(123456789.0) == perf_histogram_bucket(123456789UL));
+
+  for (k = 0; k < 3; ++k)
+  {
+    double ns = k == 0 ? 5.0e9 : (k == 1 ? 3.0e11 : 1.0e12);
+    unsigned long b = perf_histogram_bucket_ns(ns);
+
+    assert(b + 1 < PERF_HISTOGRAM_BUCKETS);
+    assert(perf_histogram_bucket_lower(b) <= ns && ns < perf_histogram_bucket_lower(b + 1));
+  }
+
+  assert(perf_histogram_bucket_ns(1.0e30) == PERF_HISTOGRAM_BUCKETS - 1);
+#else
+  assert(perf_stats_percentile(e, 0.5) == 0.0);
+#endif
+}
+
+static void imagine_test_perf_calibration(void)
+{
+  double start_ns;
+  double end_ns;
+  double measured_ns;
+  perf_u64 start_cycles;
+  perf_u64 end_cycles;
+
+  assert(perf_platform_cycles_per_ns() > 0.0);
+
+  /* Wait 20 ms on the monotonic clock and convert the ticks counted meanwhile back to time */
+  start_cycles = perf_platform_current_cycle_count();
+  start_ns = perf_platform_current_time_nanoseconds();
+
+  do
+  {
+    end_ns = perf_platform_current_time_nanoseconds();
+  } while (end_ns - start_ns < 20000000.0);
+
+  end_cycles = perf_platform_current_cycle_count_end();
+  measured_ns = perf_cycles_to_ns((unsigned long)(end_cycles - start_cycles));
+
+  assert(end_cycles > start_cycles);
+  assert(measured_ns >= (end_ns - start_ns) * 0.9 && measured_ns <= (end_ns - start_ns) * 1.1);
+}
+
+static void imagine_test_perf_hw(void)
+{
+  static unsigned char data[64 * 1024];
+  perf_hw_sample start;
+  perf_hw_sample end;
+  unsigned long i;
+
+  if (!perf_hw_read(&start))
+  {
+    return; /* Not built with PERF_HW_COUNTERS or no PMU access (containers, perf_event_paranoid) */
+  }
+
+  assert(perf_hw_available(PERF_HW_CYCLES));
+  assert(perf_hw_available(PERF_HW_INSTRUCTIONS));
+
+  for (i = 0; i < sizeof(data); ++i)
+  {
+    data[i] = (unsigned char)(data[(i * 7919) % sizeof(data)] + i);
+  }
+
+  assert(perf_hw_read(&end));
+  assert(end.value[PERF_HW_CYCLES] > start.value[PERF_HW_CYCLES]);
+  assert(end.value[PERF_HW_INSTRUCTIONS] > start.value[PERF_HW_INSTRUCTIONS] + sizeof(data));
+
+  /* A closed group is reopened on the next read */
+  perf_hw_close();
+  assert(perf_hw_read(&start));
+  assert(perf_hw_read(&end));
+  assert(end.value[PERF_HW_INSTRUCTIONS] >= start.value[PERF_HW_INSTRUCTIONS]);
+}
+
+#if defined(PERF_STATS_THREADS) && !defined(_WIN32)
+#define PERF_THREAD_SAMPLES 1000
+
+static char imagine_test_perf_thread_file[] = "threads.c";
+
+static void *imagine_test_perf_thread_record(void *name)
+{
+  unsigned long k;
+
+  for (k = 0; k < PERF_THREAD_SAMPLES; ++k)
+  {
+    perf_stats_store_result(imagine_test_perf_thread_file, 1, 1, 0.001, (char *)name);
+  }
+
+  return 0;
+}
+
+/* Starts count threads that all record PERF_THREAD_SAMPLES samples under name and waits for them */
+static void imagine_test_perf_threads_run(char *name, long count)
+{
+  pthread_t threads[PERF_STATS_THREADS + 1];
+  long t;
+
+  for (t = 0; t < count; ++t)
+  {
+    assert(pthread_create(&threads[t], 0, imagine_test_perf_thread_record, name) == 0);
+  }
+
+  for (t = 0; t < count; ++t)
+  {
+    assert(pthread_join(threads[t], 0) == 0);
+  }
+}
+
+static void imagine_test_perf_threads(void)
+{
+  static char pair[] = "threads_pair";
+  static char overflow[] = "threads_overflow";
+  static char dropped[] = "threads_dropped";
+  perf_stats_entry *e;
+  long claimed;
+  long free_slots;
+
+  perf_stats_store_result(imagine_test_perf_thread_file, 1, 1, 0.001, pair); /* The main thread holds a slot as well */
+
+  claimed = perf_stats_thread_count;
+  free_slots = PERF_STATS_THREADS - claimed;
+
+  if (free_slots < 2)
+  {
+    return; /* PERF_STATS_THREADS too small for two more recording threads */
+  }
+
+  /* Two threads in separate slots, merged into one entry */
+  imagine_test_perf_threads_run(pair, 2);
+  e = imagine_test_perf_entry(pair);
+  assert(e && e->count == 2 * PERF_THREAD_SAMPLES + 1);
+  assert(perf_stats_thread_count == claimed + 2);
+  assert(perf_stats_threads_dropped == 0);
+
+  /* More threads than slots: the surplus is dropped, each thread claims once instead of per sample */
+  free_slots -= 2;
+  imagine_test_perf_threads_run(overflow, free_slots + 1);
+  e = imagine_test_perf_entry(overflow);
+  assert(e && e->count == (unsigned long)free_slots * PERF_THREAD_SAMPLES);
+  assert(perf_stats_thread_count == PERF_STATS_THREADS + 1);
+  assert(perf_stats_threads_dropped == 1);
+
+  /* A site only recorded by dropped threads stays empty */
+  imagine_test_perf_threads_run(dropped, 1);
+  e = imagine_test_perf_entry(dropped);
+  assert(e && e->count == 0);
+  assert(perf_stats_threads_dropped == 2);
+}
+#endif
+#endif
+
+int main(void)
+{
+  imagine_test_load();
+  imagine_test_all_netpbm();
+  imagine_test_all_bmp();
+  imagine_test_pio_map();
+  imagine_test_pio_stream();
+  imagine_test_pio_dir();
+  imagine_test_resize();
+  imagine_test_color();
+  imagine_test_rotate();
+  imagine_test_filters();
+  imagine_test_histogram();
+  imagine_test_hash();
+  imagine_test_composite();
+  imagine_test_quantize();
+  imagine_test_layout();
+  imagine_test_planar();
+  imagine_test_pitch();
+
+#ifdef IMAGINE_STATS
+  imagine_test_stats();
+#endif
+
+#ifdef PERF_STATS_ENABLE
+  imagine_test_perf_calibration();
+  imagine_test_perf_hw();
+  imagine_test_perf_gate();
+  imagine_test_perf_zones();
+  imagine_test_perf_bench();
+  imagine_test_perf_percentile();
+  imagine_test_perf_compare();
+#if defined(PERF_STATS_THREADS) && !defined(_WIN32)
+  imagine_test_perf_threads();
+#endif
+#endif
 
   return 0;
 }